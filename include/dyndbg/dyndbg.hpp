@@ -0,0 +1,144 @@
+#ifndef __DYNDEBUG_HPP__
+#define __DYNDEBUG_HPP__
+
+#include <dyndbg/dyndbg_us.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dyndbg
+{
+
+namespace detail
+{
+
+constexpr size_t max_watch_length = 8;
+constexpr size_t hw_slots = 4;
+
+/* Largest length dividing both the size and the alignment, the debug
+registers need the address aligned on the length */
+constexpr size_t chunk_length(size_t size, size_t align, size_t length =
+    max_watch_length)
+{
+    return length == 0 ? 0 :
+        (size % length == 0 && align % length == 0) ? length :
+        chunk_length(size, align, length / 2);
+}
+
+/* Not the numeric order, DDBG_BREAK_8BYTES is 2 */
+constexpr ddbg_bsize_t to_bsize(size_t length)
+{
+    return length == 8 ? DDBG_BREAK_8BYTES :
+        length == 4 ? DDBG_BREAK_4BYTES :
+        length == 2 ? DDBG_BREAK_2BYTES : DDBG_BREAK_1BYTE;
+}
+
+/* A failed enable leaves the breakpoint listed, a duplicate is not listed */
+inline void unlist(ddbg_breakpoint_t *b, void *address, ddbg_btype_t type,
+    ddbg_bsize_t size)
+{
+    if (dyndebug_find_breakpoint(address, type, size, false) == b)
+        dyndebug_remove_breakpoint(b);
+}
+
+} /* namespace detail */
+
+/* A breakpoint armed for the lifetime of the object, it is linked in the
+library list by address hence neither copyable nor movable */
+class scoped_breakpoint
+{
+public:
+    scoped_breakpoint(void *address, ddbg_btype_t type, ddbg_bsize_t size,
+            ddbg_bcallback_t callback, void *priv_arg = nullptr)
+        : result_(dyndebug_add_breakpoint(&breakpoint_, address, type, size,
+            callback, priv_arg, true))
+    {
+        if (result_ != DDBG_SUCCESS)
+            detail::unlist(&breakpoint_, address, type, size);
+    }
+
+    ~scoped_breakpoint()
+    {
+        if (result_ == DDBG_SUCCESS)
+            dyndebug_remove_breakpoint(&breakpoint_);
+    }
+
+    scoped_breakpoint(const scoped_breakpoint &) = delete;
+    scoped_breakpoint &operator=(const scoped_breakpoint &) = delete;
+
+    ddbg_result_t result() const { return result_; }
+    explicit operator bool() const { return result_ == DDBG_SUCCESS; }
+    ddbg_breakpoint_t *get() { return &breakpoint_; }
+
+private:
+    ddbg_breakpoint_t breakpoint_;
+    ddbg_result_t result_;
+};
+
+/* Watches a whole object, split in as many aligned slots as its size and
+alignment require, all armed or none */
+template <typename T, ddbg_btype_t Type = DDBG_BREAK_DATA_WRITE>
+class watch
+{
+public:
+    static constexpr size_t length = detail::chunk_length(sizeof(T), alignof(T));
+    static constexpr size_t slots = length ? sizeof(T) / length : 0;
+
+    static_assert(Type == DDBG_BREAK_DATA_WRITE || Type == DDBG_BREAK_DATA_RDWR,
+        "watch<> is for data, use scoped_breakpoint for instructions");
+    static_assert(slots > 0 && slots <= detail::hw_slots,
+        "the object does not fit the 4 debug registers");
+
+    watch(T &object, ddbg_bcallback_t callback, void *priv_arg = nullptr)
+        : armed_(0), result_(DDBG_SUCCESS)
+    {
+        uint8_t *address = const_cast<uint8_t *>(
+            reinterpret_cast<const volatile uint8_t *>(&object));
+        /* Only a packed member can be less aligned than its type */
+        if (reinterpret_cast<uintptr_t>(address) % length)
+        {
+            result_ = DDBG_INVALID_ARGUMENT;
+            return;
+        }
+        for ( ; armed_ < slots ; armed_++)
+        {
+            uint8_t *chunk = address + armed_ * length;
+            result_ = dyndebug_add_breakpoint(&breakpoints_[armed_], chunk,
+                Type, detail::to_bsize(length), callback, priv_arg, true);
+            if (result_ != DDBG_SUCCESS)
+            {
+                detail::unlist(&breakpoints_[armed_], chunk, Type,
+                    detail::to_bsize(length));
+                disarm();
+                return;
+            }
+        }
+    }
+
+    ~watch()
+    {
+        disarm();
+    }
+
+    watch(const watch &) = delete;
+    watch &operator=(const watch &) = delete;
+
+    ddbg_result_t result() const { return result_; }
+    explicit operator bool() const { return result_ == DDBG_SUCCESS; }
+    ddbg_breakpoint_t *get(size_t slot) { return &breakpoints_[slot]; }
+
+private:
+    void disarm()
+    {
+        while (armed_)
+            dyndebug_remove_breakpoint(&breakpoints_[--armed_]);
+    }
+
+    ddbg_breakpoint_t breakpoints_[slots];
+    size_t armed_;
+    ddbg_result_t result_;
+};
+
+} /* namespace dyndbg */
+
+#endif /* __DYNDEBUG_HPP__ */
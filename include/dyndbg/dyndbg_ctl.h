@@ -0,0 +1,52 @@
+#ifndef __DYNDEBUG_CTL__
+#define __DYNDEBUG_CTL__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Control protocol, one SOCK_SEQPACKET message per request and per response,
+the abstract socket name is DDBG_CTL_PREFIX followed by the serving pid */
+#define DDBG_CTL_PREFIX         "dyndbg."
+#define DDBG_CTL_MAX_ITEMS      16
+#define DDBG_CTL_SYMBOL_LENGTH  48
+
+typedef enum
+{
+    DDBG_CTL_ADD = 1,       /* watches armed in as few monitor stops as possible */
+    DDBG_CTL_REMOVE,        /* the ones added by DDBG_CTL_ADD only */
+    DDBG_CTL_LIST,          /* every listed breakpoint, from offset */
+} ddbg_ctl_op_t;
+
+typedef struct
+{
+    uint64_t                address;    /* 0 to resolve symbol */
+    uint64_t                hits;       /* DDBG_CTL_ADD ones only */
+    uint32_t                result;     /* ddbg_result_t in responses */
+    uint8_t                 type;       /* ddbg_btype_t */
+    uint8_t                 size;       /* ddbg_bsize_t */
+    uint8_t                 enabled;
+    uint8_t                 owned;      /* added by DDBG_CTL_ADD */
+    char                    symbol[DDBG_CTL_SYMBOL_LENGTH];
+} ddbg_ctl_item_t;
+
+typedef struct
+{
+    uint32_t                op;         /* ddbg_ctl_op_t */
+    uint32_t                count;      /* items following */
+    uint32_t                offset;     /* DDBG_CTL_LIST first breakpoint */
+    uint32_t                total;      /* DDBG_CTL_LIST responses */
+    ddbg_ctl_item_t         items[DDBG_CTL_MAX_ITEMS];
+} ddbg_ctl_message_t;
+
+#define DDBG_CTL_MESSAGE_SIZE(count) \
+    (sizeof(ddbg_ctl_message_t) - \
+    (DDBG_CTL_MAX_ITEMS - (count)) * sizeof(ddbg_ctl_item_t))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DYNDEBUG_CTL__ */
@@ -0,0 +1,86 @@
+#ifndef __DYNDEBUG_STATS__
+#define __DYNDEBUG_STATS__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Statistics page, mapped by dyndebug_start_stats() from DDBG_STATS_PREFIX
+followed by the process pid, mode 0600. Readers only map it */
+#define DDBG_STATS_PREFIX       "/dev/shm/dyndbg."
+#define DDBG_STATS_MAGIC        0x5354415447424444ULL  /* "DDBGSTAT" */
+#define DDBG_STATS_VERSION      1
+#define DDBG_STATS_BREAKPOINTS  64
+#define DDBG_STATS_SLOTS        4
+
+/* state bits, relaxed stores outside of the sequence */
+#define DDBG_STATS_ENABLED      (1 << 0)
+#define DDBG_STATS_DEMOTED      (1 << 1)    /* gated, disarmed while idle */
+
+typedef struct
+{
+    uint64_t                address;    /* 0 for a free entry */
+    uint64_t                hits;
+    uint64_t                last_hit_ns; /* CLOCK_MONOTONIC */
+    uint32_t                flags;      /* ddbg_bflags_t */
+    uint8_t                 type;       /* ddbg_btype_t */
+    uint8_t                 size;       /* ddbg_bsize_t */
+    uint8_t                 is_hw;
+    uint8_t                 state;
+} ddbg_stats_breakpoint_t;
+
+typedef struct
+{
+    uint64_t                magic;
+    uint32_t                version;
+    uint32_t                pid;
+    uint32_t                sequence;   /* odd while the table changes */
+    uint32_t                count;      /* entries in use up to it */
+    uint64_t                untracked;  /* breakpoints beyond the table */
+    uint64_t                requests;   /* monitor requests */
+    uint8_t                 slots[DDBG_STATS_SLOTS]; /* watches per register */
+    uint32_t                reserved;
+    ddbg_stats_breakpoint_t breakpoints[DDBG_STATS_BREAKPOINTS];
+} ddbg_stats_page_t;
+
+/* Seqlock reader, copies a consistent table and returns its count, -1 when
+the writer kept it busy. Counters and state move outside of the sequence */
+static inline int ddbg_stats_read(const ddbg_stats_page_t *page,
+    ddbg_stats_breakpoint_t *breakpoints, int attempts)
+{
+    while (attempts--)
+    {
+        uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+        uint32_t count = __atomic_load_n(&page->count, __ATOMIC_RELAXED);
+        if (count > DDBG_STATS_BREAKPOINTS)
+            continue;
+        for (uint32_t i = 0 ; i < count ; i++)
+        {
+            const ddbg_stats_breakpoint_t *from = &page->breakpoints[i];
+            breakpoints[i].address = __atomic_load_n(&from->address,
+                __ATOMIC_RELAXED);
+            breakpoints[i].hits = __atomic_load_n(&from->hits, __ATOMIC_RELAXED);
+            breakpoints[i].last_hit_ns = __atomic_load_n(&from->last_hit_ns,
+                __ATOMIC_RELAXED);
+            breakpoints[i].flags = __atomic_load_n(&from->flags, __ATOMIC_RELAXED);
+            breakpoints[i].type = __atomic_load_n(&from->type, __ATOMIC_RELAXED);
+            breakpoints[i].size = __atomic_load_n(&from->size, __ATOMIC_RELAXED);
+            breakpoints[i].is_hw = __atomic_load_n(&from->is_hw, __ATOMIC_RELAXED);
+            breakpoints[i].state = __atomic_load_n(&from->state, __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == sequence)
+            return (int)count;
+    }
+    return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DYNDEBUG_STATS__ */
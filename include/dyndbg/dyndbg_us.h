@@ -5,6 +5,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct ddbg_breakpoint_;
 
 typedef void (*ddbg_bcallback_t)(struct ddbg_breakpoint_ *bp);
@@ -43,6 +47,128 @@ typedef enum
     DDBG_BREAK_4BYTES,
 } ddbg_bsize_t;
 
+typedef enum
+{
+    DDBG_CRASH_DEFAULT          = 0,
+    DDBG_CRASH_ALL_THREADS      = 1 << 0, /* monitor dumps every thread */
+    DDBG_CRASH_MEMORY_CAPTURE   = 1 << 1, /* memory around fault and registers */
+    DDBG_CRASH_CORE_FILE        = 1 << 2, /* monitor writes a sparse core */
+    DDBG_CRASH_DEDUPLICATE      = 1 << 3, /* full report for new signatures */
+} ddbg_crash_flags_t;
+
+typedef enum
+{
+    DDBG_CORE_STACKS            = 1 << 0, /* every thread stack */
+    DDBG_CORE_HEAP              = 1 << 1, /* heap and arenas touched recently */
+    DDBG_CORE_DATA              = 1 << 2, /* writable data of loaded objects */
+    DDBG_CORE_REGIONS           = 1 << 3, /* dyndebug_add_core_region() ones */
+    DDBG_CORE_DEFAULT           = DDBG_CORE_STACKS | DDBG_CORE_HEAP |
+                                  DDBG_CORE_DATA | DDBG_CORE_REGIONS,
+} ddbg_core_policy_t;
+
+typedef enum
+{
+    DDBG_BP_DEFAULT             = 0,
+    DDBG_BP_TRACE               = 1 << 0, /* single-step the hitting thread */
+    DDBG_BP_SNAPSHOT            = 1 << 1, /* fork a stopped copy on hit */
+    DDBG_BP_ON_CHANGE           = 1 << 2, /* data hits changing the value */
+    DDBG_BP_GATED               = 1 << 3, /* hits while the thread gate is open */
+    DDBG_BP_ASYNC               = 1 << 4, /* callback run by the dispatcher */
+} ddbg_bflags_t;
+
+/* reg is a ucontext greg index (REG_RAX...) */
+#define DDBG_FIXUP_NO_REGISTER  (-1)
+
+typedef struct
+{
+    uint64_t                signature;
+    uint64_t                count;
+    void                    *rip;
+    int                     signum;
+    int                     trapno;
+} ddbg_crash_signature_t;
+
+#define DDBG_WRITE_SITE_DEPTH   4
+#define DDBG_TRACE_REGS         2
+
+/* Instructions executed in a row without any jump, regs are the selected
+registers once the last one is reached */
+typedef struct
+{
+    uint64_t                rip;        /* first instruction */
+    uint32_t                steps;
+    uint32_t                last_offset; /* of the last instruction */
+    uint64_t                regs[DDBG_TRACE_REGS];
+} ddbg_trace_run_t;
+
+typedef struct
+{
+    void                    *address;   /* watched variable */
+    void                    *pcs[DDBG_WRITE_SITE_DEPTH]; /* [0] after access */
+    uint64_t                count;
+} ddbg_write_site_t;
+
+typedef struct
+{
+    pid_t                   pid;        /* stopped, for gdb -p as well */
+    void                    *address;   /* of the breakpoint hit */
+    uint64_t                taken_ns;   /* CLOCK_MONOTONIC */
+    uint64_t                private_kb; /* pages not shared anymore */
+} ddbg_snapshot_t;
+
+#define DDBG_UAF_DEPTH          8
+
+typedef struct
+{
+    void                    *address;   /* freed block */
+    size_t                  size;
+    void                    *access_pcs[DDBG_UAF_DEPTH]; /* [0] after access */
+    void                    *free_pcs[DDBG_UAF_DEPTH]; /* [0] the free caller */
+} ddbg_uaf_report_t;
+
+typedef struct
+{
+    const char              *name;      /* valid until the index refresh */
+    void                    *address;
+    uint64_t                size;
+    bool                    is_function;
+} ddbg_symbol_t;
+
+typedef enum
+{
+    DDBG_PHASE_REQUEST = 0,     /* round trip seen by the caller, locked */
+    DDBG_PHASE_PIPE,            /* round trip less the monitor phases */
+    DDBG_PHASE_LOCK,            /* wait for the request lock */
+    DDBG_PHASE_ATTACH,          /* PTRACE_ATTACH */
+    DDBG_PHASE_STOP,            /* waitpid() for the attach stop */
+    DDBG_PHASE_OPERATION,       /* PEEKUSER, POKEUSER... of the operation */
+    DDBG_PHASE_DETACH,          /* PTRACE_DETACH */
+    DDBG_PHASES,
+} ddbg_phase_t;
+
+/* Log-linear, DDBG_LATENCY_SUB buckets per power of two from
+2^DDBG_LATENCY_SHIFT ns, linear below, the last bucket takes everything
+beyond */
+#define DDBG_LATENCY_SHIFT      8
+#define DDBG_LATENCY_SUB        4
+#define DDBG_LATENCY_BUCKETS    80
+
+typedef struct
+{
+    uint64_t                count;
+    uint64_t                total_ns;
+    uint64_t                max_ns;
+    uint64_t                buckets[DDBG_LATENCY_BUCKETS];
+} ddbg_histogram_t;
+
+typedef struct
+{
+    uint64_t                requests;
+    uint64_t                stops;      /* tasks stopped by the monitor */
+    uint64_t                ptraces;    /* ptrace calls of the monitor */
+    ddbg_histogram_t        phases[DDBG_PHASES];
+} ddbg_monitor_stats_t;
+
 typedef struct ddbg_breakpoint_
 {
     struct ddbg_breakpoint_ *next;
@@ -53,18 +179,193 @@ typedef struct ddbg_breakpoint_
     ddbg_bsize_t            size:2;
     bool                    is_hw;
     bool                    enabled;
+    uint32_t                flags;      /* ddbg_bflags_t */
+    uint64_t                shadow;     /* last value seen, the new one on hit */
+    uint64_t                old_value;  /* before the hit, data watches */
+    uint64_t                value_mask;
+    uint64_t                value_min;
+    uint64_t                value_max;
+    uint64_t                gate_bit;   /* DDBG_BP_GATED, 0 otherwise */
+    uint64_t                gate_state; /* entries << 32 | threads inside */
+    uint32_t                gate_seen;  /* entries at the last demotion check */
+    bool                    demoted;    /* disarmed until the next entry */
+    void                    *probe;     /* !is_hw, trampoline once built */
+    ddbg_bcallback_t        exit_callback; /* !is_hw, on return */
+    uint32_t                probe_returns; /* !is_hw, exit callbacks due */
+    uint32_t                stats_entry; /* index + 1 in the statistics page */
 } ddbg_breakpoint_t;
 
+#define DDBG_HIT_GREGS          23      /* NGREG */
+
+/* Captured by the trap handler for a DDBG_BP_ASYNC breakpoint */
+typedef struct
+{
+    ddbg_breakpoint_t       *breakpoint;
+    uint64_t                taken_ns;   /* CLOCK_MONOTONIC */
+    uint64_t                rip;
+    uint64_t                old_value;  /* DDBG_BP_ON_CHANGE, b->old_value */
+    uint64_t                value;      /* DDBG_BP_ON_CHANGE, b->shadow */
+    pid_t                   tid;
+    int                     cpu;
+    long long               gregs[DDBG_HIT_GREGS]; /* zeroed for probes */
+} ddbg_hit_t;
+
+typedef struct
+{
+    uint64_t                queued;
+    uint64_t                dispatched;
+    uint64_t                dropped;    /* queue still full after block_us */
+    uint64_t                blocked;    /* hits which waited for room */
+    uint64_t                batches;
+    uint64_t                max_depth;  /* deepest queue seen by a worker */
+} ddbg_dispatch_stats_t;
+
 ddbg_result_t dyndebug_start_monitor(void);
 ddbg_result_t dyndebug_install_crash_handler(ddbg_crash_callback_t cb);
+ddbg_result_t dyndebug_set_crash_flags(uint32_t flags);
+ddbg_result_t dyndebug_refresh_memory_map(void);
+/* Repeated signatures print one line at most every interval_ms */
+ddbg_result_t dyndebug_set_crash_summary_interval(uint32_t interval_ms);
+/* Returns the number of signatures copied */
+int dyndebug_get_crash_signatures(ddbg_crash_signature_t *signatures, int max);
+/* The core is written to "<path>.<pid>", a relative path is taken from the
+working directory of the crashed process, or of the snapshot */
+ddbg_result_t dyndebug_set_core_policy(uint32_t policy, const char *path);
+/* DDBG_ALL_HWBP_BUSY when the regions table is full */
+ddbg_result_t dyndebug_add_core_region(void *address, size_t size);
+ddbg_result_t dyndebug_remove_core_region(void *address);
+/* A fault with RIP in [start, end) resumes at landing (if not NULL) with reg
+set to value (if not DDBG_FIXUP_NO_REGISTER), without any report */
+ddbg_result_t dyndebug_add_fault_fixup(void *start, void *end, void *landing,
+    int reg, uint64_t value);
+ddbg_result_t dyndebug_remove_fault_fixup(void *start);
+/* Samples the calling thread CPU time at frequency Hz (up to 1000), other
+threads opt in with dyndebug_profile_thread(), folded stacks are written to
+path by dyndebug_stop_profiler(). The stacks are walked by frame pointers,
+code built without -fno-omit-frame-pointer shows truncated stacks. SIGPROF is
+ours while running, the previous action is put back on stop */
+ddbg_result_t dyndebug_start_profiler(uint32_t frequency, const char *path);
+ddbg_result_t dyndebug_profile_thread(void);
+ddbg_result_t dyndebug_unprofile_thread(void);
+ddbg_result_t dyndebug_stop_profiler(void);
+/* Watched accesses are attributed to their call sites. With more watches than
+slots, they take turns in the first slots debug registers, rotation_ms each */
+ddbg_result_t dyndebug_add_profiled_watch(void *address, ddbg_btype_t type,
+    ddbg_bsize_t size);
+ddbg_result_t dyndebug_start_write_profiler(uint32_t slots, uint32_t rotation_ms);
+/* The report goes to path, or stderr when NULL */
+ddbg_result_t dyndebug_stop_write_profiler(const char *path);
+/* Returns the number of sites copied, counts are exact for the time each
+address was watched only */
+int dyndebug_get_write_sites(ddbg_write_site_t *sites, int max);
+/* Instruction breakpoints which are not is_hw are probes, the function
+prologue jumps to a trampoline calling cb directly, without any signal. The
+general, vector and x87 registers are preserved. Functions with a direct
+branch into the patched bytes, or not in the symbol index, are refused */
 ddbg_result_t dyndebug_add_breakpoint(ddbg_breakpoint_t *new_bp, void *address,
     ddbg_btype_t type, ddbg_bsize_t size, ddbg_bcallback_t cb, void *priv_arg,
     bool is_hw);
+/* Probes call cb when the function returns as well. Its return address is
+replaced: longjmp is fine but a C++ exception thrown through the function
+cannot unwind it and ends in std::terminate. The callback is the one set when
+the function was entered, removing the probe waits for the calls of the other
+threads to return, the ones of the removing thread skip it */
+ddbg_result_t dyndebug_set_probe_exit(ddbg_breakpoint_t *b, ddbg_bcallback_t cb);
+/* Instruction breakpoints on the functions matching the glob patterns, armed
+in batches, returns how many were armed (4 debug registers at most) */
+int dyndebug_add_symbol_breakpoints(const char *const *patterns, int count,
+    ddbg_breakpoint_t *breakpoints, int max, ddbg_bcallback_t cb,
+    void *priv_arg);
+/* Every loaded object symbol tables, static and hidden symbols included, are
+indexed on the first lookup, returns the number of symbols copied */
+int dyndebug_find_symbols(const char *pattern, ddbg_symbol_t *symbols, int max);
+void *dyndebug_resolve_symbol(const char *name);
+/* Objects were loaded or unloaded, the index is rebuilt on the next lookup */
+ddbg_result_t dyndebug_refresh_symbols(void);
 ddbg_breakpoint_t *dyndebug_find_breakpoint(void *address, ddbg_btype_t type,
     ddbg_bsize_t size, bool verbose);
 ddbg_result_t dyndebug_remove_breakpoint(ddbg_breakpoint_t *b);
 ddbg_result_t dyndebug_enable_breakpoint(ddbg_breakpoint_t *b);
 ddbg_result_t dyndebug_disable_breakpoint(ddbg_breakpoint_t *b);
 ddbg_result_t dyndebug_disable_all_breakpoint();
+ddbg_result_t dyndebug_set_breakpoint_flags(ddbg_breakpoint_t *b, uint32_t flags);
+/* Sets DDBG_BP_ON_CHANGE, hits are reported when the masked value changed and
+lies within [min, max], old_value and shadow hold the values for the callback */
+ddbg_result_t dyndebug_set_value_filter(ddbg_breakpoint_t *b, uint64_t mask,
+    uint64_t min, uint64_t max);
+/* DDBG_BP_GATED breakpoints stay armed, their hits are only reported to the
+threads in between enter and exit, 64 of them at most */
+void dyndebug_gate_enter(ddbg_breakpoint_t *b);
+void dyndebug_gate_exit(ddbg_breakpoint_t *b);
+/* Gated breakpoints not entered for idle_ms are disarmed until the next
+entry, which pays the rearming, 0 to stop */
+ddbg_result_t dyndebug_set_gate_demotion(uint32_t idle_ms);
+/* DDBG_BP_TRACE hits record the next steps instructions with reg0 and reg1
+(greg indexes or DDBG_FIXUP_NO_REGISTER), without the monitor. The window is
+not resized while a trace is recording, DDBG_INVALID_ARGUMENT */
+ddbg_result_t dyndebug_set_trace_window(uint32_t steps, int reg0, int reg1);
+/* Copies and releases the oldest completed trace, returns its run count */
+int dyndebug_get_trace(ddbg_trace_run_t *runs, int max);
+/* DDBG_BP_SNAPSHOT hits beyond max_live snapshots are skipped, max_kb (0 for
+no limit) is enforced by dyndebug_account_snapshots(). A snapshot is killed
+when the thread which took it exits */
+ddbg_result_t dyndebug_set_snapshot_limits(uint32_t max_live, uint64_t max_kb);
+/* Refreshes the memory accounting, releases the oldest snapshots over budget
+and copies the live ones, returns their count */
+int dyndebug_account_snapshots(ddbg_snapshot_t *snapshots, int max);
+/* The core is written by the monitor as on crash, snapshot stays stopped */
+ddbg_result_t dyndebug_dump_snapshot(pid_t pid);
+ddbg_result_t dyndebug_release_snapshot(pid_t pid);
+/* Freed blocks are quarantined (one free in sample). The first word of up to
+watches quarantined blocks is watched, the next blocks in turn every
+period_ms. libdyndbg.so built with DYNDBG_INTERPOSE_FREE routes free() here */
+ddbg_result_t dyndebug_start_uaf_detector(uint32_t quarantined, uint32_t sample,
+    uint32_t watches, uint32_t period_ms);
+void dyndebug_uaf_free(void *ptr);
+/* The quarantined blocks are released */
+ddbg_result_t dyndebug_stop_uaf_detector(void);
+/* Returns the number of reports copied, the first accesses only */
+int dyndebug_get_uaf_reports(ddbg_uaf_report_t *reports, int max);
+/* Serves dyndbg/dyndbg_ctl.h requests from a thread, on the abstract socket
+name or DDBG_CTL_PREFIX"<pid>" when NULL, to clients of the same effective
+uid only. The watches it added are removed on stop */
+ddbg_result_t dyndebug_start_control(const char *name);
+ddbg_result_t dyndebug_stop_control(void);
+/* Hits, states and debug register occupancy are published in the
+dyndbg/dyndbg_stats.h page, removed on stop */
+ddbg_result_t dyndebug_start_stats(void);
+ddbg_result_t dyndebug_stop_stats(void);
+/* Times the monitor requests phase by phase, enabling resets the counters,
+disabled costs a branch per request */
+ddbg_result_t dyndebug_set_monitor_stats(bool enable);
+ddbg_result_t dyndebug_get_stats(ddbg_monitor_stats_t *stats);
+/* Lower bound of a ddbg_histogram_t bucket */
+uint64_t dyndebug_latency_bucket_ns(int bucket);
+/* Traps, callbacks and monitor requests are buffered per thread with TSC
+stamps and streamed to path as Chrome trace events (chrome://tracing,
+ui.perfetto.dev), one track per thread */
+ddbg_result_t dyndebug_start_timeline(const char *path);
+ddbg_result_t dyndebug_stop_timeline(void);
+/* DDBG_BP_ASYNC hits are queued by the trap handler on the queue of the
+current CPU, workers run their callbacks up to batch hits at a time. A full
+queue holds the trapping thread up to block_us, then the hit is dropped.
+Stopped, the callbacks are run by the trap handler again. Queued hits point
+to their breakpoint, a worker callback can neither remove a DDBG_BP_ASYNC
+breakpoint nor clear its flag, DDBG_INVALID_ARGUMENT */
+ddbg_result_t dyndebug_start_dispatcher(uint32_t workers, uint32_t depth,
+    uint32_t batch, uint32_t block_us);
+/* Waits for the hits queued so far, not from a callback */
+ddbg_result_t dyndebug_flush_dispatcher(void);
+ddbg_result_t dyndebug_stop_dispatcher(void);
+ddbg_result_t dyndebug_get_dispatch_stats(ddbg_dispatch_stats_t *stats);
+/* The hit being dispatched, only valid within a DDBG_BP_ASYNC callback */
+const ddbg_hit_t *dyndebug_get_hit(void);
+/* The trapped thread ucontext, only valid within a synchronous breakpoint
+callback */
+void *dyndebug_get_trap_ucontext(void);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* __DYNDEBUG_US__ */
@@ -0,0 +1,35 @@
+#ifndef __PRIV_DYNDEBUG_COREDUMP__
+#define __PRIV_DYNDEBUG_COREDUMP__
+
+#include <private/dyndbg_monitor_threads.h>
+#include <private/dyndbg_monitor.h>
+#include <dyndbg/dyndbg_us.h>
+
+#include <stdint.h>
+
+#define MAX_CORE_REGIONS        64
+#define MAX_CORE_PATH           256
+#define MAX_CORE_WORKERS        8
+#define CORE_CHUNK_SIZE         (1024 * 1024)
+#define CORE_DEFAULT_PATH       "dyndbg.core"
+
+/* Lives in the monitored process, the monitor reads it back on crash */
+typedef struct
+{
+    uint32_t                policy;
+    int                     region_count;
+    char                    path[MAX_CORE_PATH];
+    struct
+    {
+        uint64_t            start;
+        uint64_t            size;
+    } regions[MAX_CORE_REGIONS];
+} ddbg_core_config_t;
+
+ddbg_core_config_t *dyndebug_core_config(void);
+
+ddbg_result_t dyndebug_monitor_write_core(ddbg_context_t *context,
+    ddbg_monitor_request_t *request, const long long *crash_gregs,
+    ddbg_task_t *tasks, int count);
+
+#endif /* __PRIV_DYNDEBUG_COREDUMP__ */
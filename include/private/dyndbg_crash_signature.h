@@ -0,0 +1,24 @@
+#ifndef __PRIV_DYNDEBUG_CRASH_SIGNATURE__
+#define __PRIV_DYNDEBUG_CRASH_SIGNATURE__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_CRASH_SIGNATURES    256 /* power of 2 */
+#define CRASH_SIGNATURE_DEPTH   4   /* return addresses hashed with RIP */
+#define DEFAULT_SUMMARY_INTERVAL_MS 1000
+
+typedef struct
+{
+    uint64_t                signature;  /* 0 for a free slot */
+    uint64_t                count;
+    uint64_t                rip;
+    int                     signum;
+    int                     trapno;
+    uint64_t                last_summary_ns;
+} ddbg_signature_entry_t;
+
+/* Records the crash, true when its signature was already seen in which case
+a one line summary may have been printed instead of the full report */
+bool dyndebug_crash_signature_seen(int signum, const long long *gregs);
+
+#endif /* __PRIV_DYNDEBUG_CRASH_SIGNATURE__ */
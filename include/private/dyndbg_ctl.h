@@ -0,0 +1,22 @@
+#ifndef __PRIV_DYNDEBUG_CTL__
+#define __PRIV_DYNDEBUG_CTL__
+
+#include <dyndbg/dyndbg_us.h>
+#include <dyndbg/dyndbg_ctl.h>
+
+#define MAX_CTL_WATCHES         16
+#define CTL_POLL_MS             100
+
+/* A breakpoint added through the control socket, owned by the library */
+typedef struct
+{
+    ddbg_breakpoint_t       breakpoint;
+    uint64_t                hits;
+    char                    symbol[DDBG_CTL_SYMBOL_LENGTH];
+    bool                    used;
+} ddbg_ctl_watch_t;
+
+/* In a forked child */
+void dyndebug_control_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_CTL__ */
@@ -0,0 +1,37 @@
+#ifndef __PRIV_DYNDEBUG_DECODE__
+#define __PRIV_DYNDEBUG_DECODE__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_INSTRUCTION_SIZE    15
+#define NO_REGISTER             0xff
+
+typedef struct
+{
+    uint8_t                 length;
+    bool                    branch;     /* jmp, jcc, call, loop with rel8/32 */
+    bool                    rep_string; /* stays on itself while counting */
+    bool                    rip_relative; /* ModRM disp32 off the next RIP */
+    int32_t                 displacement; /* of the branch target */
+    bool                    memory;     /* ModRM memory operand */
+    bool                    segment;    /* fs or gs based */
+    bool                    address32;
+    uint8_t                 base;       /* register numbers, rax 0 to r15 15 */
+    uint8_t                 index;
+    uint8_t                 scale;
+    int32_t                 offset;     /* ModRM displacement */
+    uint8_t                 store;      /* bytes written to it, 0 if unknown */
+    uint16_t                clobbers;   /* registers written as well */
+} ddbg_instruction_t;
+
+/* x86-64 length decoder, legacy, VEX and EVEX encodings. Returns the length,
+0 for an invalid or unknown encoding, async-signal-safe */
+int dyndebug_decode_instruction(const uint8_t *code, ddbg_instruction_t *insn);
+
+/* Memory operand address from the registers of a ucontext trapped once the
+instruction retired, false when they no longer tell it */
+bool dyndebug_instruction_address(const ddbg_instruction_t *insn,
+    const long long *gregs, uint64_t *address);
+
+#endif /* __PRIV_DYNDEBUG_DECODE__ */
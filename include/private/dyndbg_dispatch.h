@@ -0,0 +1,19 @@
+#ifndef __PRIV_DYNDEBUG_DISPATCH__
+#define __PRIV_DYNDEBUG_DISPATCH__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define DISPATCH_MAX_QUEUES     64      /* CPUs beyond share the queues */
+#define DISPATCH_MAX_WORKERS    16
+#define DISPATCH_IDLE_MS        10      /* worker sleep without any wake up */
+
+/* From the trap handler and probes, async-signal-safe. False when the
+dispatcher is stopped, the caller runs the callback itself. ucontext is NULL
+for probes */
+bool dyndebug_dispatch_hit(ddbg_breakpoint_t *b, const void *ucontext);
+/* True in a worker, it cannot wait for the queued hits */
+bool dyndebug_dispatch_in_worker(void);
+/* In a forked child */
+void dyndebug_dispatch_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_DISPATCH__ */
@@ -0,0 +1,21 @@
+#ifndef __PRIV_DYNDEBUG_FIXUP__
+#define __PRIV_DYNDEBUG_FIXUP__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_FAULT_FIXUPS        256
+
+typedef struct
+{
+    uint64_t                start;
+    uint64_t                end;
+    uint64_t                landing;
+    uint64_t                value;
+    int                     reg;
+} ddbg_fault_fixup_t;
+
+/* Called first by the crash handler, true when the fault was fixed up and
+the thread can resume */
+bool dyndebug_apply_fault_fixup(void *ucontext);
+
+#endif /* __PRIV_DYNDEBUG_FIXUP__ */
@@ -0,0 +1,25 @@
+#ifndef __PRIV_DYNDEBUG_GATE__
+#define __PRIV_DYNDEBUG_GATE__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_GATES               64
+#define GATE_ENTRY              (1ULL << 32)    /* gate_state entries unit */
+#define GATE_INSIDE_MASK        (GATE_ENTRY - 1)
+
+/* Gates the calling thread is in, one bit per gated breakpoint, read first
+thing by the trap handler hence no __tls_get_addr */
+extern __thread uint64_t dyndebug_open_gates
+    __attribute__((tls_model("initial-exec")));
+
+/* Gives b a gate bit, false when all are taken */
+bool dyndebug_gate_acquire(ddbg_breakpoint_t *b);
+void dyndebug_gate_release(ddbg_breakpoint_t *b);
+
+/* Around fork(), no demotion nor promotion in progress. The child has no
+demotion thread */
+void dyndebug_gate_fork_prepare(void);
+void dyndebug_gate_fork_parent(void);
+void dyndebug_gate_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_GATE__ */
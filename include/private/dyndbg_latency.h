@@ -0,0 +1,23 @@
+#ifndef __PRIV_DYNDEBUG_LATENCY__
+#define __PRIV_DYNDEBUG_LATENCY__
+
+#include <private/dyndbg_monitor.h>
+
+#include <time.h>
+
+/* Read on every monitor request, set by dyndebug_set_monitor_stats() */
+extern bool dyndebug_latency_enabled;
+
+static inline uint64_t dyndebug_latency_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Accounts a timed response, elapsed_ns is the caller round trip once it
+held the request lock, waited for lock_ns */
+void dyndebug_latency_record(const ddbg_monitor_response_t *response,
+    uint64_t lock_ns, uint64_t elapsed_ns);
+
+#endif /* __PRIV_DYNDEBUG_LATENCY__ */
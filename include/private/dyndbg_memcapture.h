@@ -0,0 +1,44 @@
+#ifndef __PRIV_DYNDEBUG_MEMCAPTURE__
+#define __PRIV_DYNDEBUG_MEMCAPTURE__
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_MAPPINGS            1024
+#define MAPPING_NAME_LEN        48
+#define MEMCAPTURE_BEFORE       64  /* bytes captured below a pointer */
+#define MEMCAPTURE_AFTER        192 /* bytes captured from a pointer on */
+#define MAX_MEMCAPTURE_WINDOWS  24
+
+typedef struct
+{
+    uint64_t                start;
+    uint64_t                end;
+    bool                    readable;
+    bool                    writable;
+    char                    name[MAPPING_NAME_LEN];
+} ddbg_mapping_t;
+
+typedef struct
+{
+    int                     count;
+    ddbg_mapping_t          mappings[MAX_MAPPINGS];
+} ddbg_maps_t;
+
+/* Async-signal-safe: no stdio nor malloc, maps end up sorted by address */
+int dyndebug_parse_maps(pid_t pid, ddbg_maps_t *maps);
+const ddbg_mapping_t *dyndebug_find_mapping(const ddbg_maps_t *maps,
+    uint64_t address);
+
+/* True when a register points between the known mappings but in none of
+them, meaning that the cached maps missed a new mapping */
+bool dyndebug_maps_outdated(const ddbg_maps_t *maps, const long long *gregs);
+
+/* Captures the memory around the fault address and every register pointing
+into a readable mapping of pid, gregs is the mcontext general registers set */
+void dyndebug_capture_memory(FILE *out, pid_t pid, const ddbg_maps_t *maps,
+    const long long *gregs, void *fault_address);
+
+#endif /* __PRIV_DYNDEBUG_MEMCAPTURE__ */
@@ -8,11 +8,15 @@
 #define DYNDBG_MONITOR_PREFIX   "dyndbg_monitor_"
 #define HW_BREAKPOINTS_COUNT    4
 #define PTRACE_STOP_ATTEMPTS    4
+#define MAX_PACKED_WATCHES      8   /* logical watches sharing one slot */
+#define MAX_MONITOR_SESSIONS    64  /* the monitored process and its children */
+#define MONITOR_POLL_MS         500
+#define MAX_PATCH_BATCH         16  /* code patches of one request */
 
 #if 0
 #define debug_print(fmt, args...)   printf("%s:%d: "fmt, __func__, __LINE__, ##args)
 #else
-#define debug_print(fmt, args...)
+#define debug_print(fmt, args...)   do { } while (0)
 #endif
 #define info_print(fmt, args...)    printf("%s:%d: "fmt, __func__, __LINE__, ##args)
 #define error_print(fmt, args...)   fprintf(stderr, "%s:%d: "fmt, __func__, __LINE__, ##args)
@@ -23,11 +27,18 @@ typedef enum
     DDBG_DISABLE_BREAKPOINT,
     DDBG_DISABLE_ALL_BREAKPOINTS,
     DDBG_GET_TRIGGERED_BREAKPOINT,
+    DDBG_CRASH_REPORT,
+    DDBG_SNAPSHOT_CORE,         /* crash fields, tid is the snapshot pid */
+    DDBG_ENABLE_BREAKPOINTS,    /* batch, disarmed then armed in order */
+    DDBG_PATCH_CODE,            /* batch, every task stopped outside of spans */
+    DDBG_SPLIT_BREAKPOINT,      /* watches of a packed word to slots of theirs */
 } ddbg_monitor_op_t;
 
 typedef struct
 {
     ddbg_monitor_op_t       operation;
+    bool                    timed;      /* phase_ns wanted in the response */
+    bool                    traced;     /* stopped_tsc and resumed_tsc too */
     union
     {
         struct
@@ -36,22 +47,73 @@ typedef struct
             ddbg_btype_t    type:8;
             ddbg_bsize_t    size:8;
             bool            is_hw;
+            pid_t           tid;        /* trapped thread, 0 for the leader */
         } breakpoint;
+        struct
+        {
+            pid_t           tid;
+            int             signum;
+            void            *fault_address;
+            void            *ucontext;  /* read back by the monitor */
+            void            *core_config;
+            uint32_t        flags;
+        } crash;
+        struct
+        {
+            int             count;
+            int             disarmed;   /* leading items, disabled first */
+            struct
+            {
+                void            *address;
+                ddbg_btype_t    type:8;
+                ddbg_bsize_t    size:8;
+            } items[2 * HW_BREAKPOINTS_COUNT];
+        } batch;
+        struct
+        {
+            int             count;
+            struct
+            {
+                void            *address;
+                int             length;     /* bytes written */
+                int             span;       /* instructions overwritten */
+                uint8_t         bytes[8];
+            } items[MAX_PATCH_BATCH];
+        } patch;
     };
 } ddbg_monitor_request_t;
 
 typedef struct
 {
     ddbg_result_t           result;
+    uint8_t                 slots[HW_BREAKPOINTS_COUNT]; /* watches in each */
+    uint16_t                stops;      /* tasks stopped for the request */
+    uint16_t                ptraces;    /* ptrace calls for the request */
+    uint64_t                phase_ns[DDBG_PHASES]; /* monitor side ones */
+    uint64_t                stopped_tsc; /* 0 unless traced */
+    uint64_t                resumed_tsc;
     union
     {
         struct
         {
-            void            *address;
-            ddbg_btype_t    type:8;
-            ddbg_bsize_t    size:8;
-            bool            is_hw;
-        } breakpoint;
+            int             count;      /* slots fired, in slot order */
+            struct
+            {
+                void            *address;
+                ddbg_btype_t    type:8;
+                ddbg_bsize_t    size:8;
+                bool            packed; /* slot shared by several watches */
+            } items[HW_BREAKPOINTS_COUNT];
+        } trapped;
+        struct
+        {
+            int             threads;
+        } crash;
+        struct
+        {
+            int             armed;      /* or patched */
+            int             disarmed;
+        } batch;
     };
 } ddbg_monitor_response_t;
 
@@ -61,11 +123,56 @@ typedef struct
     ddbg_breakpoint_t       *breakpoints_root;
     int                     monitor_pipe[2];
     int                     monitored_pipe[2];
+    int                     session_socket[2]; /* forked children register */
     pid_t                   monitor_pid;
     pid_t                   monitored_pid;
+    bool                    forked;     /* child without a session yet */
 } ddbg_context_t;
 
+static inline int dyndebug_bsize_bytes(ddbg_bsize_t size)
+{
+    switch (size)
+    {
+        case DDBG_BREAK_1BYTE: return 1;
+        case DDBG_BREAK_2BYTES: return 2;
+        case DDBG_BREAK_4BYTES: return 4;
+        default: return 8;
+    }
+}
+
+/* Monitor process counters, incremented at each ptrace call and task stop */
+extern uint32_t dyndebug_monitor_ptraces;
+extern uint32_t dyndebug_monitor_stops;
+
 ddbg_context_t *dyndebug_get_context(void);
+ddbg_context_t *dyndebug_peek_context(void);
 void dyndebug_run_monitor(ddbg_context_t *context);
+void dyndebug_send_monitor_request(ddbg_context_t *context,
+        ddbg_monitor_request_t *request, ddbg_monitor_response_t *response);
+/* Links a disabled hardware breakpoint or probe in the list */
+void dyndebug_list_breakpoint(ddbg_context_t *context, ddbg_breakpoint_t *new_bp,
+    void *address, ddbg_btype_t type, ddbg_bsize_t size, ddbg_bcallback_t cb,
+    void *priv_arg, bool is_hw);
+/* Lock-free walks of the breakpoint list, async-signal-safe. The breakpoints
+seen are not released by dyndebug_remove_breakpoint() before the exit */
+int dyndebug_tree_enter(void);
+void dyndebug_tree_exit(int parity);
+/* Opens the session of a forked child on its first request, with pipes of
+its own passed to the monitor */
+bool dyndebug_register_session(ddbg_context_t *context);
+/* pthread_atfork() handlers of the monitored process, the child starts
+without session nor armed debug registers */
+void dyndebug_fork_prepare(void);
+void dyndebug_fork_parent(void);
+void dyndebug_fork_child(void);
+/* Listed hardware breakpoints are armed in as few monitor requests as
+possible, up to the first failure, returns how many were armed */
+int dyndebug_arm_breakpoints(ddbg_breakpoint_t **breakpoints, int count);
+/* Same, the armed ones in disarmed (up to HW_BREAKPOINTS_COUNT) are disabled
+first within the same request, they stay listed */
+int dyndebug_swap_breakpoints(ddbg_breakpoint_t **disarmed, int disarm_count,
+    ddbg_breakpoint_t **armed, int arm_count);
+/* Same for listed probes, all the process tasks are stopped once a batch */
+int dyndebug_arm_probes(ddbg_breakpoint_t **breakpoints, int count);
 
 #endif /* __PRIV_DYNDEBUG_MONITOR__ */
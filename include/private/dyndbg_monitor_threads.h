@@ -0,0 +1,40 @@
+#ifndef __PRIV_DYNDEBUG_MONITOR_THREADS__
+#define __PRIV_DYNDEBUG_MONITOR_THREADS__
+
+#include <private/dyndbg_monitor.h>
+
+#include <sys/user.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_THREAD_STACK_COPY   (16 * 1024)
+#define MAX_THREAD_BACKTRACE    64
+#define MAX_THREAD_STACK_DUMP   512
+#define MAX_DUMP_WORKERS        16
+
+typedef struct
+{
+    pid_t                   tid;
+    bool                    stopped;    /* ptrace-stopped by the monitor */
+    bool                    seized;     /* we attached it, we detach it */
+    bool                    regs_valid;
+    struct user_regs_struct regs;
+    char                    name[16];
+    uint8_t                 *stack;     /* copy of [rsp, rsp+stack_size) */
+    size_t                  stack_size;
+    char                    *report;
+    size_t                  report_size;
+} ddbg_task_t;
+
+/* Lists the tasks of pid, the array is malloc'ed, returns the count or -1 */
+int dyndebug_monitor_list_tasks(pid_t pid, ddbg_task_t **tasks);
+/* Stops every task but the (already attached) leader and reads the registers */
+int dyndebug_monitor_stop_tasks(pid_t pid, ddbg_task_t *tasks, int count);
+void dyndebug_monitor_resume_tasks(ddbg_task_t *tasks, int count);
+void dyndebug_monitor_free_tasks(ddbg_task_t *tasks, int count);
+
+/* Expects the tasks stopped by dyndebug_monitor_stop_tasks() */
+void dyndebug_monitor_dump_threads(ddbg_context_t *context,
+    ddbg_monitor_request_t *request, ddbg_task_t *tasks, int count, int stopped);
+
+#endif /* __PRIV_DYNDEBUG_MONITOR_THREADS__ */
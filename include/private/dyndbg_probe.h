@@ -0,0 +1,51 @@
+#ifndef __PRIV_DYNDEBUG_PROBE__
+#define __PRIV_DYNDEBUG_PROBE__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define PROBE_JUMP_SIZE         5       /* jmp rel32 */
+#define MAX_PROBE_RELOCATED     16      /* prologue bytes moved */
+#define PROBE_SLOT_SIZE         256
+#define PROBE_PAGE_SIZE         4096
+#define MAX_PROBE_PAGES         64
+#define PROBE_SEARCH_STEP       (16ULL << 20)
+#define PROBE_JUMP_RANGE        (2ULL << 30)
+#define MAX_PROBE_RETURNS       64      /* nested exit probes per thread */
+
+/* Lives in a trampoline page slot, never released as threads may still be
+running its code. Written through the page writable view */
+typedef struct
+{
+    uint8_t                 *site;      /* patched, after any endbr64 */
+    uint8_t                 saved[PROBE_JUMP_SIZE];
+    uint8_t                 length;     /* relocated bytes */
+    uint8_t                 code[];     /* the jump target */
+} ddbg_probe_t;
+
+typedef struct
+{
+    uint8_t                 *base;      /* executable, not writable */
+    uint8_t                 *writable;  /* the same memfd page */
+    uint32_t                used;
+} ddbg_probe_page_t;
+
+typedef struct
+{
+    uint64_t                slot;       /* where the return address was */
+    uint64_t                address;    /* the original one */
+    ddbg_breakpoint_t       *breakpoint; /* NULL once its probe is removed */
+    ddbg_bcallback_t        callback;   /* exit one, as on entry */
+} ddbg_probe_return_t;
+
+/* The trampoline is built on the first patch, the monitor writes the jump */
+ddbg_result_t dyndebug_probe_patch(ddbg_breakpoint_t *b);
+/* Batched, the process is stopped once per MAX_PATCH_BATCH probes. Up to the
+first failure, returns how many were patched */
+int dyndebug_probe_patch_batch(ddbg_breakpoint_t **breakpoints, int count);
+ddbg_result_t dyndebug_probe_unpatch(ddbg_breakpoint_t *b);
+/* Once unpatched, until the exit callbacks due for b have run */
+void dyndebug_probe_wait_returns(ddbg_breakpoint_t *b);
+/* In a forked child */
+void dyndebug_probe_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_PROBE__ */
@@ -0,0 +1,57 @@
+#ifndef __PRIV_DYNDEBUG_PROFILER__
+#define __PRIV_DYNDEBUG_PROFILER__
+
+#include <dyndbg/dyndbg_us.h>
+
+#include <signal.h>
+#include <time.h>
+
+#define MAX_PROFILED_THREADS    256
+#define MAX_PROFILE_DEPTH       32
+#define PROFILE_RING_SIZE       512     /* power of 2, samples per thread */
+#define MAX_PROFILE_STACKS      4096    /* power of 2, distinct stacks */
+#define MAX_PROFILE_FREQUENCY   1000
+#define PROFILE_DRAIN_PERIOD_MS 100
+#define DEFAULT_PROFILE_PATH    "dyndbg.folded"
+
+typedef enum
+{
+    DDBG_PROFILE_SLOT_FREE = 0,
+    DDBG_PROFILE_SLOT_ACTIVE,
+    DDBG_PROFILE_SLOT_RETIRED,  /* thread gone, drained then freed */
+} ddbg_profile_slot_state_t;
+
+typedef struct
+{
+    uint32_t                depth;
+    uint64_t                pcs[MAX_PROFILE_DEPTH];
+} ddbg_profile_sample_t;
+
+/* Single producer (the thread signal handler), single consumer (the
+aggregator), head and tail only grow */
+typedef struct
+{
+    uint32_t                state;
+    pid_t                   tid;
+    void                    *owner;     /* &profile_self of the thread */
+    timer_t                 timer;
+    uint64_t                head;
+    uint64_t                tail;
+    uint64_t                dropped;
+    ddbg_profile_sample_t   samples[PROFILE_RING_SIZE];
+} ddbg_profile_thread_t;
+
+typedef struct
+{
+    uint64_t                hash;       /* 0 for a free slot */
+    uint64_t                count;
+    ddbg_profile_sample_t   sample;
+} ddbg_profile_stack_t;
+
+/* Around fork(), the thread slots are consistent while the lock is held.
+Timers are not inherited, the child profiler is stopped */
+void dyndebug_profiler_fork_prepare(void);
+void dyndebug_profiler_fork_parent(void);
+void dyndebug_profiler_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_PROFILER__ */
@@ -0,0 +1,31 @@
+#ifndef __PRIV_DYNDEBUG_SNAPSHOT__
+#define __PRIV_DYNDEBUG_SNAPSHOT__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_SNAPSHOTS           16
+#define DEFAULT_MAX_SNAPSHOTS   4
+
+typedef enum
+{
+    DDBG_SNAPSHOT_FREE = 0,
+    DDBG_SNAPSHOT_CREATING,
+    DDBG_SNAPSHOT_LIVE,
+} ddbg_snapshot_state_t;
+
+typedef struct
+{
+    uint32_t                state;
+    ddbg_snapshot_t         snapshot;
+    void                    *ucontext;  /* same address in the snapshot */
+} ddbg_snapshot_slot_t;
+
+/* Forks a stopped copy of the process from the SIGTRAP handler */
+void dyndebug_snapshot_take(ddbg_breakpoint_t *b, void *ucontext);
+/* Around fork(), no snapshot is being released or dumped. The snapshots are
+the parent children, the child forgets them */
+void dyndebug_snapshot_fork_prepare(void);
+void dyndebug_snapshot_fork_parent(void);
+void dyndebug_snapshot_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_SNAPSHOT__ */
@@ -0,0 +1,60 @@
+#ifndef __PRIV_DYNDEBUG_STATS__
+#define __PRIV_DYNDEBUG_STATS__
+
+#include <dyndbg/dyndbg_us.h>
+#include <dyndbg/dyndbg_stats.h>
+
+#include <time.h>
+
+/* NULL until dyndebug_start_stats(), the stop unmaps the page once the
+writers in flight are done */
+extern ddbg_stats_page_t *dyndebug_stats_page;
+extern int dyndebug_stats_writers;
+
+/* Table changes, under the sequence */
+void dyndebug_stats_add(ddbg_breakpoint_t *b);
+void dyndebug_stats_remove(ddbg_breakpoint_t *b);
+void dyndebug_stats_update(ddbg_breakpoint_t *b);
+/* Enabled and demoted bits, outside of the sequence */
+void dyndebug_stats_state(ddbg_breakpoint_t *b);
+/* Debug register occupancy as of the last monitor response */
+void dyndebug_stats_slots(const uint8_t *slots);
+/* In a forked child */
+void dyndebug_stats_forked(void);
+
+/* The published page counted as written until dyndebug_stats_release(),
+NULL when there is none. Costs a load while stopped */
+static inline ddbg_stats_page_t *dyndebug_stats_acquire(void)
+{
+    if (!__atomic_load_n(&dyndebug_stats_page, __ATOMIC_RELAXED))
+        return NULL;
+    __atomic_fetch_add(&dyndebug_stats_writers, 1, __ATOMIC_SEQ_CST);
+    ddbg_stats_page_t *page = __atomic_load_n(&dyndebug_stats_page,
+        __ATOMIC_SEQ_CST);
+    if (!page)
+        __atomic_fetch_sub(&dyndebug_stats_writers, 1, __ATOMIC_RELEASE);
+    return page;
+}
+
+static inline void dyndebug_stats_release(void)
+{
+    __atomic_fetch_sub(&dyndebug_stats_writers, 1, __ATOMIC_RELEASE);
+}
+
+/* From the trap handler and probes, async-signal-safe */
+static inline void dyndebug_stats_hit(const ddbg_breakpoint_t *b)
+{
+    uint32_t entry = __atomic_load_n(&b->stats_entry, __ATOMIC_RELAXED);
+    ddbg_stats_page_t *page = entry ? dyndebug_stats_acquire() : NULL;
+    if (!page)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ddbg_stats_breakpoint_t *stats = &page->breakpoints[entry - 1];
+    __atomic_fetch_add(&stats->hits, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->last_hit_ns,
+        now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+    dyndebug_stats_release();
+}
+
+#endif /* __PRIV_DYNDEBUG_STATS__ */
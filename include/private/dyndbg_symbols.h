@@ -0,0 +1,28 @@
+#ifndef __PRIV_DYNDEBUG_SYMBOLS__
+#define __PRIV_DYNDEBUG_SYMBOLS__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_INDEXED_OBJECTS     256
+#define SYMBOL_INDEX_CHUNK      4096    /* entries per growth */
+
+typedef struct
+{
+    const char              *name;      /* in the mapped object file */
+    uint64_t                address;
+    uint64_t                size;
+    uint32_t                hash;
+    bool                    is_function;
+} ddbg_symbol_entry_t;
+
+/* An object file mapped for its string tables, for the index lifetime */
+typedef struct
+{
+    void                    *base;
+    size_t                  length;
+} ddbg_mapped_object_t;
+
+/* The indexed function containing address, false when none does */
+bool dyndebug_function_bounds(void *address, uint64_t *start, uint64_t *size);
+
+#endif /* __PRIV_DYNDEBUG_SYMBOLS__ */
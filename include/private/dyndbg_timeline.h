@@ -0,0 +1,61 @@
+#ifndef __PRIV_DYNDEBUG_TIMELINE__
+#define __PRIV_DYNDEBUG_TIMELINE__
+
+#include <private/dyndbg_monitor.h>
+
+#include <x86intrin.h>
+
+#define TIMELINE_EVENTS         4096    /* per thread, dropped beyond */
+#define TIMELINE_FLUSH_MS       50
+#define TIMELINE_CALIBRATION_MS 10
+
+typedef enum
+{
+    DDBG_TIMELINE_TRAP,         /* SIGTRAP handled */
+    DDBG_TIMELINE_CALLBACK,     /* user callback of a hit */
+    DDBG_TIMELINE_REQUEST,      /* monitor request, detail is the operation */
+    DDBG_TIMELINE_STOPPED,      /* by the monitor, detail is the tasks count */
+} ddbg_timeline_kind_t;
+
+/* Written by the thread, signal handlers included, read by the writer */
+typedef struct
+{
+    uint64_t                sequence;   /* index + 1 once complete */
+    uint64_t                begin;      /* TSC */
+    uint64_t                end;
+    uint64_t                address;
+    uint32_t                kind;
+    uint32_t                detail;
+} ddbg_timeline_event_t;
+
+typedef struct ddbg_timeline_buffer_
+{
+    struct ddbg_timeline_buffer_ *next;
+    pid_t                   tid;
+    bool                    named;      /* thread_name written */
+    bool                    released;   /* thread gone, reused once drained */
+    uint64_t                head;       /* next reserved */
+    uint64_t                tail;       /* next written out */
+    uint64_t                dropped;
+    ddbg_timeline_event_t   events[TIMELINE_EVENTS];
+} ddbg_timeline_buffer_t;
+
+/* Read before any timestamp, set by dyndebug_start_timeline() */
+extern bool dyndebug_timeline_enabled;
+
+/* 0 when not tracing, the events of an interval starting at 0 are dropped */
+static inline uint64_t dyndebug_timeline_begin(void)
+{
+    return __atomic_load_n(&dyndebug_timeline_enabled, __ATOMIC_RELAXED) ?
+        __rdtsc() : 0;
+}
+
+/* Async-signal-safe, end is taken now */
+void dyndebug_timeline_record(ddbg_timeline_kind_t kind, uint32_t detail,
+    uint64_t address, uint64_t begin);
+void dyndebug_timeline_request(const ddbg_monitor_request_t *request,
+    const ddbg_monitor_response_t *response, uint64_t begin);
+/* In a forked child */
+void dyndebug_timeline_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_TIMELINE__ */
@@ -0,0 +1,37 @@
+#ifndef __PRIV_DYNDEBUG_TRACE__
+#define __PRIV_DYNDEBUG_TRACE__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_TRACE_BUFFERS       8
+#define MAX_TRACE_STEPS         65536
+#define X86_EFLAGS_TF           0x100
+
+typedef enum
+{
+    DDBG_TRACE_FREE = 0,
+    DDBG_TRACE_RECORDING,
+    DDBG_TRACE_DONE,
+    DDBG_TRACE_RESIZING,        /* claimed by dyndebug_set_trace_window() */
+} ddbg_trace_state_t;
+
+typedef struct
+{
+    uint32_t                state;
+    uint32_t                remaining;
+    uint32_t                count;
+    uint64_t                sequence;
+    ddbg_trace_run_t        *runs;
+} ddbg_trace_buffer_t;
+
+/* Starts single-stepping the trapped thread, from the breakpoint handler */
+void dyndebug_trace_start(void *ucontext);
+/* Handles a TF trap, false when the thread is not traced */
+bool dyndebug_trace_step(void *ucontext);
+/* Around fork(), no window is being resized. The traces the other threads
+were recording are dropped in the child */
+void dyndebug_trace_fork_prepare(void);
+void dyndebug_trace_fork_parent(void);
+void dyndebug_trace_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_TRACE__ */
@@ -0,0 +1,38 @@
+#ifndef __PRIV_DYNDEBUG_UAF__
+#define __PRIV_DYNDEBUG_UAF__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_QUARANTINE          4096
+#define DEFAULT_QUARANTINE      1024
+#define DEFAULT_UAF_ROTATION_MS 50
+#define MAX_UAF_REPORTS         16
+
+/* A freed block kept aside, its memory is not reused until evicted */
+typedef struct
+{
+    void                    *ptr;
+    size_t                  size;
+    uint64_t                free_pcs[DDBG_UAF_DEPTH];
+    int                     free_depth;
+    int                     slot;       /* armed in, -1 otherwise */
+} ddbg_quarantined_t;
+
+/* A watch of the detector, the report template is copied on arming so that
+the trap handler does not touch the quarantine */
+typedef struct
+{
+    ddbg_breakpoint_t       breakpoint;
+    ddbg_quarantined_t      *block;
+    ddbg_uaf_report_t       report;
+    bool                    reported;   /* atomic, set by the trap handlers */
+    bool                    busy;       /* being disarmed by a free */
+} ddbg_uaf_slot_t;
+
+/* Around fork(), the quarantine is consistent while the lock is held. The
+child has no rotation thread, its detector is stopped */
+void dyndebug_uaf_fork_prepare(void);
+void dyndebug_uaf_fork_parent(void);
+void dyndebug_uaf_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_UAF__ */
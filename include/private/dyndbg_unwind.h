@@ -0,0 +1,17 @@
+#ifndef __PRIV_DYNDEBUG_UNWIND__
+#define __PRIV_DYNDEBUG_UNWIND__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_UNWIND_FRAME_SIZE   (64 * 1024)
+
+/* Records the calling thread stack bounds so that unwinding it from a signal
+handler costs no system call, threads not registered are probed instead */
+bool dyndebug_unwind_register_thread(void);
+
+/* Frame pointer walk from a signal ucontext general registers, pcs[0] is the
+interrupted RIP, returns the number of pcs, async-signal-safe */
+int dyndebug_unwind(const long long *gregs, uint64_t *pcs, int max);
+
+#endif /* __PRIV_DYNDEBUG_UNWIND__ */
@@ -0,0 +1,34 @@
+#ifndef __PRIV_DYNDEBUG_WRITE_PROFILER__
+#define __PRIV_DYNDEBUG_WRITE_PROFILER__
+
+#include <dyndbg/dyndbg_us.h>
+
+#define MAX_PROFILED_WATCHES    64
+#define MAX_WRITE_SITES         1024    /* power of 2 */
+#define DEFAULT_ROTATION_MS     100
+
+typedef struct
+{
+    ddbg_breakpoint_t       breakpoint; /* armed while in the rotation window */
+    void                    *address;
+    ddbg_btype_t            type;
+    ddbg_bsize_t            size;
+    bool                    armed;
+    uint64_t                armed_since_ns;
+    uint64_t                armed_total_ns;
+    uint64_t                hits;
+} ddbg_profiled_watch_t;
+
+typedef struct
+{
+    uint64_t                hash;       /* 0 for a free slot */
+    ddbg_write_site_t       site;
+} ddbg_write_site_entry_t;
+
+/* Around fork(), the watches are consistent while the lock is held. The child
+has no rotation thread, its profiler is stopped */
+void dyndebug_write_profiler_fork_prepare(void);
+void dyndebug_write_profiler_fork_parent(void);
+void dyndebug_write_profiler_forked(void);
+
+#endif /* __PRIV_DYNDEBUG_WRITE_PROFILER__ */
@@ -12,7 +12,9 @@
 #include <string.h>
 #include <errno.h>
 
-#define X86_DBG_STATUS_VALID(x)     (x.res0 == 0)
+/* Older kernels report the DR6 reserved bits 4-11 cleared, newer ones report
+them set as the hardware does */
+#define X86_DBG_STATUS_VALID(x)     (x.res0 == 0 || x.res0 == 0xff)
 #define X86_DBG_CONTROL_VALID(x)    (x.res0 == 0)
 
 typedef enum
@@ -73,6 +75,7 @@ static inline uint64_t x86_read_drx(pid_t pid, x86_breakpoint_register_t x)
 {
     assert(x < X86_HW_BREAKPOINT_MAX_REG);
     errno = 0;
+    dyndebug_monitor_ptraces++;
     uint64_t drx = ptrace(PTRACE_PEEKUSER, pid,
             offsetof(struct user, u_debugreg[x]), 0);
     int errno_ = errno;
@@ -89,6 +92,7 @@ static inline int x86_write_drx(pid_t pid, x86_breakpoint_register_t x,
 {
     assert(x < X86_HW_BREAKPOINT_MAX_REG);
     errno = 0;
+    dyndebug_monitor_ptraces++;
     int rc = ptrace( PTRACE_POKEUSER, pid,
             offsetof(struct user, u_debugreg[x]), val);
     int errno_ = errno;
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_coredump.h>
+#include <private/dyndbg_monitor_threads.h>
+#include <private/dyndbg_monitor.h>
+#include <dyndbg/dyndbg_us.h>
+
+#include <ucontext.h>
+
+#include <sys/procfs.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <elf.h>
+
+#define CORE_PAGE_SIZE      4096
+#define MAX_CORE_NAME       256
+#define MAX_AUXV_SIZE       4096
+#define MAX_PSARGS          80
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define align_up(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+typedef struct
+{
+    uint64_t                start;
+    uint64_t                end;
+    uint64_t                pgoff;
+    uint64_t                inode;
+    uint64_t                referenced_kb;
+    uint64_t                file_offset; /* in the core */
+    bool                    readable;
+    bool                    writable;
+    bool                    executable;
+    bool                    shared;
+    bool                    dumped;
+    char                    name[MAX_CORE_NAME];
+} ddbg_core_segment_t;
+
+typedef struct
+{
+    int                     fd;
+    pid_t                   pid;
+    ddbg_core_segment_t     *segments;
+    int                     count;
+    int                     next_chunk;
+    int                     chunk_count;
+    /* chunk index -> (segment, offset in the segment) */
+    struct
+    {
+        int                 segment;
+        uint64_t            offset;
+    } *chunks;
+    uint64_t                written;
+    uint64_t                holes;
+    int                     error;      /* first write errno, 0 if none */
+} ddbg_core_job_t;
+
+static ddbg_core_config_t core_config =
+{
+    .policy = DDBG_CORE_DEFAULT,
+    .path = CORE_DEFAULT_PATH,
+};
+
+ddbg_core_config_t *dyndebug_core_config(void)
+{
+    return &core_config;
+}
+
+ddbg_result_t dyndebug_set_core_policy(uint32_t policy, const char *path)
+{
+    if (policy & ~DDBG_CORE_DEFAULT)
+        return DDBG_INVALID_ARGUMENT;
+    if (path && strlen(path) >= MAX_CORE_PATH - 16)
+        return DDBG_INVALID_ARGUMENT;
+    core_config.policy = policy;
+    if (path)
+        strcpy(core_config.path, path);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_add_core_region(void *address, size_t size)
+{
+    if (!address || !size)
+        return DDBG_INVALID_ARGUMENT;
+    if (core_config.region_count == MAX_CORE_REGIONS)
+        return DDBG_ALL_HWBP_BUSY;
+    for (int i = 0 ; i < core_config.region_count ; i++)
+        if (core_config.regions[i].start == (uint64_t)address)
+            return DDBG_BP_ALREADY_EXISTS;
+    core_config.regions[core_config.region_count].start = (uint64_t)address;
+    core_config.regions[core_config.region_count].size = size;
+    core_config.region_count++;
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_remove_core_region(void *address)
+{
+    for (int i = 0 ; i < core_config.region_count ; i++)
+    {
+        if (core_config.regions[i].start != (uint64_t)address)
+            continue;
+        core_config.regions[i] = core_config.regions[--core_config.region_count];
+        return DDBG_SUCCESS;
+    }
+    return DDBG_INVALID_ARGUMENT;
+}
+
+static int parse_smaps(pid_t pid, ddbg_core_segment_t **segments)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/smaps", pid);
+    FILE *smaps = fopen(path, "r");
+    if (!smaps)
+        return -1;
+
+    int count = 0, capacity = 256;
+    ddbg_core_segment_t *array = calloc(capacity, sizeof(ddbg_core_segment_t));
+    char *line = NULL;
+    size_t line_size = 0;
+    while (array && getline(&line, &line_size, smaps) > 0)
+    {
+        uint64_t start, end, pgoff, inode, kb;
+        unsigned int major, minor;
+        char perms[8];
+        int name_offset = 0;
+        if (sscanf(line, "%lx-%lx %7s %lx %x:%x %lu %n", &start, &end, perms,
+                &pgoff, &major, &minor, &inode, &name_offset) >= 7)
+        {
+            if (count == capacity)
+            {
+                ddbg_core_segment_t *larger = realloc(array,
+                    2 * capacity * sizeof(ddbg_core_segment_t));
+                if (!larger)
+                    break;
+                array = larger;
+                capacity *= 2;
+            }
+            ddbg_core_segment_t *s = &array[count++];
+            memset(s, 0, sizeof(*s));
+            s->start = start;
+            s->end = end;
+            s->pgoff = pgoff;
+            s->inode = inode;
+            s->readable = perms[0] == 'r';
+            s->writable = perms[1] == 'w';
+            s->executable = perms[2] == 'x';
+            s->shared = perms[3] == 's';
+            strncpy(s->name, line + name_offset, MAX_CORE_NAME - 1);
+            s->name[strcspn(s->name, "\n")] = 0;
+        } else if (count && sscanf(line, "Referenced: %lu kB", &kb) == 1)
+            array[count - 1].referenced_kb = kb;
+    }
+    free(line);
+    fclose(smaps);
+    if (!array)
+        return -1;
+    *segments = array;
+    return count;
+}
+
+static bool holds_a_stack(ddbg_core_segment_t *s, ddbg_task_t *tasks, int count)
+{
+    if (!strncmp(s->name, "[stack", 6))
+        return true;
+    for (int i = 0 ; i < count ; i++)
+        if (tasks[i].regs_valid && tasks[i].regs.rsp >= s->start &&
+                tasks[i].regs.rsp < s->end)
+            return true;
+    return false;
+}
+
+static void select_segments(ddbg_core_segment_t *segments, int count,
+    ddbg_core_config_t *config, ddbg_task_t *tasks, int task_count)
+{
+    for (int i = 0 ; i < count ; i++)
+    {
+        ddbg_core_segment_t *s = &segments[i];
+        bool file_backed = s->inode != 0;
+        if (!s->readable || !strcmp(s->name, "[vvar]") ||
+                !strcmp(s->name, "[vsyscall]"))
+            continue;
+        if (!strcmp(s->name, "[vdso]"))
+            s->dumped = true;
+        if ((config->policy & DDBG_CORE_STACKS) && holds_a_stack(s, tasks,
+                task_count))
+            s->dumped = true;
+        /* The accessed bits tell which anonymous memory was touched lately */
+        if ((config->policy & DDBG_CORE_HEAP) && (!strcmp(s->name, "[heap]") ||
+                (!file_backed && !s->name[0] && s->writable &&
+                s->referenced_kb)))
+            s->dumped = true;
+        /* .data/.bss and the RELRO page before them, gdb needs the .dynamic
+        it holds to find the shared libraries */
+        if ((config->policy & DDBG_CORE_DATA) && file_backed && !s->executable &&
+                (s->writable || (i + 1 < count && segments[i + 1].writable &&
+                segments[i + 1].inode == s->inode)))
+            s->dumped = true;
+    }
+}
+
+static int add_region_segments(ddbg_core_segment_t **segments, int count,
+    ddbg_core_config_t *config)
+{
+    if (!(config->policy & DDBG_CORE_REGIONS))
+        return count;
+
+    /* Only the registered pages of a mapping not dumped otherwise */
+    int total = count;
+    for (int r = 0 ; r < config->region_count && r < MAX_CORE_REGIONS ; r++)
+    {
+        uint64_t start = config->regions[r].start & ~(uint64_t)(CORE_PAGE_SIZE - 1);
+        uint64_t end = align_up(config->regions[r].start + config->regions[r].size,
+            CORE_PAGE_SIZE);
+        for (int i = 0 ; i < count ; i++)
+        {
+            ddbg_core_segment_t *s = &(*segments)[i];
+            if (s->dumped || !s->readable || start >= s->end || end <= s->start)
+                continue;
+            ddbg_core_segment_t *larger = realloc(*segments,
+                (total + 1) * sizeof(ddbg_core_segment_t));
+            if (!larger)
+                return total;
+            *segments = larger;
+            s = &larger[i];
+            ddbg_core_segment_t *region = &larger[total++];
+            *region = *s;
+            region->start = start > s->start ? start : s->start;
+            region->end = end < s->end ? end : s->end;
+            region->inode = 0; /* keeps NT_FILE clean */
+            region->dumped = true;
+        }
+    }
+    return total;
+}
+
+static void write_note(FILE *out, const char *name, uint32_t type,
+    const void *desc, uint32_t size)
+{
+    static const uint8_t padding[4] = {0};
+    Elf64_Nhdr note = {.n_namesz = strlen(name) + 1, .n_descsz = size,
+        .n_type = type};
+    fwrite(&note, sizeof(note), 1, out);
+    fwrite(name, note.n_namesz, 1, out);
+    fwrite(padding, align_up(note.n_namesz, 4) - note.n_namesz, 1, out);
+    fwrite(desc, size, 1, out);
+    fwrite(padding, align_up(size, 4) - size, 1, out);
+}
+
+static void gregs_to_user_regs(const long long *gregs, struct user_regs_struct *r)
+{
+    r->r8 = gregs[REG_R8];
+    r->r9 = gregs[REG_R9];
+    r->r10 = gregs[REG_R10];
+    r->r11 = gregs[REG_R11];
+    r->r12 = gregs[REG_R12];
+    r->r13 = gregs[REG_R13];
+    r->r14 = gregs[REG_R14];
+    r->r15 = gregs[REG_R15];
+    r->rdi = gregs[REG_RDI];
+    r->rsi = gregs[REG_RSI];
+    r->rbp = gregs[REG_RBP];
+    r->rbx = gregs[REG_RBX];
+    r->rdx = gregs[REG_RDX];
+    r->rax = gregs[REG_RAX];
+    r->rcx = gregs[REG_RCX];
+    r->rsp = gregs[REG_RSP];
+    r->rip = gregs[REG_RIP];
+    r->eflags = gregs[REG_EFL];
+    r->cs = gregs[REG_CSGSFS] & 0xffff;
+    r->orig_rax = -1;
+}
+
+static void write_prstatus(FILE *out, ddbg_task_t *task, int signum,
+    const long long *crash_gregs)
+{
+    struct elf_prstatus status;
+    struct user_regs_struct regs = task->regs;
+    memset(&status, 0, sizeof(status));
+    status.pr_pid = task->tid;
+    if (crash_gregs)
+    {
+        /* Show the faulting frame, not the crash handler one */
+        gregs_to_user_regs(crash_gregs, &regs);
+        status.pr_cursig = signum;
+        status.pr_info.si_signo = signum;
+    }
+    memcpy(&status.pr_reg, &regs, min(sizeof(status.pr_reg), sizeof(regs)));
+    write_note(out, "CORE", NT_PRSTATUS, &status, sizeof(status));
+}
+
+static void write_prpsinfo(FILE *out, ddbg_context_t *context)
+{
+    struct elf_prpsinfo info;
+    char path[64];
+    memset(&info, 0, sizeof(info));
+    info.pr_pid = context->monitored_pid;
+    info.pr_ppid = context->monitor_pid;
+    info.pr_sname = 'R';
+    strncpy(info.pr_fname, context->monitored_process_name,
+        sizeof(info.pr_fname) - 1);
+    snprintf(path, sizeof(path), "/proc/%d/cmdline", context->monitored_pid);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        ssize_t len = read(fd, info.pr_psargs, sizeof(info.pr_psargs) - 1);
+        for (ssize_t i = 0 ; i < len - 1 ; i++)
+            if (!info.pr_psargs[i])
+                info.pr_psargs[i] = ' ';
+        close(fd);
+    }
+    write_note(out, "CORE", NT_PRPSINFO, &info, sizeof(info));
+}
+
+static void write_auxv(FILE *out, pid_t pid)
+{
+    uint8_t auxv[MAX_AUXV_SIZE];
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/auxv", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    ssize_t len = read(fd, auxv, sizeof(auxv));
+    close(fd);
+    if (len > 0)
+        write_note(out, "CORE", NT_AUXV, auxv, len);
+}
+
+static void write_file_note(FILE *out, ddbg_core_segment_t *segments, int count)
+{
+    char *desc = NULL;
+    size_t size = 0;
+    FILE *note = open_memstream(&desc, &size);
+    if (!note)
+        return;
+
+    uint64_t files = 0, page_size = CORE_PAGE_SIZE;
+    for (int i = 0 ; i < count ; i++)
+        if (segments[i].inode && segments[i].name[0] == '/')
+            files++;
+    fwrite(&files, sizeof(files), 1, note);
+    fwrite(&page_size, sizeof(page_size), 1, note);
+    for (int i = 0 ; i < count ; i++)
+    {
+        if (!segments[i].inode || segments[i].name[0] != '/')
+            continue;
+        uint64_t entry[3] = {segments[i].start, segments[i].end,
+            segments[i].pgoff / CORE_PAGE_SIZE};
+        fwrite(entry, sizeof(entry), 1, note);
+    }
+    for (int i = 0 ; i < count ; i++)
+        if (segments[i].inode && segments[i].name[0] == '/')
+            fwrite(segments[i].name, strlen(segments[i].name) + 1, 1, note);
+    fclose(note);
+    write_note(out, "CORE", NT_FILE, desc, size);
+    free(desc);
+}
+
+static bool zero_page(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    for (size_t i = 0 ; i < CORE_PAGE_SIZE / sizeof(uint64_t) ; i++)
+        if (words[i])
+            return false;
+    return true;
+}
+
+/* The first error is kept for the result, the workers stop on it */
+static void set_core_error(ddbg_core_job_t *job, int error)
+{
+    int none = 0;
+    if (__atomic_compare_exchange_n(&job->error, &none, error ? error : EIO,
+            false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        error_print("Cannot write the core -- %s\n", strerror(error));
+}
+
+static size_t write_run(ddbg_core_job_t *job, ddbg_core_segment_t *s,
+    uint64_t offset, const uint8_t *buffer, size_t from, size_t to)
+{
+    if (to <= from)
+        return 0;
+    /* A short write is a full disk, errno is not set */
+    ssize_t rc = pwrite(job->fd, buffer + from, to - from,
+        s->file_offset + offset + from);
+    if (rc != (ssize_t)(to - from))
+    {
+        set_core_error(job, rc < 0 ? errno : ENOSPC);
+        return rc > 0 ? rc : 0;
+    }
+    return to - from;
+}
+
+static void *core_worker(void *arg)
+{
+    ddbg_core_job_t *job = arg;
+    uint8_t *buffer = malloc(CORE_CHUNK_SIZE);
+    uint64_t written = 0, holes = 0;
+    int i;
+    if (!buffer)
+        return NULL;
+
+    while (!__atomic_load_n(&job->error, __ATOMIC_RELAXED) &&
+            (i = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) <
+            job->chunk_count)
+    {
+        ddbg_core_segment_t *s = &job->segments[job->chunks[i].segment];
+        uint64_t offset = job->chunks[i].offset;
+        size_t size = min(CORE_CHUNK_SIZE, s->end - s->start - offset);
+        struct iovec local = {.iov_base = buffer, .iov_len = size};
+        struct iovec remote = {.iov_base = (void *)(s->start + offset),
+            .iov_len = size};
+        /* Unreadable tails (guard pages...) stay holes */
+        ssize_t rc = process_vm_readv(job->pid, &local, 1, &remote, 1, 0);
+        size_t copied = rc > 0 ? rc : 0;
+
+        /* Write the non zero runs only, the zero pages are holes */
+        size_t run = 0, page;
+        for (page = 0 ; page < copied ; page += CORE_PAGE_SIZE)
+        {
+            if (page + CORE_PAGE_SIZE <= copied && !zero_page(buffer + page))
+                continue;
+            written += write_run(job, s, offset, buffer, run, page);
+            holes++;
+            run = page + CORE_PAGE_SIZE;
+        }
+        written += write_run(job, s, offset, buffer, run, min(page, copied));
+    }
+    free(buffer);
+    __atomic_fetch_add(&job->written, written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->holes, holes, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+ddbg_result_t dyndebug_monitor_write_core(ddbg_context_t *context,
+    ddbg_monitor_request_t *request, const long long *crash_gregs,
+    ddbg_task_t *tasks, int count)
+{
+    ddbg_core_config_t config;
+    ddbg_core_job_t job = {0};
+    struct timeval begin, end;
+    char path[PATH_MAX + MAX_CORE_PATH + sizeof(".-2147483648")];
+    int i;
+
+    gettimeofday(&begin, NULL);
+    job.pid = context->monitored_pid;
+
+    struct iovec local = {.iov_base = &config, .iov_len = sizeof(config)};
+    struct iovec remote = {.iov_base = request->crash.core_config,
+        .iov_len = sizeof(config)};
+    if (process_vm_readv(job.pid, &local, 1, &remote, 1, 0) != sizeof(config))
+    {
+        error_print("Cannot read the core policy -- %s\n", strerror(errno));
+        return DDBG_SYSTEM_ERROR;
+    }
+    config.path[MAX_CORE_PATH - 1] = 0;
+
+    job.count = parse_smaps(job.pid, &job.segments);
+    if (job.count < 0)
+    {
+        error_print("Cannot read the mappings of %d -- %s\n", job.pid,
+            strerror(errno));
+        return DDBG_SYSTEM_ERROR;
+    }
+    select_segments(job.segments, job.count, &config, tasks, count);
+    int mappings = job.count;
+    job.count = add_region_segments(&job.segments, job.count, &config);
+
+    /* Notes: the crashed thread first, gdb makes it the current one */
+    char *notes = NULL;
+    size_t notes_size = 0;
+    FILE *out = open_memstream(&notes, &notes_size);
+    if (!out)
+    {
+        free(job.segments);
+        return DDBG_SYSTEM_ERROR;
+    }
+    write_prpsinfo(out, context);
+    for (i = 0 ; i < count ; i++)
+        if (tasks[i].tid == request->crash.tid)
+            write_prstatus(out, &tasks[i], request->crash.signum, crash_gregs);
+    for (i = 0 ; i < count ; i++)
+        if (tasks[i].tid != request->crash.tid && tasks[i].regs_valid)
+            write_prstatus(out, &tasks[i], 0, NULL);
+    write_auxv(out, job.pid);
+    write_file_note(out, job.segments, job.count);
+    fclose(out);
+
+    /* Layout: headers, notes, then the page aligned segments */
+    int loads = 0;
+    uint64_t mapped = 0, dumped = 0;
+    for (i = 0 ; i < job.count ; i++)
+    {
+        if (i < mappings)
+            mapped += job.segments[i].end - job.segments[i].start;
+        if (job.segments[i].dumped)
+            loads++;
+    }
+    uint64_t offset = sizeof(Elf64_Ehdr) + (loads + 1) * sizeof(Elf64_Phdr);
+    uint64_t notes_offset = offset;
+    offset = align_up(offset + notes_size, CORE_PAGE_SIZE);
+
+    Elf64_Phdr *phdrs = calloc(loads + 1, sizeof(Elf64_Phdr));
+    if (!phdrs)
+    {
+        free(notes);
+        free(job.segments);
+        return DDBG_SYSTEM_ERROR;
+    }
+    phdrs[0].p_type = PT_NOTE;
+    phdrs[0].p_offset = notes_offset;
+    phdrs[0].p_filesz = notes_size;
+    int load = 1;
+    for (i = 0 ; i < job.count ; i++)
+    {
+        ddbg_core_segment_t *s = &job.segments[i];
+        if (!s->dumped)
+            continue;
+        s->file_offset = offset;
+        Elf64_Phdr *p = &phdrs[load++];
+        p->p_type = PT_LOAD;
+        p->p_offset = offset;
+        p->p_vaddr = s->start;
+        p->p_filesz = s->end - s->start;
+        p->p_memsz = s->end - s->start;
+        p->p_flags = (s->readable ? PF_R : 0) | (s->writable ? PF_W : 0) |
+            (s->executable ? PF_X : 0);
+        p->p_align = CORE_PAGE_SIZE;
+        job.chunk_count += (p->p_filesz + CORE_CHUNK_SIZE - 1) / CORE_CHUNK_SIZE;
+        offset += p->p_filesz;
+        dumped += p->p_filesz;
+    }
+
+    Elf64_Ehdr ehdr;
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_CORE;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = loads + 1;
+
+    /* A relative path is the process one, not the monitor working directory */
+    char cwd[PATH_MAX] = "";
+    if (config.path[0] != '/')
+    {
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/%d/cwd", job.pid);
+        ssize_t len = readlink(link, cwd, sizeof(cwd) - 2);
+        if (len > 0)
+        {
+            cwd[len] = '/';
+            cwd[len + 1] = 0;
+        }
+        else
+            cwd[0] = 0;
+    }
+    snprintf(path, sizeof(path), "%s%s.%d", cwd, config.path, job.pid);
+    job.fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (job.fd < 0)
+    {
+        error_print("Cannot create the core %s -- %s\n", path, strerror(errno));
+        free(phdrs);
+        free(notes);
+        free(job.segments);
+        return DDBG_SYSTEM_ERROR;
+    }
+    /* Sizing the file first makes every page not written a hole */
+    if (ftruncate(job.fd, offset) ||
+            pwrite(job.fd, &ehdr, sizeof(ehdr), 0) != (ssize_t)sizeof(ehdr) ||
+            pwrite(job.fd, phdrs, (loads + 1) * sizeof(Elf64_Phdr),
+            sizeof(ehdr)) != (ssize_t)((loads + 1) * sizeof(Elf64_Phdr)) ||
+            pwrite(job.fd, notes, notes_size, notes_offset) !=
+            (ssize_t)notes_size)
+        set_core_error(&job, errno);
+
+    /* Chunks of every segment are spread over the workers */
+    job.chunks = calloc(job.chunk_count, sizeof(*job.chunks));
+    int chunk = 0;
+    for (i = 0 ; job.chunks && i < job.count ; i++)
+    {
+        ddbg_core_segment_t *s = &job.segments[i];
+        if (!s->dumped)
+            continue;
+        for (uint64_t o = 0 ; o < s->end - s->start ; o += CORE_CHUNK_SIZE)
+        {
+            job.chunks[chunk].segment = i;
+            job.chunks[chunk++].offset = o;
+        }
+    }
+    if (!job.chunks)
+        job.chunk_count = 0;
+
+    pthread_t workers[MAX_CORE_WORKERS];
+    int nworkers = min(min(sysconf(_SC_NPROCESSORS_ONLN), MAX_CORE_WORKERS),
+        job.chunk_count), started = 0;
+    for ( ; nworkers > 1 && started < nworkers ; started++)
+        if (pthread_create(&workers[started], NULL, core_worker, &job))
+            break;
+    core_worker(&job);
+    for (i = 0 ; i < started ; i++)
+        pthread_join(workers[i], NULL);
+    if (close(job.fd))
+        set_core_error(&job, errno);
+
+    gettimeofday(&end, NULL);
+    if (job.error)
+        fprintf(stderr, "\nCore %s left incomplete -- %s\n", path,
+            strerror(job.error));
+    else
+        fprintf(stderr, "\nCore written to %s: %d of %d mappings, %lu of %lu "\
+            "MB, %lu MB of data, %lu zero pages left as holes, %ld ms\n", path,
+            loads, mappings, dumped >> 20, mapped >> 20, job.written >> 20,
+            job.holes, (end.tv_sec - begin.tv_sec) * 1000 +
+            (end.tv_usec - begin.tv_usec) / 1000);
+    fflush(stderr);
+
+    free(job.chunks);
+    free(phdrs);
+    free(notes);
+    free(job.segments);
+    return job.error ? DDBG_SYSTEM_ERROR : DDBG_SUCCESS;
+}
@@ -1,10 +1,16 @@
 #include <dyndbg/dyndbg_us.h>
 #include <private/dyndbg_monitor.h>
+#include <private/dyndbg_memcapture.h>
+#include <private/dyndbg_coredump.h>
+#include <private/dyndbg_fixup.h>
+#include <private/dyndbg_crash_signature.h>
 
 #define __USE_GNU
 #include <ucontext.h>
 
+#include <sys/syscall.h>
 #include <execinfo.h>
+#include <unistd.h>
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,6 +39,8 @@ enum X86_ERROR_BITS
 };
 
 static ddbg_crash_callback_t crash_callback = NULL;
+static uint32_t crash_flags = DDBG_CRASH_DEFAULT;
+static ddbg_maps_t crash_maps;
 extern void dyndebug_on_crash(int signum, siginfo_t *info, void *ucontext);
 
 void set_crash_callback(ddbg_crash_callback_t cb)
@@ -40,6 +48,29 @@ void set_crash_callback(ddbg_crash_callback_t cb)
     crash_callback = cb;
 }
 
+ddbg_result_t dyndebug_set_crash_flags(uint32_t flags)
+{
+    if (flags & ~(DDBG_CRASH_ALL_THREADS | DDBG_CRASH_MEMORY_CAPTURE |
+            DDBG_CRASH_CORE_FILE | DDBG_CRASH_DEDUPLICATE))
+        return DDBG_INVALID_ARGUMENT;
+    crash_flags = flags;
+    if ((flags & DDBG_CRASH_MEMORY_CAPTURE) && !crash_maps.count)
+        return dyndebug_refresh_memory_map();
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_refresh_memory_map(void)
+{
+    /* Parsed ahead of time, only used when no monitor can do it for us */
+    if (dyndebug_parse_maps(getpid(), &crash_maps) < 0)
+    {
+        error_print("Cannot parse the process mappings -- %s\n",
+            strerror(errno));
+        return DDBG_SYSTEM_ERROR;
+    }
+    return DDBG_SUCCESS;
+}
+
 ddbg_result_t dyndebug_install_crash_handler(ddbg_crash_callback_t cb)
 {
     struct sigaction sa = {0};
@@ -180,10 +211,48 @@ void print_fault(void *addr, mcontext_t *mcontext)
     }
 }
 
-void dyndebug_on_crash(int signum, siginfo_t *info, void *_ucontext)
+static void request_crash_report(int signum, void *fault_address,
+    ucontext_t *ucontext)
 {
-    ucontext_t *ucontext = _ucontext;
+    /* Only if a monitor runs already, forking one from here is not an option */
+    ddbg_context_t *context = dyndebug_peek_context();
+    if (!context || context->monitored_pid)
+    {
+        if (crash_flags & DDBG_CRASH_MEMORY_CAPTURE)
+        {
+            if (dyndebug_maps_outdated(&crash_maps, ucontext->uc_mcontext.gregs))
+                dyndebug_parse_maps(getpid(), &crash_maps);
+            /* process_vm_readv on ourselves fails instead of faulting */
+            dyndebug_capture_memory(stderr, getpid(), &crash_maps,
+                ucontext->uc_mcontext.gregs, fault_address);
+        }
+        if (crash_flags & DDBG_CRASH_ALL_THREADS)
+            fprintf(stderr, "\nNo monitor running, other threads not dumped\n");
+        if (crash_flags & DDBG_CRASH_CORE_FILE)
+            fprintf(stderr, "\nNo monitor running, no core written\n");
+        return;
+    }
+
+    ddbg_monitor_request_t request;
+    ddbg_monitor_response_t response;
+    request.operation = DDBG_CRASH_REPORT;
+    request.crash.tid = syscall(SYS_gettid);
+    request.crash.signum = signum;
+    request.crash.fault_address = fault_address;
+    request.crash.ucontext = ucontext;
+    request.crash.core_config = dyndebug_core_config();
+    request.crash.flags = crash_flags;
+    /* Blocks until the monitor has stopped, dumped and released every thread */
+    fflush(stderr);
+    dyndebug_send_monitor_request(context, &request, &response);
+    if (response.result != DDBG_SUCCESS)
+        fprintf(stderr, "\nThe monitor failed to report the crash (%d)\n",
+            response.result);
+}
 
+static __attribute__((noinline)) void report_crash(int signum,
+    siginfo_t *info, ucontext_t *ucontext)
+{
     /* Disable alignment check if set, it will be restored upon signal return */
     __asm__("pushf\n"
             "mov (%rsp), %rax\n"
@@ -197,13 +266,30 @@ void dyndebug_on_crash(int signum, siginfo_t *info, void *_ucontext)
 
     void *backtrace_array[MAX_BACKTRACE_DEPTH];
     size_t backtrace_size = backtrace(backtrace_array, MAX_BACKTRACE_DEPTH);
-    /* print directly to avoid malloc and ignore the first 2 which are related
+    /* print directly to avoid malloc and ignore the first 3 which are related
     to the signal handling */
     fprintf(stderr, "Error Callstack:\n");
-    backtrace_symbols_fd(&backtrace_array[2], backtrace_size-2, fileno(stderr));
+    backtrace_symbols_fd(&backtrace_array[3], backtrace_size-3, fileno(stderr));
 
     dump_registers(&ucontext->uc_mcontext);
     dump_stack(&ucontext->uc_mcontext);
+    if (crash_flags & ~DDBG_CRASH_DEDUPLICATE)
+        request_crash_report(signum, info->si_addr, ucontext);
+}
+
+void dyndebug_on_crash(int signum, siginfo_t *info, void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+
+    /* Expected faults (probing...) resume right away, without any report */
+    if (dyndebug_apply_fault_fixup(ucontext))
+        return;
+
+    /* A crash loop only pays for the full report once per signature */
+    if (!(crash_flags & DDBG_CRASH_DEDUPLICATE) ||
+            !dyndebug_crash_signature_seen(signum, ucontext->uc_mcontext.gregs))
+        report_crash(signum, info, ucontext);
+
     if (crash_callback)
     {
         crash_callback(signum, ucontext);
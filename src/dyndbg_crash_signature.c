@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_crash_signature.h>
+#include <private/dyndbg_unwind.h>
+
+#include <ucontext.h>
+
+#include <stdio.h>
+#include <time.h>
+
+/* Slots are claimed with a CAS on the signature and never released, the crash
+handler may run concurrently on several threads */
+static ddbg_signature_entry_t signatures[MAX_CRASH_SIGNATURES];
+static uint64_t summary_interval_ns = DEFAULT_SUMMARY_INTERVAL_MS * 1000000ULL;
+
+static uint64_t signature_mix(uint64_t hash, uint64_t value)
+{
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static ddbg_signature_entry_t *signature_lookup(uint64_t signature, bool *created)
+{
+    uint32_t slot = signature & (MAX_CRASH_SIGNATURES - 1);
+    for (int probe = 0 ; probe < MAX_CRASH_SIGNATURES ; probe++)
+    {
+        ddbg_signature_entry_t *entry = &signatures[slot];
+        uint64_t current = __atomic_load_n(&entry->signature, __ATOMIC_ACQUIRE);
+        if (current == signature)
+            return entry;
+        if (!current)
+        {
+            if (__atomic_compare_exchange_n(&entry->signature, &current,
+                    signature, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                *created = true;
+                return entry;
+            }
+            /* Lost the race, another thread may have inserted the same one */
+            if (current == signature)
+                return entry;
+        }
+        slot = (slot + 1) & (MAX_CRASH_SIGNATURES - 1);
+    }
+    return NULL;
+}
+
+bool dyndebug_crash_signature_seen(int signum, const long long *gregs)
+{
+    uint64_t pcs[CRASH_SIGNATURE_DEPTH + 1];
+    int depth = dyndebug_unwind(gregs, pcs, CRASH_SIGNATURE_DEPTH + 1);
+
+    uint64_t signature = signature_mix(signum, gregs[REG_TRAPNO]);
+    for (int i = 0 ; i < depth ; i++)
+        signature = signature_mix(signature, pcs[i]);
+    if (!signature)
+        signature = 1;
+
+    bool created = false;
+    ddbg_signature_entry_t *entry = signature_lookup(signature, &created);
+    if (!entry)
+        return false; /* table full, keep reporting */
+    if (created)
+    {
+        entry->rip = gregs[REG_RIP];
+        entry->signum = signum;
+        entry->trapno = gregs[REG_TRAPNO];
+        entry->last_summary_ns = now_ns();
+    }
+    uint64_t count = __atomic_add_fetch(&entry->count, 1, __ATOMIC_ACQ_REL);
+    if (created)
+        return false;
+
+    /* One line per signature and interval, whoever wins the CAS prints it */
+    uint64_t now = now_ns();
+    uint64_t last = __atomic_load_n(&entry->last_summary_ns, __ATOMIC_RELAXED);
+    if (now - last >= __atomic_load_n(&summary_interval_ns, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&entry->last_summary_ns, &last, now,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        fprintf(stderr, "Crash signature 0x%016lx seen %lu times (signal %d, "
+            "trap %d, RIP 0x%016lx)\n", signature, count, entry->signum,
+            entry->trapno, entry->rip);
+    return true;
+}
+
+ddbg_result_t dyndebug_set_crash_summary_interval(uint32_t interval_ms)
+{
+    __atomic_store_n(&summary_interval_ns, interval_ms * 1000000ULL,
+        __ATOMIC_RELAXED);
+    return DDBG_SUCCESS;
+}
+
+int dyndebug_get_crash_signatures(ddbg_crash_signature_t *exported, int max)
+{
+    int count = 0;
+    for (int slot = 0 ; slot < MAX_CRASH_SIGNATURES && count < max ; slot++)
+    {
+        ddbg_signature_entry_t *entry = &signatures[slot];
+        uint64_t hits = __atomic_load_n(&entry->count, __ATOMIC_ACQUIRE);
+        if (!hits)
+            continue;
+        exported[count].signature = entry->signature;
+        exported[count].count = hits;
+        exported[count].rip = (void *)entry->rip;
+        exported[count].signum = entry->signum;
+        exported[count].trapno = entry->trapno;
+        count++;
+    }
+    return count;
+}
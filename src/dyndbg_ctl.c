@@ -0,0 +1,324 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_ctl.h>
+#include <private/dyndbg_monitor.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+
+static ddbg_ctl_watch_t watches[MAX_CTL_WATCHES];
+static pthread_mutex_t ctl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ctl_thread;
+static int ctl_fd = -1;
+static bool ctl_stopping;
+
+static void on_ctl_hit(ddbg_breakpoint_t *b)
+{
+    ddbg_ctl_watch_t *watch = b->callback_priv_arg;
+    __atomic_fetch_add(&watch->hits, 1, __ATOMIC_RELAXED);
+}
+
+static bool resolve_item(ddbg_ctl_item_t *item)
+{
+    item->symbol[DDBG_CTL_SYMBOL_LENGTH - 1] = '\0';
+    if (!item->address && item->symbol[0])
+        item->address = (uint64_t)dyndebug_resolve_symbol(item->symbol);
+    if (item->type == DDBG_BREAK_INSTRUCTION)
+        item->size = DDBG_BREAK_1BYTE;
+    return item->address && item->type != DDBG_BREAK_DATA_IO_RDWR &&
+        item->type <= DDBG_BREAK_DATA_RDWR && item->size <= DDBG_BREAK_4BYTES &&
+        !(item->address % dyndebug_bsize_bytes(item->size));
+}
+
+static ddbg_ctl_watch_t *find_watch(const ddbg_ctl_item_t *item)
+{
+    for (int i = 0 ; i < MAX_CTL_WATCHES ; i++)
+    {
+        ddbg_breakpoint_t *b = &watches[i].breakpoint;
+        if (watches[i].used && (uint64_t)b->address == item->address &&
+                b->type == item->type && b->size == item->size)
+            return &watches[i];
+    }
+    return NULL;
+}
+
+static void add_watches(ddbg_context_t *context, ddbg_ctl_message_t *message)
+{
+    ddbg_breakpoint_t *listing[DDBG_CTL_MAX_ITEMS];
+    ddbg_ctl_item_t *listed_items[DDBG_CTL_MAX_ITEMS];
+    int listed = 0;
+
+    for (uint32_t i = 0 ; i < message->count ; i++)
+    {
+        ddbg_ctl_item_t *item = &message->items[i];
+        item->owned = 0;
+        item->enabled = 0;
+        item->hits = 0;
+        if (!resolve_item(item))
+        {
+            item->result = DDBG_INVALID_ARGUMENT;
+            continue;
+        }
+        if (dyndebug_find_breakpoint((void *)item->address, item->type,
+                item->size, false))
+        {
+            item->result = DDBG_BP_ALREADY_EXISTS;
+            continue;
+        }
+        ddbg_ctl_watch_t *watch = NULL;
+        for (int w = 0 ; w < MAX_CTL_WATCHES && !watch ; w++)
+            if (!watches[w].used)
+                watch = &watches[w];
+        if (!watch)
+        {
+            item->result = DDBG_ALL_HWBP_BUSY;
+            continue;
+        }
+        watch->used = true;
+        watch->hits = 0;
+        memcpy(watch->symbol, item->symbol, DDBG_CTL_SYMBOL_LENGTH);
+        dyndebug_list_breakpoint(context, &watch->breakpoint,
+            (void *)item->address, item->type, item->size, on_ctl_hit, watch,
+            true);
+        listing[listed] = &watch->breakpoint;
+        listed_items[listed++] = item;
+    }
+
+    /* All the valid items at once, the monitor stops the process per batch */
+    int armed = dyndebug_arm_breakpoints(listing, listed);
+    for (int i = 0 ; i < listed ; i++)
+    {
+        if (i < armed)
+        {
+            listed_items[i]->result = DDBG_SUCCESS;
+            listed_items[i]->enabled = 1;
+            listed_items[i]->owned = 1;
+            continue;
+        }
+        listed_items[i]->result = DDBG_ALL_HWBP_BUSY;
+        dyndebug_remove_breakpoint(listing[i]);
+        ((ddbg_ctl_watch_t *)listing[i]->callback_priv_arg)->used = false;
+    }
+}
+
+static void remove_watches(ddbg_ctl_message_t *message)
+{
+    for (uint32_t i = 0 ; i < message->count ; i++)
+    {
+        ddbg_ctl_item_t *item = &message->items[i];
+        ddbg_ctl_watch_t *watch = resolve_item(item) ? find_watch(item) : NULL;
+        if (!watch)
+        {
+            item->result = DDBG_HWBP_NOT_FOUND;
+            continue;
+        }
+        item->hits = __atomic_load_n(&watch->hits, __ATOMIC_RELAXED);
+        item->owned = 1;
+        item->enabled = 0;
+        item->result = dyndebug_remove_breakpoint(&watch->breakpoint);
+        watch->used = false;
+    }
+}
+
+static void list_watches(ddbg_context_t *context, ddbg_ctl_message_t *message)
+{
+    uint32_t index = 0;
+    message->count = 0;
+    int parity = dyndebug_tree_enter();
+    for (ddbg_breakpoint_t *b = context->breakpoints_root ; b ;
+            b = b->next, index++)
+    {
+        if (index < message->offset || message->count == DDBG_CTL_MAX_ITEMS)
+            continue;
+        ddbg_ctl_item_t *item = &message->items[message->count++];
+        memset(item, 0, sizeof(ddbg_ctl_item_t));
+        item->address = (uint64_t)b->address;
+        item->type = b->type;
+        item->size = b->size;
+        item->enabled = b->enabled;
+        item->result = DDBG_SUCCESS;
+        if (b->callback == on_ctl_hit)
+        {
+            ddbg_ctl_watch_t *watch = b->callback_priv_arg;
+            item->owned = 1;
+            item->hits = __atomic_load_n(&watch->hits, __ATOMIC_RELAXED);
+            memcpy(item->symbol, watch->symbol, DDBG_CTL_SYMBOL_LENGTH);
+            continue;
+        }
+
+        Dl_info info;
+        if (dladdr(b->address, &info) && info.dli_sname &&
+                info.dli_saddr == b->address)
+            strncpy(item->symbol, info.dli_sname, DDBG_CTL_SYMBOL_LENGTH - 1);
+    }
+    dyndebug_tree_exit(parity);
+    message->total = index;
+}
+
+static void serve_request(ddbg_context_t *context, int fd)
+{
+    ddbg_ctl_message_t message;
+    ssize_t length = recv(fd, &message, sizeof(message), 0);
+    if (length < (ssize_t)DDBG_CTL_MESSAGE_SIZE(0) ||
+            message.count > DDBG_CTL_MAX_ITEMS ||
+            length < (ssize_t)DDBG_CTL_MESSAGE_SIZE(message.count))
+    {
+        message.count = 0;
+        message.op = 0;
+    }
+
+    pthread_mutex_lock(&ctl_lock);
+    switch (message.op)
+    {
+        case DDBG_CTL_ADD:
+            add_watches(context, &message);
+            break;
+        case DDBG_CTL_REMOVE:
+            remove_watches(&message);
+            break;
+        case DDBG_CTL_LIST:
+            list_watches(context, &message);
+            break;
+        default:
+            debug_print("Invalid control request of %ld bytes\n", length);
+            message.count = 0;
+            break;
+    }
+    pthread_mutex_unlock(&ctl_lock);
+
+    if (send(fd, &message, DDBG_CTL_MESSAGE_SIZE(message.count),
+            MSG_NOSIGNAL) < 0)
+        debug_print("Cannot answer the control client -- %s\n",
+            strerror(errno));
+}
+
+/* One client at a time, the socket is polled so that stopping is noticed */
+/* The abstract socket is reachable by any local user, only our own is served */
+static int accept_client(void)
+{
+    int client = accept4(ctl_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0)
+        return -1;
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &length) ||
+            peer.uid != geteuid())
+    {
+        error_print("Control client rejected\n");
+        close(client);
+        return -1;
+    }
+    return client;
+}
+
+static void *ctl_main(void *arg)
+{
+    ddbg_context_t *context = arg;
+    int client = -1;
+    while (!__atomic_load_n(&ctl_stopping, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = {.fd = client < 0 ? ctl_fd : client, .events = POLLIN};
+        if (poll(&pfd, 1, CTL_POLL_MS) <= 0)
+            continue;
+        if (client < 0)
+            client = accept_client();
+        else if (pfd.revents & (POLLHUP | POLLERR))
+        {
+            close(client);
+            client = -1;
+        }
+        else
+            serve_request(context, client);
+    }
+    if (client >= 0)
+        close(client);
+    return NULL;
+}
+
+/* The server thread is not inherited, the socket is left to the parent */
+void dyndebug_control_forked(void)
+{
+    pthread_mutex_init(&ctl_lock, NULL);
+    if (ctl_fd >= 0)
+        close(ctl_fd);
+    ctl_fd = -1;
+}
+
+ddbg_result_t dyndebug_start_control(const char *name)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    int length = name ?
+        snprintf(&address.sun_path[1], sizeof(address.sun_path) - 1, "%s", name) :
+        snprintf(&address.sun_path[1], sizeof(address.sun_path) - 1, "%s%d",
+            DDBG_CTL_PREFIX, getpid());
+    if (length <= 0 || length >= (int)sizeof(address.sun_path) - 1)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&ctl_lock);
+    if (ctl_fd >= 0)
+    {
+        pthread_mutex_unlock(&ctl_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    ctl_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (ctl_fd < 0 || bind(ctl_fd, (struct sockaddr *)&address,
+            offsetof(struct sockaddr_un, sun_path) + 1 + length) ||
+            listen(ctl_fd, 4))
+    {
+        error_print("Cannot open the control socket %s -- %s\n",
+            &address.sun_path[1], strerror(errno));
+        if (ctl_fd >= 0)
+            close(ctl_fd);
+        ctl_fd = -1;
+        pthread_mutex_unlock(&ctl_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+
+    __atomic_store_n(&ctl_stopping, false, __ATOMIC_RELEASE);
+    if (pthread_create(&ctl_thread, NULL, ctl_main, context))
+    {
+        error_print("Cannot start the control thread\n");
+        close(ctl_fd);
+        ctl_fd = -1;
+        pthread_mutex_unlock(&ctl_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    pthread_mutex_unlock(&ctl_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_stop_control(void)
+{
+    pthread_mutex_lock(&ctl_lock);
+    if (ctl_fd < 0)
+    {
+        pthread_mutex_unlock(&ctl_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    __atomic_store_n(&ctl_stopping, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctl_lock);
+    pthread_join(ctl_thread, NULL);
+
+    pthread_mutex_lock(&ctl_lock);
+    close(ctl_fd);
+    ctl_fd = -1;
+    for (int i = 0 ; i < MAX_CTL_WATCHES ; i++)
+    {
+        if (!watches[i].used)
+            continue;
+        dyndebug_remove_breakpoint(&watches[i].breakpoint);
+        watches[i].used = false;
+    }
+    pthread_mutex_unlock(&ctl_lock);
+    return DDBG_SUCCESS;
+}
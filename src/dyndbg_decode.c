@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_decode.h>
+
+#include <string.h>
+#include <ucontext.h>
+
+/* Prefixes selecting the opcode map and the operand sizes */
+typedef struct
+{
+    int                     map;        /* one byte, 0x0f, 0x0f38, 0x0f3a */
+    int                     pp;         /* none, 66, f3 or f2 */
+    uint8_t                 rex;        /* W R X B, VEX/EVEX ones uninverted */
+    bool                    narrow;
+    bool                    vex;
+    bool                    evex;
+    bool                    l;          /* 256 bits vectors */
+} ddbg_encoding_t;
+
+/* ucontext registers by register number */
+static const int greg_numbers[16] = {REG_RAX, REG_RCX, REG_RDX, REG_RBX,
+    REG_RSP, REG_RBP, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11,
+    REG_R12, REG_R13, REG_R14, REG_R15};
+
+/* Not encodable in 64-bit mode */
+static bool invalid_opcode(uint8_t opcode)
+{
+    switch (opcode)
+    {
+        case 0x06: case 0x07: case 0x0e: case 0x16: case 0x17: case 0x1e:
+        case 0x1f: case 0x27: case 0x2f: case 0x37: case 0x3f: case 0x60:
+        case 0x61: case 0x82: case 0x9a: case 0xce: case 0xd4: case 0xd5:
+        case 0xd6: case 0xea:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int32_t read32(const uint8_t *p)
+{
+    return (int32_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+/* ModRM then SIB and displacement, p on the ModRM byte */
+static const uint8_t *skip_modrm(const uint8_t *p, uint8_t rex,
+    ddbg_instruction_t *insn)
+{
+    uint8_t m = *p++;
+    int mod = m >> 6, rm = m & 7;
+    if (mod == 3)
+        return p;
+    insn->memory = true;
+    insn->base = rm | (rex & 1) << 3;
+    if (rm == 4)
+    {
+        uint8_t sib = *p++;
+        int index = (sib >> 3 & 7) | (rex & 2) << 2;
+        insn->scale = 1 << (sib >> 6);
+        insn->index = index == 4 ? NO_REGISTER : index;
+        insn->base = (sib & 7) | (rex & 1) << 3;
+        if (mod == 0 && (sib & 7) == 5)
+        {
+            insn->base = NO_REGISTER;
+            insn->offset = read32(p);
+            return p + 4;
+        }
+    }
+    else if (mod == 0 && rm == 5)
+    {
+        insn->rip_relative = true;
+        insn->base = NO_REGISTER;
+        insn->offset = read32(p);
+        return p + 4;
+    }
+    if (mod == 1)
+        insn->offset = (int8_t)*p;
+    else if (mod == 2)
+        insn->offset = read32(p);
+    return p + (mod == 1 ? 1 : (mod == 2 ? 4 : 0));
+}
+
+/* Bytes written to the memory operand by the common stores, plain and
+read-modify-write ops, 0 for the others */
+static int store_width(const ddbg_encoding_t *e, uint8_t opcode, uint8_t modrm,
+    ddbg_instruction_t *insn)
+{
+    int reg = modrm >> 3 & 7;
+    int z = e->rex & 8 ? 8 : (e->narrow ? 2 : 4);
+    int vector = e->l ? 32 : 16;
+    if (e->map == 0)
+    {
+        switch (opcode)
+        {
+            case 0x00 ... 0x3f:
+                /* r/m, r forms, but cmp */
+                if ((opcode & 7) > 1 || (opcode & 0x38) == 0x38)
+                    return 0;
+                return opcode & 1 ? z : 1;
+            case 0x80: case 0x81: case 0x83:
+                return reg == 7 ? 0 : (opcode == 0x80 ? 1 : z);
+            case 0x86: case 0x87:
+                insn->clobbers = 1 << (reg | (e->rex & 4) << 1);
+                return opcode == 0x86 ? 1 : z;
+            case 0x88: case 0xc0: case 0xd0: case 0xd2:
+                return 1;
+            case 0x89: case 0xc1: case 0xd1: case 0xd3:
+                return z;
+            case 0x8c:
+                return 2;
+            case 0x8f:
+                return reg == 0 ? 8 : 0;
+            case 0xc6: case 0xc7:
+                return reg != 0 ? 0 : (opcode == 0xc6 ? 1 : z);
+            case 0xf6: case 0xf7:
+                return reg != 2 && reg != 3 ? 0 : (opcode == 0xf6 ? 1 : z);
+            case 0xfe: case 0xff:
+                return reg > 1 ? 0 : (opcode == 0xfe ? 1 : z);
+            default:
+                return 0;
+        }
+    }
+    if (e->map != 1 || e->evex)
+        return 0;
+    switch (opcode)
+    {
+        case 0x11:
+            /* movups/movupd, movss, movsd */
+            return e->pp == 2 ? 4 : (e->pp == 3 ? 8 : vector);
+        case 0x13: case 0x17:
+            return e->pp < 2 ? 8 : 0;
+        case 0x29: case 0x2b:
+            return e->pp < 2 ? vector : 0;
+        case 0x7e:
+            return e->pp == 1 || (e->pp == 0 && !e->vex) ?
+                (e->rex & 8 ? 8 : 4) : 0;
+        case 0x7f: case 0xe7:
+            if (e->pp == 0 && !e->vex)
+                return 8;
+            return e->pp == 1 || (e->pp == 2 && opcode == 0x7f) ? vector : 0;
+        case 0xd6:
+            return e->pp == 1 ? 8 : 0;
+        case 0x90 ... 0x9f:
+            return e->vex ? 0 : 1;
+        case 0xb0: case 0xb1:
+            /* cmpxchg loads rax on failure */
+            insn->clobbers = 1;
+            return e->vex ? 0 : (opcode == 0xb0 ? 1 : z);
+        case 0xc0: case 0xc1:
+            insn->clobbers = 1 << (reg | (e->rex & 4) << 1);
+            return e->vex ? 0 : (opcode == 0xc0 ? 1 : z);
+        case 0xc3:
+            return e->vex ? 0 : (e->rex & 8 ? 8 : 4);
+        default:
+            return 0;
+    }
+}
+
+/* 0x0f map and VEX/EVEX map 1 imm8 forms: shifts, shuffles, compares */
+static bool map1_immediate(uint8_t opcode)
+{
+    return (opcode >= 0x70 && opcode <= 0x73) || opcode == 0xc2 ||
+        (opcode >= 0xc4 && opcode <= 0xc6);
+}
+
+/* Returns the immediate size, -1 for an invalid opcode */
+static int decode_map1(uint8_t opcode, bool *modrm, ddbg_instruction_t *insn)
+{
+    switch (opcode)
+    {
+        case 0x04: case 0x0a: case 0x0c: case 0x0f: case 0x25: case 0x27:
+        case 0x36: case 0x39: case 0x3b ... 0x3f:
+            return -1;
+        case 0x05 ... 0x09: case 0x0b: case 0x0e: case 0x30 ... 0x35:
+        case 0x37: case 0x77: case 0xa0 ... 0xa2: case 0xa8 ... 0xaa:
+        case 0xc8 ... 0xcf:
+            return 0;
+        case 0x80 ... 0x8f:
+            insn->branch = true;
+            return 4;
+        case 0xa4: case 0xac: case 0xba:
+            *modrm = true;
+            return 1;
+        default:
+            *modrm = true;
+            return map1_immediate(opcode) ? 1 : 0;
+    }
+}
+
+/* Returns the immediate size, -1 for an invalid opcode */
+static int decode_legacy(uint8_t opcode, const uint8_t *p, int z, bool wide,
+    bool address32, bool *modrm, ddbg_instruction_t *insn)
+{
+    if (invalid_opcode(opcode))
+        return -1;
+    switch (opcode)
+    {
+        case 0x00 ... 0x3f:
+            /* ALU ops, r/m forms then al and eAX immediate forms */
+            if ((opcode & 7) < 4)
+                *modrm = true;
+            return (opcode & 7) == 4 ? 1 : ((opcode & 7) == 5 ? z : 0);
+        case 0x50 ... 0x5f: case 0x6c ... 0x6f: case 0x90 ... 0x9f:
+        case 0xa4 ... 0xa7: case 0xaa ... 0xaf: case 0xc3: case 0xc9:
+        case 0xcb: case 0xcc: case 0xcf: case 0xd7: case 0xec ... 0xef:
+        case 0xf1: case 0xf4: case 0xf5: case 0xf8 ... 0xfd:
+            return 0;
+        case 0x63: case 0x84 ... 0x8f: case 0xd0 ... 0xd3: case 0xd8 ... 0xdf:
+        case 0xfe: case 0xff:
+            *modrm = true;
+            return 0;
+        case 0x6a: case 0xa8: case 0xb0 ... 0xb7: case 0xcd: case 0xe4 ... 0xe7:
+            return 1;
+        case 0x68: case 0xa9:
+            return z;
+        case 0x69: case 0x81: case 0xc7:
+            *modrm = true;
+            return z;
+        case 0x6b: case 0x80: case 0x83: case 0xc0: case 0xc1: case 0xc6:
+            *modrm = true;
+            return 1;
+        case 0x70 ... 0x7f: case 0xe0 ... 0xe3: case 0xeb:
+            insn->branch = true;
+            return 1;
+        case 0xe8: case 0xe9:
+            insn->branch = true;
+            return 4;
+        case 0xa0 ... 0xa3:
+            return address32 ? 4 : 8;
+        case 0xb8 ... 0xbf:
+            return wide ? 8 : z;
+        case 0xc2: case 0xca:
+            return 2;
+        case 0xc8:
+            return 3;
+        case 0xf6: case 0xf7:
+            /* test r/m, imm only */
+            *modrm = true;
+            if ((*p >> 3 & 7) > 1)
+                return 0;
+            return opcode == 0xf6 ? 1 : z;
+        default:
+            return -1;
+    }
+}
+
+int dyndebug_decode_instruction(const uint8_t *code, ddbg_instruction_t *insn)
+{
+    const uint8_t *p = code;
+    bool address32 = false, rep = false;
+    ddbg_encoding_t encoding = {0};
+    memset(insn, 0, sizeof(*insn));
+    insn->base = NO_REGISTER;
+    insn->index = NO_REGISTER;
+
+    for ( ; p - code < MAX_INSTRUCTION_SIZE ; p++)
+    {
+        if (*p == 0x66)
+            encoding.narrow = true;
+        else if (*p == 0x67)
+            address32 = true;
+        else if (*p == 0xf2 || *p == 0xf3)
+        {
+            rep = true;
+            encoding.pp = *p == 0xf3 ? 2 : 3;
+        }
+        else if (*p == 0x64 || *p == 0x65)
+            insn->segment = true;
+        else if (*p != 0xf0 && *p != 0x26 && *p != 0x2e && *p != 0x36 &&
+                *p != 0x3e)
+            break;
+    }
+    if (!encoding.pp && encoding.narrow)
+        encoding.pp = 1;
+    if ((*p & 0xf0) == 0x40)
+        encoding.rex = *p++ & 0x0f;
+    bool wide = encoding.rex & 8;
+    insn->address32 = address32;
+
+    /* REX.W wins over the operand size prefix, imm32 sign extended */
+    int z = encoding.narrow && !wide ? 2 : 4, immediate;
+    bool modrm = false;
+    uint8_t opcode = *p++;
+    if (opcode == 0xc4 || opcode == 0xc5 || opcode == 0x62)
+    {
+        /* VEX 2 and 3 bytes, EVEX: prefix bytes then the map opcode */
+        encoding.vex = opcode != 0x62;
+        encoding.evex = opcode == 0x62;
+        if (opcode == 0xc5)
+        {
+            encoding.map = 1;
+            encoding.rex = (~p[0] & 0x80) >> 5;
+            encoding.l = p[0] & 0x04;
+            encoding.pp = p[0] & 0x03;
+        }
+        else
+        {
+            encoding.map = opcode == 0xc4 ? p[0] & 0x1f : p[0] & 0x07;
+            encoding.rex = (~p[0] & 0xe0) >> 5 | (p[1] & 0x80) >> 4;
+            encoding.l = opcode == 0xc4 && (p[1] & 0x04);
+            encoding.pp = p[1] & 0x03;
+        }
+        p += opcode == 0xc5 ? 1 : (opcode == 0xc4 ? 2 : 3);
+        opcode = *p++;
+        modrm = encoding.map != 1 || opcode != 0x77;    /* vzeroupper, vzeroall */
+        if (encoding.map == 1)
+            immediate = map1_immediate(opcode) ? 1 : 0;
+        else if (encoding.map == 3)
+            immediate = 1;
+        else if (encoding.map == 2 || encoding.map == 5 || encoding.map == 6)
+            immediate = 0;
+        else
+            return 0;
+    }
+    else if (opcode == 0x0f)
+    {
+        opcode = *p++;
+        encoding.map = 1;
+        if (opcode == 0x38 || opcode == 0x3a)
+        {
+            encoding.map = opcode == 0x3a ? 3 : 2;
+            immediate = opcode == 0x3a ? 1 : 0;
+            opcode = *p++;
+            modrm = true;
+        }
+        else
+            immediate = decode_map1(opcode, &modrm, insn);
+    }
+    else
+    {
+        immediate = decode_legacy(opcode, p, z, wide, address32, &modrm, insn);
+        bool string = (opcode >= 0x6c && opcode <= 0x6f) ||
+            (opcode >= 0xa4 && opcode <= 0xa7) ||
+            (opcode >= 0xaa && opcode <= 0xaf);
+        insn->rep_string = rep && string;
+    }
+    if (immediate < 0)
+        return 0;
+
+    if (modrm)
+    {
+        uint8_t m = *p;
+        p = skip_modrm(p, encoding.rex, insn);
+        /* EVEX disp8 is scaled by the operand size, left unaddressed */
+        if (encoding.evex && (m >> 6) == 1)
+            insn->memory = false;
+        if (insn->memory)
+            insn->store = store_width(&encoding, opcode, m, insn);
+    }
+    int length = p - code + immediate;
+    if (length > MAX_INSTRUCTION_SIZE)
+        return 0;
+    if (insn->branch)
+        insn->displacement = immediate == 1 ? (int8_t)p[0] : read32(p);
+    insn->length = length;
+    return length;
+}
+
+bool dyndebug_instruction_address(const ddbg_instruction_t *insn,
+    const long long *gregs, uint64_t *address)
+{
+    if (!insn->memory || insn->segment ||
+            (insn->base != NO_REGISTER && (insn->clobbers & 1 << insn->base)) ||
+            (insn->index != NO_REGISTER && (insn->clobbers & 1 << insn->index)))
+        return false;
+
+    uint64_t target = (int64_t)insn->offset;
+    if (insn->rip_relative)
+        target += gregs[REG_RIP];
+    if (insn->base != NO_REGISTER)
+        target += gregs[greg_numbers[insn->base]];
+    if (insn->index != NO_REGISTER)
+        target += gregs[greg_numbers[insn->index]] * insn->scale;
+    *address = insn->address32 ? (uint32_t)target : target;
+    return true;
+}
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_dispatch.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_timeline.h>
+
+#include <ucontext.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct
+{
+    uint64_t                sequence;   /* position + 1 once written */
+    ddbg_hit_t              hit;
+} dispatch_slot_t;
+
+/* Bounded ring, written by any thread running on the CPU, drained by one
+worker. The tail moves once the callbacks ran, a slot is not reused before */
+typedef struct
+{
+    uint64_t                head;       /* next position to reserve */
+    uint64_t                queued;
+    uint64_t                dropped;
+    uint64_t                blocked;
+    uint8_t                 pad[32];
+    uint64_t                tail;       /* next position to dispatch */
+    uint64_t                max_depth;
+    dispatch_slot_t         slots[];
+} dispatch_queue_t;
+
+typedef struct
+{
+    pthread_t               thread;
+    int                     index;
+    uint32_t                sleeping;   /* futex, 1 while waiting */
+    uint64_t                dispatched;
+    uint64_t                batches;
+} dispatch_worker_t;
+
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static dispatch_queue_t *queues[DISPATCH_MAX_QUEUES];
+static size_t queue_size;
+static int queue_count;
+static uint32_t queue_depth;
+static dispatch_worker_t workers[DISPATCH_MAX_WORKERS];
+static int worker_count;
+static uint32_t batch_size;
+static uint64_t block_ns;
+static bool running;
+static bool stopping;
+/* Trap handlers past the running check, the stop waits for them */
+static int inflight;
+static __thread pid_t thread_tid;
+static __thread bool in_worker;
+static __thread const ddbg_hit_t *current_hit;
+
+const ddbg_hit_t *dyndebug_get_hit(void)
+{
+    return current_hit;
+}
+
+bool dyndebug_dispatch_in_worker(void)
+{
+    return in_worker;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void wake(dispatch_worker_t *worker)
+{
+    if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &worker->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL,
+            NULL, 0);
+}
+
+/* Workers never wait for room, their own queue may be the full one */
+static bool reserve(dispatch_queue_t *queue, uint64_t *position)
+{
+    uint64_t deadline = 0;
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) < queue_depth)
+        {
+            if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *position = head;
+                return true;
+            }
+            continue;
+        }
+        if (!block_ns || in_worker)
+            return false;
+        uint64_t now = now_ns();
+        if (!deadline)
+        {
+            deadline = now + block_ns;
+            __atomic_fetch_add(&queue->blocked, 1, __ATOMIC_RELAXED);
+        }
+        else if (now >= deadline)
+            return false;
+        sched_yield();
+        head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    }
+}
+
+bool dyndebug_dispatch_hit(ddbg_breakpoint_t *b, const void *ucontext)
+{
+    __atomic_fetch_add(&inflight, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&running, __ATOMIC_SEQ_CST))
+    {
+        __atomic_fetch_sub(&inflight, 1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    int cpu = sched_getcpu();
+    int index = (cpu < 0 ? 0 : cpu) % queue_count;
+    dispatch_queue_t *queue = queues[index];
+    uint64_t position;
+    if (!reserve(queue, &position))
+    {
+        __atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&inflight, 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    if (!thread_tid)
+        thread_tid = syscall(SYS_gettid);
+    dispatch_slot_t *slot = &queue->slots[position % queue_depth];
+    ddbg_hit_t *hit = &slot->hit;
+    hit->breakpoint = b;
+    hit->taken_ns = now_ns();
+    hit->old_value = b->old_value;
+    hit->value = b->shadow;
+    hit->tid = thread_tid;
+    hit->cpu = cpu;
+    if (ucontext)
+    {
+        const ucontext_t *context = ucontext;
+        memcpy(hit->gregs, context->uc_mcontext.gregs, sizeof(hit->gregs));
+        hit->rip = context->uc_mcontext.gregs[REG_RIP];
+    }
+    else
+    {
+        memset(hit->gregs, 0, sizeof(hit->gregs));
+        hit->rip = (uint64_t)b->address;
+    }
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&queue->queued, 1, __ATOMIC_RELAXED);
+
+    /* Pairs with the worker announcing its sleep then checking the queues */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    wake(&workers[index % worker_count]);
+    __atomic_fetch_sub(&inflight, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void run(const ddbg_hit_t *hit)
+{
+    ddbg_breakpoint_t *b = hit->breakpoint;
+    current_hit = hit;
+    uint64_t begin = dyndebug_timeline_begin();
+    b->callback(b);
+    if (begin)
+        dyndebug_timeline_record(DDBG_TIMELINE_CALLBACK, 0, (uint64_t)b->address,
+            begin);
+    current_hit = NULL;
+}
+
+/* Returns the number of hits dispatched, a batch at most */
+static uint64_t drain_queue(dispatch_worker_t *worker, dispatch_queue_t *queue)
+{
+    uint64_t tail = queue->tail, end = tail;
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (head - tail > queue->max_depth)
+        __atomic_store_n(&queue->max_depth, head - tail, __ATOMIC_RELAXED);
+    /* A reserved slot may not be written yet, the batch stops before it */
+    while (end < head && end - tail < batch_size &&
+            __atomic_load_n(&queue->slots[end % queue_depth].sequence,
+            __ATOMIC_ACQUIRE) == end + 1)
+        end++;
+    if (end == tail)
+        return 0;
+
+    for (uint64_t position = tail ; position < end ; position++)
+        run(&queue->slots[position % queue_depth].hit);
+    __atomic_store_n(&queue->tail, end, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&worker->dispatched, end - tail, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&worker->batches, 1, __ATOMIC_RELAXED);
+    return end - tail;
+}
+
+static uint64_t drain(dispatch_worker_t *worker)
+{
+    uint64_t dispatched = 0;
+    for (int q = worker->index ; q < queue_count ; q += worker_count)
+        dispatched += drain_queue(worker, queues[q]);
+    return dispatched;
+}
+
+static void *worker_main(void *arg)
+{
+    dispatch_worker_t *worker = arg;
+    struct timespec idle = {.tv_sec = 0,
+        .tv_nsec = DISPATCH_IDLE_MS * 1000000L};
+    in_worker = true;
+    for (;;)
+    {
+        bool stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        if (drain(worker))
+            continue;
+        if (stop)
+            break;
+        __atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!drain(worker) && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+            syscall(SYS_futex, &worker->sleeping, FUTEX_WAIT_PRIVATE, 1, &idle,
+                NULL, 0);
+        __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void release_queues(void)
+{
+    for (int q = 0 ; q < queue_count ; q++)
+    {
+        if (queues[q])
+            munmap(queues[q], queue_size);
+        queues[q] = NULL;
+    }
+    queue_count = 0;
+}
+
+/* Called with dispatch_lock held */
+static void stop_workers(int count)
+{
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    for (int w = 0 ; w < count ; w++)
+    {
+        __atomic_store_n(&workers[w].sleeping, 1, __ATOMIC_SEQ_CST);
+        wake(&workers[w]);
+    }
+    for (int w = 0 ; w < count ; w++)
+        pthread_join(workers[w].thread, NULL);
+}
+
+/* The workers are not inherited, the child callbacks run inline */
+void dyndebug_dispatch_forked(void)
+{
+    pthread_mutex_init(&dispatch_lock, NULL);
+    __atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&inflight, 0, __ATOMIC_SEQ_CST);
+}
+
+ddbg_result_t dyndebug_start_dispatcher(uint32_t workers_count, uint32_t depth,
+    uint32_t batch, uint32_t block_us)
+{
+    if (!workers_count || workers_count > DISPATCH_MAX_WORKERS || !depth ||
+            !batch)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&dispatch_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+
+    /* The former session counters were kept for dyndebug_get_dispatch_stats() */
+    release_queues();
+    queue_count = get_nprocs_conf();
+    if (queue_count > DISPATCH_MAX_QUEUES)
+        queue_count = DISPATCH_MAX_QUEUES;
+    if (queue_count < 1)
+        queue_count = 1;
+    queue_depth = depth;
+    queue_size = sizeof(dispatch_queue_t) + depth * sizeof(dispatch_slot_t);
+    for (int q = 0 ; q < queue_count ; q++)
+    {
+        queues[q] = mmap(NULL, queue_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (queues[q] == MAP_FAILED)
+        {
+            queues[q] = NULL;
+            error_print("Cannot allocate the dispatch queues\n");
+            release_queues();
+            pthread_mutex_unlock(&dispatch_lock);
+            return DDBG_SYSTEM_ERROR;
+        }
+    }
+
+    /* Extra workers would have no queue */
+    worker_count = workers_count < (uint32_t)queue_count ? workers_count :
+        (uint32_t)queue_count;
+    batch_size = batch;
+    block_ns = block_us * 1000ULL;
+    __atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+    memset(workers, 0, sizeof(workers));
+    for (int w = 0 ; w < worker_count ; w++)
+    {
+        workers[w].index = w;
+        if (pthread_create(&workers[w].thread, NULL, worker_main, &workers[w]))
+        {
+            error_print("Cannot start the dispatch workers\n");
+            stop_workers(w);
+            release_queues();
+            pthread_mutex_unlock(&dispatch_lock);
+            return DDBG_SYSTEM_ERROR;
+        }
+    }
+    __atomic_store_n(&running, true, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&dispatch_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_flush_dispatcher(void)
+{
+    uint64_t heads[DISPATCH_MAX_QUEUES];
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 100000};
+    if (in_worker)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&dispatch_lock);
+        return DDBG_SUCCESS;
+    }
+    for (int q = 0 ; q < queue_count ; q++)
+        heads[q] = __atomic_load_n(&queues[q]->head, __ATOMIC_ACQUIRE);
+    for (int q = 0 ; q < queue_count ; q++)
+        while (__atomic_load_n(&queues[q]->tail, __ATOMIC_ACQUIRE) < heads[q])
+        {
+            wake(&workers[q % worker_count]);
+            nanosleep(&pause, NULL);
+        }
+    pthread_mutex_unlock(&dispatch_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_stop_dispatcher(void)
+{
+    if (in_worker)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&dispatch_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    /* New hits run inline, the queued ones are dispatched before the join */
+    __atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&inflight, __ATOMIC_SEQ_CST))
+        sched_yield();
+    stop_workers(worker_count);
+    pthread_mutex_unlock(&dispatch_lock);
+    return DDBG_SUCCESS;
+}
+
+/* The counters of the last session remain readable once stopped */
+ddbg_result_t dyndebug_get_dispatch_stats(ddbg_dispatch_stats_t *stats)
+{
+    if (!stats)
+        return DDBG_INVALID_ARGUMENT;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&dispatch_lock);
+    for (int q = 0 ; q < queue_count ; q++)
+    {
+        dispatch_queue_t *queue = queues[q];
+        stats->queued += __atomic_load_n(&queue->queued, __ATOMIC_RELAXED);
+        stats->dropped += __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+        stats->blocked += __atomic_load_n(&queue->blocked, __ATOMIC_RELAXED);
+        uint64_t depth = __atomic_load_n(&queue->max_depth, __ATOMIC_RELAXED);
+        if (depth > stats->max_depth)
+            stats->max_depth = depth;
+    }
+    for (int w = 0 ; w < worker_count ; w++)
+    {
+        stats->dispatched += __atomic_load_n(&workers[w].dispatched,
+            __ATOMIC_RELAXED);
+        stats->batches += __atomic_load_n(&workers[w].batches,
+            __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&dispatch_lock);
+    return DDBG_SUCCESS;
+}
@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_fixup.h>
+#include <private/dyndbg_monitor.h>
+#include <dyndbg/dyndbg_us.h>
+
+#include <ucontext.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+typedef struct
+{
+    int                     readers;    /* crash handlers looking it up */
+    int                     count;
+    ddbg_fault_fixup_t      fixups[MAX_FAULT_FIXUPS];
+} ddbg_fixup_table_t;
+
+/* The crash handler reads the published table without any lock, updates
+build the other one once its last reader left and swap the pointer */
+static ddbg_fixup_table_t fixup_tables[2];
+static ddbg_fixup_table_t *fixup_table = &fixup_tables[0];
+static pthread_mutex_t fixup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ddbg_fixup_table_t *fixup_table_next(void)
+{
+    ddbg_fixup_table_t *current = fixup_table;
+    ddbg_fixup_table_t *next = current == &fixup_tables[0] ?
+        &fixup_tables[1] : &fixup_tables[0];
+    /* A reader may still hold the table it loaded before the last swap */
+    while (__atomic_load_n(&next->readers, __ATOMIC_SEQ_CST))
+        sched_yield();
+    next->count = current->count;
+    memcpy(next->fixups, current->fixups,
+        current->count * sizeof(ddbg_fault_fixup_t));
+    return next;
+}
+
+ddbg_result_t dyndebug_add_fault_fixup(void *start, void *end, void *landing,
+    int reg, uint64_t value)
+{
+    if (!start || end <= start || (!landing && reg == DDBG_FIXUP_NO_REGISTER) ||
+            reg < DDBG_FIXUP_NO_REGISTER || reg >= NGREG)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&fixup_lock);
+    ddbg_fixup_table_t *next = fixup_table_next();
+    if (next->count == MAX_FAULT_FIXUPS)
+    {
+        pthread_mutex_unlock(&fixup_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+
+    /* Sorted by start, ranges never overlap */
+    int i;
+    for (i = 0 ; i < next->count ; i++)
+    {
+        ddbg_fault_fixup_t *f = &next->fixups[i];
+        if ((uint64_t)start < f->end && (uint64_t)end > f->start)
+        {
+            pthread_mutex_unlock(&fixup_lock);
+            return DDBG_BP_ALREADY_EXISTS;
+        }
+        if ((uint64_t)start < f->start)
+            break;
+    }
+    memmove(&next->fixups[i + 1], &next->fixups[i],
+        (next->count - i) * sizeof(ddbg_fault_fixup_t));
+    next->fixups[i].start = (uint64_t)start;
+    next->fixups[i].end = (uint64_t)end;
+    next->fixups[i].landing = (uint64_t)landing;
+    next->fixups[i].reg = reg;
+    next->fixups[i].value = value;
+    next->count++;
+
+    __atomic_store_n(&fixup_table, next, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&fixup_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_remove_fault_fixup(void *start)
+{
+    pthread_mutex_lock(&fixup_lock);
+    ddbg_fixup_table_t *next = fixup_table_next();
+    for (int i = 0 ; i < next->count ; i++)
+    {
+        if (next->fixups[i].start != (uint64_t)start)
+            continue;
+        memmove(&next->fixups[i], &next->fixups[i + 1],
+            (next->count - i - 1) * sizeof(ddbg_fault_fixup_t));
+        next->count--;
+        __atomic_store_n(&fixup_table, next, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&fixup_lock);
+        return DDBG_SUCCESS;
+    }
+    pthread_mutex_unlock(&fixup_lock);
+    return DDBG_INVALID_ARGUMENT;
+}
+
+bool dyndebug_apply_fault_fixup(void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+    greg_t *r = ucontext->uc_mcontext.gregs;
+    uint64_t rip = r[REG_RIP];
+    ddbg_fixup_table_t *table;
+    for ( ; ; )
+    {
+        /* Still the published one once counted, not rewritten before we leave */
+        table = __atomic_load_n(&fixup_table, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&table->readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&fixup_table, __ATOMIC_SEQ_CST) == table)
+            break;
+        __atomic_fetch_sub(&table->readers, 1, __ATOMIC_RELEASE);
+    }
+
+    int low = 0, high = table->count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        const ddbg_fault_fixup_t *f = &table->fixups[middle];
+        if (rip < f->start)
+            high = middle - 1;
+        else if (rip >= f->end)
+            low = middle + 1;
+        else
+        {
+            if (f->reg != DDBG_FIXUP_NO_REGISTER)
+                r[f->reg] = f->value;
+            if (f->landing)
+                r[REG_RIP] = f->landing;
+            __atomic_fetch_sub(&table->readers, 1, __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    __atomic_fetch_sub(&table->readers, 1, __ATOMIC_RELEASE);
+    return false;
+}
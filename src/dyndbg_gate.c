@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_gate.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_stats.h>
+
+#include <pthread.h>
+#include <time.h>
+
+__thread uint64_t dyndebug_open_gates __attribute__((tls_model("initial-exec")));
+
+static uint64_t gate_bits;
+/* Demotion and promotion (the monitor requests) are serialized */
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Starting and stopping the demotion thread, which takes gate_lock */
+static pthread_mutex_t demotion_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t demotion_thread;
+static uint32_t demotion_ms;
+static bool demotion_running;
+static bool demotion_stopping;
+
+bool dyndebug_gate_acquire(ddbg_breakpoint_t *b)
+{
+    uint64_t bits = __atomic_load_n(&gate_bits, __ATOMIC_RELAXED);
+    do
+    {
+        if (!~bits)
+            return false;
+        b->gate_bit = ~bits & (bits + 1);
+    } while (!__atomic_compare_exchange_n(&gate_bits, &bits, bits | b->gate_bit,
+        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    b->gate_state = 0;
+    b->gate_seen = 0;
+    b->demoted = false;
+    return true;
+}
+
+void dyndebug_gate_release(ddbg_breakpoint_t *b)
+{
+    __atomic_fetch_and(&gate_bits, ~b->gate_bit, __ATOMIC_ACQ_REL);
+    b->gate_bit = 0;
+}
+
+static void promote(ddbg_breakpoint_t *b)
+{
+    pthread_mutex_lock(&gate_lock);
+    if (__atomic_load_n(&b->demoted, __ATOMIC_SEQ_CST))
+    {
+        if (dyndebug_enable_breakpoint(b) != DDBG_SUCCESS)
+            error_print("Cannot rearm the gated breakpoint %p\n", b->address);
+        __atomic_store_n(&b->demoted, false, __ATOMIC_SEQ_CST);
+        dyndebug_stats_state(b);
+    }
+    pthread_mutex_unlock(&gate_lock);
+}
+
+void dyndebug_gate_enter(ddbg_breakpoint_t *b)
+{
+    dyndebug_open_gates |= b->gate_bit;
+    /* Either the demotion sees us inside or we see it demoted */
+    __atomic_fetch_add(&b->gate_state, GATE_ENTRY + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->demoted, __ATOMIC_SEQ_CST))
+        promote(b);
+}
+
+void dyndebug_gate_exit(ddbg_breakpoint_t *b)
+{
+    __atomic_fetch_sub(&b->gate_state, 1, __ATOMIC_RELEASE);
+    dyndebug_open_gates &= ~b->gate_bit;
+}
+
+/* Called with gate_lock held, disarms b when nobody entered since last time */
+static void demote(ddbg_breakpoint_t *b)
+{
+    uint64_t state = __atomic_load_n(&b->gate_state, __ATOMIC_SEQ_CST);
+    uint32_t entries = state >> 32;
+    if (entries != b->gate_seen || (state & GATE_INSIDE_MASK))
+    {
+        b->gate_seen = entries;
+        return;
+    }
+    __atomic_store_n(&b->demoted, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->gate_state, __ATOMIC_SEQ_CST) != state ||
+            dyndebug_disable_breakpoint(b) != DDBG_SUCCESS)
+        __atomic_store_n(&b->demoted, false, __ATOMIC_SEQ_CST);
+    dyndebug_stats_state(b);
+}
+
+static void *demotion_main(void *arg)
+{
+    struct timespec period = {
+        .tv_sec = demotion_ms / 1000, .tv_nsec = (demotion_ms % 1000) * 1000000L};
+    ddbg_context_t *context = arg;
+    while (!__atomic_load_n(&demotion_stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&gate_lock);
+        int parity = dyndebug_tree_enter();
+        ddbg_breakpoint_t *current = __atomic_load_n(&context->breakpoints_root,
+            __ATOMIC_ACQUIRE);
+        for ( ; current &&
+                !__atomic_load_n(&demotion_stopping, __ATOMIC_ACQUIRE) ;
+                current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
+            if ((current->flags & DDBG_BP_GATED) && current->enabled)
+                demote(current);
+        dyndebug_tree_exit(parity);
+        pthread_mutex_unlock(&gate_lock);
+    }
+    return NULL;
+}
+
+void dyndebug_gate_fork_prepare(void)
+{
+    pthread_mutex_lock(&demotion_lock);
+    pthread_mutex_lock(&gate_lock);
+}
+
+void dyndebug_gate_fork_parent(void)
+{
+    pthread_mutex_unlock(&gate_lock);
+    pthread_mutex_unlock(&demotion_lock);
+}
+
+void dyndebug_gate_forked(void)
+{
+    pthread_mutex_init(&gate_lock, NULL);
+    pthread_mutex_init(&demotion_lock, NULL);
+    demotion_running = false;
+}
+
+ddbg_result_t dyndebug_set_gate_demotion(uint32_t idle_ms)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&demotion_lock);
+    if (demotion_running)
+    {
+        __atomic_store_n(&demotion_stopping, true, __ATOMIC_RELEASE);
+        pthread_join(demotion_thread, NULL);
+        demotion_running = false;
+    }
+    if (!idle_ms)
+    {
+        pthread_mutex_unlock(&demotion_lock);
+        return DDBG_SUCCESS;
+    }
+
+    demotion_ms = idle_ms;
+    __atomic_store_n(&demotion_stopping, false, __ATOMIC_RELEASE);
+    ddbg_result_t result = DDBG_SUCCESS;
+    if (pthread_create(&demotion_thread, NULL, demotion_main, context))
+    {
+        error_print("Cannot start the gate demotion\n");
+        result = DDBG_SYSTEM_ERROR;
+    }
+    else
+        demotion_running = true;
+    pthread_mutex_unlock(&demotion_lock);
+    return result;
+}
@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_latency.h>
+#include <private/dyndbg_monitor.h>
+
+bool dyndebug_latency_enabled;
+/* Recorded under the request lock, read without it hence relaxed atomics */
+static ddbg_monitor_stats_t monitor_stats;
+
+static int latency_bucket(uint64_t ns)
+{
+    if (ns < (1ULL << DDBG_LATENCY_SHIFT))
+        return ns >> (DDBG_LATENCY_SHIFT - 2);
+    int power = 63 - __builtin_clzll(ns);
+    int bucket = (power - DDBG_LATENCY_SHIFT + 1) * DDBG_LATENCY_SUB +
+        ((ns >> (power - 2)) & (DDBG_LATENCY_SUB - 1));
+    return bucket < DDBG_LATENCY_BUCKETS ? bucket : DDBG_LATENCY_BUCKETS - 1;
+}
+
+uint64_t dyndebug_latency_bucket_ns(int bucket)
+{
+    if (bucket < 0 || bucket >= DDBG_LATENCY_BUCKETS)
+        return 0;
+    if (bucket < DDBG_LATENCY_SUB)
+        return (uint64_t)bucket << (DDBG_LATENCY_SHIFT - 2);
+    int power = bucket / DDBG_LATENCY_SUB + DDBG_LATENCY_SHIFT - 1;
+    return (uint64_t)(DDBG_LATENCY_SUB + bucket % DDBG_LATENCY_SUB) <<
+        (power - 2);
+}
+
+static void record_phase(ddbg_histogram_t *histogram, uint64_t ns)
+{
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[latency_bucket(ns)], 1,
+        __ATOMIC_RELAXED);
+    if (ns > __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED))
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+void dyndebug_latency_record(const ddbg_monitor_response_t *response,
+    uint64_t lock_ns, uint64_t elapsed_ns)
+{
+    uint64_t monitor_ns = 0;
+    for (int phase = DDBG_PHASE_ATTACH ; phase < DDBG_PHASES ; phase++)
+    {
+        record_phase(&monitor_stats.phases[phase], response->phase_ns[phase]);
+        monitor_ns += response->phase_ns[phase];
+    }
+    record_phase(&monitor_stats.phases[DDBG_PHASE_REQUEST], elapsed_ns);
+    record_phase(&monitor_stats.phases[DDBG_PHASE_LOCK], lock_ns);
+    record_phase(&monitor_stats.phases[DDBG_PHASE_PIPE],
+        elapsed_ns > monitor_ns ? elapsed_ns - monitor_ns : 0);
+    __atomic_fetch_add(&monitor_stats.requests, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&monitor_stats.stops, response->stops, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&monitor_stats.ptraces, response->ptraces,
+        __ATOMIC_RELAXED);
+}
+
+ddbg_result_t dyndebug_set_monitor_stats(bool enable)
+{
+    if (enable && !__atomic_load_n(&dyndebug_latency_enabled, __ATOMIC_RELAXED))
+    {
+        uint64_t *counters = (uint64_t *)&monitor_stats;
+        for (size_t i = 0 ; i < sizeof(monitor_stats) / sizeof(uint64_t) ; i++)
+            __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&dyndebug_latency_enabled, enable, __ATOMIC_RELAXED);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_get_stats(ddbg_monitor_stats_t *stats)
+{
+    if (!stats)
+        return DDBG_INVALID_ARGUMENT;
+    const uint64_t *from = (const uint64_t *)&monitor_stats;
+    uint64_t *to = (uint64_t *)stats;
+    for (size_t i = 0 ; i < sizeof(monitor_stats) / sizeof(uint64_t) ; i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return DDBG_SUCCESS;
+}
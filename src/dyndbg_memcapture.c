@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_memcapture.h>
+#include <private/dyndbg_monitor.h>
+
+#include <ucontext.h>
+
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#define MEMCAPTURE_WINDOW   (MEMCAPTURE_BEFORE + MEMCAPTURE_AFTER)
+#define MAX_MAPS_LINE       512
+#define HEXDUMP_WIDTH       16
+
+typedef struct
+{
+    uint64_t                start;
+    uint64_t                end;
+    size_t                  copied;
+    const ddbg_mapping_t    *mapping;
+    char                    labels[64];
+} ddbg_window_t;
+
+static const struct
+{
+    int                     reg;
+    const char              *name;
+} captured_registers[] =
+{
+    {REG_RAX, "RAX"}, {REG_RBX, "RBX"}, {REG_RCX, "RCX"}, {REG_RDX, "RDX"},
+    {REG_RSI, "RSI"}, {REG_RDI, "RDI"}, {REG_R8,  "R08"}, {REG_R9,  "R09"},
+    {REG_R10, "R10"}, {REG_R11, "R11"}, {REG_R12, "R12"}, {REG_R13, "R13"},
+    {REG_R14, "R14"}, {REG_R15, "R15"}, {REG_RBP, "RBP"}, {REG_RSP, "RSP"},
+    {REG_RIP, "RIP"},
+};
+
+/* Static so that the crash handler does not need to allocate */
+static uint8_t capture_buffer[MAX_MEMCAPTURE_WINDOWS * MEMCAPTURE_WINDOW];
+
+static uint64_t parse_hex(const char **p)
+{
+    uint64_t value = 0;
+    for ( ; ; (*p)++)
+    {
+        char c = **p;
+        if (c >= '0' && c <= '9') value = (value << 4) | (c - '0');
+        else if (c >= 'a' && c <= 'f') value = (value << 4) | (c - 'a' + 10);
+        else break;
+    }
+    return value;
+}
+
+static void parse_maps_line(const char *line, ddbg_maps_t *maps)
+{
+    if (maps->count == MAX_MAPPINGS)
+        return;
+    ddbg_mapping_t *m = &maps->mappings[maps->count];
+    const char *p = line;
+    m->start = parse_hex(&p);
+    if (*p++ != '-')
+        return;
+    m->end = parse_hex(&p);
+    if (*p++ != ' ')
+        return;
+    m->readable = p[0] == 'r';
+    m->writable = p[1] == 'w';
+
+    /* Skip perms, offset, dev and inode to reach the optional path name */
+    for (int field = 0 ; field < 4 && *p ; field++)
+    {
+        while (*p && *p != ' ') p++;
+        while (*p == ' ') p++;
+    }
+    size_t len = strlen(p);
+    if (len >= MAPPING_NAME_LEN)
+        p += len - MAPPING_NAME_LEN + 1;
+    strncpy(m->name, p, MAPPING_NAME_LEN - 1);
+    m->name[MAPPING_NAME_LEN - 1] = 0;
+    maps->count++;
+}
+
+int dyndebug_parse_maps(pid_t pid, ddbg_maps_t *maps)
+{
+    char path[64], chunk[4096], line[MAX_MAPS_LINE];
+    size_t line_len = 0;
+    ssize_t rc;
+
+    /* No snprintf, it is not async-signal-safe */
+    char digits[16];
+    int ndigits = 0;
+    do
+        digits[ndigits++] = '0' + pid % 10;
+    while ((pid /= 10) && ndigits < (int)sizeof(digits));
+    strcpy(path, "/proc/");
+    for (int i = 0 ; i < ndigits ; i++)
+        path[6 + i] = digits[ndigits - 1 - i];
+    strcpy(&path[6 + ndigits], "/maps");
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    maps->count = 0;
+    while ((rc = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        for (ssize_t i = 0 ; i < rc ; i++)
+        {
+            if (chunk[i] != '\n')
+            {
+                if (line_len < MAX_MAPS_LINE - 1)
+                    line[line_len++] = chunk[i];
+                continue;
+            }
+            line[line_len] = 0;
+            parse_maps_line(line, maps);
+            line_len = 0;
+        }
+    }
+    close(fd);
+    return maps->count;
+}
+
+const ddbg_mapping_t *dyndebug_find_mapping(const ddbg_maps_t *maps,
+    uint64_t address)
+{
+    int low = 0, high = maps->count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        const ddbg_mapping_t *m = &maps->mappings[middle];
+        if (address < m->start)
+            high = middle - 1;
+        else if (address >= m->end)
+            low = middle + 1;
+        else
+            return m;
+    }
+    return NULL;
+}
+
+bool dyndebug_maps_outdated(const ddbg_maps_t *maps, const long long *gregs)
+{
+    if (!maps->count)
+        return true;
+    uint64_t lowest = maps->mappings[0].start;
+    uint64_t highest = maps->mappings[maps->count - 1].end;
+    for (size_t i = 0 ; i < sizeof(captured_registers)/sizeof(captured_registers[0]) ; i++)
+    {
+        uint64_t value = gregs[captured_registers[i].reg];
+        if (value >= lowest && value < highest && !dyndebug_find_mapping(maps, value))
+            return true;
+    }
+    return false;
+}
+
+static void append_label(ddbg_window_t *w, const char *label)
+{
+    size_t len = strlen(w->labels);
+    if (len + strlen(label) + 2 >= sizeof(w->labels))
+        return;
+    if (len)
+        w->labels[len++] = ' ';
+    strcpy(&w->labels[len], label);
+}
+
+static int add_window(ddbg_window_t *windows, int count, const ddbg_maps_t *maps,
+    uint64_t value, const char *label)
+{
+    const ddbg_mapping_t *m = dyndebug_find_mapping(maps, value);
+    if (!m || !m->readable)
+        return count;
+
+    uint64_t start = (value - MEMCAPTURE_BEFORE) & ~(uint64_t)(HEXDUMP_WIDTH - 1);
+    uint64_t end = value + MEMCAPTURE_AFTER;
+    if (value < MEMCAPTURE_BEFORE || start < m->start) start = m->start;
+    if (end > m->end || end < value) end = m->end;
+
+    /* Keep the windows sorted and merged, they end up in one readv */
+    int i;
+    for (i = 0 ; i < count ; i++)
+    {
+        ddbg_window_t *w = &windows[i];
+        if (start <= w->end && end >= w->start && m == w->mapping)
+        {
+            if (start < w->start) w->start = start;
+            if (end > w->end) w->end = end;
+            append_label(w, label);
+            return count;
+        }
+        if (start < w->start)
+            break;
+    }
+    if (count == MAX_MEMCAPTURE_WINDOWS)
+        return count;
+    memmove(&windows[i + 1], &windows[i], (count - i) * sizeof(ddbg_window_t));
+    ddbg_window_t *w = &windows[i];
+    w->start = start;
+    w->end = end;
+    w->copied = 0;
+    w->mapping = m;
+    w->labels[0] = 0;
+    append_label(w, label);
+    return count + 1;
+}
+
+static void hexdump(FILE *out, uint64_t address, const uint8_t *data, size_t size)
+{
+    for (size_t line = 0 ; line < size ; line += HEXDUMP_WIDTH)
+    {
+        size_t i, width = size - line < HEXDUMP_WIDTH ? size - line : HEXDUMP_WIDTH;
+        fprintf(out, "0x%016lx: ", address + line);
+        for (i = 0 ; i < HEXDUMP_WIDTH ; i++)
+        {
+            if (i < width)
+                fprintf(out, "%02x ", data[line + i]);
+            else
+                fprintf(out, "   ");
+        }
+        fprintf(out, "|");
+        for (i = 0 ; i < width ; i++)
+        {
+            uint8_t c = data[line + i];
+            fputc(c >= 0x20 && c < 0x7f ? c : '.', out);
+        }
+        fprintf(out, "|\n");
+    }
+}
+
+void dyndebug_capture_memory(FILE *out, pid_t pid, const ddbg_maps_t *maps,
+    const long long *gregs, void *fault_address)
+{
+    ddbg_window_t windows[MAX_MEMCAPTURE_WINDOWS];
+    struct iovec local[MAX_MEMCAPTURE_WINDOWS], remote[MAX_MEMCAPTURE_WINDOWS];
+    int count = 0, i;
+
+    count = add_window(windows, count, maps, (uint64_t)fault_address, "fault");
+    for (size_t r = 0 ; r < sizeof(captured_registers)/sizeof(captured_registers[0]) ; r++)
+        count = add_window(windows, count, maps,
+            gregs[captured_registers[r].reg], captured_registers[r].name);
+
+    /* Windows may have grown while merging, never overflow the buffer */
+    size_t offset = 0, total = 0;
+    for (i = 0 ; i < count ; i++)
+    {
+        size_t size = windows[i].end - windows[i].start;
+        if (offset + size > sizeof(capture_buffer))
+            size = sizeof(capture_buffer) - offset;
+        windows[i].end = windows[i].start + size;
+        local[i].iov_base = &capture_buffer[offset];
+        local[i].iov_len = size;
+        remote[i].iov_base = (void *)windows[i].start;
+        remote[i].iov_len = size;
+        offset += size;
+    }
+
+    /* One vectored copy for everybody, it stops at the first unreadable
+    byte so the leftovers are probed one window at a time */
+    ssize_t rc = process_vm_readv(pid, local, count, remote, count, 0);
+    total = rc > 0 ? rc : 0;
+    for (i = 0 ; i < count ; i++)
+    {
+        size_t size = local[i].iov_len;
+        windows[i].copied = total < size ? total : size;
+        total -= windows[i].copied;
+        if (windows[i].copied == size)
+            continue;
+        struct iovec l = {.iov_base = (uint8_t *)local[i].iov_base +
+            windows[i].copied, .iov_len = size - windows[i].copied};
+        struct iovec r = {.iov_base = (uint8_t *)remote[i].iov_base +
+            windows[i].copied, .iov_len = size - windows[i].copied};
+        rc = process_vm_readv(pid, &l, 1, &r, 1, 0);
+        if (rc > 0)
+            windows[i].copied += rc;
+    }
+
+    fprintf(out, "\nMemory around the fault and the registers (%d windows):\n",
+        count);
+    for (i = 0 ; i < count ; i++)
+    {
+        ddbg_window_t *w = &windows[i];
+        fprintf(out, "[%s] 0x%lx-0x%lx %s%s\n", w->labels, w->start, w->end,
+            w->mapping->name, w->copied ? "" : " -- not readable");
+        hexdump(out, w->start, local[i].iov_base, w->copied);
+    }
+}
@@ -1,13 +1,24 @@
+#define _GNU_SOURCE
 #include <private/x86_debug_registers.h>
+#include <private/dyndbg_monitor_threads.h>
+#include <private/dyndbg_memcapture.h>
+#include <private/dyndbg_coredump.h>
 #include <private/dyndbg_monitor.h>
+#include <private/dyndbg_latency.h>
 #include <dyndbg/dyndbg_us.h>
 
 #include <sys/ptrace.h>
+#include <sys/socket.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/user.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
@@ -15,19 +26,61 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <x86intrin.h>
 
 volatile bool interrupted = 0;
+static ddbg_context_t *context = NULL;
+uint32_t dyndebug_monitor_ptraces;
+uint32_t dyndebug_monitor_stops;
+
+/* Logical watches behind each debug register, several compatible ones in
+the same aligned 8 bytes word share a slot */
+typedef struct
+{
+    int                     count;
+    struct
+    {
+        uint64_t            address;
+        ddbg_bsize_t        size;
+    } watches[MAX_PACKED_WATCHES];
+} ddbg_slot_watches_t;
+
+/* A monitored process, sessions[0] is the one forked with the monitor, the
+others its children which registered */
+typedef struct
+{
+    pid_t                   pid;
+    int                     requests;
+    int                     responses;
+    ddbg_slot_watches_t     slot_watches[HW_BREAKPOINTS_COUNT];
+} ddbg_session_t;
+static ddbg_session_t sessions[MAX_MONITOR_SESSIONS];
+static int session_count;
+/* The session of the request being handled */
+static ddbg_slot_watches_t *slot_watches = sessions[0].slot_watches;
 
 static void on_monitored_signal(int signum);
-static void handle_request(ddbg_context_t *, ddbg_monitor_request_t *);
+static bool handle_request(ddbg_context_t *, ddbg_monitor_request_t *);
 static void set_hw_breakpoint(pid_t , ddbg_monitor_request_t *, ddbg_monitor_response_t *);
+static void set_hw_breakpoints(pid_t , ddbg_monitor_request_t *, ddbg_monitor_response_t *);
+static void split_hw_breakpoint(pid_t , ddbg_monitor_request_t *, ddbg_monitor_response_t *);
 static void reset_hw_breakpoint(pid_t , ddbg_monitor_request_t *, ddbg_monitor_response_t *);
 static void reset_all_breakpoints(pid_t pid, ddbg_monitor_response_t *response);
 static void prepare_trig_breakpt_response(pid_t , ddbg_monitor_response_t *);
+static void handle_crash_report(ddbg_context_t *, ddbg_monitor_request_t *, ddbg_monitor_response_t *);
+static void mirror_debug_registers(ddbg_context_t *);
+static void handle_snapshot_core(ddbg_context_t *, ddbg_monitor_request_t *, ddbg_monitor_response_t *);
+static void prepare_thread_trig_response(ddbg_context_t *, pid_t , ddbg_monitor_response_t *);
+static void handle_patch_code(ddbg_context_t *, ddbg_monitor_request_t *, ddbg_monitor_response_t *);
+
+ddbg_context_t *dyndebug_peek_context(void)
+{
+    /* Never forks a monitor, safe to call from the crash handler */
+    return context;
+}
 
 ddbg_context_t *dyndebug_get_context(void)
 {
-    static ddbg_context_t *context = NULL;
     if (context) return context;
 
     assert(sizeof(x86_breakpoint_control_t) == sizeof(uint64_t));
@@ -42,25 +95,41 @@ ddbg_context_t *dyndebug_get_context(void)
             "malloc(%ld) failed -- %s\n", sizeof(ddbg_context_t), strerror(errno));
         return NULL;
     }
-    if (pipe(context->monitor_pipe))
+    if (pipe2(context->monitor_pipe, O_CLOEXEC))
     {
         free(context);
+        context = NULL;
         error_print("Cannot create the monitor pipe -- %s\n", strerror(errno));
         return NULL;
     }
 
-    if (pipe(context->monitored_pipe))
+    if (pipe2(context->monitored_pipe, O_CLOEXEC))
     {
         free(context);
+        context = NULL;
         error_print("Cannot create the monitored pipe -- %s\n", strerror(errno));
         return NULL;
     }
 
+    /* The kernel tells the monitor who registers, not the message */
+    int passcred = 1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+            context->session_socket) ||
+            setsockopt(context->session_socket[0], SOL_SOCKET, SO_PASSCRED,
+            &passcred, sizeof(passcred)))
+    {
+        free(context);
+        context = NULL;
+        error_print("Cannot create the session socket -- %s\n", strerror(errno));
+        return NULL;
+    }
+
     context->monitor_pid = getpid();
     context->monitored_pid = fork();
     if (context->monitored_pid == -1)
     {
         free(context);
+        context = NULL;
         error_print("Cannot fork our process for monitoring -- %s\n", strerror(errno));
         return NULL;
     }
@@ -73,9 +142,180 @@ ddbg_context_t *dyndebug_get_context(void)
         free(context);
         exit(0);
     }
+    close(context->session_socket[0]);
+    pthread_atfork(dyndebug_fork_prepare, dyndebug_fork_parent,
+        dyndebug_fork_child);
     return context;
 }
 
+bool dyndebug_register_session(ddbg_context_t *context)
+{
+    int requests[2], responses[2];
+    if (pipe2(requests, O_CLOEXEC))
+        return false;
+    if (pipe2(responses, O_CLOEXEC))
+    {
+        close(requests[0]);
+        close(requests[1]);
+        return false;
+    }
+
+    /* The monitor gets the ends it uses, whom to attach comes with them */
+    pid_t pid = getpid();
+    int fds[2] = {requests[0], responses[1]};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = &pid, .iov_len = sizeof(pid)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    ssize_t sent = sendmsg(context->session_socket[1], &message, MSG_NOSIGNAL);
+    close(requests[0]);
+    close(responses[1]);
+
+    /* Acknowledged on the new pipe, the session table may be full */
+    ddbg_monitor_response_t response;
+    if (sent != sizeof(pid) || read(responses[0], &response,
+            sizeof(response)) != sizeof(response) ||
+            response.result != DDBG_SUCCESS)
+    {
+        close(requests[1]);
+        close(responses[0]);
+        return false;
+    }
+    context->monitor_pipe[1] = requests[1];
+    context->monitored_pipe[0] = responses[0];
+    context->forked = false;
+    return true;
+}
+
+static void accept_session(ddbg_context_t *context)
+{
+    pid_t pid = 0;
+    int fds[2] = {-1, -1};
+    struct ucred *credentials = NULL;
+    char control[CMSG_SPACE(sizeof(fds)) + CMSG_SPACE(sizeof(struct ucred))];
+    struct iovec iov = {.iov_base = &pid, .iov_len = sizeof(pid)};
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t rc = recvmsg(context->session_socket[0], &message, MSG_CMSG_CLOEXEC);
+    if (rc < 0 && errno == EINTR)
+        return;
+    if (rc <= 0)
+    {
+        /* No process left to register, poll() ignores the closed socket */
+        close(context->session_socket[0]);
+        context->session_socket[0] = -1;
+        return;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    for ( ; cmsg ; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET)
+            continue;
+        if (cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        else if (cmsg->cmsg_type == SCM_CREDENTIALS &&
+                cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)))
+            credentials = (struct ucred *)CMSG_DATA(cmsg);
+    }
+    if (fds[0] < 0 || fds[1] < 0 || (message.msg_flags & MSG_CTRUNC))
+    {
+        error_print("Invalid session registration, skipped\n");
+        if (fds[0] >= 0)
+            close(fds[0]);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        return;
+    }
+
+    /* Checked by the kernel, the pid in the message is only a hint */
+    bool trusted = credentials && credentials->uid == getuid() &&
+        credentials->pid == pid;
+    ddbg_monitor_response_t response;
+    memset(&response, 0, sizeof(response));
+    response.result = rc == sizeof(pid) && trusted &&
+        session_count < MAX_MONITOR_SESSIONS ?
+        DDBG_SUCCESS : DDBG_MONITOR_REQUEST_FAILURE;
+    if (write(fds[1], &response, sizeof(response)) != sizeof(response) ||
+            response.result != DDBG_SUCCESS)
+    {
+        error_print("Session of process %d refused\n", pid);
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    ddbg_session_t *session = &sessions[session_count++];
+    memset(session, 0, sizeof(*session));
+    session->pid = pid;
+    session->requests = fds[0];
+    session->responses = fds[1];
+    debug_print("Session %d opened for process %d\n", session_count - 1, pid);
+}
+
+static void end_session(int index)
+{
+    debug_print("Session of process %d ended\n", sessions[index].pid);
+    close(sessions[index].requests);
+    close(sessions[index].responses);
+    sessions[index] = sessions[--session_count];
+}
+
+/* Requests are handled as if the session process were the monitored one */
+static void enter_session(ddbg_context_t *context, ddbg_session_t *session)
+{
+    context->monitored_pid = session->pid;
+    context->monitored_pipe[1] = session->responses;
+    slot_watches = session->slot_watches;
+}
+
+static void serve_session(ddbg_context_t *context, int index,
+    const sigset_t *sigchld)
+{
+    ddbg_monitor_request_t request;
+    errno = 0;
+    int rc = read(sessions[index].requests, &request, sizeof(request));
+    if (errno == EAGAIN || errno == EINTR)
+        return;
+    if (rc == sizeof(ddbg_monitor_request_t))
+    {
+        /* Handle the request */
+        sigprocmask(SIG_BLOCK, sigchld, NULL);
+        enter_session(context, &sessions[index]);
+        bool alive = handle_request(context, &request);
+        enter_session(context, &sessions[0]);
+        sigprocmask(SIG_UNBLOCK, sigchld, NULL);
+        if (!alive && !index)
+            interrupted = 1;
+        else if (!alive)
+            end_session(index);
+    } else if (rc > 0)
+    {
+        /* Didn't receive a full request, ignore it! */
+        error_print("Incomplete dyndebug monitoring request (%d vs %ld)"\
+            " for %s, skipped\n", rc, sizeof(ddbg_monitor_request_t),
+            context->monitored_process_name);
+    } else if (index)
+        end_session(index);
+    else if (rc == -1)
+    {
+        /* Closed pipe ?*/
+        error_print("Dyndebug monitoring read failure for %s, abort!\n",
+            context->monitored_process_name);
+        interrupted = 1;
+    } else
+    {
+        /* Every writer is gone, the monitored process exits */
+        debug_print("Dyndebug monitoring pipe closed for %s\n",
+            context->monitored_process_name);
+        interrupted = 1;
+    }
+}
+
 void dyndebug_run_monitor(ddbg_context_t *context)
 {
     char monitor_process_name[1024];
@@ -94,6 +334,11 @@ void dyndebug_run_monitor(ddbg_context_t *context)
     fclose(stdin);
     close(context->monitor_pipe[1]);
     close(context->monitored_pipe[0]);
+    close(context->session_socket[1]);
+    sessions[0].pid = context->monitored_pid;
+    sessions[0].requests = context->monitor_pipe[0];
+    sessions[0].responses = context->monitored_pipe[1];
+    session_count = 1;
     // fcntl(context->monitor_pipe[0], F_SETFL, O_NONBLOCK);
 
     //signal(SIGCHLD, on_monitored_signal);
@@ -102,36 +347,41 @@ void dyndebug_run_monitor(ddbg_context_t *context)
     rc = sigaction(SIGCHLD, &sa, NULL);
     debug_print("sigaction(%d, sa, NULL) returned %d\n", SIGCHLD, rc);
 
-    ddbg_monitor_request_t request;
-    while (!interrupted)
+    /* SIGCHLD stays blocked while a request is handled, otherwise its
+    handler may reap the ptrace stop handle_request() waits for */
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+
+    /* Children sessions outlive the monitored process, not the other way */
+    struct pollfd fds[MAX_MONITOR_SESSIONS + 1];
+    while (!interrupted || session_count > 1)
     {
+        int first = interrupted ? 1 : 0, count = 0;
+        for (int s = first ; s < session_count ; s++)
+            fds[count++] = (struct pollfd){.fd = sessions[s].requests,
+                .events = POLLIN};
+        fds[count] = (struct pollfd){.fd = context->session_socket[0],
+            .events = POLLIN};
         errno = 0;
-        rc = read(context->monitor_pipe[0], &request, sizeof(ddbg_monitor_request_t));
-        if (errno == EAGAIN)
+        rc = poll(fds, count + 1, MONITOR_POLL_MS);
+        if (rc < 0)
             continue;
-        if (rc == -1)
-        {
-            /* Closed pipe ?*/
-            error_print("Dyndebug monitoring read failure for %s, abort!\n",
-                context->monitored_process_name);
-            interrupted = 1;
-        } else if (rc == sizeof(ddbg_monitor_request_t))
-        {
-            /* Handle the request */
-            handle_request(context, &request);
-        } else if (rc > 0)
-        {
-            /* Didn't receive a full request, ignore it! */
-            error_print("Incomplete dyndebug monitoring request (%d vs %ld)"\
-                " for %s, skipped\n", rc, sizeof(ddbg_monitor_request_t),
-                context->monitored_process_name);
-        } else
+        if (!rc)
         {
             /* else, nothing has been received, check if the process dies */
-            waitpid(context->monitored_pid, NULL, WNOHANG);
+            if (!interrupted)
+                waitpid(context->monitored_pid, NULL, WNOHANG);
             if (errno == ECHILD)
                 interrupted = 1;
+            continue;
         }
+        /* Backwards, an ended session is replaced by the last one */
+        for (int i = count - 1 ; i >= 0 ; i--)
+            if (fds[i].revents)
+                serve_session(context, first + i, &sigchld);
+        if (fds[count].revents)
+            accept_session(context);
     }
     debug_print("Dyndebug monitoring session for %s ended!\n",
         context->monitored_process_name);
@@ -182,10 +432,19 @@ static void on_monitored_signal(int signum)
             "but waitpid returned %d!\n", context->monitored_process_name, rc);
 }
 
-static void handle_request(ddbg_context_t *context, ddbg_monitor_request_t *request)
+/* False when the session is over, the process is gone */
+static bool handle_request(ddbg_context_t *context, ddbg_monitor_request_t *request)
 {
     debug_print("New request operation %d\n", request->operation);
+    uint32_t ptraces = dyndebug_monitor_ptraces;
+    uint32_t stops = dyndebug_monitor_stops;
+    /* Each phase ends where the next one starts, the last at the response */
+    uint64_t phase_start[DDBG_PHASES + 1] = {0};
+    if (request->timed)
+        phase_start[DDBG_PHASE_ATTACH] = dyndebug_latency_now();
+
     /* Attach the process under debug */
+    dyndebug_monitor_ptraces++;
     int rc = ptrace(PTRACE_ATTACH, context->monitored_pid, 0, 0);
     if (rc < 0)
     {
@@ -193,26 +452,31 @@ static void handle_request(ddbg_context_t *context, ddbg_monitor_request_t *requ
         {
             error_print("Monitored process %s died, interrupting the session\n",
                 context->monitored_process_name);
-            interrupted = true;
-            return;
+            return false;
         }
         error_print("Cannot attach to the monitored process %s -- %s\n",
             context->monitored_process_name, strerror(errno));
-        interrupted = true;
-        return;
+        return false;
     }
 
+    if (request->timed)
+        phase_start[DDBG_PHASE_STOP] = dyndebug_latency_now();
     int status;
     rc = waitpid(context->monitored_pid, &status, 0); //WNOHANG);
     if (rc != context->monitored_pid)
     {
         error_print("Cannot wait for to the monitored process %s -- %s\n",
             context->monitored_process_name, strerror(errno));
-        return;
+        return true;
     }
+    dyndebug_monitor_stops++;
 
     /* Interpret the request */
+    if (request->timed)
+        phase_start[DDBG_PHASE_OPERATION] = dyndebug_latency_now();
     ddbg_monitor_response_t response;
+    response.stopped_tsc = request->traced ? __rdtsc() : 0;
+    response.resumed_tsc = 0;
     x86_breakpoint_control_t bp_control = {0};
     switch (request->operation)
     {
@@ -220,19 +484,57 @@ static void handle_request(ddbg_context_t *context, ddbg_monitor_request_t *requ
             debug_print("%s:%d Enable breakpoint at %p\n", __func__, __LINE__,
                     request->breakpoint.address);
             set_hw_breakpoint(context->monitored_pid, request, &response);
+            if (response.result == DDBG_SUCCESS)
+                mirror_debug_registers(context);
+            break;
+        case DDBG_ENABLE_BREAKPOINTS:
+            debug_print("Enable %d breakpoints\n", request->batch.count);
+            set_hw_breakpoints(context->monitored_pid, request, &response);
+            if (response.batch.armed || response.batch.disarmed)
+                mirror_debug_registers(context);
+            break;
+        case DDBG_SPLIT_BREAKPOINT:
+            debug_print("Split the watches of %p\n",
+                    request->breakpoint.address);
+            split_hw_breakpoint(context->monitored_pid, request, &response);
+            if (response.result == DDBG_SUCCESS)
+                mirror_debug_registers(context);
             break;
         case DDBG_DISABLE_BREAKPOINT:
             debug_print("Disable breakpoint at %p\n",
                     request->breakpoint.address);
             reset_hw_breakpoint(context->monitored_pid, request, &response);
+            if (response.result == DDBG_SUCCESS)
+                mirror_debug_registers(context);
             break;
         case DDBG_DISABLE_ALL_BREAKPOINTS:
             debug_print("Disable all the breakpoints\n");
             reset_all_breakpoints(context->monitored_pid, &response);
+            if (response.result == DDBG_SUCCESS)
+                mirror_debug_registers(context);
             break;
         case DDBG_GET_TRIGGERED_BREAKPOINT:
             debug_print("Get the triggered breakpoint\n");
-            prepare_trig_breakpt_response(context->monitored_pid, &response);
+            if (!request->breakpoint.tid ||
+                    request->breakpoint.tid == context->monitored_pid)
+                prepare_trig_breakpt_response(context->monitored_pid, &response);
+            else
+                prepare_thread_trig_response(context, request->breakpoint.tid,
+                    &response);
+            break;
+        case DDBG_CRASH_REPORT:
+            debug_print("Crash report for %d, flags 0x%x\n",
+                request->crash.tid, request->crash.flags);
+            handle_crash_report(context, request, &response);
+            break;
+        case DDBG_SNAPSHOT_CORE:
+            debug_print("Core of snapshot %d\n", request->crash.tid);
+            handle_snapshot_core(context, request, &response);
+            break;
+        case DDBG_PATCH_CODE:
+            debug_print("Patch %d sites from %p\n", request->patch.count,
+                request->patch.items[0].address);
+            handle_patch_code(context, request, &response);
             break;
         default:
             debug_print("Unknown operation %d\n", request->operation);
@@ -241,6 +543,9 @@ static void handle_request(ddbg_context_t *context, ddbg_monitor_request_t *requ
     }
 
     /* Finally detach the process under debug */
+    if (request->timed)
+        phase_start[DDBG_PHASE_DETACH] = dyndebug_latency_now();
+    dyndebug_monitor_ptraces++;
     rc = ptrace(PTRACE_DETACH, context->monitored_pid, 0, 0);
     if (rc < 0)
     {
@@ -248,22 +553,167 @@ static void handle_request(ddbg_context_t *context, ddbg_monitor_request_t *requ
         {
             error_print("Monitored process %s died before we could detach it,"\
                 " interrupting the session\n", context->monitored_process_name);
-            interrupted = true;
-            return;
+            return false;
         }
         error_print("Cannot attach to the monitored process %s -- %s\n",
             context->monitored_process_name, strerror(errno));
-        interrupted = true;
-        return;
+        return false;
     }
+    if (request->traced)
+        response.resumed_tsc = __rdtsc();
 
     /* Send the response */
+    for (int slot = 0 ; slot < HW_BREAKPOINTS_COUNT ; slot++)
+        response.slots[slot] = slot_watches[slot].count;
+    response.ptraces = dyndebug_monitor_ptraces - ptraces;
+    response.stops = dyndebug_monitor_stops - stops;
+    if (request->timed)
+    {
+        phase_start[DDBG_PHASES] = dyndebug_latency_now();
+        for (int phase = DDBG_PHASE_ATTACH ; phase < DDBG_PHASES ; phase++)
+            response.phase_ns[phase] = phase_start[phase + 1] -
+                phase_start[phase];
+    }
     if (write(context->monitored_pipe[1], &response, sizeof(response)) !=
             sizeof(response))
     {
         error_print("Cannot answer the monitored process %s -- %s\n",
             context->monitored_process_name, strerror(errno));
-        interrupted = true;
+        return false;
+    }
+    return true;
+}
+
+static void slot_fields(uint64_t control, int slot, ddbg_btype_t *type,
+        ddbg_bsize_t *size)
+{
+    *type = (control >> (16 + 4 * slot)) & 0x3;
+    *size = (control >> (18 + 4 * slot)) & 0x3;
+}
+
+/* Rewrites an enabled slot, disabled meanwhile for the kernel checks */
+static int rewrite_slot(pid_t pid, int slot, uint64_t address,
+        ddbg_btype_t type, ddbg_bsize_t size)
+{
+    uint64_t control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+    uint64_t cleared = control & ~((1ULL << (2 * slot)) |
+        (0xfULL << (16 + 4 * slot)));
+    if (x86_write_drx(pid, X86_HW_BREAKPOINT_CONTROL, cleared) ||
+            x86_write_drx(pid, slot, address))
+        return -1;
+    return x86_write_drx(pid, X86_HW_BREAKPOINT_CONTROL, cleared |
+        (1ULL << (2 * slot)) | ((uint64_t)type << (16 + 4 * slot)) |
+        ((uint64_t)size << (18 + 4 * slot)));
+}
+
+/* Shares an enabled write slot covering the same aligned 8 bytes word. Reads
+of the word could not be told apart, read watches get slots of their own */
+static bool pack_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
+        ddbg_monitor_response_t *response)
+{
+    ddbg_btype_t type = request->breakpoint.type;
+    uint64_t start = (uint64_t)request->breakpoint.address;
+    uint64_t word = start & ~7ULL;
+    if (type != DDBG_BREAK_DATA_WRITE ||
+            start + dyndebug_bsize_bytes(request->breakpoint.size) > word + 8)
+        return false;
+
+    uint64_t control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+    for (int slot = 0 ; slot < HW_BREAKPOINTS_COUNT ; slot++)
+    {
+        ddbg_slot_watches_t *watches = &slot_watches[slot];
+        ddbg_btype_t slot_type;
+        ddbg_bsize_t slot_size;
+        slot_fields(control, slot, &slot_type, &slot_size);
+        if (!(control & (1ULL << (2 * slot))) || !watches->count ||
+                watches->count == MAX_PACKED_WATCHES || slot_type != type ||
+                (x86_read_drx(pid, slot) & ~7ULL) != word)
+            continue;
+
+        response->result = rewrite_slot(pid, slot, word, type,
+            DDBG_BREAK_8BYTES) == 0 ? DDBG_SUCCESS : (ddbg_result_t)errno;
+        if (response->result == DDBG_SUCCESS)
+        {
+            watches->watches[watches->count].address = start;
+            watches->watches[watches->count].size = request->breakpoint.size;
+            watches->count++;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* Removes a watch from a shared slot, narrowed back once alone */
+static bool unpack_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
+        ddbg_monitor_response_t *response)
+{
+    uint64_t control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+    for (int slot = 0 ; slot < HW_BREAKPOINTS_COUNT ; slot++)
+    {
+        ddbg_slot_watches_t *watches = &slot_watches[slot];
+        ddbg_btype_t slot_type;
+        ddbg_bsize_t slot_size;
+        slot_fields(control, slot, &slot_type, &slot_size);
+        if (watches->count < 2 || slot_type != request->breakpoint.type)
+            continue;
+        for (int i = 0 ; i < watches->count ; i++)
+        {
+            if (watches->watches[i].address !=
+                    (uint64_t)request->breakpoint.address ||
+                    watches->watches[i].size != request->breakpoint.size)
+                continue;
+            watches->watches[i] = watches->watches[--watches->count];
+            if (watches->count == 1)
+                response->result = rewrite_slot(pid, slot,
+                    watches->watches[0].address, slot_type,
+                    watches->watches[0].size) == 0 ?
+                    DDBG_SUCCESS : (ddbg_result_t)errno;
+            else
+                response->result = DDBG_SUCCESS;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A store to the word could not be decoded, its watches move to free slots
+as long as there are some, narrowed to their own bytes */
+static void split_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
+        ddbg_monitor_response_t *response)
+{
+    uint64_t word = (uint64_t)request->breakpoint.address;
+    uint64_t control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+    response->result = DDBG_SUCCESS;
+    for (int slot = 0 ; slot < HW_BREAKPOINTS_COUNT ; slot++)
+    {
+        ddbg_slot_watches_t *watches = &slot_watches[slot];
+        ddbg_btype_t type;
+        ddbg_bsize_t size;
+        slot_fields(control, slot, &type, &size);
+        if (watches->count < 2 || type != request->breakpoint.type ||
+                x86_read_drx(pid, slot) != word)
+            continue;
+
+        for (int spare = 0 ; spare < HW_BREAKPOINTS_COUNT &&
+                watches->count > 1 ; spare++)
+        {
+            int last = watches->count - 1;
+            if (control & (1ULL << (2 * spare)))
+                continue;
+            if (rewrite_slot(pid, spare, watches->watches[last].address, type,
+                    watches->watches[last].size))
+            {
+                response->result = (ddbg_result_t)errno;
+                return;
+            }
+            slot_watches[spare].count = 1;
+            slot_watches[spare].watches[0] = watches->watches[last];
+            watches->count--;
+            control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+        }
+        if (watches->count == 1 && rewrite_slot(pid, slot,
+                watches->watches[0].address, type, watches->watches[0].size))
+            response->result = (ddbg_result_t)errno;
         return;
     }
 }
@@ -277,6 +727,9 @@ static void set_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
         response->result = (ddbg_result_t)errno;
         return;
     }
+    if (pack_hw_breakpoint(pid, request, response))
+        return;
+    uint64_t former = *((uint64_t *)&control);
     x86_breakpoint_register_t breakpoint;
     if (!control.l0)
     {
@@ -308,6 +761,14 @@ static void set_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
         response->result = DDBG_ALL_HWBP_BUSY;
         return;
     }
+    /* A disabled slot keeps its former type and length and the kernel checks
+    the new address against them (alignment), reset them first */
+    uint64_t reset = former & ~(0xfULL << (16 + 4 * breakpoint));
+    if (reset != former && x86_write_drx(pid, X86_HW_BREAKPOINT_CONTROL, reset))
+    {
+        response->result = (ddbg_result_t)errno;
+        return;
+    }
     if (x86_write_drx(pid, breakpoint, (uint64_t)request->breakpoint.address))
     {
         response->result = (ddbg_result_t)errno;
@@ -315,6 +776,47 @@ static void set_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
     }
     response->result = (x86_write_dr_control(pid, control) == 0 ?
         DDBG_SUCCESS : (ddbg_result_t)errno);
+    if (response->result == DDBG_SUCCESS)
+    {
+        slot_watches[breakpoint].count = 1;
+        slot_watches[breakpoint].watches[0].address =
+            (uint64_t)request->breakpoint.address;
+        slot_watches[breakpoint].watches[0].size = request->breakpoint.size;
+    }
+}
+
+/* A single attach and mirroring for the whole batch, the slots released
+first are available to the ones armed next */
+static void set_hw_breakpoints(pid_t pid, ddbg_monitor_request_t *request,
+        ddbg_monitor_response_t *response)
+{
+    ddbg_monitor_request_t item = {.operation = DDBG_ENABLE_BREAKPOINT};
+    ddbg_monitor_response_t result = {.result = DDBG_SUCCESS};
+    int disarmed = 0, armed = 0;
+    item.breakpoint.is_hw = true;
+    for ( ; disarmed < request->batch.disarmed ; disarmed++)
+    {
+        item.breakpoint.address = request->batch.items[disarmed].address;
+        item.breakpoint.type = request->batch.items[disarmed].type;
+        item.breakpoint.size = request->batch.items[disarmed].size;
+        reset_hw_breakpoint(pid, &item, &result);
+        if (result.result != DDBG_SUCCESS)
+            break;
+    }
+    for (int i = disarmed ; result.result == DDBG_SUCCESS &&
+            i < request->batch.count && armed < HW_BREAKPOINTS_COUNT ;
+            i++, armed++)
+    {
+        item.breakpoint.address = request->batch.items[i].address;
+        item.breakpoint.type = request->batch.items[i].type;
+        item.breakpoint.size = request->batch.items[i].size;
+        set_hw_breakpoint(pid, &item, &result);
+        if (result.result != DDBG_SUCCESS)
+            break;
+    }
+    response->result = result.result;
+    response->batch.armed = armed;
+    response->batch.disarmed = disarmed;
 }
 
 static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
@@ -326,6 +828,8 @@ static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
         response->result = (ddbg_result_t)errno;
         return;
     }
+    if (unpack_hw_breakpoint(pid, request, response))
+        return;
 
     void *address;
     if (control.l0 == 1)
@@ -336,6 +840,7 @@ static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
                 control.len0 == request->breakpoint.size)
         {
             control.l0 = 0;
+            slot_watches[0].count = 0;
             response->result = (x86_write_dr_control(pid, control) == 0 ?
                 DDBG_SUCCESS : (ddbg_result_t)errno);
             return;
@@ -349,6 +854,7 @@ static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
                 control.len1 == request->breakpoint.size)
         {
             control.l1 = 0;
+            slot_watches[1].count = 0;
             response->result = (x86_write_dr_control(pid, control) == 0 ?
                 DDBG_SUCCESS : (ddbg_result_t)errno);
             return;
@@ -362,6 +868,7 @@ static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
                 control.len2 == request->breakpoint.size)
         {
             control.l2 = 0;
+            slot_watches[2].count = 0;
             response->result = (x86_write_dr_control(pid, control) == 0 ?
                 DDBG_SUCCESS : (ddbg_result_t)errno);
                 return;
@@ -375,6 +882,7 @@ static void reset_hw_breakpoint(pid_t pid, ddbg_monitor_request_t *request,
                 control.len3 == request->breakpoint.size)
         {
             control.l3 = 0;
+            slot_watches[3].count = 0;
             response->result = (x86_write_dr_control(pid, control) == 0 ?
                 DDBG_SUCCESS : (ddbg_result_t)errno);
             return;
@@ -395,6 +903,7 @@ static void reset_all_breakpoints(pid_t pid, ddbg_monitor_response_t *response)
     control.l1 = 0;
     control.l2 = 0;
     control.l3 = 0;
+    memset(slot_watches, 0, HW_BREAKPOINTS_COUNT * sizeof(ddbg_slot_watches_t));
     response->result = (x86_write_dr_control(pid, control) == 0 ?
         DDBG_SUCCESS : (ddbg_result_t)errno);
 }
@@ -422,43 +931,267 @@ static void prepare_trig_breakpt_response(pid_t pid,
         response->result = (ddbg_result_t)errno;
         return;
     }
-    x86_breakpoint_register_t reg;
-    ddbg_btype_t type;
-    ddbg_bsize_t size;
-    if (status.b0)
+    /* A store may fire several slots, every one of them is reported */
+    uint64_t fired = *((uint64_t *)&status) & 0xf;
+    if (!fired)
     {
-        reg = X86_HW_BREAKPOINT_0;
-        type = control.rw0;
-        size = control.len0;
+        error_print("Trap exception but no breakpt triggered, status is 0x%lx\n",
+            *((uint64_t*)&status));
+        response->result = DDBG_HWBP_NOT_FOUND;
+        return;
     }
-    else if (status.b1)
+    response->trapped.count = 0;
+    for (int slot = 0 ; slot < HW_BREAKPOINTS_COUNT ; slot++)
     {
-        reg = X86_HW_BREAKPOINT_1;
-        type = control.rw1;
-        size = control.len1;
+        /* Disabled since, by a rotation racing the trap, the hit is stale */
+        if (!(fired & (1ULL << slot)) ||
+                !(*((uint64_t *)&control) & (1ULL << (2 * slot))))
+            continue;
+        ddbg_btype_t type;
+        ddbg_bsize_t size;
+        slot_fields(*((uint64_t *)&control), slot, &type, &size);
+        int item = response->trapped.count++;
+        response->trapped.items[item].address = (void *)x86_read_drx(pid, slot);
+        response->trapped.items[item].type = type;
+        response->trapped.items[item].size = size;
+        response->trapped.items[item].packed = slot_watches[slot].count > 1;
     }
-    else if (status.b2)
+    response->result = DDBG_SUCCESS;
+}
+
+/* Debug registers are per thread, the leader ones are copied to the other
+threads every time they change. Threads created afterwards start without any
+breakpoint */
+static void mirror_debug_registers(ddbg_context_t *context)
+{
+    ddbg_task_t *tasks;
+    pid_t pid = context->monitored_pid;
+    int count = dyndebug_monitor_list_tasks(pid, &tasks);
+    if (count <= 1)
     {
-        reg = X86_HW_BREAKPOINT_2;
-        type = control.rw2;
-        size = control.len2;
+        if (count == 1)
+            dyndebug_monitor_free_tasks(tasks, count);
+        return;
     }
-    else if (status.b3)
+
+    uint64_t drx[HW_BREAKPOINTS_COUNT];
+    for (int i = 0 ; i < HW_BREAKPOINTS_COUNT ; i++)
+        drx[i] = x86_read_drx(pid, X86_HW_BREAKPOINT_0 + i);
+    uint64_t control = x86_read_drx(pid, X86_HW_BREAKPOINT_CONTROL);
+
+    dyndebug_monitor_stop_tasks(pid, tasks, count);
+    for (int i = 0 ; i < count ; i++)
     {
-        reg = X86_HW_BREAKPOINT_3;
-        type = control.rw3;
-        size = control.len3;
+        ddbg_task_t *task = &tasks[i];
+        if (task->tid == pid || !task->stopped)
+            continue;
+        /* Disabled first, the addresses are checked against the lengths */
+        if (x86_write_drx(task->tid, X86_HW_BREAKPOINT_CONTROL, 0))
+            continue;
+        for (int j = 0 ; j < HW_BREAKPOINTS_COUNT ; j++)
+            x86_write_drx(task->tid, X86_HW_BREAKPOINT_0 + j, drx[j]);
+        x86_write_drx(task->tid, X86_HW_BREAKPOINT_CONTROL, control);
     }
-    else
+    dyndebug_monitor_resume_tasks(tasks, count);
+    dyndebug_monitor_free_tasks(tasks, count);
+}
+
+static void prepare_thread_trig_response(ddbg_context_t *context, pid_t tid,
+        ddbg_monitor_response_t *response)
+{
+    /* The trapped thread waits for us in its SIGTRAP handler */
+    ddbg_task_t task = {.tid = tid};
+    if (!dyndebug_monitor_stop_tasks(context->monitored_pid, &task, 1))
     {
-        error_print("Trap exception but no breakpt triggered, status is 0x%lx\n",
-            *((uint64_t*)&status));
+        response->result = DDBG_HWBP_NOT_FOUND;
         return;
     }
-    uint64_t drx = x86_read_drx(pid, reg);
-    response->breakpoint.address = (void *)drx;
-    response->breakpoint.type = type;
-    response->breakpoint.size = size;
-    response->breakpoint.is_hw = true;
+    prepare_trig_breakpt_response(tid, response);
+    dyndebug_monitor_resume_tasks(&task, 1);
+}
+
+static void handle_crash_report(ddbg_context_t *context,
+        ddbg_monitor_request_t *request, ddbg_monitor_response_t *response)
+{
+    /* The monitor is not in a signal handler, it has room for that. Kept for
+    the next reports of the same process, as long as the registers point into
+    known mappings */
+    static ddbg_maps_t maps;
+    static pid_t maps_pid;
+    uint32_t flags = request->crash.flags;
+    ddbg_task_t *tasks = NULL;
+    int count = 0, stopped = 0;
+
     response->result = DDBG_SUCCESS;
+
+    /* The faulting registers are in the ucontext on the crashed thread
+    stack, not in what PTRACE_GETREGSET would return */
+    long long gregs[NGREG];
+    struct iovec local = {.iov_base = gregs, .iov_len = sizeof(gregs)};
+    struct iovec remote = {.iov_base = (uint8_t *)request->crash.ucontext +
+        offsetof(ucontext_t, uc_mcontext.gregs), .iov_len = sizeof(gregs)};
+    if (process_vm_readv(context->monitored_pid, &local, 1, &remote, 1, 0) !=
+            sizeof(gregs))
+    {
+        error_print("Cannot read the crash context of %s -- %s\n",
+            context->monitored_process_name, strerror(errno));
+        response->result = DDBG_SYSTEM_ERROR;
+        return;
+    }
+
+    if (flags & DDBG_CRASH_MEMORY_CAPTURE)
+    {
+        if (maps_pid != context->monitored_pid ||
+                dyndebug_maps_outdated(&maps, gregs))
+            maps_pid = dyndebug_parse_maps(context->monitored_pid, &maps) < 0 ?
+                0 : context->monitored_pid;
+        if (!maps_pid)
+        {
+            error_print("Cannot read the mappings of %s -- %s\n",
+                context->monitored_process_name, strerror(errno));
+            response->result = DDBG_SYSTEM_ERROR;
+        } else
+        {
+            dyndebug_capture_memory(stderr, context->monitored_pid, &maps, gregs,
+                request->crash.fault_address);
+            fflush(stderr);
+        }
+    }
+
+    /* Stop everybody once for both the threads dump and the core */
+    if (flags & (DDBG_CRASH_ALL_THREADS | DDBG_CRASH_CORE_FILE))
+    {
+        count = dyndebug_monitor_list_tasks(context->monitored_pid, &tasks);
+        if (count < 0)
+        {
+            response->result = DDBG_SYSTEM_ERROR;
+            return;
+        }
+        stopped = dyndebug_monitor_stop_tasks(context->monitored_pid, tasks,
+            count);
+        response->crash.threads = stopped;
+    }
+    if (flags & DDBG_CRASH_ALL_THREADS)
+        dyndebug_monitor_dump_threads(context, request, tasks, count, stopped);
+    if (flags & DDBG_CRASH_CORE_FILE)
+    {
+        ddbg_result_t result = dyndebug_monitor_write_core(context, request,
+            gregs, tasks, count);
+        if (result != DDBG_SUCCESS)
+            response->result = result;
+    }
+    if (tasks)
+    {
+        dyndebug_monitor_resume_tasks(tasks, count);
+        dyndebug_monitor_free_tasks(tasks, count);
+    }
+}
+
+static void handle_snapshot_core(ddbg_context_t *context,
+        ddbg_monitor_request_t *request, ddbg_monitor_response_t *response)
+{
+    /* The snapshot is a stopped single threaded child of the monitored
+    process, seized on its own and left stopped when detached */
+    ddbg_task_t task = {.tid = request->crash.tid};
+    if (!dyndebug_monitor_stop_tasks(0, &task, 1))
+    {
+        response->result = DDBG_INVALID_ARGUMENT;
+        return;
+    }
+
+    long long gregs[NGREG];
+    struct iovec local = {.iov_base = gregs, .iov_len = sizeof(gregs)};
+    struct iovec remote = {.iov_base = (uint8_t *)request->crash.ucontext +
+        offsetof(ucontext_t, uc_mcontext.gregs), .iov_len = sizeof(gregs)};
+    if (process_vm_readv(task.tid, &local, 1, &remote, 1, 0) != sizeof(gregs))
+    {
+        error_print("Cannot read the context of snapshot %d -- %s\n",
+            task.tid, strerror(errno));
+        response->result = DDBG_SYSTEM_ERROR;
+    } else
+    {
+        ddbg_context_t snapshot = *context;
+        snapshot.monitor_pid = context->monitored_pid;
+        snapshot.monitored_pid = task.tid;
+        response->result = dyndebug_monitor_write_core(&snapshot, request,
+            gregs, &task, 1);
+    }
+    dyndebug_monitor_resume_tasks(&task, 1);
+}
+
+/* ptrace writes whatever the page protection */
+static ddbg_result_t poke_code(pid_t pid, uint64_t address, const uint8_t *bytes,
+        int length)
+{
+    int done = 0;
+    while (done < length)
+    {
+        uint64_t word = (address + done) & ~7ULL;
+        errno = 0;
+        dyndebug_monitor_ptraces += 2;
+        long value = ptrace(PTRACE_PEEKDATA, pid, word, 0);
+        if (errno)
+            return DDBG_SYSTEM_ERROR;
+        for (int i = address + done - word ; i < 8 && done < length ; i++)
+            ((uint8_t *)&value)[i] = bytes[done++];
+        if (ptrace(PTRACE_POKEDATA, pid, word, value) < 0)
+            return DDBG_SYSTEM_ERROR;
+    }
+    return DDBG_SUCCESS;
+}
+
+/* No thread may resume in the middle of the instructions replaced, they are
+all stopped and checked, retried while one is in there */
+static void handle_patch_code(ddbg_context_t *context,
+        ddbg_monitor_request_t *request, ddbg_monitor_response_t *response)
+{
+    pid_t pid = context->monitored_pid;
+    int patches = request->patch.count;
+    response->result = DDBG_SYSTEM_ERROR;
+    response->batch.armed = 0;
+    if (patches < 0 || patches > MAX_PATCH_BATCH)
+    {
+        response->result = DDBG_INVALID_ARGUMENT;
+        return;
+    }
+    for (int attempt = 0 ; attempt < PTRACE_STOP_ATTEMPTS ; attempt++)
+    {
+        ddbg_task_t *tasks;
+        int count = dyndebug_monitor_list_tasks(pid, &tasks);
+        if (count < 0)
+            return;
+        dyndebug_monitor_stop_tasks(pid, tasks, count);
+
+        /* The whole batch waits for a thread within any of the spans */
+        bool inside = false;
+        for (int i = 0 ; i < count ; i++)
+            for (int p = 0 ; p < patches ; p++)
+            {
+                uint64_t site = (uint64_t)request->patch.items[p].address;
+                inside |= tasks[i].stopped && tasks[i].regs_valid &&
+                    tasks[i].regs.rip > site &&
+                    tasks[i].regs.rip < site + request->patch.items[p].span;
+            }
+        if (!inside)
+        {
+            response->result = DDBG_SUCCESS;
+            for (int p = 0 ; p < patches ; p++)
+            {
+                response->result = poke_code(pid,
+                    (uint64_t)request->patch.items[p].address,
+                    request->patch.items[p].bytes,
+                    request->patch.items[p].length);
+                if (response->result != DDBG_SUCCESS)
+                    break;
+                response->batch.armed++;
+            }
+        }
+        dyndebug_monitor_resume_tasks(tasks, count);
+        dyndebug_monitor_free_tasks(tasks, count);
+        if (!inside)
+            return;
+        usleep(1000);
+    }
+    error_print("A thread stays within the code patched from %p\n",
+        request->patch.items[0].address);
 }
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_monitor_threads.h>
+#include <private/dyndbg_monitor.h>
+#include <dyndbg/dyndbg_us.h>
+
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <elf.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct
+{
+    ddbg_task_t             *tasks;
+    int                     count;
+    int                     next;
+    pid_t                   pid;
+    pid_t                   crashed_tid;
+} ddbg_dump_job_t;
+
+static int compare_tasks(const void *a, const void *b)
+{
+    return ((const ddbg_task_t *)a)->tid - ((const ddbg_task_t *)b)->tid;
+}
+
+int dyndebug_monitor_list_tasks(pid_t pid, ddbg_task_t **tasks)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        error_print("Cannot list the tasks of %d -- %s\n", pid, strerror(errno));
+        return -1;
+    }
+
+    int count = 0, capacity = 64;
+    ddbg_task_t *array = calloc(capacity, sizeof(ddbg_task_t));
+    struct dirent *entry;
+    while (array && (entry = readdir(dir)))
+    {
+        pid_t tid = atoi(entry->d_name);
+        if (tid <= 0)
+            continue;
+        if (count == capacity)
+        {
+            ddbg_task_t *larger = realloc(array, 2 * capacity * sizeof(ddbg_task_t));
+            if (!larger)
+                break;
+            memset(&larger[capacity], 0, capacity * sizeof(ddbg_task_t));
+            array = larger;
+            capacity *= 2;
+        }
+        array[count].tid = tid;
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/comm", pid, tid);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0)
+        {
+            ssize_t len = read(fd, array[count].name, sizeof(array[count].name) - 1);
+            if (len > 0 && array[count].name[len - 1] == '\n')
+                array[count].name[len - 1] = 0;
+            close(fd);
+        }
+        count++;
+    }
+    closedir(dir);
+    if (!array)
+    {
+        error_print("Cannot allocate the task list of %d\n", pid);
+        return -1;
+    }
+
+    qsort(array, count, sizeof(ddbg_task_t), compare_tasks);
+    *tasks = array;
+    return count;
+}
+
+static bool read_task_registers(ddbg_task_t *task)
+{
+    struct iovec iov = {.iov_base = &task->regs, .iov_len = sizeof(task->regs)};
+    dyndebug_monitor_ptraces++;
+    if (ptrace(PTRACE_GETREGSET, task->tid, NT_PRSTATUS, &iov) < 0)
+    {
+        error_print("Cannot read the registers of task %d -- %s\n", task->tid,
+            strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int dyndebug_monitor_stop_tasks(pid_t pid, ddbg_task_t *tasks, int count)
+{
+    int stopped = 0, i;
+
+    /* Interrupt everybody first so that the stops happen concurrently... */
+    for (i = 0 ; i < count ; i++)
+    {
+        ddbg_task_t *task = &tasks[i];
+        if (task->tid == pid)
+        {
+            task->stopped = true;
+            continue;
+        }
+        dyndebug_monitor_ptraces += 2;
+        if (ptrace(PTRACE_SEIZE, task->tid, 0, 0) < 0)
+        {
+            /* The thread may have exited in the meantime */
+            debug_print("Cannot seize task %d -- %s\n", task->tid, strerror(errno));
+            continue;
+        }
+        task->seized = true;
+        if (ptrace(PTRACE_INTERRUPT, task->tid, 0, 0) < 0)
+            debug_print("Cannot interrupt task %d -- %s\n", task->tid,
+                strerror(errno));
+    }
+
+    /* ...then collect the stops and the registers */
+    for (i = 0 ; i < count ; i++)
+    {
+        ddbg_task_t *task = &tasks[i];
+        if (task->seized)
+        {
+            int status, rc;
+            do
+                rc = waitpid(task->tid, &status, __WALL);
+            while (rc < 0 && errno == EINTR);
+            if (rc != task->tid || !WIFSTOPPED(status))
+            {
+                debug_print("Task %d did not stop -- %s\n", task->tid,
+                    strerror(errno));
+                continue;
+            }
+            task->stopped = true;
+            dyndebug_monitor_stops++;
+        }
+        if (task->stopped)
+        {
+            task->regs_valid = read_task_registers(task);
+            stopped++;
+        }
+    }
+    return stopped;
+}
+
+void dyndebug_monitor_resume_tasks(ddbg_task_t *tasks, int count)
+{
+    for (int i = 0 ; i < count ; i++)
+    {
+        if (!tasks[i].seized)
+            continue;
+        dyndebug_monitor_ptraces++;
+        if (ptrace(PTRACE_DETACH, tasks[i].tid, 0, 0) < 0)
+            debug_print("Cannot detach task %d -- %s\n", tasks[i].tid,
+                strerror(errno));
+        tasks[i].seized = false;
+        tasks[i].stopped = false;
+    }
+}
+
+void dyndebug_monitor_free_tasks(ddbg_task_t *tasks, int count)
+{
+    for (int i = 0 ; i < count ; i++)
+    {
+        free(tasks[i].stack);
+        free(tasks[i].report);
+    }
+    free(tasks);
+}
+
+static void print_symbol(FILE *out, uint64_t address)
+{
+    /* The monitor is a fork of the monitored process, the objects loaded
+    before dyndebug_get_context() share the same layout */
+    Dl_info info;
+    if (dladdr((void *)address, &info) && info.dli_fname)
+    {
+        if (info.dli_sname)
+            fprintf(out, "%s(%s+0x%lx)", info.dli_fname, info.dli_sname,
+                address - (uint64_t)info.dli_saddr);
+        else
+            fprintf(out, "%s(+0x%lx)", info.dli_fname,
+                address - (uint64_t)info.dli_fbase);
+    }
+    fprintf(out, "[0x%lx]\n", address);
+}
+
+static void copy_task_stack(pid_t pid, ddbg_task_t *task)
+{
+    task->stack = malloc(MAX_THREAD_STACK_COPY);
+    if (!task->stack)
+        return;
+    struct iovec local = {.iov_base = task->stack, .iov_len = MAX_THREAD_STACK_COPY};
+    struct iovec remote = {.iov_base = (void *)task->regs.rsp,
+        .iov_len = MAX_THREAD_STACK_COPY};
+    /* Partial reads are fine, the stack top is usually closer than that */
+    ssize_t rc = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+    task->stack_size = rc > 0 ? rc : 0;
+}
+
+static uint64_t stack_word(ddbg_task_t *task, uint64_t address)
+{
+    uint64_t offset = address - task->regs.rsp;
+    return *(uint64_t *)(task->stack + offset);
+}
+
+static bool in_stack_copy(ddbg_task_t *task, uint64_t address)
+{
+    return address >= task->regs.rsp &&
+        address + 2 * sizeof(uint64_t) <= task->regs.rsp + task->stack_size;
+}
+
+static void dump_task(ddbg_dump_job_t *job, ddbg_task_t *task)
+{
+    FILE *out = open_memstream(&task->report, &task->report_size);
+    if (!out)
+        return;
+
+    fprintf(out, "\nThread %d (%s)%s:\n", task->tid, task->name,
+        task->tid == job->crashed_tid ? " -- crashed, in the crash handler" : "");
+    if (!task->regs_valid)
+    {
+        fprintf(out, "Registers not available\n");
+        fclose(out);
+        return;
+    }
+
+    struct user_regs_struct *r = &task->regs;
+    fprintf(out, "RAX  0x%016llx, RBX  0x%016llx, RCX  0x%016llx\n", r->rax, r->rbx, r->rcx);
+    fprintf(out, "RDX  0x%016llx, RSI  0x%016llx, RDI  0x%016llx\n", r->rdx, r->rsi, r->rdi);
+    fprintf(out, "R08  0x%016llx, R09  0x%016llx, R10  0x%016llx\n", r->r8, r->r9, r->r10);
+    fprintf(out, "R11  0x%016llx, R12  0x%016llx, R13  0x%016llx\n", r->r11, r->r12, r->r13);
+    fprintf(out, "R14  0x%016llx, R15  0x%016llx\n", r->r14, r->r15);
+    fprintf(out, "RBP  0x%016llx, RSP  0x%016llx\n", r->rbp, r->rsp);
+    fprintf(out, "RIP  0x%016llx, EFL  0x%016llx, FS_BASE 0x%016llx\n", r->rip,
+        r->eflags, r->fs_base);
+
+    copy_task_stack(job->pid, task);
+
+    /* Frame pointer chain, bounded by what we could copy */
+    fprintf(out, "Callstack:\n#0  ");
+    print_symbol(out, r->rip);
+    uint64_t fp = r->rbp;
+    for (int depth = 1 ; depth < MAX_THREAD_BACKTRACE && in_stack_copy(task, fp);
+            depth++)
+    {
+        uint64_t next = stack_word(task, fp);
+        uint64_t ret = stack_word(task, fp + sizeof(uint64_t));
+        if (!ret)
+            break;
+        fprintf(out, "#%-2d ", depth);
+        print_symbol(out, ret);
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+
+    size_t words = min(MAX_THREAD_STACK_COPY, task->stack_size) / sizeof(uint64_t);
+    words = min(words, MAX_THREAD_STACK_DUMP / sizeof(uint64_t));
+    fprintf(out, "Partial stack dump (%ld bytes from 0x%llx):\n",
+        words * sizeof(uint64_t), r->rsp);
+    for (size_t i = 0 ; i < words ; i++)
+    {
+        fprintf(out, "0x%llx: ", r->rsp + i * sizeof(uint64_t));
+        print_symbol(out, ((uint64_t *)task->stack)[i]);
+    }
+    fclose(out);
+}
+
+static void *dump_worker(void *arg)
+{
+    ddbg_dump_job_t *job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        dump_task(job, &job->tasks[i]);
+    return NULL;
+}
+
+void dyndebug_monitor_dump_threads(ddbg_context_t *context,
+    ddbg_monitor_request_t *request, ddbg_task_t *tasks, int count, int stopped)
+{
+    ddbg_dump_job_t job = {0};
+    job.pid = context->monitored_pid;
+    job.crashed_tid = request->crash.tid;
+    job.tasks = tasks;
+    job.count = count;
+
+    /* Only the ptrace stop needs this thread, the stacks copy and the
+    symbolization spread over the workers */
+    pthread_t workers[MAX_DUMP_WORKERS];
+    int nworkers = min(min(sysconf(_SC_NPROCESSORS_ONLN), MAX_DUMP_WORKERS),
+        job.count), started = 0;
+    for ( ; nworkers > 1 && started < nworkers ; started++)
+        if (pthread_create(&workers[started], NULL, dump_worker, &job))
+            break;
+    dump_worker(&job);
+    for (int i = 0 ; i < started ; i++)
+        pthread_join(workers[i], NULL);
+
+    fprintf(stderr, "\nAll threads of %s (%d threads, %d stopped), signal %d "\
+        "at %p in thread %d:\n", context->monitored_process_name, job.count,
+        stopped, request->crash.signum, request->crash.fault_address,
+        request->crash.tid);
+    for (int i = 0 ; i < job.count ; i++)
+        if (job.tasks[i].report)
+            fwrite(job.tasks[i].report, 1, job.tasks[i].report_size, stderr);
+    fflush(stderr);
+}
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_unwind.h>
+#include <dyndbg/dyndbg_us.h>
+
+#include <ucontext.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <time.h>
+
+/* libdyndbg_preload.so arms breakpoints at load time, from the file named by
+DYNDBG_CONFIG or the ';' separated lines of DYNDBG_BREAKPOINTS:
+
+    <address|symbol>[:x|w|rw|p[:1|2|4|8]] [count|trace|stack|crash]
+    core <path>         cores of the crash action, "<path>.<pid>"
+    report <path>       counts and stacks at exit, stderr by default
+    control             dyndebug_start_control(NULL)
+    stats               dyndebug_start_stats()
+
+p is a probe, the function prologue jumps to the callback. Instructions are
+the default, 1 byte, counted */
+
+#define MAX_PRELOAD_ENTRIES     32
+#define PRELOAD_TARGET_LENGTH   64
+#define PRELOAD_STACKS          64
+#define PRELOAD_STACK_DEPTH     8
+#define PRELOAD_REAP_MS         100     /* crash snapshots dump period */
+#define PRELOAD_LINE_LENGTH     256
+
+typedef enum
+{
+    PRELOAD_COUNT = 0,
+    PRELOAD_TRACE,                      /* one line per hit, from a worker */
+    PRELOAD_STACK,                      /* distinct stacks with their counts */
+    PRELOAD_CRASH,                      /* a core of a snapshot per hit */
+} preload_action_t;
+
+typedef struct
+{
+    ddbg_breakpoint_t       breakpoint;
+    char                    target[PRELOAD_TARGET_LENGTH];
+    void                    *address;
+    ddbg_btype_t            type;
+    ddbg_bsize_t            size;
+    bool                    is_hw;
+    preload_action_t        action;
+    uint64_t                hits;
+} preload_entry_t;
+
+typedef struct
+{
+    uint64_t                signature;  /* 0 while free */
+    preload_entry_t         *entry;
+    uint64_t                count;
+    int                     depth;
+    uint64_t                pcs[PRELOAD_STACK_DEPTH];
+} preload_stack_t;
+
+static const char *action_names[] = {"count", "trace", "stack", "crash"};
+
+static preload_entry_t entries[MAX_PRELOAD_ENTRIES];
+static int entry_count;
+static preload_stack_t stacks[PRELOAD_STACKS];
+static uint64_t stacks_dropped;
+static char report_path[PRELOAD_LINE_LENGTH];
+static char core_path[PRELOAD_LINE_LENGTH] = "/tmp/dyndbg_core";
+static bool start_control;
+static bool start_stats;
+/* The application, neither the monitor nor forked children report */
+static pid_t preload_pid;
+static pthread_t reaper_thread;
+static bool reaper_running;
+static bool reaper_stopping;
+
+static void on_count(ddbg_breakpoint_t *b)
+{
+    preload_entry_t *entry = b->callback_priv_arg;
+    __atomic_fetch_add(&entry->hits, 1, __ATOMIC_RELAXED);
+}
+
+/* Asynchronous, stdio is fine on the dispatcher worker */
+static void on_trace(ddbg_breakpoint_t *b)
+{
+    preload_entry_t *entry = b->callback_priv_arg;
+    const ddbg_hit_t *hit = dyndebug_get_hit();
+    __atomic_fetch_add(&entry->hits, 1, __ATOMIC_RELAXED);
+    if (hit)
+        fprintf(stderr, "dyndbg: %s hit by %d at 0x%lx\n", entry->target,
+            hit->tid, hit->rip);
+    else
+        fprintf(stderr, "dyndbg: %s hit by %d\n", entry->target, gettid());
+}
+
+static void on_stack(ddbg_breakpoint_t *b)
+{
+    preload_entry_t *entry = b->callback_priv_arg;
+    ucontext_t *ucontext = dyndebug_get_trap_ucontext();
+    uint64_t pcs[PRELOAD_STACK_DEPTH];
+    int depth = 0;
+    __atomic_fetch_add(&entry->hits, 1, __ATOMIC_RELAXED);
+    if (ucontext)
+        depth = dyndebug_unwind(ucontext->uc_mcontext.gregs, pcs,
+            PRELOAD_STACK_DEPTH);
+    else
+        pcs[depth++] = (uint64_t)b->address;
+
+    uint64_t signature = (uint64_t)entry * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0 ; i < depth ; i++)
+        signature = (signature ^ pcs[i]) * 0x100000001b3ULL;
+    signature |= 1;
+
+    /* Open addressing, a slot is claimed once and never released */
+    for (int i = 0 ; i < PRELOAD_STACKS ; i++)
+    {
+        preload_stack_t *stack = &stacks[(signature + i) % PRELOAD_STACKS];
+        uint64_t current = __atomic_load_n(&stack->signature, __ATOMIC_ACQUIRE);
+        if (!current && __atomic_compare_exchange_n(&stack->signature, &current,
+                signature, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            stack->entry = entry;
+            stack->depth = depth;
+            memcpy(stack->pcs, pcs, depth * sizeof(uint64_t));
+            current = signature;
+        }
+        if (current == signature)
+        {
+            __atomic_fetch_add(&stack->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&stacks_dropped, 1, __ATOMIC_RELAXED);
+}
+
+/* Snapshots are forked by the trap handler, the cores are written from here */
+static void *reaper_main(void *arg __attribute__((unused)))
+{
+    struct timespec period = {.tv_sec = 0,
+        .tv_nsec = PRELOAD_REAP_MS * 1000000L};
+    ddbg_snapshot_t snapshots[16];
+    for (;;)
+    {
+        bool stopping = __atomic_load_n(&reaper_stopping, __ATOMIC_ACQUIRE);
+        int count = dyndebug_account_snapshots(snapshots, 16);
+        for (int i = 0 ; i < count ; i++)
+        {
+            ddbg_result_t result = dyndebug_dump_snapshot(snapshots[i].pid);
+            fprintf(stderr, "dyndbg: %p hit, %s.%d %s\n", snapshots[i].address,
+                core_path, snapshots[i].pid, result == DDBG_SUCCESS ?
+                "written" : "not written");
+            dyndebug_release_snapshot(snapshots[i].pid);
+        }
+        if (stopping)
+            break;
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+static bool parse_type(const char *token, ddbg_btype_t *type, bool *is_hw)
+{
+    *is_hw = true;
+    if (!strcmp(token, "x"))
+        *type = DDBG_BREAK_INSTRUCTION;
+    else if (!strcmp(token, "p"))
+    {
+        *type = DDBG_BREAK_INSTRUCTION;
+        *is_hw = false;
+    }
+    else if (!strcmp(token, "w"))
+        *type = DDBG_BREAK_DATA_WRITE;
+    else if (!strcmp(token, "rw"))
+        *type = DDBG_BREAK_DATA_RDWR;
+    else
+        return false;
+    return true;
+}
+
+static bool parse_size(const char *token, ddbg_bsize_t *size)
+{
+    switch (atoi(token))
+    {
+        case 1: *size = DDBG_BREAK_1BYTE; return true;
+        case 2: *size = DDBG_BREAK_2BYTES; return true;
+        case 4: *size = DDBG_BREAK_4BYTES; return true;
+        case 8: *size = DDBG_BREAK_8BYTES; return true;
+        default: return false;
+    }
+}
+
+/* Resolved only, the monitor is not started for nothing */
+static void parse_breakpoint(char *spec, char *action)
+{
+    ddbg_btype_t type = DDBG_BREAK_INSTRUCTION;
+    ddbg_bsize_t size = DDBG_BREAK_1BYTE;
+    bool is_hw = true;
+    char *save, *target = strtok_r(spec, ":", &save);
+    char *type_token = strtok_r(NULL, ":", &save);
+    char *size_token = strtok_r(NULL, ":", &save);
+    if ((type_token && !parse_type(type_token, &type, &is_hw)) ||
+            (size_token && !parse_size(size_token, &size)))
+    {
+        error_print("dyndbg: bad breakpoint %s\n", target);
+        return;
+    }
+
+    preload_action_t act = PRELOAD_COUNT;
+    for ( ; action && act <= PRELOAD_CRASH ; act++)
+        if (!strcmp(action, action_names[act]))
+            break;
+    if (act > PRELOAD_CRASH || (act == PRELOAD_CRASH && !is_hw))
+    {
+        error_print("dyndbg: bad action %s for %s\n", action, target);
+        return;
+    }
+
+    char *end;
+    void *address = (void *)strtoull(target, &end, 0);
+    if (*end || !address)
+        address = dyndebug_resolve_symbol(target);
+    if (!address)
+    {
+        error_print("dyndbg: %s not found\n", target);
+        return;
+    }
+    if (entry_count == MAX_PRELOAD_ENTRIES)
+    {
+        error_print("dyndbg: %s not added\n", target);
+        return;
+    }
+
+    preload_entry_t *entry = &entries[entry_count++];
+    snprintf(entry->target, sizeof(entry->target), "%s", target);
+    entry->address = address;
+    entry->type = type;
+    entry->size = size;
+    entry->is_hw = is_hw;
+    entry->action = act;
+}
+
+static void parse_line(char *line)
+{
+    char *save, *first, *second;
+    line[strcspn(line, "#\n")] = '\0';
+    first = strtok_r(line, " \t", &save);
+    second = strtok_r(NULL, " \t", &save);
+    if (!first)
+        return;
+    if (!strcmp(first, "core") && second)
+        snprintf(core_path, sizeof(core_path), "%s", second);
+    else if (!strcmp(first, "report") && second)
+        snprintf(report_path, sizeof(report_path), "%s", second);
+    else if (!strcmp(first, "control"))
+        start_control = true;
+    else if (!strcmp(first, "stats"))
+        start_stats = true;
+    else
+        parse_breakpoint(first, second);
+}
+
+static void parse_config(void)
+{
+    char line[PRELOAD_LINE_LENGTH];
+    const char *path = getenv("DYNDBG_CONFIG");
+    const char *inline_config = getenv("DYNDBG_BREAKPOINTS");
+    if (path)
+    {
+        FILE *config = fopen(path, "r");
+        if (!config)
+            error_print("dyndbg: cannot read %s -- %s\n", path, strerror(errno));
+        while (config && fgets(line, sizeof(line), config))
+            parse_line(line);
+        if (config)
+            fclose(config);
+    }
+    while (inline_config && *inline_config)
+    {
+        size_t length = strcspn(inline_config, ";");
+        snprintf(line, sizeof(line), "%.*s", (int)length, inline_config);
+        parse_line(line);
+        inline_config += length + (inline_config[length] == ';');
+    }
+}
+
+static void arm_entries(ddbg_context_t *context)
+{
+    ddbg_bcallback_t callbacks[] = {on_count, on_trace, on_stack, on_count};
+    ddbg_breakpoint_t *listing[MAX_PRELOAD_ENTRIES];
+    ddbg_breakpoint_t *probes[MAX_PRELOAD_ENTRIES];
+    int listed = 0, probed = 0;
+    for (int i = 0 ; i < entry_count ; i++)
+    {
+        preload_entry_t *entry = &entries[i];
+        if (dyndebug_find_breakpoint(entry->address, entry->type, entry->size,
+                false))
+        {
+            error_print("dyndbg: %s listed twice\n", entry->target);
+            continue;
+        }
+        dyndebug_list_breakpoint(context, &entry->breakpoint, entry->address,
+            entry->type, entry->size, callbacks[entry->action], entry,
+            entry->is_hw);
+        if (entry->action == PRELOAD_TRACE)
+            dyndebug_set_breakpoint_flags(&entry->breakpoint, DDBG_BP_ASYNC);
+        else if (entry->action == PRELOAD_CRASH)
+            dyndebug_set_breakpoint_flags(&entry->breakpoint, DDBG_BP_SNAPSHOT);
+        if (entry->is_hw)
+            listing[listed++] = &entry->breakpoint;
+        else
+            probes[probed++] = &entry->breakpoint;
+    }
+
+    /* Patched in one stop of the process, a failed one is skipped */
+    for (int done = 0 ; done < probed ; done++)
+    {
+        done += dyndebug_arm_probes(&probes[done], probed - done);
+        if (done == probed)
+            break;
+        preload_entry_t *entry = probes[done]->callback_priv_arg;
+        error_print("dyndbg: probe %s not armed\n", entry->target);
+        dyndebug_remove_breakpoint(probes[done]);
+    }
+
+    /* Four debug registers, one monitor request stops the process once */
+    int armed = dyndebug_arm_breakpoints(listing, listed);
+    for (int i = armed ; i < listed ; i++)
+    {
+        preload_entry_t *entry = listing[i]->callback_priv_arg;
+        error_print("dyndbg: %s not armed, out of debug registers\n",
+            entry->target);
+        dyndebug_remove_breakpoint(listing[i]);
+    }
+}
+
+__attribute__((constructor)) static void preload_start(void)
+{
+    /* Programs started by the application inherit LD_PRELOAD, the ones
+    without any of the symbols run without monitor */
+    parse_config();
+    if (!entry_count)
+        return;
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context || dyndebug_start_monitor() != DDBG_SUCCESS)
+    {
+        error_print("dyndbg: cannot start the monitor\n");
+        return;
+    }
+    preload_pid = getpid();
+
+    bool trace = false, crash = false;
+    for (int i = 0 ; i < entry_count ; i++)
+    {
+        trace |= entries[i].action == PRELOAD_TRACE;
+        crash |= entries[i].action == PRELOAD_CRASH;
+    }
+    if (trace)
+        dyndebug_start_dispatcher(1, 256, 32, 0);
+    if (crash)
+    {
+        dyndebug_set_core_policy(DDBG_CORE_DEFAULT, core_path);
+        reaper_running = !pthread_create(&reaper_thread, NULL, reaper_main,
+            NULL);
+    }
+    arm_entries(context);
+    if (start_control)
+        dyndebug_start_control(NULL);
+    if (start_stats)
+        dyndebug_start_stats();
+}
+
+static void print_stack(FILE *report, const preload_stack_t *stack)
+{
+    fprintf(report, "  %lu", stack->count);
+    for (int i = 0 ; i < stack->depth ; i++)
+    {
+        Dl_info info;
+        if (dladdr((void *)stack->pcs[i], &info) && info.dli_sname)
+            fprintf(report, " %s+0x%lx", info.dli_sname,
+                stack->pcs[i] - (uint64_t)info.dli_saddr);
+        else
+            fprintf(report, " 0x%lx", stack->pcs[i]);
+    }
+    fprintf(report, "\n");
+}
+
+__attribute__((destructor)) static void preload_stop(void)
+{
+    if (!preload_pid || getpid() != preload_pid)
+        return;
+    if (reaper_running)
+    {
+        __atomic_store_n(&reaper_stopping, true, __ATOMIC_RELEASE);
+        pthread_join(reaper_thread, NULL);
+    }
+    dyndebug_stop_dispatcher();
+    if (start_control)
+        dyndebug_stop_control();
+    if (start_stats)
+        dyndebug_stop_stats();
+
+    FILE *report = *report_path ? fopen(report_path, "w") : stderr;
+    if (!report)
+        report = stderr;
+    for (int i = 0 ; i < entry_count ; i++)
+    {
+        preload_entry_t *entry = &entries[i];
+        if (!entry->breakpoint.enabled)
+            continue;
+        fprintf(report, "dyndbg: %s %s %lu hits\n", entry->target,
+            action_names[entry->action],
+            __atomic_load_n(&entry->hits, __ATOMIC_RELAXED));
+        for (int s = 0 ; s < PRELOAD_STACKS ; s++)
+            if (__atomic_load_n(&stacks[s].signature, __ATOMIC_ACQUIRE) &&
+                    stacks[s].entry == entry)
+                print_stack(report, &stacks[s]);
+    }
+    if (stacks_dropped)
+        fprintf(report, "dyndbg: %lu stacks dropped\n", stacks_dropped);
+    if (report != stderr)
+        fclose(report);
+}
@@ -0,0 +1,579 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_probe.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_stats.h>
+#include <private/dyndbg_timeline.h>
+#include <private/dyndbg_dispatch.h>
+#include <private/dyndbg_decode.h>
+#include <private/dyndbg_symbols.h>
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <cpuid.h>
+
+static ddbg_probe_page_t pages[MAX_PROBE_PAGES];
+static int page_count;
+/* Backs the trampoline pages, mapped executable and writable apart */
+static int probe_memfd = -1;
+static int memfd_pages;
+static uint8_t *exit_trampoline;
+static uint32_t state_size;             /* xsave area, rounded to 64 bytes */
+static bool state_xsave;                /* fxsave otherwise */
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread ddbg_probe_return_t returns[MAX_PROBE_RETURNS];
+static __thread int return_depth;
+
+/* Called by the trampolines, slot holds the probed function return address */
+void dyndebug_probe_enter(ddbg_breakpoint_t *b, uint64_t *slot)
+{
+    dyndebug_stats_hit(b);
+    if (!(b->flags & DDBG_BP_ASYNC) || !dyndebug_dispatch_hit(b, NULL))
+    {
+        uint64_t begin = dyndebug_timeline_begin();
+        b->callback(b);
+        if (begin)
+            dyndebug_timeline_record(DDBG_TIMELINE_CALLBACK, 0,
+                (uint64_t)b->address, begin);
+    }
+    if (!b->exit_callback || return_depth == MAX_PROBE_RETURNS)
+        return;
+    ddbg_probe_return_t *r = &returns[return_depth++];
+    r->slot = (uint64_t)slot;
+    r->address = *slot;
+    r->breakpoint = b;
+    r->callback = b->exit_callback;
+    __atomic_add_fetch(&b->probe_returns, 1, __ATOMIC_ACQ_REL);
+    *slot = (uint64_t)exit_trampoline;
+}
+
+/* The record is done with b, its probe may be removed */
+static void release_return(ddbg_probe_return_t *r)
+{
+    if (r->breakpoint)
+        __atomic_sub_fetch(&r->breakpoint->probe_returns, 1, __ATOMIC_RELEASE);
+}
+
+/* Called by the exit trampoline with the stack pointer after the return,
+gives the original return address back */
+uint64_t dyndebug_probe_leave(uint64_t sp)
+{
+    /* Frames left by longjmp never came back, they are deeper */
+    while (return_depth && returns[return_depth - 1].slot < sp - 8)
+        release_return(&returns[--return_depth]);
+    if (!return_depth || returns[return_depth - 1].slot != sp - 8)
+    {
+        error_print("Probe return address lost for stack %p\n", (void *)sp);
+        abort();
+    }
+    ddbg_probe_return_t *r = &returns[--return_depth];
+    if (r->breakpoint)
+        r->callback(r->breakpoint);
+    release_return(r);
+    return r->address;
+}
+
+void dyndebug_probe_wait_returns(ddbg_breakpoint_t *b)
+{
+    /* Ours would never come back while waiting */
+    for (int i = 0 ; i < return_depth ; i++)
+    {
+        if (returns[i].breakpoint != b)
+            continue;
+        release_return(&returns[i]);
+        returns[i].breakpoint = NULL;
+    }
+    while (__atomic_load_n(&b->probe_returns, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+/* Length of the instruction at code, 0 when it cannot run elsewhere: RIP
+relative operand, branch or anything the prologues do not use */
+static int instruction_length(const uint8_t *code)
+{
+    const uint8_t *p = code;
+    bool wide = false, narrow = false;
+    int immediate = 0;
+    bool modrm = false;
+
+    for ( ; *p == 0x66 || *p == 0xf2 || *p == 0xf3 ; p++)
+        narrow |= *p == 0x66;
+    if ((*p & 0xf0) == 0x40)
+        wide = *p++ & 0x08;
+
+    uint8_t opcode = *p++;
+    switch (opcode)
+    {
+        case 0x50 ... 0x5f: /* push, pop */
+        case 0x90:
+            break;
+        case 0x01: case 0x03: case 0x09: case 0x0b: case 0x21: case 0x23:
+        case 0x29: case 0x2b: case 0x31: case 0x33: case 0x39: case 0x3b:
+        case 0x85: case 0x88: case 0x89: case 0x8a: case 0x8b: case 0x8d:
+            modrm = true;
+            break;
+        case 0x83: case 0xc6:
+            modrm = true;
+            immediate = 1;
+            break;
+        case 0x81: case 0xc7:
+            modrm = true;
+            immediate = narrow ? 2 : 4;
+            break;
+        case 0xb8 ... 0xbf:
+            immediate = wide ? 8 : (narrow ? 2 : 4);
+            break;
+        case 0x0f:
+            /* endbr64 and the multi-byte nops */
+            opcode = *p++;
+            if (opcode != 0x1e && opcode != 0x1f)
+                return 0;
+            modrm = true;
+            break;
+        default:
+            return 0;
+    }
+
+    if (modrm)
+    {
+        uint8_t m = *p++;
+        int mod = m >> 6, rm = m & 7;
+        if (mod != 3 && rm == 4)
+        {
+            uint8_t sib = *p++;
+            if (mod == 0 && (sib & 7) == 5)
+                p += 4;
+        }
+        else if (mod == 0 && rm == 5)
+            return 0;
+        if (mod == 1)
+            p += 1;
+        else if (mod == 2)
+            p += 4;
+    }
+    return p - code + immediate;
+}
+
+static bool in_jump_range(uint8_t *site, uint8_t *base)
+{
+    int64_t distance = (int64_t)(base - (site + PROBE_JUMP_SIZE));
+    return distance > -(int64_t)PROBE_JUMP_RANGE + PROBE_PAGE_SIZE &&
+        distance < (int64_t)PROBE_JUMP_RANGE - PROBE_PAGE_SIZE;
+}
+
+/* Called with probe_lock held, the writable view is not inherited */
+static uint8_t *map_writable(off_t offset)
+{
+    uint8_t *writable = mmap(NULL, PROBE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, probe_memfd, offset);
+    if (writable == MAP_FAILED)
+        return NULL;
+    madvise(writable, PROBE_PAGE_SIZE, MADV_DONTFORK);
+    return writable;
+}
+
+/* Called with probe_lock held, trampolines are reached by jmp rel32. Returns
+the executable slot, *writable the same bytes mapped for writing */
+static uint8_t *allocate_slot(uint8_t *site, uint8_t **writable)
+{
+    for (int i = 0 ; i < page_count ; i++)
+    {
+        ddbg_probe_page_t *page = &pages[i];
+        if (page->used + PROBE_SLOT_SIZE <= PROBE_PAGE_SIZE &&
+                in_jump_range(site, page->base))
+        {
+            page->used += PROBE_SLOT_SIZE;
+            *writable = page->writable + page->used - PROBE_SLOT_SIZE;
+            return page->base + page->used - PROBE_SLOT_SIZE;
+        }
+    }
+    if (page_count == MAX_PROBE_PAGES)
+        return NULL;
+    if (probe_memfd < 0)
+    {
+        probe_memfd = memfd_create("dyndbg-probes", MFD_CLOEXEC);
+        if (probe_memfd < 0)
+            return NULL;
+        memfd_pages = 0;
+        if (ftruncate(probe_memfd, MAX_PROBE_PAGES * PROBE_PAGE_SIZE))
+        {
+            close(probe_memfd);
+            probe_memfd = -1;
+            return NULL;
+        }
+    }
+    off_t offset = (off_t)memfd_pages * PROBE_PAGE_SIZE;
+
+    /* The hints are taken when free, the placement is checked anyway */
+    for (uint64_t delta = PROBE_SEARCH_STEP ; delta < PROBE_JUMP_RANGE ;
+            delta += PROBE_SEARCH_STEP)
+    {
+        for (int up = 0 ; up < 2 ; up++)
+        {
+            if (!up && (uint64_t)site < delta + PROBE_SEARCH_STEP)
+                continue;
+            uint64_t hint = ((uint64_t)site + (up ? delta : -delta)) &
+                ~(uint64_t)(PROBE_PAGE_SIZE - 1);
+            uint8_t *base = mmap((void *)hint, PROBE_PAGE_SIZE,
+                PROT_READ | PROT_EXEC, MAP_SHARED, probe_memfd, offset);
+            if (base == MAP_FAILED)
+                continue;
+            if (!in_jump_range(site, base))
+            {
+                munmap(base, PROBE_PAGE_SIZE);
+                continue;
+            }
+            uint8_t *page = map_writable(offset);
+            if (!page)
+            {
+                munmap(base, PROBE_PAGE_SIZE);
+                return NULL;
+            }
+            memfd_pages++;
+            pages[page_count].base = base;
+            pages[page_count].writable = page;
+            pages[page_count++].used = PROBE_SLOT_SIZE;
+            *writable = page;
+            return base;
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *emit(uint8_t *p, const void *bytes, size_t length)
+{
+    memcpy(p, bytes, length);
+    return p + length;
+}
+
+static uint8_t *emit_u64(uint8_t *p, uint64_t value)
+{
+    return emit(p, &value, sizeof(value));
+}
+
+/* Called with probe_lock held, xsave when the kernel enabled it (the x87,
+SSE, AVX and AVX-512 registers), fxsave otherwise */
+static void probe_state_size(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    state_xsave = __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+        (ecx & bit_OSXSAVE);
+    state_size = 512;
+    if (state_xsave)
+    {
+        __cpuid_count(0xd, 0, eax, ebx, ecx, edx);
+        state_size = (ebx + 63) & ~63U;
+    }
+}
+
+/* rbp, pushed before, keeps the stack pointer while the whole vector and
+x87 state is saved to a 64 bytes aligned area below. Uses rax, rcx, rdx and
+rdi */
+static uint8_t *emit_state_save(uint8_t *p)
+{
+    static const uint8_t frame[] = {
+        0x48, 0x89, 0xe5,                           /* mov rbp, rsp */
+        0x48, 0x81, 0xec};                          /* sub rsp, imm32 */
+    static const uint8_t align[] = {
+        0x48, 0x83, 0xe4, 0xc0};                    /* and rsp, -64 */
+    static const uint8_t header[] = {
+        0x31, 0xc0,                                 /* xor eax, eax */
+        0x48, 0x8d, 0xbc, 0x24, 0x00, 0x02, 0x00, 0x00, /* lea rdi, [rsp+512] */
+        0xb9, 0x08, 0x00, 0x00, 0x00,               /* mov ecx, 8 */
+        0xf3, 0x48, 0xab,                           /* rep stosq */
+        0x83, 0xc8, 0xff, 0x83, 0xca, 0xff,         /* or eax, -1, or edx, -1 */
+        0x48, 0x0f, 0xae, 0x24, 0x24};              /* xsave64 [rsp] */
+    static const uint8_t fxsave[] = {0x48, 0x0f, 0xae, 0x04, 0x24};
+
+    p = emit(p, frame, sizeof(frame));
+    p = emit(p, &state_size, sizeof(state_size));
+    p = emit(p, align, sizeof(align));
+    /* xrstor faults on a header left with garbage */
+    return state_xsave ? emit(p, header, sizeof(header)) :
+        emit(p, fxsave, sizeof(fxsave));
+}
+
+/* The load back then rsp from rbp, uses rax and rdx */
+static uint8_t *emit_state_restore(uint8_t *p)
+{
+    static const uint8_t xrstor[] = {
+        0x83, 0xc8, 0xff, 0x83, 0xca, 0xff,         /* or eax, -1, or edx, -1 */
+        0x48, 0x0f, 0xae, 0x2c, 0x24};              /* xrstor64 [rsp] */
+    static const uint8_t fxrstor[] = {0x48, 0x0f, 0xae, 0x0c, 0x24};
+    static const uint8_t frame[] = {0x48, 0x89, 0xec}; /* mov rsp, rbp */
+
+    p = state_xsave ? emit(p, xrstor, sizeof(xrstor)) :
+        emit(p, fxrstor, sizeof(fxrstor));
+    return emit(p, frame, sizeof(frame));
+}
+
+/* Called with probe_lock held, return values (rax, rdx, the vector registers
+and st0/st1) are preserved around the exit callback, written once then made
+executable */
+static bool build_exit_trampoline(void)
+{
+    static const uint8_t prologue[] = {
+        0x50, 0x52, 0x55};                          /* push rax, rdx, rbp */
+    static const uint8_t call[] = {
+        0xdb, 0xe3,                                 /* fninit, empty x87 stack */
+        0x48, 0x8d, 0x7d, 0x18,                     /* lea rdi, [rbp+24] */
+        0x48, 0xb8};                                /* mov rax, imm64 */
+    static const uint8_t epilogue[] = {
+        0xff, 0xd0,                                 /* call rax */
+        0x49, 0x89, 0xc3};                          /* mov r11, rax */
+    static const uint8_t jump[] = {
+        0x5d, 0x5a, 0x58,                           /* pop rbp, rdx, rax */
+        0x41, 0xff, 0xe3};                          /* jmp r11 */
+
+    uint8_t *code = mmap(NULL, PROBE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return false;
+    uint8_t *p = emit(code, prologue, sizeof(prologue));
+    p = emit_state_save(p);
+    p = emit(p, call, sizeof(call));
+    p = emit_u64(p, (uint64_t)dyndebug_probe_leave);
+    p = emit(p, epilogue, sizeof(epilogue));
+    p = emit_state_restore(p);
+    emit(p, jump, sizeof(jump));
+    if (mprotect(code, PROBE_PAGE_SIZE, PROT_READ | PROT_EXEC))
+    {
+        munmap(code, PROBE_PAGE_SIZE);
+        return false;
+    }
+    exit_trampoline = code;
+    return true;
+}
+
+/* A direct branch of the function into the bytes replaced by the jump, past
+the first one, would land in its middle. Indirect ones are not checked */
+static bool branches_into(uint8_t *site, int length)
+{
+    uint64_t start, size;
+    if (!dyndebug_function_bounds(site, &start, &size))
+    {
+        error_print("No function bounds for %p, branches not checked\n", site);
+        return true;
+    }
+    for (uint64_t offset = 0 ; offset < size ; )
+    {
+        ddbg_instruction_t insn;
+        int n = dyndebug_decode_instruction((const uint8_t *)start + offset,
+            &insn);
+        if (!n)
+        {
+            error_print("Cannot decode %p, branches not checked\n",
+                (void *)(start + offset));
+            return true;
+        }
+        offset += n;
+        uint64_t target = start + offset + insn.displacement;
+        if (insn.branch && target > (uint64_t)site &&
+                target < (uint64_t)site + length)
+        {
+            error_print("Branch to %p within the patched bytes\n",
+                (void *)target);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called with probe_lock held. The jump lands with the stack as on entry,
+caller-saved registers are pushed (9 of them, then rbp keeping the stack
+pointer) and the vector state saved below */
+static ddbg_probe_t *build_probe(ddbg_breakpoint_t *b)
+{
+    static const uint8_t endbr64[] = {0xf3, 0x0f, 0x1e, 0xfa};
+    static const uint8_t save[] = {
+        0x50, 0x51, 0x52, 0x56, 0x57,               /* rax, rcx, rdx, rsi, rdi */
+        0x41, 0x50, 0x41, 0x51, 0x41, 0x52, 0x41, 0x53, /* r8 - r11 */
+        0x55};                                      /* rbp */
+    static const uint8_t restore[] = {
+        0x5d,
+        0x41, 0x5b, 0x41, 0x5a, 0x41, 0x59, 0x41, 0x58,
+        0x5f, 0x5e, 0x5a, 0x59, 0x58};
+    static const uint8_t call[] = {
+        0x48, 0x8d, 0x75, 0x50,                     /* lea rsi, [rbp+80] */
+        0x48, 0xb8};                                /* mov rax, imm64 */
+    static const uint8_t call_rax[] = {0xff, 0xd0};
+    static const uint8_t jump_back[] = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+    static const uint8_t load_b[] = {0x48, 0xbf};   /* mov rdi, imm64 */
+
+    uint8_t *site = b->address;
+    if (!memcmp(site, endbr64, sizeof(endbr64)))
+        site += sizeof(endbr64);
+    int length = 0;
+    while (length < PROBE_JUMP_SIZE)
+    {
+        int size = instruction_length(site + length);
+        if (!size || length + size > MAX_PROBE_RELOCATED)
+        {
+            error_print("Cannot relocate the prologue of %p\n", b->address);
+            return NULL;
+        }
+        length += size;
+    }
+    if (branches_into(site, length))
+    {
+        error_print("Cannot patch the prologue of %p\n", b->address);
+        return NULL;
+    }
+
+    if (!state_size)
+        probe_state_size();
+    if (!exit_trampoline && !build_exit_trampoline())
+        return NULL;
+    uint8_t *writable;
+    ddbg_probe_t *probe = (ddbg_probe_t *)allocate_slot(site, &writable);
+    if (!probe)
+    {
+        error_print("No trampoline within reach of %p\n", b->address);
+        return NULL;
+    }
+    ddbg_probe_t *draft = (ddbg_probe_t *)writable;
+    draft->site = site;
+    draft->length = length;
+    memcpy(draft->saved, site, PROBE_JUMP_SIZE);
+
+    uint8_t *p = emit(draft->code, save, sizeof(save));
+    p = emit_state_save(p);
+    p = emit(p, load_b, sizeof(load_b));
+    p = emit_u64(p, (uint64_t)b);
+    p = emit(p, call, sizeof(call));
+    p = emit_u64(p, (uint64_t)dyndebug_probe_enter);
+    p = emit(p, call_rax, sizeof(call_rax));
+    p = emit_state_restore(p);
+    p = emit(p, restore, sizeof(restore));
+    p = emit(p, site, length);
+    p = emit(p, jump_back, sizeof(jump_back));
+    emit_u64(p, (uint64_t)(site + length));
+    return probe;
+}
+
+/* The writable views are gone, the child fills pages of its own */
+void dyndebug_probe_forked(void)
+{
+    pthread_mutex_init(&probe_lock, NULL);
+    /* The calls of the other threads are gone with them */
+    ddbg_context_t *context = dyndebug_get_context();
+    for (ddbg_breakpoint_t *b = context ? context->breakpoints_root : NULL ; b ;
+            b = b->next)
+        b->probe_returns = 0;
+    for (int i = 0 ; i < return_depth ; i++)
+        if (returns[i].breakpoint)
+            returns[i].breakpoint->probe_returns++;
+    for (int i = 0 ; i < page_count ; i++)
+    {
+        pages[i].writable = NULL;
+        pages[i].used = PROBE_PAGE_SIZE;
+    }
+    if (probe_memfd >= 0)
+        close(probe_memfd);
+    probe_memfd = -1;
+}
+
+static void add_patch(ddbg_monitor_request_t *request,
+    const ddbg_probe_t *probe, const uint8_t *bytes)
+{
+    int p = request->patch.count++;
+    request->patch.items[p].address = probe->site;
+    request->patch.items[p].length = PROBE_JUMP_SIZE;
+    request->patch.items[p].span = probe->length;
+    memcpy(request->patch.items[p].bytes, bytes, PROBE_JUMP_SIZE);
+}
+
+static void add_jump(ddbg_monitor_request_t *request, const ddbg_probe_t *probe)
+{
+    uint8_t jump[PROBE_JUMP_SIZE] = {0xe9};
+    int32_t offset = (int32_t)(probe->code - (probe->site + PROBE_JUMP_SIZE));
+    memcpy(&jump[1], &offset, sizeof(offset));
+    add_patch(request, probe, jump);
+}
+
+/* Returns how many patches were written, in order */
+static int patch_code(ddbg_monitor_request_t *request, ddbg_result_t *result)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+    {
+        *result = DDBG_CONTEXT_NOT_FOUND;
+        return 0;
+    }
+
+    ddbg_monitor_response_t response;
+    request->operation = DDBG_PATCH_CODE;
+    dyndebug_send_monitor_request(context, request, &response);
+    *result = response.result;
+    return response.result == DDBG_SUCCESS ? request->patch.count :
+        response.batch.armed;
+}
+
+static ddbg_probe_t *get_probe(ddbg_breakpoint_t *b)
+{
+    pthread_mutex_lock(&probe_lock);
+    if (!b->probe)
+        b->probe = build_probe(b);
+    pthread_mutex_unlock(&probe_lock);
+    return b->probe;
+}
+
+ddbg_result_t dyndebug_probe_patch(ddbg_breakpoint_t *b)
+{
+    ddbg_probe_t *probe = get_probe(b);
+    if (!probe)
+        return DDBG_INVALID_ARGUMENT;
+
+    ddbg_monitor_request_t request;
+    ddbg_result_t result;
+    request.patch.count = 0;
+    add_jump(&request, probe);
+    patch_code(&request, &result);
+    return result;
+}
+
+int dyndebug_probe_patch_batch(ddbg_breakpoint_t **breakpoints, int count)
+{
+    int patched = 0;
+    while (patched < count)
+    {
+        ddbg_monitor_request_t request;
+        ddbg_result_t result = DDBG_SUCCESS;
+        request.patch.count = 0;
+        bool built = true;
+        for (int i = patched ; i < count &&
+                request.patch.count < MAX_PATCH_BATCH ; i++)
+        {
+            ddbg_probe_t *probe = get_probe(breakpoints[i]);
+            if (!probe)
+            {
+                built = false;
+                break;
+            }
+            add_jump(&request, probe);
+        }
+        if (request.patch.count)
+            patched += patch_code(&request, &result);
+        if (!built || result != DDBG_SUCCESS)
+            break;
+    }
+    return patched;
+}
+
+ddbg_result_t dyndebug_probe_unpatch(ddbg_breakpoint_t *b)
+{
+    ddbg_probe_t *probe = b->probe;
+    if (!probe)
+        return DDBG_HWBP_NOT_FOUND;
+
+    ddbg_monitor_request_t request;
+    ddbg_result_t result;
+    request.patch.count = 0;
+    add_patch(&request, probe, probe->saved);
+    patch_code(&request, &result);
+    return result;
+}
@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_profiler.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_unwind.h>
+
+#include <ucontext.h>
+
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <errno.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static ddbg_profile_thread_t *profile_threads[MAX_PROFILED_THREADS];
+static __thread ddbg_profile_thread_t *profile_self;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Retires the slot of a thread exiting while profiled */
+static pthread_key_t profile_key;
+static pthread_once_t profile_key_once = PTHREAD_ONCE_INIT;
+
+/* Only touched by the aggregator thread, or once it is joined */
+static ddbg_profile_stack_t *profile_stacks;
+static uint64_t profile_overflow;
+
+static bool profile_running;
+static bool profile_stopping;
+static uint32_t profile_frequency;
+static char profile_path[256];
+static pthread_t profile_aggregator;
+/* The application one, put back on stop */
+static struct sigaction profile_saved_action;
+
+static void on_profile_tick(int signum __attribute__((unused)),
+    siginfo_t *info __attribute__((unused)), void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+    ddbg_profile_thread_t *self = profile_self;
+    /* The slot may have been recycled for another thread since */
+    if (!self || self->owner != &profile_self)
+        return;
+
+    int saved_errno = errno;
+    uint64_t head = self->head;
+    if (head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) >= PROFILE_RING_SIZE)
+        self->dropped++;
+    else
+    {
+        ddbg_profile_sample_t *sample = &self->samples[head & (PROFILE_RING_SIZE - 1)];
+        sample->depth = dyndebug_unwind(ucontext->uc_mcontext.gregs, sample->pcs,
+            MAX_PROFILE_DEPTH);
+        __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+    }
+    errno = saved_errno;
+}
+
+static void aggregate_sample(const ddbg_profile_sample_t *sample)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0 ; i < sample->depth ; i++)
+        hash = (hash ^ sample->pcs[i]) * 0x100000001b3ULL;
+    if (!hash)
+        hash = 1;
+
+    uint32_t slot = hash & (MAX_PROFILE_STACKS - 1);
+    for (int probe = 0 ; probe < MAX_PROFILE_STACKS ; probe++)
+    {
+        ddbg_profile_stack_t *stack = &profile_stacks[slot];
+        if (!stack->hash)
+        {
+            stack->hash = hash;
+            stack->sample = *sample;
+        }
+        if (stack->hash == hash && stack->sample.depth == sample->depth &&
+                !memcmp(stack->sample.pcs, sample->pcs,
+                    sample->depth * sizeof(uint64_t)))
+        {
+            stack->count++;
+            return;
+        }
+        slot = (slot + 1) & (MAX_PROFILE_STACKS - 1);
+    }
+    profile_overflow++;
+}
+
+static void drain_thread(ddbg_profile_thread_t *thread)
+{
+    uint64_t tail = thread->tail;
+    uint64_t head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+    for ( ; tail != head ; tail++)
+        aggregate_sample(&thread->samples[tail & (PROFILE_RING_SIZE - 1)]);
+    __atomic_store_n(&thread->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_all(void)
+{
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0 ; i < MAX_PROFILED_THREADS ; i++)
+    {
+        ddbg_profile_thread_t *thread = profile_threads[i];
+        if (!thread || thread->state == DDBG_PROFILE_SLOT_FREE)
+            continue;
+        drain_thread(thread);
+        if (thread->state == DDBG_PROFILE_SLOT_RETIRED)
+        {
+            thread->owner = NULL;
+            thread->state = DDBG_PROFILE_SLOT_FREE;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void *aggregator_main(void *arg __attribute__((unused)))
+{
+    struct timespec period = {
+        .tv_sec = 0, .tv_nsec = PROFILE_DRAIN_PERIOD_MS * 1000000L};
+    while (!__atomic_load_n(&profile_stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&period, NULL);
+        drain_all();
+    }
+    return NULL;
+}
+
+static void print_frame(FILE *out, uint64_t pc)
+{
+    Dl_info info;
+    if (dladdr((void *)pc, &info) && info.dli_sname)
+        fprintf(out, "%s", info.dli_sname);
+    else if (info.dli_fname)
+    {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(out, "%s+0x%lx", name ? name + 1 : info.dli_fname,
+            pc - (uint64_t)info.dli_fbase);
+    }
+    else
+        fprintf(out, "0x%lx", pc);
+}
+
+/* One "root;...;leaf count" line per distinct stack */
+static ddbg_result_t write_folded(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+    {
+        error_print("Cannot create the profile %s -- %s\n", path,
+            strerror(errno));
+        return DDBG_SYSTEM_ERROR;
+    }
+    for (int i = 0 ; i < MAX_PROFILE_STACKS ; i++)
+    {
+        ddbg_profile_stack_t *stack = &profile_stacks[i];
+        if (!stack->count)
+            continue;
+        for (int depth = stack->sample.depth - 1 ; depth >= 0 ; depth--)
+        {
+            /* Return addresses point after the call */
+            print_frame(out, stack->sample.pcs[depth] - (depth ? 1 : 0));
+            fputc(depth ? ';' : ' ', out);
+        }
+        fprintf(out, "%lu\n", stack->count);
+    }
+    if (profile_overflow)
+        fprintf(out, "[overflow] %lu\n", profile_overflow);
+    fclose(out);
+    return DDBG_SUCCESS;
+}
+
+static void retire_thread(ddbg_profile_thread_t *thread)
+{
+    timer_delete(thread->timer);
+    thread->state = DDBG_PROFILE_SLOT_RETIRED;
+}
+
+static void on_thread_exit(void *value)
+{
+    ddbg_profile_thread_t *thread = value;
+    pthread_mutex_lock(&profile_lock);
+    /* Unless the profiler was stopped, and maybe the slot recycled, since */
+    if (thread->owner == &profile_self &&
+            thread->state == DDBG_PROFILE_SLOT_ACTIVE)
+        retire_thread(thread);
+    profile_self = NULL;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void create_profile_key(void)
+{
+    pthread_key_create(&profile_key, on_thread_exit);
+}
+
+static bool is_profiled(void)
+{
+    return profile_self && profile_self->owner == &profile_self &&
+        profile_self->state == DDBG_PROFILE_SLOT_ACTIVE;
+}
+
+ddbg_result_t dyndebug_profile_thread(void)
+{
+    if (is_profiled())
+        return DDBG_BP_ALREADY_EXISTS;
+    dyndebug_unwind_register_thread();
+    pthread_once(&profile_key_once, create_profile_key);
+
+    pthread_mutex_lock(&profile_lock);
+    if (!profile_running)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_CONTEXT_NOT_FOUND;
+    }
+    int i;
+    for (i = 0 ; i < MAX_PROFILED_THREADS ; i++)
+        if (!profile_threads[i] ||
+                profile_threads[i]->state == DDBG_PROFILE_SLOT_FREE)
+            break;
+    if (i == MAX_PROFILED_THREADS)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    if (!profile_threads[i])
+        profile_threads[i] = calloc(1, sizeof(ddbg_profile_thread_t));
+    ddbg_profile_thread_t *thread = profile_threads[i];
+    if (!thread)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    thread->head = thread->tail = thread->dropped = 0;
+    thread->tid = syscall(SYS_gettid);
+
+    struct sigevent event = {0};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = thread->tid;
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread->timer))
+    {
+        error_print("Cannot create the profiling timer -- %s\n",
+            strerror(errno));
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    thread->owner = &profile_self;
+    thread->state = DDBG_PROFILE_SLOT_ACTIVE;
+    profile_self = thread;
+    pthread_setspecific(profile_key, thread);
+
+    long period_ns = 1000000000L / profile_frequency;
+    struct timespec period = {
+        .tv_sec = period_ns / 1000000000L, .tv_nsec = period_ns % 1000000000L};
+    struct itimerspec spec = {.it_interval = period, .it_value = period};
+    timer_settime(thread->timer, 0, &spec, NULL);
+    pthread_mutex_unlock(&profile_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_unprofile_thread(void)
+{
+    pthread_mutex_lock(&profile_lock);
+    if (!is_profiled())
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    /* A tick still pending lands on a NULL profile_self */
+    ddbg_profile_thread_t *thread = profile_self;
+    profile_self = NULL;
+    pthread_setspecific(profile_key, NULL);
+    retire_thread(thread);
+    pthread_mutex_unlock(&profile_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_start_profiler(uint32_t frequency, const char *path)
+{
+    if (!frequency || frequency > MAX_PROFILE_FREQUENCY ||
+            (path && strlen(path) >= sizeof(profile_path)))
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&profile_lock);
+    if (profile_running)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    profile_stacks = calloc(MAX_PROFILE_STACKS, sizeof(ddbg_profile_stack_t));
+    if (!profile_stacks)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    profile_overflow = 0;
+    strcpy(profile_path, path ? path : DEFAULT_PROFILE_PATH);
+    profile_frequency = frequency;
+
+    struct sigaction sa = {0};
+    sa.sa_sigaction = on_profile_tick;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    if (sigaction(SIGPROF, &sa, &profile_saved_action))
+    {
+        error_print("Cannot install the profiling handler -- %s\n",
+            strerror(errno));
+        free(profile_stacks);
+        profile_stacks = NULL;
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+
+    __atomic_store_n(&profile_stopping, false, __ATOMIC_RELEASE);
+    if (pthread_create(&profile_aggregator, NULL, aggregator_main, NULL))
+    {
+        error_print("Cannot start the profile aggregator\n");
+        sigaction(SIGPROF, &profile_saved_action, NULL);
+        free(profile_stacks);
+        profile_stacks = NULL;
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_START_FAILURE;
+    }
+    profile_running = true;
+    pthread_mutex_unlock(&profile_lock);
+
+    return dyndebug_profile_thread();
+}
+
+void dyndebug_profiler_fork_prepare(void)
+{
+    pthread_mutex_lock(&profile_lock);
+}
+
+void dyndebug_profiler_fork_parent(void)
+{
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/* Neither the aggregator nor the parent threads, the samples are dropped */
+void dyndebug_profiler_forked(void)
+{
+    pthread_mutex_init(&profile_lock, NULL);
+    profile_self = NULL;
+    if (!profile_running)
+        return;
+    profile_running = false;
+    for (int i = 0 ; i < MAX_PROFILED_THREADS ; i++)
+        if (profile_threads[i])
+        {
+            profile_threads[i]->owner = NULL;
+            profile_threads[i]->state = DDBG_PROFILE_SLOT_FREE;
+        }
+    free(profile_stacks);
+    profile_stacks = NULL;
+}
+
+ddbg_result_t dyndebug_stop_profiler(void)
+{
+    pthread_mutex_lock(&profile_lock);
+    if (!profile_running)
+    {
+        pthread_mutex_unlock(&profile_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    profile_running = false;
+    for (int i = 0 ; i < MAX_PROFILED_THREADS ; i++)
+    {
+        ddbg_profile_thread_t *thread = profile_threads[i];
+        if (thread && thread->state == DDBG_PROFILE_SLOT_ACTIVE)
+            retire_thread(thread);
+    }
+    pthread_mutex_unlock(&profile_lock);
+    profile_self = NULL;
+
+    __atomic_store_n(&profile_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(profile_aggregator, NULL);
+    drain_all();
+    /* The timers are deleted, no tick is left for our handler */
+    sigaction(SIGPROF, &profile_saved_action, NULL);
+
+    ddbg_result_t result = write_folded(profile_path);
+    free(profile_stacks);
+    profile_stacks = NULL;
+    return result;
+}
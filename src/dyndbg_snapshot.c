@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_snapshot.h>
+#include <private/dyndbg_coredump.h>
+#include <private/dyndbg_monitor.h>
+
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+static ddbg_snapshot_slot_t snapshots[MAX_SNAPSHOTS];
+static uint32_t snapshot_live;
+static uint32_t snapshot_max = DEFAULT_MAX_SNAPSHOTS;
+static uint64_t snapshot_max_kb;
+static uint64_t snapshot_skipped;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void dyndebug_snapshot_take(ddbg_breakpoint_t *b, void *ucontext)
+{
+    if (__atomic_add_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL) >
+            __atomic_load_n(&snapshot_max, __ATOMIC_RELAXED))
+    {
+        __atomic_sub_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&snapshot_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ddbg_snapshot_slot_t *slot = NULL;
+    for (int i = 0 ; i < MAX_SNAPSHOTS && !slot ; i++)
+    {
+        uint32_t expected = DDBG_SNAPSHOT_FREE;
+        if (__atomic_compare_exchange_n(&snapshots[i].state, &expected,
+                DDBG_SNAPSHOT_CREATING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            slot = &snapshots[i];
+    }
+    if (!slot)
+    {
+        __atomic_sub_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&snapshot_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* The raw system call skips the atfork handlers, the copy runs nothing */
+    pid_t parent = syscall(SYS_getpid);
+    pid_t pid = syscall(SYS_fork);
+    if (!pid)
+    {
+        /* Killed with the thread which took it, the monitor pipes are only
+        held by the process, their end tells the monitor it exited */
+        syscall(SYS_prctl, PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+        if (syscall(SYS_getppid) != parent)
+            syscall(SYS_exit_group, 0);
+        ddbg_context_t *context = dyndebug_peek_context();
+        if (context)
+        {
+            syscall(SYS_close, context->monitor_pipe[1]);
+            syscall(SYS_close, context->monitored_pipe[0]);
+            syscall(SYS_close, context->session_socket[1]);
+        }
+        syscall(SYS_kill, syscall(SYS_getpid), SIGSTOP);
+        /* Continued by a debugger detaching, the copy is done */
+        syscall(SYS_exit_group, 0);
+    }
+    if (pid < 0)
+    {
+        __atomic_store_n(&slot->state, DDBG_SNAPSHOT_FREE, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&snapshot_skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slot->snapshot.pid = pid;
+    slot->snapshot.address = b->address;
+    slot->snapshot.taken_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    slot->snapshot.private_kb = 0;
+    slot->ucontext = ucontext;
+    __atomic_store_n(&slot->state, DDBG_SNAPSHOT_LIVE, __ATOMIC_RELEASE);
+}
+
+ddbg_result_t dyndebug_set_snapshot_limits(uint32_t max_live, uint64_t max_kb)
+{
+    if (!max_live || max_live > MAX_SNAPSHOTS)
+        return DDBG_INVALID_ARGUMENT;
+    __atomic_store_n(&snapshot_max, max_live, __ATOMIC_RELAXED);
+    __atomic_store_n(&snapshot_max_kb, max_kb, __ATOMIC_RELAXED);
+    return DDBG_SUCCESS;
+}
+
+static ddbg_snapshot_slot_t *find_snapshot(pid_t pid)
+{
+    for (int i = 0 ; i < MAX_SNAPSHOTS ; i++)
+        if (__atomic_load_n(&snapshots[i].state, __ATOMIC_ACQUIRE) ==
+                DDBG_SNAPSHOT_LIVE && snapshots[i].snapshot.pid == pid)
+            return &snapshots[i];
+    return NULL;
+}
+
+static void release_slot(ddbg_snapshot_slot_t *slot)
+{
+    kill(slot->snapshot.pid, SIGKILL);
+    while (waitpid(slot->snapshot.pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+    __atomic_store_n(&slot->state, DDBG_SNAPSHOT_FREE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL);
+}
+
+ddbg_result_t dyndebug_release_snapshot(pid_t pid)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    ddbg_snapshot_slot_t *slot = find_snapshot(pid);
+    if (!slot)
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    release_slot(slot);
+    pthread_mutex_unlock(&snapshot_lock);
+    return DDBG_SUCCESS;
+}
+
+/* The pages a snapshot does not share with us anymore are what it costs */
+static uint64_t snapshot_private_kb(pid_t pid)
+{
+    char path[64], buffer[4096];
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t len = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (len <= 0)
+        return 0;
+    buffer[len] = 0;
+
+    uint64_t kb = 0;
+    const char *keys[] = {"Private_Clean:", "Private_Dirty:"};
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        const char *line = strstr(buffer, keys[i]);
+        if (line)
+            kb += strtoull(line + strlen(keys[i]), NULL, 10);
+    }
+    return kb;
+}
+
+int dyndebug_account_snapshots(ddbg_snapshot_t *exported, int max)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    uint64_t total = 0;
+    for (int i = 0 ; i < MAX_SNAPSHOTS ; i++)
+    {
+        ddbg_snapshot_slot_t *slot = &snapshots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != DDBG_SNAPSHOT_LIVE)
+            continue;
+        /* Gone with the thread which took it, or killed from outside */
+        if (waitpid(slot->snapshot.pid, NULL, WNOHANG) == slot->snapshot.pid)
+        {
+            __atomic_store_n(&slot->state, DDBG_SNAPSHOT_FREE, __ATOMIC_RELEASE);
+            __atomic_sub_fetch(&snapshot_live, 1, __ATOMIC_ACQ_REL);
+            continue;
+        }
+        slot->snapshot.private_kb = snapshot_private_kb(slot->snapshot.pid);
+        total += slot->snapshot.private_kb;
+    }
+
+    /* Over budget, the oldest ones go first */
+    uint64_t budget = __atomic_load_n(&snapshot_max_kb, __ATOMIC_RELAXED);
+    while (budget && total > budget)
+    {
+        ddbg_snapshot_slot_t *oldest = NULL;
+        for (int i = 0 ; i < MAX_SNAPSHOTS ; i++)
+        {
+            ddbg_snapshot_slot_t *slot = &snapshots[i];
+            if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) ==
+                    DDBG_SNAPSHOT_LIVE && (!oldest ||
+                    slot->snapshot.taken_ns < oldest->snapshot.taken_ns))
+                oldest = slot;
+        }
+        if (!oldest)
+            break;
+        total -= oldest->snapshot.private_kb;
+        release_slot(oldest);
+    }
+
+    int count = 0;
+    for (int i = 0 ; i < MAX_SNAPSHOTS && count < max ; i++)
+        if (__atomic_load_n(&snapshots[i].state, __ATOMIC_ACQUIRE) ==
+                DDBG_SNAPSHOT_LIVE)
+            exported[count++] = snapshots[i].snapshot;
+    pthread_mutex_unlock(&snapshot_lock);
+    return count;
+}
+
+ddbg_result_t dyndebug_dump_snapshot(pid_t pid)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&snapshot_lock);
+    ddbg_snapshot_slot_t *slot = find_snapshot(pid);
+    if (!slot)
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    ddbg_monitor_request_t request;
+    ddbg_monitor_response_t response;
+    memset(&request, 0, sizeof(request));
+    request.operation = DDBG_SNAPSHOT_CORE;
+    request.crash.tid = pid;
+    request.crash.signum = SIGTRAP;
+    request.crash.ucontext = slot->ucontext;
+    request.crash.core_config = dyndebug_core_config();
+    dyndebug_send_monitor_request(context, &request, &response);
+    pthread_mutex_unlock(&snapshot_lock);
+    return response.result;
+}
+
+void dyndebug_snapshot_fork_prepare(void)
+{
+    pthread_mutex_lock(&snapshot_lock);
+}
+
+void dyndebug_snapshot_fork_parent(void)
+{
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+/* Not ours to release at exit, nor a budget to account */
+void dyndebug_snapshot_forked(void)
+{
+    pthread_mutex_init(&snapshot_lock, NULL);
+    for (int i = 0 ; i < MAX_SNAPSHOTS ; i++)
+        snapshots[i].state = DDBG_SNAPSHOT_FREE;
+    snapshot_live = 0;
+}
+
+/* Not left stopped nor as zombies when the process exits normally */
+__attribute__((destructor)) static void release_snapshots(void)
+{
+    pthread_mutex_lock(&snapshot_lock);
+    for (int i = 0 ; i < MAX_SNAPSHOTS ; i++)
+        if (__atomic_load_n(&snapshots[i].state, __ATOMIC_ACQUIRE) ==
+                DDBG_SNAPSHOT_LIVE)
+            release_slot(&snapshots[i]);
+    pthread_mutex_unlock(&snapshot_lock);
+}
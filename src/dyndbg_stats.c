@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_stats.h>
+#include <private/dyndbg_monitor.h>
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+ddbg_stats_page_t *dyndebug_stats_page;
+int dyndebug_stats_writers;
+/* Writers are serialized, readers are not known */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static char stats_path[64];
+
+static void write_begin(ddbg_stats_page_t *page)
+{
+    __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(ddbg_stats_page_t *page)
+{
+    __atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static uint8_t breakpoint_state(const ddbg_breakpoint_t *b)
+{
+    return (b->enabled ? DDBG_STATS_ENABLED : 0) |
+        (__atomic_load_n(&b->demoted, __ATOMIC_RELAXED) ? DDBG_STATS_DEMOTED : 0);
+}
+
+/* Called with stats_lock held and the sequence odd */
+static void fill_entry(ddbg_stats_breakpoint_t *stats, const ddbg_breakpoint_t *b)
+{
+    __atomic_store_n(&stats->flags, b->flags, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->type, b->type, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->size, b->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->is_hw, b->is_hw, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->state, breakpoint_state(b), __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->address, (uint64_t)b->address, __ATOMIC_RELAXED);
+}
+
+/* Called with stats_lock held */
+static void add_entry(ddbg_stats_page_t *page, ddbg_breakpoint_t *b)
+{
+    uint32_t entry = 0;
+    while (entry < DDBG_STATS_BREAKPOINTS && page->breakpoints[entry].address)
+        entry++;
+    if (entry == DDBG_STATS_BREAKPOINTS)
+    {
+        __atomic_fetch_add(&page->untracked, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    write_begin(page);
+    ddbg_stats_breakpoint_t *stats = &page->breakpoints[entry];
+    __atomic_store_n(&stats->hits, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->last_hit_ns, 0, __ATOMIC_RELAXED);
+    fill_entry(stats, b);
+    if (entry >= page->count)
+        __atomic_store_n(&page->count, entry + 1, __ATOMIC_RELAXED);
+    write_end(page);
+    __atomic_store_n(&b->stats_entry, entry + 1, __ATOMIC_RELAXED);
+}
+
+void dyndebug_stats_add(ddbg_breakpoint_t *b)
+{
+    b->stats_entry = 0;
+    pthread_mutex_lock(&stats_lock);
+    if (dyndebug_stats_page)
+        add_entry(dyndebug_stats_page, b);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void dyndebug_stats_remove(ddbg_breakpoint_t *b)
+{
+    pthread_mutex_lock(&stats_lock);
+    ddbg_stats_page_t *page = dyndebug_stats_page;
+    uint32_t entry = b->stats_entry;
+    if (page && entry)
+    {
+        __atomic_store_n(&b->stats_entry, 0, __ATOMIC_RELAXED);
+        write_begin(page);
+        __atomic_store_n(&page->breakpoints[entry - 1].address, 0,
+            __ATOMIC_RELAXED);
+        uint32_t count = page->count;
+        while (count && !page->breakpoints[count - 1].address)
+            count--;
+        __atomic_store_n(&page->count, count, __ATOMIC_RELAXED);
+        write_end(page);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void dyndebug_stats_update(ddbg_breakpoint_t *b)
+{
+    pthread_mutex_lock(&stats_lock);
+    ddbg_stats_page_t *page = dyndebug_stats_page;
+    if (page && b->stats_entry)
+    {
+        write_begin(page);
+        fill_entry(&page->breakpoints[b->stats_entry - 1], b);
+        write_end(page);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void dyndebug_stats_state(ddbg_breakpoint_t *b)
+{
+    uint32_t entry = __atomic_load_n(&b->stats_entry, __ATOMIC_RELAXED);
+    ddbg_stats_page_t *page = entry ? dyndebug_stats_acquire() : NULL;
+    if (!page)
+        return;
+    __atomic_store_n(&page->breakpoints[entry - 1].state,
+        breakpoint_state(b), __ATOMIC_RELAXED);
+    dyndebug_stats_release();
+}
+
+void dyndebug_stats_slots(const uint8_t *slots)
+{
+    ddbg_stats_page_t *page = dyndebug_stats_acquire();
+    if (!page)
+        return;
+    __atomic_fetch_add(&page->requests, 1, __ATOMIC_RELAXED);
+    for (int slot = 0 ; slot < DDBG_STATS_SLOTS ; slot++)
+        __atomic_store_n(&page->slots[slot], slots[slot], __ATOMIC_RELAXED);
+    dyndebug_stats_release();
+}
+
+/* The file stays the parent's, the copy of its mapping is not written by any
+thread of ours */
+void dyndebug_stats_forked(void)
+{
+    ddbg_context_t *context = dyndebug_peek_context();
+    pthread_mutex_init(&stats_lock, NULL);
+    if (dyndebug_stats_page)
+        munmap(dyndebug_stats_page, sizeof(ddbg_stats_page_t));
+    __atomic_store_n(&dyndebug_stats_writers, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&dyndebug_stats_page, NULL, __ATOMIC_RELEASE);
+    for (ddbg_breakpoint_t *b = context->breakpoints_root ; b ; b = b->next)
+        __atomic_store_n(&b->stats_entry, 0, __ATOMIC_RELAXED);
+}
+
+ddbg_result_t dyndebug_start_stats(void)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&stats_lock);
+    if (dyndebug_stats_page)
+    {
+        pthread_mutex_unlock(&stats_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    snprintf(stats_path, sizeof(stats_path), "%s%d", DDBG_STATS_PREFIX,
+        getpid());
+    /* Never through a link, nor a file someone else planted. One left by a
+    former process of the same pid is replaced */
+    int flags = O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    int fd = open(stats_path, flags, 0600);
+    if (fd < 0 && errno == EEXIST && !unlink(stats_path))
+        fd = open(stats_path, flags, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(ddbg_stats_page_t)))
+    {
+        error_print("Cannot create the statistics page %s -- %s\n",
+            stats_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        pthread_mutex_unlock(&stats_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    ddbg_stats_page_t *page = mmap(NULL, sizeof(ddbg_stats_page_t),
+        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        error_print("Cannot map the statistics page %s -- %s\n",
+            stats_path, strerror(errno));
+        unlink(stats_path);
+        pthread_mutex_unlock(&stats_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+
+    page->version = DDBG_STATS_VERSION;
+    page->pid = getpid();
+    int parity = dyndebug_tree_enter();
+    for (ddbg_breakpoint_t *b = context->breakpoints_root ; b ; b = b->next)
+        add_entry(page, b);
+    dyndebug_tree_exit(parity);
+    /* Readers check the magic last */
+    __atomic_store_n(&page->magic, DDBG_STATS_MAGIC, __ATOMIC_RELEASE);
+    __atomic_store_n(&dyndebug_stats_page, page, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_stop_stats(void)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context)
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&stats_lock);
+    if (!dyndebug_stats_page)
+    {
+        pthread_mutex_unlock(&stats_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    ddbg_stats_page_t *page = dyndebug_stats_page;
+    __atomic_store_n(&dyndebug_stats_page, NULL, __ATOMIC_SEQ_CST);
+    int parity = dyndebug_tree_enter();
+    for (ddbg_breakpoint_t *b = context->breakpoints_root ; b ; b = b->next)
+        __atomic_store_n(&b->stats_entry, 0, __ATOMIC_RELAXED);
+    dyndebug_tree_exit(parity);
+    while (__atomic_load_n(&dyndebug_stats_writers, __ATOMIC_SEQ_CST))
+        sched_yield();
+    munmap(page, sizeof(ddbg_stats_page_t));
+    unlink(stats_path);
+    pthread_mutex_unlock(&stats_lock);
+    return DDBG_SUCCESS;
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_symbols.h>
+#include <private/dyndbg_monitor.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+
+/* Entries and buckets live in anonymous mappings, grown with mremap */
+static ddbg_symbol_entry_t *entries;
+static uint32_t entry_count;
+static uint32_t entry_capacity;
+static uint32_t *buckets;               /* entry index + 1, 0 when free */
+static uint32_t bucket_count;           /* power of 2 */
+static ddbg_mapped_object_t objects[MAX_INDEXED_OBJECTS];
+static int object_count;
+static bool indexed;
+/* Lookups read the index, building and refreshing it write it */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash;
+}
+
+static bool add_entry(const char *name, uint64_t address, uint64_t size,
+    bool is_function)
+{
+    if (entry_count == entry_capacity)
+    {
+        size_t former = entry_capacity * sizeof(ddbg_symbol_entry_t);
+        size_t length = former + SYMBOL_INDEX_CHUNK * sizeof(ddbg_symbol_entry_t);
+        void *grown = entries ?
+            mremap(entries, former, length, MREMAP_MAYMOVE) :
+            mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (grown == MAP_FAILED)
+            return false;
+        entries = grown;
+        entry_capacity += SYMBOL_INDEX_CHUNK;
+    }
+    ddbg_symbol_entry_t *entry = &entries[entry_count++];
+    entry->name = name;
+    entry->address = address;
+    entry->size = size;
+    entry->hash = name_hash(name);
+    entry->is_function = is_function;
+    return true;
+}
+
+/* Both .symtab (static and hidden symbols) and .dynsym, when present */
+static void index_symbols(const uint8_t *image, size_t length, uint64_t bias)
+{
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)image;
+    if (length < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+            ehdr->e_ident[EI_CLASS] != ELFCLASS64 || !ehdr->e_shoff ||
+            ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) > length)
+        return;
+
+    const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(image + ehdr->e_shoff);
+    for (int i = 0 ; i < ehdr->e_shnum ; i++)
+    {
+        const Elf64_Shdr *table = &shdrs[i];
+        if ((table->sh_type != SHT_SYMTAB && table->sh_type != SHT_DYNSYM) ||
+                table->sh_link >= ehdr->e_shnum ||
+                table->sh_offset + table->sh_size > length)
+            continue;
+        const Elf64_Shdr *strings = &shdrs[table->sh_link];
+        if (strings->sh_offset + strings->sh_size > length)
+            continue;
+
+        const Elf64_Sym *symbols = (const Elf64_Sym *)(image + table->sh_offset);
+        const char *names = (const char *)(image + strings->sh_offset);
+        for (size_t s = 0 ; s < table->sh_size / sizeof(Elf64_Sym) ; s++)
+        {
+            const Elf64_Sym *symbol = &symbols[s];
+            int type = ELF64_ST_TYPE(symbol->st_info);
+            if ((type != STT_FUNC && type != STT_OBJECT) ||
+                    symbol->st_shndx == SHN_UNDEF || !symbol->st_value ||
+                    !symbol->st_name || symbol->st_name >= strings->sh_size)
+                continue;
+            if (!add_entry(names + symbol->st_name, bias + symbol->st_value,
+                    symbol->st_size, type == STT_FUNC))
+                return;
+        }
+    }
+}
+
+static int index_object(struct dl_phdr_info *info,
+    size_t size __attribute__((unused)), void *arg __attribute__((unused)))
+{
+    const char *path = info->dlpi_name[0] ? info->dlpi_name : "/proc/self/exe";
+    if (object_count == MAX_INDEXED_OBJECTS)
+        return 1;
+
+    /* The vdso has no file, left out */
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void *image = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size)
+        image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return 0;
+
+    objects[object_count].base = image;
+    objects[object_count++].length = st.st_size;
+    index_symbols(image, st.st_size, info->dlpi_addr);
+    return 0;
+}
+
+/* The same symbol is often in both tables, kept once */
+static void insert_bucket(uint32_t index)
+{
+    ddbg_symbol_entry_t *entry = &entries[index];
+    uint32_t slot = entry->hash & (bucket_count - 1);
+    while (buckets[slot])
+    {
+        ddbg_symbol_entry_t *other = &entries[buckets[slot] - 1];
+        if (other->hash == entry->hash && other->address == entry->address &&
+                !strcmp(other->name, entry->name))
+            return;
+        slot = (slot + 1) & (bucket_count - 1);
+    }
+    buckets[slot] = index + 1;
+}
+
+/* Called with index_lock held */
+static bool build_index(void)
+{
+    dl_iterate_phdr(index_object, NULL);
+    for (bucket_count = 1024 ; bucket_count < 2 * entry_count ; )
+        bucket_count *= 2;
+    buckets = mmap(NULL, bucket_count * sizeof(uint32_t),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buckets == MAP_FAILED)
+    {
+        buckets = NULL;
+        return false;
+    }
+    for (uint32_t i = 0 ; i < entry_count ; i++)
+        insert_bucket(i);
+    debug_print("%u symbols indexed from %d objects\n", entry_count,
+        object_count);
+    return true;
+}
+
+/* Returns with index_lock held for reading once the index is built */
+static bool lock_index(void)
+{
+    for ( ; ; )
+    {
+        pthread_rwlock_rdlock(&index_lock);
+        if (indexed)
+            return true;
+        pthread_rwlock_unlock(&index_lock);
+
+        /* Built by another thread meanwhile or refreshed again, retried */
+        pthread_rwlock_wrlock(&index_lock);
+        if (!indexed)
+            indexed = build_index();
+        bool built = indexed;
+        pthread_rwlock_unlock(&index_lock);
+        if (!built)
+            return false;
+    }
+}
+
+ddbg_result_t dyndebug_refresh_symbols(void)
+{
+    pthread_rwlock_wrlock(&index_lock);
+    indexed = false;
+    if (buckets)
+        munmap(buckets, bucket_count * sizeof(uint32_t));
+    if (entries)
+        munmap(entries, entry_capacity * sizeof(ddbg_symbol_entry_t));
+    for (int i = 0 ; i < object_count ; i++)
+        munmap(objects[i].base, objects[i].length);
+    buckets = NULL;
+    entries = NULL;
+    entry_count = entry_capacity = bucket_count = 0;
+    object_count = 0;
+    pthread_rwlock_unlock(&index_lock);
+    return DDBG_SUCCESS;
+}
+
+bool dyndebug_function_bounds(void *address, uint64_t *start, uint64_t *size)
+{
+    if (!lock_index())
+        return false;
+    bool found = false;
+    for (uint32_t i = 0 ; i < entry_count && !found ; i++)
+    {
+        const ddbg_symbol_entry_t *entry = &entries[i];
+        if (!entry->is_function || (uint64_t)address < entry->address ||
+                (uint64_t)address >= entry->address + entry->size)
+            continue;
+        *start = entry->address;
+        *size = entry->size;
+        found = true;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+static void copy_symbol(ddbg_symbol_t *symbol, const ddbg_symbol_entry_t *entry)
+{
+    symbol->name = entry->name;
+    symbol->address = (void *)entry->address;
+    symbol->size = entry->size;
+    symbol->is_function = entry->is_function;
+}
+
+int dyndebug_find_symbols(const char *pattern, ddbg_symbol_t *symbols, int max)
+{
+    int count = 0;
+    if (!pattern || !lock_index())
+        return 0;
+
+    if (!strpbrk(pattern, "*?["))
+    {
+        uint32_t hash = name_hash(pattern);
+        uint32_t slot = hash & (bucket_count - 1);
+        for ( ; buckets[slot] && count < max ;
+                slot = (slot + 1) & (bucket_count - 1))
+        {
+            const ddbg_symbol_entry_t *entry = &entries[buckets[slot] - 1];
+            if (entry->hash == hash && !strcmp(entry->name, pattern))
+                copy_symbol(&symbols[count++], entry);
+        }
+        pthread_rwlock_unlock(&index_lock);
+        return count;
+    }
+
+    /* Globs see every entry, the duplicates are in the buckets only */
+    for (uint32_t slot = 0 ; slot < bucket_count && count < max ; slot++)
+    {
+        if (!buckets[slot])
+            continue;
+        const ddbg_symbol_entry_t *entry = &entries[buckets[slot] - 1];
+        if (!fnmatch(pattern, entry->name, 0))
+            copy_symbol(&symbols[count++], entry);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return count;
+}
+
+void *dyndebug_resolve_symbol(const char *name)
+{
+    ddbg_symbol_t symbol;
+    return dyndebug_find_symbols(name, &symbol, 1) ? symbol.address : NULL;
+}
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_timeline.h>
+#include <private/dyndbg_monitor.h>
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+bool dyndebug_timeline_enabled;
+static __thread ddbg_timeline_buffer_t *thread_buffer;
+/* Never unmapped, the buffers of the exited threads are handed to new ones */
+static ddbg_timeline_buffer_t *buffers;
+static pthread_key_t buffer_key;
+static bool buffer_key_created;
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer_thread;
+static bool writer_stopping;
+static FILE *timeline_file;
+static bool first_event;
+static uint64_t tsc_origin;
+static uint64_t ns_origin;
+static double ns_per_tick;
+
+/* Indexed by ddbg_monitor_op_t */
+static const char *operation_names[] =
+{
+    "enable", "disable", "disable all", "triggered", "crash report",
+    "snapshot core", "enable batch", "patch code", "split",
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Thread exit, the writer still drains what is left in it */
+static void release_buffer(void *arg)
+{
+    ddbg_timeline_buffer_t *buffer = arg;
+    thread_buffer = NULL;
+    __atomic_store_n(&buffer->released, true, __ATOMIC_RELEASE);
+}
+
+/* A released buffer, once all its events are written out */
+static ddbg_timeline_buffer_t *reuse_buffer(void)
+{
+    ddbg_timeline_buffer_t *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for ( ; buffer ; buffer = buffer->next)
+    {
+        bool released = true;
+        if (__atomic_load_n(&buffer->released, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) ==
+                __atomic_load_n(&buffer->head, __ATOMIC_RELAXED) &&
+                __atomic_compare_exchange_n(&buffer->released, &released, false,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            buffer->named = false;
+            __atomic_store_n(&buffer->dropped, 0, __ATOMIC_RELAXED);
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+/* Taken on the first event of the thread, maybe from a signal handler */
+static ddbg_timeline_buffer_t *get_buffer(void)
+{
+    ddbg_timeline_buffer_t *buffer = thread_buffer;
+    if (buffer)
+        return buffer;
+    buffer = reuse_buffer();
+    if (!buffer)
+    {
+        buffer = mmap(NULL, sizeof(ddbg_timeline_buffer_t),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            return NULL;
+        buffer->tid = syscall(SYS_gettid);
+        buffer->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &buffer->next, buffer,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    else
+        buffer->tid = syscall(SYS_gettid);
+    /* The key exists, events are only recorded once a timeline started */
+    pthread_setspecific(buffer_key, buffer);
+    thread_buffer = buffer;
+    return buffer;
+}
+
+static void append_event(ddbg_timeline_kind_t kind, uint32_t detail,
+    uint64_t address, uint64_t begin, uint64_t end)
+{
+    ddbg_timeline_buffer_t *buffer = get_buffer();
+    if (!buffer)
+        return;
+
+    /* Reserved first, a signal handler may record in between */
+    uint64_t head = __atomic_load_n(&buffer->head, __ATOMIC_RELAXED);
+    do
+    {
+        if (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE) >=
+                TIMELINE_EVENTS)
+        {
+            __atomic_fetch_add(&buffer->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&buffer->head, &head, head + 1, false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    ddbg_timeline_event_t *event = &buffer->events[head % TIMELINE_EVENTS];
+    event->begin = begin;
+    event->end = end;
+    event->address = address;
+    event->kind = kind;
+    event->detail = detail;
+    __atomic_store_n(&event->sequence, head + 1, __ATOMIC_RELEASE);
+}
+
+void dyndebug_timeline_record(ddbg_timeline_kind_t kind, uint32_t detail,
+    uint64_t address, uint64_t begin)
+{
+    append_event(kind, detail, address, begin, __rdtsc());
+}
+
+void dyndebug_timeline_request(const ddbg_monitor_request_t *request,
+    const ddbg_monitor_response_t *response, uint64_t begin)
+{
+    uint64_t address = 0;
+    switch (request->operation)
+    {
+        case DDBG_ENABLE_BREAKPOINT:
+        case DDBG_DISABLE_BREAKPOINT:
+        case DDBG_SPLIT_BREAKPOINT:
+            address = (uint64_t)request->breakpoint.address;
+            break;
+        case DDBG_ENABLE_BREAKPOINTS:
+            address = (uint64_t)request->batch.items[0].address;
+            break;
+        case DDBG_CRASH_REPORT:
+            address = (uint64_t)request->crash.fault_address;
+            break;
+        case DDBG_PATCH_CODE:
+            address = (uint64_t)request->patch.items[0].address;
+            break;
+        default:
+            break;
+    }
+    dyndebug_timeline_record(DDBG_TIMELINE_REQUEST, request->operation, address,
+        begin);
+    /* Monitor side, nested in the request on the same track */
+    if (response->stopped_tsc && response->resumed_tsc > response->stopped_tsc)
+        append_event(DDBG_TIMELINE_STOPPED, response->stops, address,
+            response->stopped_tsc, response->resumed_tsc);
+}
+
+static double tsc_to_us(uint64_t tsc)
+{
+    return (int64_t)(tsc - tsc_origin) * ns_per_tick / 1000.0;
+}
+
+/* The longer the interval, the better the TSC rate */
+static void calibrate(void)
+{
+    uint64_t tsc = __rdtsc(), ns = now_ns();
+    if (tsc > tsc_origin)
+        ns_per_tick = (double)(ns - ns_origin) / (tsc - tsc_origin);
+}
+
+static void write_thread_name(ddbg_timeline_buffer_t *buffer)
+{
+    char path[64], name[32] = "";
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", buffer->tid);
+    FILE *comm = fopen(path, "r");
+    if (!comm || !fgets(name, sizeof(name), comm))
+        snprintf(name, sizeof(name), "thread %d", buffer->tid);
+    if (comm)
+        fclose(comm);
+    name[strcspn(name, "\n\"\\")] = '\0';
+    fprintf(timeline_file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+        "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+        first_event ? "" : ",\n", getpid(), buffer->tid, name);
+    first_event = false;
+    buffer->named = true;
+}
+
+static void write_event(const ddbg_timeline_buffer_t *buffer,
+    const ddbg_timeline_event_t *event)
+{
+    const char *name = event->kind == DDBG_TIMELINE_TRAP ? "trap" :
+        event->kind == DDBG_TIMELINE_CALLBACK ? "callback" :
+        event->kind == DDBG_TIMELINE_STOPPED ? "stopped" :
+        event->detail < sizeof(operation_names) / sizeof(operation_names[0]) ?
+        operation_names[event->detail] : "request";
+    fprintf(timeline_file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+        "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, "
+        "\"args\": {\"address\": \"%p\"", first_event ? "" : ",\n", name,
+        event->kind == DDBG_TIMELINE_REQUEST ||
+        event->kind == DDBG_TIMELINE_STOPPED ? "monitor" : "breakpoint",
+        tsc_to_us(event->begin), (event->end - event->begin) * ns_per_tick /
+        1000.0, getpid(), buffer->tid, (void *)event->address);
+    if (event->kind == DDBG_TIMELINE_STOPPED)
+        fprintf(timeline_file, ", \"tasks\": %u", event->detail);
+    fprintf(timeline_file, "}}");
+    first_event = false;
+}
+
+/* Called with timeline_lock held, by the writer only */
+static void drain(void)
+{
+    calibrate();
+    ddbg_timeline_buffer_t *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for ( ; buffer ; buffer = buffer->next)
+    {
+        uint64_t tail = buffer->tail;
+        while (tail < __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE))
+        {
+            ddbg_timeline_event_t *event = &buffer->events[tail % TIMELINE_EVENTS];
+            if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != tail + 1)
+                break;
+            if (!buffer->named)
+                write_thread_name(buffer);
+            if (event->begin >= tsc_origin)
+                write_event(buffer, event);
+            __atomic_store_n(&buffer->tail, ++tail, __ATOMIC_RELEASE);
+        }
+    }
+    fflush(timeline_file);
+}
+
+static void *writer_main(void *arg __attribute__((unused)))
+{
+    struct timespec period = {.tv_sec = 0,
+        .tv_nsec = TIMELINE_FLUSH_MS * 1000000L};
+    while (!__atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&timeline_lock);
+        drain();
+        pthread_mutex_unlock(&timeline_lock);
+    }
+    return NULL;
+}
+
+/* The writer is not inherited, the file is left to the parent, so are the
+events of its other threads, their buffers are free to reuse */
+void dyndebug_timeline_forked(void)
+{
+    pthread_mutex_init(&timeline_lock, NULL);
+    ddbg_timeline_buffer_t *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for ( ; buffer ; buffer = buffer->next)
+        if (buffer != thread_buffer)
+        {
+            buffer->tail = buffer->head;
+            buffer->released = true;
+        }
+    __atomic_store_n(&dyndebug_timeline_enabled, false, __ATOMIC_RELEASE);
+    timeline_file = NULL;
+}
+
+ddbg_result_t dyndebug_start_timeline(const char *path)
+{
+    if (!path)
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&timeline_lock);
+    if (timeline_file)
+    {
+        pthread_mutex_unlock(&timeline_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    timeline_file = fopen(path, "w");
+    if (!timeline_file)
+    {
+        error_print("Cannot create the timeline %s -- %s\n", path,
+            strerror(errno));
+        pthread_mutex_unlock(&timeline_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    fprintf(timeline_file, "[\n");
+    first_event = true;
+    if (!buffer_key_created)
+    {
+        if (pthread_key_create(&buffer_key, release_buffer))
+        {
+            error_print("Cannot create the timeline buffer key\n");
+            fclose(timeline_file);
+            timeline_file = NULL;
+            pthread_mutex_unlock(&timeline_lock);
+            return DDBG_SYSTEM_ERROR;
+        }
+        buffer_key_created = true;
+    }
+
+    /* Leftovers of a former session are skipped */
+    ddbg_timeline_buffer_t *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for ( ; buffer ; buffer = buffer->next)
+    {
+        buffer->named = false;
+        __atomic_store_n(&buffer->dropped, 0, __ATOMIC_RELAXED);
+    }
+
+    struct timespec calibration = {.tv_sec = 0,
+        .tv_nsec = TIMELINE_CALIBRATION_MS * 1000000L};
+    tsc_origin = __rdtsc();
+    ns_origin = now_ns();
+    nanosleep(&calibration, NULL);
+    calibrate();
+
+    __atomic_store_n(&writer_stopping, false, __ATOMIC_RELEASE);
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL))
+    {
+        error_print("Cannot start the timeline writer\n");
+        fclose(timeline_file);
+        timeline_file = NULL;
+        pthread_mutex_unlock(&timeline_lock);
+        return DDBG_SYSTEM_ERROR;
+    }
+    __atomic_store_n(&dyndebug_timeline_enabled, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&timeline_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_stop_timeline(void)
+{
+    pthread_mutex_lock(&timeline_lock);
+    if (!timeline_file)
+    {
+        pthread_mutex_unlock(&timeline_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    __atomic_store_n(&dyndebug_timeline_enabled, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&writer_stopping, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&timeline_lock);
+    pthread_join(writer_thread, NULL);
+
+    pthread_mutex_lock(&timeline_lock);
+    drain();
+    ddbg_timeline_buffer_t *buffer = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    for ( ; buffer ; buffer = buffer->next)
+    {
+        uint64_t dropped = __atomic_load_n(&buffer->dropped, __ATOMIC_RELAXED);
+        if (!dropped)
+            continue;
+        fprintf(timeline_file, "%s{\"name\": \"dropped\", \"ph\": \"i\", "
+            "\"s\": \"t\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d, "
+            "\"args\": {\"events\": %lu}}", first_event ? "" : ",\n",
+            tsc_to_us(__rdtsc()), getpid(), buffer->tid, dropped);
+        first_event = false;
+    }
+    fprintf(timeline_file, "\n]\n");
+    fclose(timeline_file);
+    timeline_file = NULL;
+    pthread_mutex_unlock(&timeline_lock);
+    return DDBG_SUCCESS;
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_trace.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_decode.h>
+
+#include <ucontext.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Preallocated, the signal handlers only claim and fill them */
+static ddbg_trace_buffer_t trace_buffers[MAX_TRACE_BUFFERS];
+static uint32_t trace_steps;
+static int trace_regs[DDBG_TRACE_REGS];
+static uint64_t trace_sequence;
+static uint64_t trace_missed;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ddbg_trace_buffer_t *trace_self;
+
+ddbg_result_t dyndebug_set_trace_window(uint32_t steps, int reg0, int reg1)
+{
+    if (!steps || steps > MAX_TRACE_STEPS ||
+            reg0 < DDBG_FIXUP_NO_REGISTER || reg0 >= NGREG ||
+            reg1 < DDBG_FIXUP_NO_REGISTER || reg1 >= NGREG)
+        return DDBG_INVALID_ARGUMENT;
+
+    /* Every buffer is claimed first, none is recording while resized */
+    uint32_t states[MAX_TRACE_BUFFERS];
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS ; i++)
+    {
+        states[i] = __atomic_load_n(&trace_buffers[i].state, __ATOMIC_ACQUIRE);
+        if (states[i] == DDBG_TRACE_RECORDING ||
+                !__atomic_compare_exchange_n(&trace_buffers[i].state,
+                &states[i], DDBG_TRACE_RESIZING, false, __ATOMIC_ACQ_REL,
+                __ATOMIC_RELAXED))
+        {
+            while (i--)
+                __atomic_store_n(&trace_buffers[i].state, states[i],
+                    __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&trace_lock);
+            return DDBG_INVALID_ARGUMENT;
+        }
+    }
+    ddbg_result_t result = DDBG_SUCCESS;
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS && result == DDBG_SUCCESS ; i++)
+    {
+        ddbg_trace_buffer_t *trace = &trace_buffers[i];
+        ddbg_trace_run_t *runs = realloc(trace->runs,
+            steps * sizeof(ddbg_trace_run_t));
+        if (!runs)
+            result = DDBG_SYSTEM_ERROR;
+        else
+            trace->runs = runs;
+    }
+    /* Buffers may be left smaller than the former window, tracing stops */
+    trace_regs[0] = reg0;
+    trace_regs[1] = reg1;
+    __atomic_store_n(&trace_steps, result == DDBG_SUCCESS ? steps : 0,
+        __ATOMIC_RELEASE);
+    /* The steps are read back once a buffer is claimed */
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS ; i++)
+    {
+        trace_buffers[i].count = 0;
+        __atomic_store_n(&trace_buffers[i].state, DDBG_TRACE_FREE,
+            __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return result;
+}
+
+static void trace_record(ddbg_trace_buffer_t *trace, const greg_t *r)
+{
+    uint64_t rip = r[REG_RIP];
+    ddbg_trace_run_t *run = trace->count ? &trace->runs[trace->count - 1] : NULL;
+
+    /* The next instruction (or a repeated string one) extends the run, a
+taken branch or an instruction not decoded starts another one */
+    if (run)
+    {
+        uint64_t last = run->rip + run->last_offset;
+        ddbg_instruction_t insn;
+        if (dyndebug_decode_instruction((const uint8_t *)last, &insn) &&
+                (rip == last + insn.length || (rip == last && insn.rep_string)))
+        {
+            run->steps++;
+            run->last_offset = rip - run->rip;
+            for (int i = 0 ; i < DDBG_TRACE_REGS ; i++)
+                if (trace_regs[i] != DDBG_FIXUP_NO_REGISTER)
+                    run->regs[i] = r[trace_regs[i]];
+            return;
+        }
+    }
+    run = &trace->runs[trace->count++];
+    run->rip = rip;
+    run->steps = 1;
+    run->last_offset = 0;
+    for (int i = 0 ; i < DDBG_TRACE_REGS ; i++)
+        run->regs[i] = trace_regs[i] != DDBG_FIXUP_NO_REGISTER ?
+            r[trace_regs[i]] : 0;
+}
+
+static void trace_stop(ddbg_trace_buffer_t *trace, greg_t *r)
+{
+    r[REG_EFL] &= ~X86_EFLAGS_TF;
+    trace->sequence = __atomic_add_fetch(&trace_sequence, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace->state, DDBG_TRACE_DONE, __ATOMIC_RELEASE);
+    trace_self = NULL;
+}
+
+void dyndebug_trace_start(void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+    uint32_t steps = __atomic_load_n(&trace_steps, __ATOMIC_ACQUIRE);
+    if (!steps || trace_self)
+        return;
+
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS ; i++)
+    {
+        ddbg_trace_buffer_t *trace = &trace_buffers[i];
+        uint32_t expected = DDBG_TRACE_FREE;
+        if (!__atomic_compare_exchange_n(&trace->state, &expected,
+                DDBG_TRACE_RECORDING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            continue;
+        /* A resize in between published other steps before the release */
+        steps = __atomic_load_n(&trace_steps, __ATOMIC_ACQUIRE);
+        if (!steps)
+        {
+            __atomic_store_n(&trace->state, DDBG_TRACE_FREE, __ATOMIC_RELEASE);
+            return;
+        }
+        trace->count = 0;
+        trace->remaining = steps - 1;
+        trace_record(trace, ucontext->uc_mcontext.gregs);
+        trace_self = trace;
+        if (trace->remaining)
+            ucontext->uc_mcontext.gregs[REG_EFL] |= X86_EFLAGS_TF;
+        else
+            trace_stop(trace, ucontext->uc_mcontext.gregs);
+        return;
+    }
+    __atomic_add_fetch(&trace_missed, 1, __ATOMIC_RELAXED);
+}
+
+bool dyndebug_trace_step(void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+    ddbg_trace_buffer_t *trace = trace_self;
+    if (!trace)
+        return false;
+
+    greg_t *r = ucontext->uc_mcontext.gregs;
+    trace_record(trace, r);
+    if (!--trace->remaining)
+        trace_stop(trace, r);
+    else
+        r[REG_EFL] |= X86_EFLAGS_TF;
+    return true;
+}
+
+void dyndebug_trace_fork_prepare(void)
+{
+    pthread_mutex_lock(&trace_lock);
+}
+
+void dyndebug_trace_fork_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void dyndebug_trace_forked(void)
+{
+    pthread_mutex_init(&trace_lock, NULL);
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS ; i++)
+        if (trace_buffers[i].state == DDBG_TRACE_RECORDING &&
+                &trace_buffers[i] != trace_self)
+            trace_buffers[i].state = DDBG_TRACE_FREE;
+}
+
+int dyndebug_get_trace(ddbg_trace_run_t *runs, int max)
+{
+    /* Oldest completed trace first, its buffer is released */
+    pthread_mutex_lock(&trace_lock);
+    ddbg_trace_buffer_t *oldest = NULL;
+    for (int i = 0 ; i < MAX_TRACE_BUFFERS ; i++)
+    {
+        ddbg_trace_buffer_t *trace = &trace_buffers[i];
+        if (__atomic_load_n(&trace->state, __ATOMIC_ACQUIRE) == DDBG_TRACE_DONE &&
+                (!oldest || trace->sequence < oldest->sequence))
+            oldest = trace;
+    }
+    int count = 0;
+    if (oldest)
+    {
+        count = oldest->count < (uint32_t)max ? (int)oldest->count : max;
+        memcpy(runs, oldest->runs, count * sizeof(ddbg_trace_run_t));
+        __atomic_store_n(&oldest->state, DDBG_TRACE_FREE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return count;
+}
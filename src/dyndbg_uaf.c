@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_uaf.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_unwind.h>
+
+#include <ucontext.h>
+
+#include <pthread.h>
+#include <malloc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#ifdef DYNDBG_INTERPOSE_FREE
+extern void __libc_free(void *ptr);
+#define real_free               __libc_free
+#else
+#define real_free               free
+#endif
+
+static ddbg_quarantined_t quarantine[MAX_QUARANTINE];
+static uint32_t quarantine_size;
+static uint32_t quarantine_next;
+static uint32_t quarantine_cursor;     /* next blocks to arm */
+/* Twice the debug registers lent, a joining block takes a free slot while the
+leaving one is still listed */
+static ddbg_uaf_slot_t slots[2 * HW_BREAKPOINTS_COUNT];
+static uint32_t slot_count;
+static uint32_t sample_period;
+static uint64_t frees;
+static uint32_t rotation_ms;
+static pthread_mutex_t uaf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t rotation_thread;
+static bool uaf_running;
+static bool rotation_stopping;
+
+/* Filled from the SIGTRAP handlers, address is set last. Printed from the
+rotation thread, stdio and dladdr are not async-signal-safe */
+static ddbg_uaf_report_t reports[MAX_UAF_REPORTS];
+static uint32_t report_count;
+static uint32_t reports_printed;
+
+static void print_frames(const char *title, void *const *pcs)
+{
+    fprintf(stderr, "%s:\n", title);
+    for (int i = 0 ; i < DDBG_UAF_DEPTH && pcs[i] ; i++)
+    {
+        Dl_info info;
+        if (dladdr(pcs[i], &info) && info.dli_sname)
+            fprintf(stderr, "    %p %s+0x%lx\n", pcs[i], info.dli_sname,
+                (uint64_t)pcs[i] - (uint64_t)info.dli_saddr);
+        else
+            fprintf(stderr, "    %p\n", pcs[i]);
+    }
+}
+
+/* Reports completed in order, the next ones once their writers are done */
+static void print_reports(void)
+{
+    for ( ; reports_printed < MAX_UAF_REPORTS ; reports_printed++)
+    {
+        ddbg_uaf_report_t *report = &reports[reports_printed];
+        void *address = __atomic_load_n(&report->address, __ATOMIC_ACQUIRE);
+        if (!address)
+            break;
+        fprintf(stderr, "Use after free of %p (%zu bytes)\n", address,
+            report->size);
+        print_frames("accessed at", report->access_pcs);
+        print_frames("freed at", report->free_pcs);
+    }
+}
+
+static void on_uaf_access(ddbg_breakpoint_t *b)
+{
+    ddbg_uaf_slot_t *slot = b->callback_priv_arg;
+    ucontext_t *ucontext = dyndebug_get_trap_ucontext();
+    if (!ucontext || __atomic_exchange_n(&slot->reported, true,
+            __ATOMIC_ACQ_REL))
+        return;
+
+    uint32_t index = __atomic_fetch_add(&report_count, 1, __ATOMIC_RELAXED);
+    if (index >= MAX_UAF_REPORTS)
+        return;
+    uint64_t pcs[DDBG_UAF_DEPTH];
+    int depth = dyndebug_unwind(ucontext->uc_mcontext.gregs, pcs,
+        DDBG_UAF_DEPTH);
+    ddbg_uaf_report_t *report = &reports[index];
+    for (int i = 0 ; i < DDBG_UAF_DEPTH ; i++)
+        report->access_pcs[i] = i < depth ? (void *)pcs[i] : NULL;
+    report->size = slot->report.size;
+    memcpy(report->free_pcs, slot->report.free_pcs, sizeof(report->free_pcs));
+    __atomic_store_n(&report->address, slot->report.address, __ATOMIC_RELEASE);
+}
+
+/* Called with uaf_lock held */
+static void disarm_slot(ddbg_uaf_slot_t *slot)
+{
+    if (!slot->block)
+        return;
+    dyndebug_remove_breakpoint(&slot->breakpoint);
+    slot->block->slot = -1;
+    slot->block = NULL;
+}
+
+/* Called with uaf_lock held, the slots of the blocks leaving the window are
+disarmed and the joining blocks armed in free slots by a single monitor
+request, the blocks staying watched keep their slot. Slots still being
+disarmed by a free count as taken */
+static void swap_watches(ddbg_quarantined_t **window, int blocks)
+{
+    ddbg_breakpoint_t *leaving[HW_BREAKPOINTS_COUNT];
+    ddbg_breakpoint_t *joining[HW_BREAKPOINTS_COUNT];
+    ddbg_uaf_slot_t *left[HW_BREAKPOINTS_COUNT];
+    ddbg_uaf_slot_t *joined[HW_BREAKPOINTS_COUNT];
+    bool staying[2 * HW_BREAKPOINTS_COUNT] = {false};
+    int leaves = 0, joins = 0;
+
+    for (int i = 0 ; i < blocks ; i++)
+        if (window[i]->slot >= 0)
+            staying[window[i]->slot] = true;
+    for (uint32_t s = 0 ; s < 2 * slot_count ; s++)
+    {
+        if (slots[s].block && !staying[s] && leaves < HW_BREAKPOINTS_COUNT)
+        {
+            left[leaves] = &slots[s];
+            leaving[leaves++] = &slots[s].breakpoint;
+        }
+    }
+
+    ddbg_context_t *context = dyndebug_get_context();
+    uint32_t s = 0;
+    for (int i = 0 ; i < blocks && joins < HW_BREAKPOINTS_COUNT ; i++)
+    {
+        ddbg_quarantined_t *block = window[i];
+        if (block->slot >= 0)
+            continue;
+        while (s < 2 * slot_count && (slots[s].block || slots[s].busy))
+            s++;
+        if (s == 2 * slot_count)
+            break;
+        ddbg_uaf_slot_t *slot = &slots[s];
+        dyndebug_list_breakpoint(context, &slot->breakpoint, block->ptr,
+            DDBG_BREAK_DATA_RDWR, DDBG_BREAK_8BYTES, on_uaf_access, slot, true);
+        slot->block = block;
+        __atomic_store_n(&slot->reported, false, __ATOMIC_RELEASE);
+        slot->report.address = block->ptr;
+        slot->report.size = block->size;
+        for (int j = 0 ; j < DDBG_UAF_DEPTH ; j++)
+            slot->report.free_pcs[j] = j < block->free_depth ?
+                (void *)block->free_pcs[j] : NULL;
+        block->slot = s;
+        joined[joins] = slot;
+        joining[joins++] = &slot->breakpoint;
+    }
+
+    int armed = dyndebug_swap_breakpoints(leaving, leaves, joining, joins);
+    for (int i = 0 ; i < leaves ; i++)
+        if (!leaving[i]->enabled)
+            disarm_slot(left[i]);
+    /* Slots busy, not kept listed */
+    for (int i = armed ; i < joins ; i++)
+        disarm_slot(joined[i]);
+}
+
+/* Called with uaf_lock held, moves the window to the next blocks */
+static void rotate_watches(void)
+{
+    ddbg_quarantined_t *window[HW_BREAKPOINTS_COUNT];
+    uint32_t busy = 0, blocks = 0, i;
+    for (uint32_t s = 0 ; s < 2 * slot_count ; s++)
+        busy += slots[s].busy;
+    for (i = 0 ; i < quarantine_size && busy + blocks < slot_count ; i++)
+    {
+        ddbg_quarantined_t *block =
+            &quarantine[(quarantine_cursor + i) % quarantine_size];
+        if (block->ptr)
+            window[blocks++] = block;
+    }
+    swap_watches(window, blocks);
+    if (quarantine_size)
+        quarantine_cursor = (quarantine_cursor + i) % quarantine_size;
+}
+
+static void *rotation_main(void *arg __attribute__((unused)))
+{
+    struct timespec period = {
+        .tv_sec = rotation_ms / 1000, .tv_nsec = (rotation_ms % 1000) * 1000000L};
+    while (!__atomic_load_n(&rotation_stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&uaf_lock);
+        if (!rotation_stopping)
+            rotate_watches();
+        pthread_mutex_unlock(&uaf_lock);
+        print_reports();
+    }
+    return NULL;
+}
+
+/* pcs[0] is ourselves and pcs[1] the public entry point, skipped */
+static __attribute__((noinline)) void quarantine_free(void *ptr)
+{
+    long long gregs[NGREG] = {0};
+    uint64_t pcs[DDBG_UAF_DEPTH + 2];
+    gregs[REG_RIP] = (long long)quarantine_free;
+    gregs[REG_RBP] = (long long)__builtin_frame_address(0);
+    gregs[REG_RSP] = (long long)gregs;
+    int depth = dyndebug_unwind(gregs, pcs, DDBG_UAF_DEPTH + 2);
+
+    pthread_mutex_lock(&uaf_lock);
+    if (!uaf_running)
+    {
+        pthread_mutex_unlock(&uaf_lock);
+        real_free(ptr);
+        return;
+    }
+    ddbg_quarantined_t *block = &quarantine[quarantine_next];
+    void *evicted = block->ptr;
+    ddbg_uaf_slot_t *disarming = NULL;
+    if (evicted && block->slot >= 0)
+    {
+        /* Detached here, removed once the lock is released: the monitor round
+        trip would hold every other free */
+        disarming = &slots[block->slot];
+        disarming->block = NULL;
+        disarming->busy = true;
+    }
+    block->ptr = ptr;
+    block->size = malloc_usable_size(ptr);
+    block->free_depth = depth > 2 ? depth - 2 : 0;
+    memcpy(block->free_pcs, &pcs[2], block->free_depth * sizeof(uint64_t));
+    block->slot = -1;
+    quarantine_next = (quarantine_next + 1) % quarantine_size;
+    pthread_mutex_unlock(&uaf_lock);
+
+    if (disarming)
+    {
+        dyndebug_remove_breakpoint(&disarming->breakpoint);
+        pthread_mutex_lock(&uaf_lock);
+        disarming->busy = false;
+        pthread_mutex_unlock(&uaf_lock);
+    }
+    if (evicted)
+        real_free(evicted);
+}
+
+/* Stopped or sampled out, the common case costs two atomics */
+static inline bool sampled(void)
+{
+    return __atomic_load_n(&uaf_running, __ATOMIC_ACQUIRE) &&
+        !(__atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED) % sample_period);
+}
+
+void dyndebug_uaf_free(void *ptr)
+{
+    if (ptr && sampled())
+        quarantine_free(ptr);
+    else
+        real_free(ptr);
+}
+
+#ifdef DYNDBG_INTERPOSE_FREE
+void free(void *ptr)
+{
+    if (ptr && sampled())
+        quarantine_free(ptr);
+    else
+        real_free(ptr);
+}
+#endif
+
+void dyndebug_uaf_fork_prepare(void)
+{
+    pthread_mutex_lock(&uaf_lock);
+}
+
+void dyndebug_uaf_fork_parent(void)
+{
+    pthread_mutex_unlock(&uaf_lock);
+}
+
+/* The watches are no longer armed, they are unlisted as a stop would and the
+quarantined blocks are the child ones to free */
+void dyndebug_uaf_forked(void)
+{
+    pthread_mutex_init(&uaf_lock, NULL);
+    if (!uaf_running)
+        return;
+    __atomic_store_n(&uaf_running, false, __ATOMIC_RELEASE);
+    for (uint32_t i = 0 ; i < 2 * slot_count ; i++)
+    {
+        disarm_slot(&slots[i]);
+        slots[i].busy = false;
+    }
+    for (uint32_t i = 0 ; i < quarantine_size ; i++)
+    {
+        real_free(quarantine[i].ptr);
+        quarantine[i].ptr = NULL;
+    }
+}
+
+ddbg_result_t dyndebug_start_uaf_detector(uint32_t quarantined, uint32_t sample,
+    uint32_t watches, uint32_t period_ms)
+{
+    if (quarantined > MAX_QUARANTINE || !watches ||
+            watches > HW_BREAKPOINTS_COUNT)
+        return DDBG_INVALID_ARGUMENT;
+    if (!dyndebug_get_context())
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&uaf_lock);
+    if (uaf_running)
+    {
+        pthread_mutex_unlock(&uaf_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    memset(quarantine, 0, sizeof(quarantine));
+    memset(slots, 0, sizeof(slots));
+    memset(reports, 0, sizeof(reports));
+    report_count = 0;
+    reports_printed = 0;
+    quarantine_size = quarantined ? quarantined : DEFAULT_QUARANTINE;
+    quarantine_next = 0;
+    quarantine_cursor = 0;
+    slot_count = watches;
+    sample_period = sample ? sample : 1;
+    rotation_ms = period_ms ? period_ms : DEFAULT_UAF_ROTATION_MS;
+
+    __atomic_store_n(&rotation_stopping, false, __ATOMIC_RELEASE);
+    if (pthread_create(&rotation_thread, NULL, rotation_main, NULL))
+    {
+        pthread_mutex_unlock(&uaf_lock);
+        error_print("Cannot start the use after free detector\n");
+        return DDBG_SYSTEM_ERROR;
+    }
+    __atomic_store_n(&uaf_running, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&uaf_lock);
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_stop_uaf_detector(void)
+{
+    pthread_mutex_lock(&uaf_lock);
+    if (!uaf_running)
+    {
+        pthread_mutex_unlock(&uaf_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    __atomic_store_n(&uaf_running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&rotation_stopping, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&uaf_lock);
+    pthread_join(rotation_thread, NULL);
+    print_reports();
+
+    pthread_mutex_lock(&uaf_lock);
+    swap_watches(NULL, 0);
+    for (uint32_t i = 0 ; i < 2 * slot_count ; i++)
+        disarm_slot(&slots[i]);
+    for (uint32_t i = 0 ; i < quarantine_size ; i++)
+    {
+        real_free(quarantine[i].ptr);
+        quarantine[i].ptr = NULL;
+    }
+    pthread_mutex_unlock(&uaf_lock);
+    return DDBG_SUCCESS;
+}
+
+int dyndebug_get_uaf_reports(ddbg_uaf_report_t *copies, int max)
+{
+    int count = 0;
+    for (int i = 0 ; i < MAX_UAF_REPORTS && count < max ; i++)
+    {
+        if (!__atomic_load_n(&reports[i].address, __ATOMIC_ACQUIRE))
+            break;
+        copies[count++] = reports[i];
+    }
+    return count;
+}
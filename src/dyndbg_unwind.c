@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_unwind.h>
+
+#include <ucontext.h>
+
+#include <sys/uio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static __thread uint64_t stack_low;
+static __thread uint64_t stack_high;
+
+bool dyndebug_unwind_register_thread(void)
+{
+    pthread_attr_t attr;
+    void *address;
+    size_t size;
+
+    if (pthread_getattr_np(pthread_self(), &attr))
+        return false;
+    int rc = pthread_attr_getstack(&attr, &address, &size);
+    pthread_attr_destroy(&attr);
+    if (rc)
+        return false;
+    stack_low = (uint64_t)address;
+    stack_high = (uint64_t)address + size;
+    return true;
+}
+
+static bool read_frame(uint64_t fp, uint64_t frame[2])
+{
+    if (stack_high)
+    {
+        if (fp < stack_low || fp + 2 * sizeof(uint64_t) > stack_high)
+            return false;
+        frame[0] = ((uint64_t *)fp)[0];
+        frame[1] = ((uint64_t *)fp)[1];
+        return true;
+    }
+    /* Unknown bounds, reading ourselves this way fails instead of faulting */
+    struct iovec local = {.iov_base = frame, .iov_len = 2 * sizeof(uint64_t)};
+    struct iovec remote = {.iov_base = (void *)fp, .iov_len = 2 * sizeof(uint64_t)};
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+        2 * sizeof(uint64_t);
+}
+
+int dyndebug_unwind(const long long *gregs, uint64_t *pcs, int max)
+{
+    int depth = 0;
+    if (max <= 0)
+        return 0;
+    pcs[depth++] = gregs[REG_RIP];
+
+    uint64_t fp = gregs[REG_RBP], sp = gregs[REG_RSP], frame[2];
+    while (depth < max && fp >= sp && fp - sp <= MAX_UNWIND_FRAME_SIZE &&
+            !(fp & (sizeof(uint64_t) - 1)) && read_frame(fp, frame))
+    {
+        if (!frame[1])
+            break;
+        pcs[depth++] = frame[1];
+        /* Frames only go up the stack */
+        sp = fp + 2 * sizeof(uint64_t);
+        fp = frame[0];
+    }
+    return depth;
+}
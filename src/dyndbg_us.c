@@ -1,13 +1,151 @@
+#define _GNU_SOURCE
 #include <private/dyndbg_monitor.h>
+#include <private/dyndbg_trace.h>
+#include <private/dyndbg_snapshot.h>
+#include <private/dyndbg_gate.h>
+#include <private/dyndbg_uaf.h>
+#include <private/dyndbg_profiler.h>
+#include <private/dyndbg_write_profiler.h>
+#include <private/dyndbg_probe.h>
+#include <private/dyndbg_stats.h>
+#include <private/dyndbg_latency.h>
+#include <private/dyndbg_timeline.h>
+#include <private/dyndbg_dispatch.h>
+#include <private/dyndbg_ctl.h>
+#include <private/dyndbg_decode.h>
 #include <dyndbg/dyndbg_us.h>
 
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sched.h>
 #include <string.h>
+#include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
 #include <stdio.h>
 
-static void on_trap(int signum);
+static void on_trap(int signum, siginfo_t *info, void *ucontext);
+
+/* Threads share the monitor pipes, one request in flight at a time */
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set while the thread holds request_lock, a signal handler interrupting it
+fails its request rather than deadlock */
+static __thread bool request_held;
+/* Writers of the breakpoint list, the trap handler never takes it */
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Readers walk the list without any lock, counted by epoch parity. A removal
+waits for the readers which may still see the breakpoint, except the ones of
+the calling thread (a callback removing a breakpoint) */
+static uint32_t tree_epoch;
+static int tree_readers[2];
+static __thread int tree_held[2];
+static __thread void *trap_ucontext;
+/* Enabled breakpoints which are not gated, none lets closed gates skip the
+monitor */
+static int armed_ungated;
+/* Bumped once disarmed breakpoints may be unlisted, tells stale traps */
+static uint64_t disarm_generation;
+
+void *dyndebug_get_trap_ucontext(void)
+{
+    return trap_ucontext;
+}
+
+int dyndebug_tree_enter(void)
+{
+    for ( ; ; )
+    {
+        int parity = __atomic_load_n(&tree_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_fetch_add(&tree_readers[parity], 1, __ATOMIC_SEQ_CST);
+        if ((int)(__atomic_load_n(&tree_epoch, __ATOMIC_SEQ_CST) & 1) == parity)
+        {
+            tree_held[parity]++;
+            return parity;
+        }
+        __atomic_fetch_sub(&tree_readers[parity], 1, __ATOMIC_RELEASE);
+    }
+}
+
+void dyndebug_tree_exit(int parity)
+{
+    tree_held[parity]--;
+    __atomic_fetch_sub(&tree_readers[parity], 1, __ATOMIC_RELEASE);
+}
+
+/* Each parity is flipped then drained, new readers go to the other one */
+static void tree_synchronize(void)
+{
+    for (int i = 0 ; i < 2 ; i++)
+    {
+        int parity = __atomic_fetch_add(&tree_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&tree_readers[parity], __ATOMIC_SEQ_CST) >
+                tree_held[parity])
+            sched_yield();
+    }
+}
+
+/* No request is in flight when another thread forks, nor a module holding
+its lock across one, they are taken first */
+void dyndebug_fork_prepare(void)
+{
+    dyndebug_snapshot_fork_prepare();
+    dyndebug_trace_fork_prepare();
+    dyndebug_write_profiler_fork_prepare();
+    dyndebug_uaf_fork_prepare();
+    dyndebug_gate_fork_prepare();
+    dyndebug_profiler_fork_prepare();
+    pthread_mutex_lock(&request_lock);
+}
+
+void dyndebug_fork_parent(void)
+{
+    pthread_mutex_unlock(&request_lock);
+    dyndebug_profiler_fork_parent();
+    dyndebug_gate_fork_parent();
+    dyndebug_uaf_fork_parent();
+    dyndebug_write_profiler_fork_parent();
+    dyndebug_trace_fork_parent();
+    dyndebug_snapshot_fork_parent();
+}
+
+/* The debug registers are not inherited and the parent pipes belong to its
+session, the child opens its own on its first request. Probes are code, they
+keep firing */
+void dyndebug_fork_child(void)
+{
+    pthread_mutex_unlock(&request_lock);
+    request_held = false;
+    /* The parent readers are gone, a writer may have been too */
+    pthread_mutex_init(&tree_lock, NULL);
+    for (int parity = 0 ; parity < 2 ; parity++)
+        tree_readers[parity] = tree_held[parity];
+    ddbg_context_t *context = dyndebug_peek_context();
+    close(context->monitor_pipe[1]);
+    close(context->monitored_pipe[0]);
+    context->monitor_pipe[1] = -1;
+    context->monitored_pipe[0] = -1;
+    context->forked = true;
+    for (ddbg_breakpoint_t *b = context->breakpoints_root ; b ; b = b->next)
+        if (b->is_hw)
+            b->enabled = false;
+    armed_ungated = 0;
+
+    /* The parent threads are not, nor its statistics page */
+    dyndebug_stats_forked();
+    dyndebug_dispatch_forked();
+    dyndebug_timeline_forked();
+    dyndebug_control_forked();
+    dyndebug_probe_forked();
+    dyndebug_gate_forked();
+    dyndebug_profiler_forked();
+    dyndebug_write_profiler_forked();
+    dyndebug_uaf_forked();
+    dyndebug_trace_forked();
+    dyndebug_snapshot_forked();
+}
 
 ddbg_result_t dyndebug_start_monitor(void)
 {
@@ -16,7 +154,8 @@ ddbg_result_t dyndebug_start_monitor(void)
         return DDBG_CONTEXT_NOT_FOUND;
 
     struct sigaction sa = {0};
-    sa.sa_handler = on_trap;
+    sa.sa_sigaction = on_trap;
+    sa.sa_flags = SA_SIGINFO;
     int rc = sigaction(SIGTRAP, &sa, NULL);
     if (rc)
     {
@@ -31,6 +170,32 @@ ddbg_result_t dyndebug_start_monitor(void)
     return DDBG_SUCCESS;
 }
 
+void dyndebug_list_breakpoint(ddbg_context_t *context, ddbg_breakpoint_t *new_bp,
+    void *address, ddbg_btype_t type, ddbg_bsize_t size, ddbg_bcallback_t cb,
+    void *priv_arg, bool is_hw)
+{
+    new_bp->address = address;
+    new_bp->type = type;
+    new_bp->size = size;
+    new_bp->callback = cb;
+    new_bp->callback_priv_arg = priv_arg;
+    new_bp->is_hw = is_hw;
+    new_bp->enabled = false;
+    new_bp->flags = DDBG_BP_DEFAULT;
+    new_bp->value_mask = UINT64_MAX;
+    new_bp->value_min = 0;
+    new_bp->value_max = UINT64_MAX;
+    new_bp->gate_bit = 0;
+    new_bp->probe = NULL;
+    new_bp->exit_callback = NULL;
+    new_bp->probe_returns = 0;
+    pthread_mutex_lock(&tree_lock);
+    new_bp->next = context->breakpoints_root;
+    __atomic_store_n(&context->breakpoints_root, new_bp, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tree_lock);
+    dyndebug_stats_add(new_bp);
+}
+
 ddbg_result_t dyndebug_add_breakpoint(ddbg_breakpoint_t *new_bp, void *address,
     ddbg_btype_t type, ddbg_bsize_t size, ddbg_bcallback_t cb, void *priv_arg,
     bool is_hw)
@@ -42,7 +207,7 @@ ddbg_result_t dyndebug_add_breakpoint(ddbg_breakpoint_t *new_bp, void *address,
     if (!new_bp)
         return DDBG_INVALID_ARGUMENT;
 
-    if (!is_hw)
+    if (!is_hw && type != DDBG_BREAK_INSTRUCTION)
         return DDBG_SWBP_NOT_IMPLEMENTED;
 
     if (!cb)
@@ -51,27 +216,123 @@ ddbg_result_t dyndebug_add_breakpoint(ddbg_breakpoint_t *new_bp, void *address,
     if (dyndebug_find_breakpoint(address, type, size, false))
         return DDBG_INVALID_ARGUMENT;
 
-    new_bp->address = address;
-    new_bp->type = type;
-    new_bp->size = size;
-    new_bp->callback = cb;
-    new_bp->callback_priv_arg = priv_arg;
-    new_bp->is_hw = is_hw;
-    new_bp->next = context->breakpoints_root;
-    context->breakpoints_root = new_bp;
-
+    dyndebug_list_breakpoint(context, new_bp, address, type, size, cb, priv_arg,
+        is_hw);
     return dyndebug_enable_breakpoint(new_bp);
 }
 
+int dyndebug_add_symbol_breakpoints(const char *const *patterns, int count,
+    ddbg_breakpoint_t *breakpoints, int max, ddbg_bcallback_t cb, void *priv_arg)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context || !patterns || !breakpoints || !cb || max <= 0)
+        return 0;
+
+    /* Everything is resolved first, the symbol index is built once */
+    ddbg_symbol_t *symbols = malloc(max * sizeof(ddbg_symbol_t));
+    if (!symbols)
+        return 0;
+    int listed = 0;
+    for (int p = 0 ; p < count && listed < max ; p++)
+    {
+        int found = dyndebug_find_symbols(patterns[p], symbols, max - listed);
+        for (int s = 0 ; s < found ; s++)
+        {
+            if (!symbols[s].is_function ||
+                    dyndebug_find_breakpoint(symbols[s].address,
+                    DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, false))
+                continue;
+            dyndebug_list_breakpoint(context, &breakpoints[listed++],
+                symbols[s].address, DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE,
+                cb, priv_arg, true);
+        }
+    }
+    free(symbols);
+
+    ddbg_breakpoint_t **listing = malloc(listed * sizeof(ddbg_breakpoint_t *));
+    int armed = 0;
+    if (listing)
+    {
+        for (int i = 0 ; i < listed ; i++)
+            listing[i] = &breakpoints[i];
+        armed = dyndebug_arm_breakpoints(listing, listed);
+        free(listing);
+    }
+
+    /* Out of debug registers, the rest is not kept listed */
+    for (int i = armed ; i < listed ; i++)
+        dyndebug_remove_breakpoint(&breakpoints[i]);
+    return armed;
+}
+
+ddbg_result_t dyndebug_set_breakpoint_flags(ddbg_breakpoint_t *b, uint32_t flags)
+{
+    if (!b || (flags & ~(DDBG_BP_TRACE | DDBG_BP_SNAPSHOT | DDBG_BP_ON_CHANGE |
+            DDBG_BP_GATED | DDBG_BP_ASYNC)) ||
+            ((flags & DDBG_BP_ON_CHANGE) && b->type == DDBG_BREAK_INSTRUCTION) ||
+            ((flags & ~DDBG_BP_ASYNC) && !b->is_hw))
+        return DDBG_INVALID_ARGUMENT;
+
+    /* Synchronous again, the hits already queued are waited for so that a
+    removal does not need to */
+    bool unqueued = (b->flags & DDBG_BP_ASYNC) && !(flags & DDBG_BP_ASYNC);
+    if (unqueued && dyndebug_dispatch_in_worker())
+        return DDBG_INVALID_ARGUMENT;
+
+    uint32_t gating = (flags ^ b->flags) & DDBG_BP_GATED;
+    if (gating && (flags & DDBG_BP_GATED))
+    {
+        if (!dyndebug_gate_acquire(b))
+            return DDBG_ALL_HWBP_BUSY;
+        if (b->enabled)
+            __atomic_fetch_sub(&armed_ungated, 1, __ATOMIC_RELEASE);
+    }
+    else if (gating)
+    {
+        dyndebug_gate_release(b);
+        if (b->enabled)
+            __atomic_fetch_add(&armed_ungated, 1, __ATOMIC_RELEASE);
+    }
+    b->flags = flags;
+    dyndebug_stats_update(b);
+    if (unqueued)
+        dyndebug_flush_dispatcher();
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_set_probe_exit(ddbg_breakpoint_t *b, ddbg_bcallback_t cb)
+{
+    if (!b || b->is_hw)
+        return DDBG_INVALID_ARGUMENT;
+    b->exit_callback = cb;
+    return DDBG_SUCCESS;
+}
+
+ddbg_result_t dyndebug_set_value_filter(ddbg_breakpoint_t *b, uint64_t mask,
+    uint64_t min, uint64_t max)
+{
+    if (!b || b->type == DDBG_BREAK_INSTRUCTION || !mask || min > max)
+        return DDBG_INVALID_ARGUMENT;
+    b->value_mask = mask;
+    b->value_min = min;
+    b->value_max = max;
+    b->flags |= DDBG_BP_ON_CHANGE;
+    dyndebug_stats_update(b);
+    return DDBG_SUCCESS;
+}
+
 static void dump_breakpoints(ddbg_context_t *context)
 {
-    ddbg_breakpoint_t *current = context->breakpoints_root;
+    int parity = dyndebug_tree_enter();
+    ddbg_breakpoint_t *current = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
     error_print("Breakpoints are:\n");
     while (current)
     {
         error_print("current->address %p\n", current->address);
-        current = current->next;
+        current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
     }
+    dyndebug_tree_exit(parity);
 }
 
 ddbg_breakpoint_t *dyndebug_find_breakpoint(void *address, ddbg_btype_t type,
@@ -81,15 +342,19 @@ ddbg_breakpoint_t *dyndebug_find_breakpoint(void *address, ddbg_btype_t type,
     if (!context)
         return NULL;
 
-    ddbg_breakpoint_t *current = context->breakpoints_root;
+    int parity = dyndebug_tree_enter();
+    ddbg_breakpoint_t *current = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
     while (current)
     {
         if ((current->address == address) && (current->type == type) &&
                 (current->size == size))
-            return current;
-        current = current->next;
+            break;
+        current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
     }
-    if (!verbose) return NULL;
+    dyndebug_tree_exit(parity);
+    if (current || !verbose)
+        return current;
 
     error_print("No breakpoint found at %p\n", address);
     dump_breakpoints(context);
@@ -108,33 +373,67 @@ ddbg_result_t dyndebug_remove_breakpoint(ddbg_breakpoint_t *b)
     if (!context->breakpoints_root)
         return DDBG_HWBP_NOT_FOUND;
 
+    /* Its queued hits are waited for below, which a worker cannot do */
+    if ((b->flags & DDBG_BP_ASYNC) && dyndebug_dispatch_in_worker())
+        return DDBG_INVALID_ARGUMENT;
+
     /* Disable it before removal */
     dyndebug_disable_breakpoint(b);
-
-    if (b == context->breakpoints_root)
+    if (b->flags & DDBG_BP_GATED)
+        dyndebug_set_breakpoint_flags(b, b->flags & ~DDBG_BP_GATED);
+    dyndebug_stats_remove(b);
+    /* Queued hits point to it */
+    if (b->flags & DDBG_BP_ASYNC)
+        dyndebug_flush_dispatcher();
+
+    /* Unlinked, b->next stays valid for the readers still on b */
+    ddbg_result_t result = DDBG_HWBP_NOT_FOUND;
+    pthread_mutex_lock(&tree_lock);
+    ddbg_breakpoint_t **link = &context->breakpoints_root;
+    for ( ; *link ; link = &(*link)->next)
     {
-        context->breakpoints_root = b->next;
-        return DDBG_SUCCESS;
-    }
-
-    ddbg_breakpoint_t *prev = context->breakpoints_root;
-    while (prev->next)
-    {
-        ddbg_breakpoint_t *current = prev->next;
-        if ((current->address == b->address) && (current->type == b->type) &&
-                (current->size == b->size))
+        if (*link == b)
         {
-            prev->next = b->next;
-            return DDBG_SUCCESS;
+            __atomic_store_n(link, b->next, __ATOMIC_RELEASE);
+            result = DDBG_SUCCESS;
+            break;
         }
-        prev = prev->next;
     }
-    return DDBG_HWBP_NOT_FOUND;
+    pthread_mutex_unlock(&tree_lock);
+    if (result == DDBG_SUCCESS)
+        tree_synchronize();
+    if (!b->is_hw)
+        dyndebug_probe_wait_returns(b);
+    return result;
 }
 
-static void dyndebug_send_monitor_request(ddbg_context_t *context,
+void dyndebug_send_monitor_request(ddbg_context_t *context,
         ddbg_monitor_request_t *request, ddbg_monitor_response_t *response)
 {
+    uint64_t begin = dyndebug_timeline_begin();
+    request->traced = begin != 0;
+    request->timed = __atomic_load_n(&dyndebug_latency_enabled,
+        __ATOMIC_RELAXED);
+    uint64_t start = request->timed ? dyndebug_latency_now() : 0;
+    /* A trap or a crash of the thread within its own request */
+    if (request_held)
+    {
+        response->result = DDBG_MONITOR_REQUEST_FAILURE;
+        return;
+    }
+    response->stopped_tsc = 0;
+    request_held = true;
+    pthread_mutex_lock(&request_lock);
+    uint64_t locked = request->timed ? dyndebug_latency_now() : 0;
+    if (context->forked && !dyndebug_register_session(context))
+    {
+        error_print("Cannot open a monitor session for process %d\n",
+            getpid());
+        response->result = DDBG_MONITOR_COMM_FAILURE;
+        pthread_mutex_unlock(&request_lock);
+        request_held = false;
+        return;
+    }
     if (write(context->monitor_pipe[1], request, sizeof(*request)) !=
             sizeof(*request))
     {
@@ -149,6 +448,45 @@ static void dyndebug_send_monitor_request(ddbg_context_t *context,
             strerror(errno));
         response->result = DDBG_MONITOR_COMM_FAILURE;
     }
+    else
+    {
+        dyndebug_stats_slots(response->slots);
+        if (request->timed)
+            dyndebug_latency_record(response, locked - start,
+                dyndebug_latency_now() - locked);
+    }
+    pthread_mutex_unlock(&request_lock);
+    request_held = false;
+    if (begin)
+        dyndebug_timeline_request(request, response, begin);
+}
+
+/* Copied by the kernel, a plain read would trigger the RDWR watches on it */
+static uint64_t breakpoint_value(const ddbg_breakpoint_t *b)
+{
+    uint64_t value = 0;
+    struct iovec local = {.iov_base = &value,
+        .iov_len = dyndebug_bsize_bytes(b->size)};
+    struct iovec remote = {.iov_base = (void *)b->address,
+        .iov_len = local.iov_len};
+    process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+    return value;
+}
+
+/* A watch joined or left a slot, the ones sharing its word restart from the
+current values */
+static void refresh_word(ddbg_context_t *context, ddbg_breakpoint_t *b)
+{
+    uint64_t word = (uint64_t)b->address & ~7ULL;
+    int parity = dyndebug_tree_enter();
+    ddbg_breakpoint_t *current = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
+    for ( ; current ;
+            current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
+        if (current->is_hw && current->type == b->type &&
+                ((uint64_t)current->address & ~7ULL) == word)
+            current->shadow = breakpoint_value(current);
+    dyndebug_tree_exit(parity);
 }
 
 static ddbg_result_t dyndebug_enable_disable_breakpoint(ddbg_breakpoint_t *b,
@@ -158,19 +496,28 @@ static ddbg_result_t dyndebug_enable_disable_breakpoint(ddbg_breakpoint_t *b,
     if (!context)
         return DDBG_CONTEXT_NOT_FOUND;
 
-    ddbg_breakpoint_t *current = context->breakpoints_root;
-    while (current)
-    {
-        if (current == b)
-            break;
-        current = current->next;
-    }
+    int parity = dyndebug_tree_enter();
+    ddbg_breakpoint_t *current = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
+    while (current && current != b)
+        current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE);
+    dyndebug_tree_exit(parity);
     if (!current)
         return DDBG_HWBP_NOT_FOUND;
 
     if (b->enabled == enable)
         return DDBG_SUCCESS;
 
+    if (!b->is_hw)
+    {
+        ddbg_result_t result = enable ? dyndebug_probe_patch(b) :
+            dyndebug_probe_unpatch(b);
+        if (result == DDBG_SUCCESS)
+            b->enabled = enable;
+        dyndebug_stats_state(b);
+        return result;
+    }
+
     ddbg_monitor_request_t request;
     ddbg_monitor_response_t response;
     request.operation = enable ? DDBG_ENABLE_BREAKPOINT : DDBG_DISABLE_BREAKPOINT;
@@ -183,10 +530,99 @@ static ddbg_result_t dyndebug_enable_disable_breakpoint(ddbg_breakpoint_t *b,
 
     /* bookkeeping */
     if (response.result == DDBG_SUCCESS)
+    {
         b->enabled = enable;
+        dyndebug_stats_state(b);
+        if (b->type != DDBG_BREAK_INSTRUCTION)
+            refresh_word(context, b);
+        if (!(b->flags & DDBG_BP_GATED))
+            __atomic_fetch_add(&armed_ungated, enable ? 1 : -1, __ATOMIC_RELEASE);
+    }
     return response.result;
 }
 
+int dyndebug_arm_breakpoints(ddbg_breakpoint_t **breakpoints, int count)
+{
+    return dyndebug_swap_breakpoints(NULL, 0, breakpoints, count);
+}
+
+int dyndebug_swap_breakpoints(ddbg_breakpoint_t **disarmed, int disarm_count,
+    ddbg_breakpoint_t **breakpoints, int count)
+{
+    ddbg_context_t *context = dyndebug_get_context();
+    if (!context || disarm_count > HW_BREAKPOINTS_COUNT)
+        return 0;
+
+    /* One monitor request per batch, not per breakpoint */
+    int armed = 0;
+    while (armed < count || disarm_count)
+    {
+        ddbg_monitor_request_t request;
+        ddbg_monitor_response_t response;
+        request.operation = DDBG_ENABLE_BREAKPOINTS;
+        request.batch.count = 0;
+        request.batch.disarmed = disarm_count;
+        for (int i = 0 ; i < disarm_count ; i++)
+        {
+            ddbg_breakpoint_t *b = disarmed[i];
+            request.batch.items[request.batch.count].address = b->address;
+            request.batch.items[request.batch.count].type = b->type;
+            request.batch.items[request.batch.count++].size = b->size;
+        }
+        for (int i = armed ; i < count &&
+                request.batch.count < disarm_count + HW_BREAKPOINTS_COUNT ; i++)
+        {
+            ddbg_breakpoint_t *b = breakpoints[i];
+            request.batch.items[request.batch.count].address = b->address;
+            request.batch.items[request.batch.count].type = b->type;
+            request.batch.items[request.batch.count++].size = b->size;
+        }
+        dyndebug_send_monitor_request(context, &request, &response);
+        if (response.result == DDBG_MONITOR_COMM_FAILURE ||
+                response.result == DDBG_MONITOR_REQUEST_FAILURE)
+            break;
+        /* Before the disarmed ones can be unlisted, see handle_slot_hit */
+        if (response.batch.disarmed)
+            __atomic_add_fetch(&disarm_generation, 1, __ATOMIC_RELEASE);
+        for (int i = 0 ; i < response.batch.disarmed ; i++)
+        {
+            ddbg_breakpoint_t *b = disarmed[i];
+            b->enabled = false;
+            dyndebug_stats_state(b);
+            if (b->type != DDBG_BREAK_INSTRUCTION)
+                refresh_word(context, b);
+            if (!(b->flags & DDBG_BP_GATED))
+                __atomic_fetch_sub(&armed_ungated, 1, __ATOMIC_RELEASE);
+        }
+        disarm_count = 0;
+        for (int i = 0 ; i < response.batch.armed ; i++)
+        {
+            ddbg_breakpoint_t *b = breakpoints[armed + i];
+            b->enabled = true;
+            dyndebug_stats_state(b);
+            if (b->type != DDBG_BREAK_INSTRUCTION)
+                refresh_word(context, b);
+            if (!(b->flags & DDBG_BP_GATED))
+                __atomic_fetch_add(&armed_ungated, 1, __ATOMIC_RELEASE);
+        }
+        armed += response.batch.armed;
+        if (response.result != DDBG_SUCCESS)
+            break;
+    }
+    return armed;
+}
+
+int dyndebug_arm_probes(ddbg_breakpoint_t **breakpoints, int count)
+{
+    int armed = dyndebug_probe_patch_batch(breakpoints, count);
+    for (int i = 0 ; i < armed ; i++)
+    {
+        breakpoints[i]->enabled = true;
+        dyndebug_stats_state(breakpoints[i]);
+    }
+    return armed;
+}
+
 ddbg_result_t dyndebug_enable_breakpoint(ddbg_breakpoint_t *b)
 {
     return dyndebug_enable_disable_breakpoint(b, true);
@@ -203,28 +639,187 @@ ddbg_result_t dyndebug_disable_all_breakpoint()
     if (!context)
         return DDBG_CONTEXT_NOT_FOUND;
 
+    /* Probes are not in the debug registers */
+    int parity = dyndebug_tree_enter();
+    ddbg_breakpoint_t *root = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
+    ddbg_breakpoint_t *current = root;
+    for ( ; current ;
+            current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
+        if (!current->is_hw)
+            dyndebug_disable_breakpoint(current);
+
     ddbg_monitor_request_t request;
     ddbg_monitor_response_t response;
     request.operation = DDBG_DISABLE_ALL_BREAKPOINTS;
     dyndebug_send_monitor_request(context, &request, &response);
     if (response.result != DDBG_SUCCESS)
+    {
+        dyndebug_tree_exit(parity);
         return response.result;
+    }
 
     /* bookkeeping */
-    ddbg_breakpoint_t *current = context->breakpoints_root;
-    while (current)
+    for (current = root ; current ;
+            current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
     {
         current->enabled = false;
-        current = current->next;
+        current->demoted = false;
+        dyndebug_stats_state(current);
     }
+    dyndebug_tree_exit(parity);
+    __atomic_store_n(&armed_ungated, 0, __ATOMIC_RELEASE);
     return DDBG_SUCCESS;
 }
 
-static void on_trap(int signum)
+static void dispatch_hit(ddbg_breakpoint_t *b, void *ucontext)
 {
-    if (signum != SIGTRAP)
+    dyndebug_stats_hit(b);
+    if (!(b->flags & DDBG_BP_ASYNC) || !dyndebug_dispatch_hit(b, ucontext))
+    {
+        /* Callbacks may look at the trapped context (RIP, stack...) */
+        void *former = trap_ucontext;
+        trap_ucontext = ucontext;
+        uint64_t begin = dyndebug_timeline_begin();
+        b->callback(b);
+        if (begin)
+            dyndebug_timeline_record(DDBG_TIMELINE_CALLBACK, 0,
+                (uint64_t)b->address, begin);
+        trap_ucontext = former;
+    }
+
+    if (b->flags & DDBG_BP_SNAPSHOT)
+        dyndebug_snapshot_take(b, ucontext);
+    if (b->flags & DDBG_BP_TRACE)
+        dyndebug_trace_start(ucontext);
+}
+
+/* Moves the shadow to the current value, true when it changed */
+static bool refresh_value(ddbg_breakpoint_t *b)
+{
+    b->old_value = b->shadow;
+    b->shadow = breakpoint_value(b);
+    return b->shadow != b->old_value;
+}
+
+/* False when the hit is filtered out: masked value unchanged or out of
+[value_min, value_max] */
+static bool filter_value(const ddbg_breakpoint_t *b)
+{
+    uint64_t value = b->shadow & b->value_mask;
+    return value != (b->old_value & b->value_mask) &&
+        value >= b->value_min && value <= b->value_max;
+}
+
+/* The store which fired a write slot, decoded back from the trapped RIP since
+data breakpoints trap once the instruction retired. False unless a single
+store ending there hits the word */
+static bool packed_store(void *ucontext, uint64_t word, uint64_t *start,
+        uint64_t *end)
+{
+    const long long *gregs = ((ucontext_t *)ucontext)->uc_mcontext.gregs;
+    uint8_t code[2 * MAX_INSTRUCTION_SIZE] = {0};
+    struct iovec local = {.iov_base = code, .iov_len = sizeof(code)};
+    struct iovec remote = {.iov_base = (void *)(gregs[REG_RIP] -
+        MAX_INSTRUCTION_SIZE), .iov_len = sizeof(code)};
+    if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) <
+            MAX_INSTRUCTION_SIZE)
+        return false;
+
+    bool found = false;
+    for (int length = 1 ; length <= MAX_INSTRUCTION_SIZE ; length++)
+    {
+        ddbg_instruction_t insn;
+        uint64_t address;
+        if (dyndebug_decode_instruction(&code[MAX_INSTRUCTION_SIZE - length],
+                &insn) != length || !insn.store ||
+                !dyndebug_instruction_address(&insn, gregs, &address) ||
+                address >= word + 8 || address + insn.store <= word)
+            continue;
+        if (found && (address != *start || address + insn.store != *end))
+            return false;
+        *start = address;
+        *end = address + insn.store;
+        found = true;
+    }
+    return found;
+}
+
+/* The write slot covers the aligned word of several watches, called when the
+decoded store overlaps them. A store which cannot be decoded calls the ones
+whose value changed, and the word is split over free slots for the next ones
+to be told apart */
+static void dispatch_packed_hit(ddbg_context_t *context, uint64_t word,
+        ddbg_btype_t type, void *ucontext)
+{
+    uint64_t start = 0, end = 0;
+    bool located = packed_store(ucontext, word, &start, &end);
+
+    ddbg_breakpoint_t *root = __atomic_load_n(&context->breakpoints_root,
+        __ATOMIC_ACQUIRE);
+    ddbg_breakpoint_t *current;
+    for (current = root ; current ;
+            current = __atomic_load_n(&current->next, __ATOMIC_ACQUIRE))
+    {
+        uint64_t address = (uint64_t)current->address;
+        if (!current->enabled || current->type != type ||
+                address < word || address >= word + 8)
+            continue;
+        bool changed = refresh_value(current);
+        if ((current->flags & DDBG_BP_GATED) &&
+                !(dyndebug_open_gates & current->gate_bit))
+            continue;
+        if (located ? address >= end ||
+                address + dyndebug_bsize_bytes(current->size) <= start :
+                !changed)
+            continue;
+        if ((current->flags & DDBG_BP_ON_CHANGE) && !filter_value(current))
+            continue;
+        dispatch_hit(current, ucontext);
+    }
+
+    if (!located)
+    {
+        ddbg_monitor_request_t request;
+        ddbg_monitor_response_t response;
+        request.operation = DDBG_SPLIT_BREAKPOINT;
+        request.breakpoint.address = (void *)word;
+        request.breakpoint.type = type;
+        dyndebug_send_monitor_request(context, &request, &response);
+    }
+}
+
+/* One of the slots the trap fired, a breakpoint disarmed and unlisted since
+the monitor answered (generation moved) is a stale hit, dropped silently */
+static void handle_slot_hit(ddbg_context_t *context, void *address,
+        ddbg_btype_t type, ddbg_bsize_t size, bool packed, uint64_t generation,
+        void *ucontext)
+{
+    if (packed)
+    {
+        dispatch_packed_hit(context, (uint64_t)address, type, ucontext);
+        return;
+    }
+    ddbg_breakpoint_t *b = dyndebug_find_breakpoint(address, type, size, false);
+    if (!b)
+    {
+        if (__atomic_load_n(&disarm_generation, __ATOMIC_ACQUIRE) == generation)
+            error_print("Breakpoint triggered but not found for (%p, %d, %d)...\n",
+                address, type, size);
+        return;
+    }
+    if (b->type != DDBG_BREAK_INSTRUCTION)
+        refresh_value(b);
+    if ((b->flags & DDBG_BP_GATED) && !(dyndebug_open_gates & b->gate_bit))
+        return;
+    if ((b->flags & DDBG_BP_ON_CHANGE) && !filter_value(b))
         return;
+    dispatch_hit(b, ucontext);
+}
 
+/* Asks the monitor which slots fired, timed as a whole by on_trap */
+static void handle_trap(void *ucontext)
+{
     ddbg_context_t *context = dyndebug_get_context();
     if (!context)
     {
@@ -235,21 +830,38 @@ static void on_trap(int signum)
     ddbg_monitor_request_t request;
     ddbg_monitor_response_t response;
     request.operation = DDBG_GET_TRIGGERED_BREAKPOINT;
+    request.breakpoint.tid = syscall(SYS_gettid);
+    uint64_t generation = __atomic_load_n(&disarm_generation, __ATOMIC_ACQUIRE);
     dyndebug_send_monitor_request(context, &request, &response);
     if (response.result != DDBG_SUCCESS)
     {
         error_print("SIGTRAP signal reason not found!\n");
         return;
     }
-    ddbg_breakpoint_t *b = dyndebug_find_breakpoint(response.breakpoint.address,
-        response.breakpoint.type, response.breakpoint.size, false);
-    if (!b)
-    {
-        error_print("Breakpoint triggered but not found for (%p, %d, %d)...\n",
-            response.breakpoint.address, response.breakpoint.type,
-            response.breakpoint.size);
+    for (int i = 0 ; i < response.trapped.count ; i++)
+        handle_slot_hit(context, response.trapped.items[i].address,
+            response.trapped.items[i].type, response.trapped.items[i].size,
+            response.trapped.items[i].packed, generation, ucontext);
+}
+
+static void on_trap(int signum, siginfo_t *info, void *ucontext)
+{
+    if (signum != SIGTRAP)
+        return;
+
+    /* Trap flag steps are handled in-process, the monitor is not involved */
+    if (info->si_code == TRAP_TRACE && dyndebug_trace_step(ucontext))
+        return;
+    /* Only gated breakpoints armed and none open in this thread */
+    if (!dyndebug_open_gates &&
+            !__atomic_load_n(&armed_ungated, __ATOMIC_ACQUIRE))
         return;
-    }
 
-    b->callback(b);
+    /* The breakpoints found are not released before their callbacks return */
+    uint64_t begin = dyndebug_timeline_begin();
+    int parity = dyndebug_tree_enter();
+    handle_trap(ucontext);
+    dyndebug_tree_exit(parity);
+    if (begin)
+        dyndebug_timeline_record(DDBG_TIMELINE_TRAP, 0, 0, begin);
 }
@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <private/dyndbg_write_profiler.h>
+#include <private/dyndbg_monitor.h>
+#include <private/dyndbg_unwind.h>
+
+#include <ucontext.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <time.h>
+
+static ddbg_profiled_watch_t watches[MAX_PROFILED_WATCHES];
+static int watch_count;
+static int watch_next;
+static uint32_t watch_slots;
+static uint32_t rotation_ms;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t rotation_thread;
+static bool rotation_running;
+static bool rotation_stopping;
+
+/* Filled from the SIGTRAP handlers, slots are claimed with a CAS */
+static ddbg_write_site_entry_t sites[MAX_WRITE_SITES];
+static uint64_t sites_overflow;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_site(void *address, const uint64_t *pcs, int depth)
+{
+    uint64_t hash = (uint64_t)address * 0x9e3779b97f4a7c15ULL;
+    for (int i = 0 ; i < depth ; i++)
+        hash = ((hash ^ pcs[i]) * 0x100000001b3ULL) ^ (hash >> 29);
+    if (!hash)
+        hash = 1;
+
+    uint32_t slot = hash & (MAX_WRITE_SITES - 1);
+    for (int probe = 0 ; probe < MAX_WRITE_SITES ; probe++)
+    {
+        ddbg_write_site_entry_t *entry = &sites[slot];
+        uint64_t current = __atomic_load_n(&entry->hash, __ATOMIC_ACQUIRE);
+        if (!current)
+        {
+            /* Filled before the count makes it visible to the readers */
+            if (__atomic_compare_exchange_n(&entry->hash, &current, hash,
+                    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                entry->site.address = address;
+                for (int i = 0 ; i < DDBG_WRITE_SITE_DEPTH ; i++)
+                    entry->site.pcs[i] = i < depth ? (void *)pcs[i] : NULL;
+                __atomic_add_fetch(&entry->site.count, 1, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+        if (current == hash)
+        {
+            __atomic_add_fetch(&entry->site.count, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        slot = (slot + 1) & (MAX_WRITE_SITES - 1);
+    }
+    __atomic_add_fetch(&sites_overflow, 1, __ATOMIC_RELAXED);
+}
+
+static void on_profiled_access(ddbg_breakpoint_t *b)
+{
+    ddbg_profiled_watch_t *watch = b->callback_priv_arg;
+    ucontext_t *ucontext = dyndebug_get_trap_ucontext();
+    uint64_t pcs[DDBG_WRITE_SITE_DEPTH];
+    int depth = 0;
+
+    __atomic_add_fetch(&watch->hits, 1, __ATOMIC_RELAXED);
+    if (ucontext)
+        depth = dyndebug_unwind(ucontext->uc_mcontext.gregs, pcs,
+            DDBG_WRITE_SITE_DEPTH);
+    record_site(watch->address, pcs, depth);
+}
+
+ddbg_result_t dyndebug_add_profiled_watch(void *address, ddbg_btype_t type,
+    ddbg_bsize_t size)
+{
+    if (!address || (type != DDBG_BREAK_DATA_WRITE &&
+            type != DDBG_BREAK_DATA_RDWR))
+        return DDBG_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&watch_lock);
+    for (int i = 0 ; i < watch_count ; i++)
+    {
+        if (watches[i].address == address)
+        {
+            pthread_mutex_unlock(&watch_lock);
+            return DDBG_BP_ALREADY_EXISTS;
+        }
+    }
+    if (watch_count == MAX_PROFILED_WATCHES || rotation_running)
+    {
+        pthread_mutex_unlock(&watch_lock);
+        return DDBG_ALL_HWBP_BUSY;
+    }
+    ddbg_profiled_watch_t *watch = &watches[watch_count++];
+    memset(watch, 0, sizeof(*watch));
+    watch->address = address;
+    watch->type = type;
+    watch->size = size;
+    pthread_mutex_unlock(&watch_lock);
+    return DDBG_SUCCESS;
+}
+
+/* Called with watch_lock held. The watches leaving the window and the ones
+joining it are swapped in a single monitor request, the leaving ones are
+unlisted after. A trap racing the swap is dropped by the monitor when its slot
+was disabled, attributed to the new watch when it was re-armed */
+static void swap_watches(bool *in_window)
+{
+    ddbg_breakpoint_t *leaving[HW_BREAKPOINTS_COUNT];
+    ddbg_breakpoint_t *joining[HW_BREAKPOINTS_COUNT];
+    ddbg_profiled_watch_t *left[HW_BREAKPOINTS_COUNT];
+    ddbg_profiled_watch_t *joined[HW_BREAKPOINTS_COUNT];
+    int leaves = 0, joins = 0;
+
+    ddbg_context_t *context = dyndebug_get_context();
+    for (int i = 0 ; i < watch_count ; i++)
+    {
+        ddbg_profiled_watch_t *watch = &watches[i];
+        if (watch->armed && !in_window[i] && leaves < HW_BREAKPOINTS_COUNT)
+        {
+            left[leaves] = watch;
+            leaving[leaves++] = &watch->breakpoint;
+        }
+        else if (!watch->armed && in_window[i] && joins < HW_BREAKPOINTS_COUNT)
+        {
+            dyndebug_list_breakpoint(context, &watch->breakpoint,
+                watch->address, watch->type, watch->size, on_profiled_access,
+                watch, true);
+            joined[joins] = watch;
+            joining[joins++] = &watch->breakpoint;
+        }
+    }
+
+    int armed = dyndebug_swap_breakpoints(leaving, leaves, joining, joins);
+    uint64_t now = now_ns();
+    for (int i = 0 ; i < leaves ; i++)
+    {
+        if (leaving[i]->enabled)
+            continue;
+        dyndebug_remove_breakpoint(leaving[i]);
+        left[i]->armed_total_ns += now - left[i]->armed_since_ns;
+        left[i]->armed = false;
+    }
+    for (int i = 0 ; i < joins ; i++)
+    {
+        /* Slots busy, not kept listed */
+        if (i >= armed)
+        {
+            dyndebug_remove_breakpoint(joining[i]);
+            continue;
+        }
+        joined[i]->armed = true;
+        joined[i]->armed_since_ns = now;
+    }
+}
+
+/* Called with watch_lock held, moves the window to the next watches */
+static void rotate_watches(void)
+{
+    bool in_window[MAX_PROFILED_WATCHES] = {false};
+    uint32_t window = (uint32_t)watch_count < watch_slots ?
+        (uint32_t)watch_count : watch_slots;
+    for (uint32_t i = 0 ; i < window ; i++)
+        in_window[(watch_next + i) % watch_count] = true;
+    swap_watches(in_window);
+    watch_next = (watch_next + window) % watch_count;
+}
+
+static void *rotation_main(void *arg __attribute__((unused)))
+{
+    struct timespec period = {
+        .tv_sec = rotation_ms / 1000, .tv_nsec = (rotation_ms % 1000) * 1000000L};
+    while (!__atomic_load_n(&rotation_stopping, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&period, NULL);
+        pthread_mutex_lock(&watch_lock);
+        if (!rotation_stopping && (uint32_t)watch_count > watch_slots)
+            rotate_watches();
+        pthread_mutex_unlock(&watch_lock);
+    }
+    return NULL;
+}
+
+ddbg_result_t dyndebug_start_write_profiler(uint32_t slots, uint32_t period_ms)
+{
+    if (!slots || slots > HW_BREAKPOINTS_COUNT)
+        return DDBG_INVALID_ARGUMENT;
+    if (!dyndebug_get_context())
+        return DDBG_CONTEXT_NOT_FOUND;
+
+    pthread_mutex_lock(&watch_lock);
+    if (rotation_running || !watch_count)
+    {
+        pthread_mutex_unlock(&watch_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    memset(sites, 0, sizeof(sites));
+    sites_overflow = 0;
+    for (int i = 0 ; i < watch_count ; i++)
+    {
+        watches[i].hits = 0;
+        watches[i].armed_total_ns = 0;
+    }
+    watch_slots = slots;
+    watch_next = 0;
+    rotation_ms = period_ms ? period_ms : DEFAULT_ROTATION_MS;
+    rotate_watches();
+
+    __atomic_store_n(&rotation_stopping, false, __ATOMIC_RELEASE);
+    if (pthread_create(&rotation_thread, NULL, rotation_main, NULL))
+    {
+        error_print("Cannot start the watch rotation\n");
+        bool none[MAX_PROFILED_WATCHES] = {false};
+        swap_watches(none);
+        pthread_mutex_unlock(&watch_lock);
+        return DDBG_START_FAILURE;
+    }
+    rotation_running = true;
+    pthread_mutex_unlock(&watch_lock);
+    return DDBG_SUCCESS;
+}
+
+void dyndebug_write_profiler_fork_prepare(void)
+{
+    pthread_mutex_lock(&watch_lock);
+}
+
+void dyndebug_write_profiler_fork_parent(void)
+{
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* The watches are no longer armed, they are unlisted as a stop would */
+void dyndebug_write_profiler_forked(void)
+{
+    pthread_mutex_init(&watch_lock, NULL);
+    if (!rotation_running)
+        return;
+    rotation_running = false;
+    for (int i = 0 ; i < watch_count ; i++)
+    {
+        if (!watches[i].armed)
+            continue;
+        dyndebug_remove_breakpoint(&watches[i].breakpoint);
+        watches[i].armed = false;
+    }
+}
+
+static void print_site_frame(FILE *out, void *pc)
+{
+    Dl_info info;
+    if (dladdr(pc, &info) && info.dli_sname)
+        fprintf(out, " %s+0x%lx", info.dli_sname,
+            (uint64_t)pc - (uint64_t)info.dli_saddr);
+    else
+        fprintf(out, " %p", pc);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    uint64_t ca = ((const ddbg_write_site_t *)a)->count;
+    uint64_t cb = ((const ddbg_write_site_t *)b)->count;
+    return ca < cb ? 1 : (ca > cb ? -1 : 0);
+}
+
+static void write_report(FILE *out)
+{
+    fprintf(out, "Watched accesses (%d addresses, %u slots, %u ms rotation):\n",
+        watch_count, watch_slots, rotation_ms);
+    for (int i = 0 ; i < watch_count ; i++)
+    {
+        ddbg_profiled_watch_t *watch = &watches[i];
+        double seconds = watch->armed_total_ns / 1e9;
+        fprintf(out, "%p: %lu hits in %.3f s watched, ~%.0f/s\n",
+            watch->address, watch->hits, seconds,
+            seconds > 0 ? watch->hits / seconds : 0.);
+    }
+
+    ddbg_write_site_t *sorted = calloc(MAX_WRITE_SITES, sizeof(ddbg_write_site_t));
+    if (!sorted)
+        return;
+    int count = dyndebug_get_write_sites(sorted, MAX_WRITE_SITES);
+    qsort(sorted, count, sizeof(ddbg_write_site_t), compare_sites);
+    fprintf(out, "Call sites (pc after the access first):\n");
+    for (int i = 0 ; i < count ; i++)
+    {
+        fprintf(out, "%8lu %p:", sorted[i].count, sorted[i].address);
+        for (int j = 0 ; j < DDBG_WRITE_SITE_DEPTH && sorted[i].pcs[j] ; j++)
+            print_site_frame(out, sorted[i].pcs[j]);
+        fputc('\n', out);
+    }
+    if (sites_overflow)
+        fprintf(out, "%8lu [overflow]\n", sites_overflow);
+    free(sorted);
+}
+
+ddbg_result_t dyndebug_stop_write_profiler(const char *path)
+{
+    pthread_mutex_lock(&watch_lock);
+    if (!rotation_running)
+    {
+        pthread_mutex_unlock(&watch_lock);
+        return DDBG_INVALID_ARGUMENT;
+    }
+    __atomic_store_n(&rotation_stopping, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&watch_lock);
+    pthread_join(rotation_thread, NULL);
+
+    pthread_mutex_lock(&watch_lock);
+    bool none[MAX_PROFILED_WATCHES] = {false};
+    swap_watches(none);
+    rotation_running = false;
+
+    ddbg_result_t result = DDBG_SUCCESS;
+    FILE *out = path ? fopen(path, "w") : stderr;
+    if (!out)
+    {
+        error_print("Cannot create the write profile %s -- %s\n", path,
+            strerror(errno));
+        result = DDBG_SYSTEM_ERROR;
+    }
+    else
+    {
+        write_report(out);
+        if (path)
+            fclose(out);
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return result;
+}
+
+int dyndebug_get_write_sites(ddbg_write_site_t *exported, int max)
+{
+    int count = 0;
+    for (int slot = 0 ; slot < MAX_WRITE_SITES && count < max ; slot++)
+    {
+        ddbg_write_site_entry_t *entry = &sites[slot];
+        uint64_t hits = __atomic_load_n(&entry->site.count, __ATOMIC_ACQUIRE);
+        if (!hits)
+            continue;
+        exported[count] = entry->site;
+        exported[count].count = hits;
+        count++;
+    }
+    return count;
+}
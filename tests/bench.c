@@ -0,0 +1,307 @@
+#include <dyndbg/dyndbg_us.h>
+
+#include <stdio.h>
+
+#define __USE_GNU
+#include <ucontext.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define DEFAULT_ITERATIONS      1000
+#define THROUGHPUT_HITS         20000
+#define STARTUP_SAMPLES         5
+
+/* Resident sizes the monitor startup is measured with, in MB */
+static const int startup_rss_mb[] = {0, 16, 64, 256};
+
+volatile uint64_t watched;
+volatile uint64_t crash_target;
+/* Written by the callbacks, behind the compiler back */
+static volatile uint64_t trap_start;
+static volatile uint64_t trap_end;
+static volatile uint64_t hits;
+static bool first_result = true;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t rss_kb(pid_t pid)
+{
+    char path[64];
+    unsigned long size = 0, resident = 0;
+    snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+    FILE *statm = fopen(path, "r");
+    if (!statm)
+        return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void check(ddbg_result_t result, const char *operation)
+{
+    if (result != DDBG_SUCCESS)
+    {
+        fprintf(stderr, "%s failed -- %d\n", operation, result);
+        exit(1);
+    }
+}
+
+static void print_separator(void)
+{
+    printf(first_result ? "\n" : ",\n");
+    first_result = false;
+}
+
+/* One JSON object per benchmark, samples are sorted in place */
+static void report(const char *name, uint64_t *samples, int count)
+{
+    uint64_t total = 0;
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    for (int i = 0 ; i < count ; i++)
+        total += samples[i];
+    print_separator();
+    printf("    {\"name\": \"%s\", \"unit\": \"ns\", \"samples\": %d, "
+        "\"mean\": %lu, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+        "\"min\": %lu, \"max\": %lu}", name, count, count ? total / count : 0,
+        samples[count / 2], samples[count * 90 / 100],
+        samples[count * 99 / 100], samples[0], samples[count - 1]);
+}
+
+static void report_value(const char *name, const char *unit, uint64_t value)
+{
+    print_separator();
+    printf("    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %lu}", name, unit,
+        value);
+}
+
+__attribute__((noinline)) void traced_function(void)
+{
+    __asm__ volatile("");
+}
+
+static void on_hit(ddbg_breakpoint_t *b __attribute__((unused)))
+{
+    trap_end = now_ns();
+    hits++;
+}
+
+/* Resumes the crashing read on a valid address */
+static void on_crash(int signum __attribute__((unused)), void *_ucontext)
+{
+    ucontext_t *ucontext = _ucontext;
+    ucontext->uc_mcontext.gregs[REG_RAX] = (uint64_t)&crash_target;
+}
+
+__attribute__((noinline)) long crash_read(void)
+{
+    register long *prax __asm__("rax") = (long*)5;
+    __asm__ volatile("movq (%0), %0\n" : "+r"(prax));
+    return (long)prax;
+}
+
+/* A forked child grows to rss_mb then starts its own monitor, which forks
+it once more, the new monitored process sends the sample back */
+static uint64_t startup_sample(int rss_mb, uint64_t *monitor_kb)
+{
+    int results[2];
+    uint64_t sample[2] = {0};
+    if (pipe(results))
+    {
+        perror("pipe");
+        exit(1);
+    }
+    /* The children would print the pending output again */
+    fflush(stdout);
+    pid_t pid = fork();
+    if (!pid)
+    {
+        close(results[0]);
+        size_t size = (size_t)rss_mb << 20;
+        char *ballast = size ? malloc(size) : NULL;
+        if (ballast)
+            memset(ballast, 1, size);
+        /* Neither the allocation nor the writes may be optimized out */
+        __asm__ volatile("" : : "r"(ballast) : "memory");
+        uint64_t start = now_ns();
+        if (dyndebug_start_monitor() != DDBG_SUCCESS)
+            _exit(1);
+        sample[0] = now_ns() - start;
+        sample[1] = rss_kb(getppid());
+        if (write(results[1], sample, sizeof(sample)) != sizeof(sample))
+            _exit(1);
+        _exit(0);
+    }
+    close(results[1]);
+    ssize_t got = pid > 0 ? read(results[0], sample, sizeof(sample)) : -1;
+    close(results[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    if (got != sizeof(sample))
+    {
+        fprintf(stderr, "Cannot start the monitor at %d MB\n", rss_mb);
+        exit(1);
+    }
+    *monitor_kb = sample[1];
+    return sample[0];
+}
+
+/* Forking the monitor copies the page tables, its cost follows the RSS */
+static void bench_startup(uint64_t *samples)
+{
+    char name[64];
+    for (unsigned i = 0 ; i < sizeof(startup_rss_mb) / sizeof(int) ; i++)
+    {
+        uint64_t monitor_kb = 0;
+        for (int s = 0 ; s < STARTUP_SAMPLES ; s++)
+            samples[s] = startup_sample(startup_rss_mb[i], &monitor_kb);
+        snprintf(name, sizeof(name), "monitor_startup_%dmb", startup_rss_mb[i]);
+        report(name, samples, STARTUP_SAMPLES);
+        snprintf(name, sizeof(name), "monitor_rss_%dmb", startup_rss_mb[i]);
+        report_value(name, "kB", monitor_kb);
+    }
+
+    /* Then our own monitor, for the other benchmarks */
+    uint64_t before_kb = rss_kb(getpid());
+    fflush(stdout);
+    check(dyndebug_start_monitor(), "dyndebug_start_monitor");
+    report_value("app_rss_before", "kB", before_kb);
+    report_value("app_rss_after", "kB", rss_kb(getpid()));
+    report_value("monitor_rss", "kB", rss_kb(getppid()));
+}
+
+static void bench_control(uint64_t *samples[4], int iterations)
+{
+    ddbg_breakpoint_t b;
+    for (int i = 0 ; i < iterations ; i++)
+    {
+        uint64_t t0 = now_ns();
+        ddbg_result_t added = dyndebug_add_breakpoint(&b, (void *)&watched,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES, on_hit, NULL, true);
+        uint64_t t1 = now_ns();
+        ddbg_result_t disabled = dyndebug_disable_breakpoint(&b);
+        uint64_t t2 = now_ns();
+        ddbg_result_t enabled = dyndebug_enable_breakpoint(&b);
+        uint64_t t3 = now_ns();
+        ddbg_result_t removed = dyndebug_remove_breakpoint(&b);
+        uint64_t t4 = now_ns();
+        check(added, "dyndebug_add_breakpoint");
+        check(disabled, "dyndebug_disable_breakpoint");
+        check(enabled, "dyndebug_enable_breakpoint");
+        check(removed, "dyndebug_remove_breakpoint");
+        samples[0][i] = t1 - t0;
+        samples[1][i] = t2 - t1;
+        samples[2][i] = t3 - t2;
+        samples[3][i] = t4 - t3;
+    }
+    report("add", samples[0], iterations);
+    report("disable", samples[1], iterations);
+    report("enable", samples[2], iterations);
+    report("remove", samples[3], iterations);
+}
+
+static void bench_trap(uint64_t *samples, int iterations)
+{
+    ddbg_breakpoint_t b;
+    check(dyndebug_add_breakpoint(&b, (void *)traced_function,
+        DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_hit, NULL, true),
+        "dyndebug_add_breakpoint");
+    for (int i = 0 ; i < iterations ; i++)
+    {
+        trap_start = now_ns();
+        traced_function();
+        samples[i] = trap_end - trap_start;
+    }
+    check(dyndebug_remove_breakpoint(&b), "dyndebug_remove_breakpoint");
+    report("trap_instruction", samples, iterations);
+
+    check(dyndebug_add_breakpoint(&b, (void *)&watched, DDBG_BREAK_DATA_WRITE,
+        DDBG_BREAK_8BYTES, on_hit, NULL, true), "dyndebug_add_breakpoint");
+    for (int i = 0 ; i < iterations ; i++)
+    {
+        trap_start = now_ns();
+        watched = i;
+        samples[i] = trap_end - trap_start;
+    }
+    check(dyndebug_remove_breakpoint(&b), "dyndebug_remove_breakpoint");
+    report("trap_data_write", samples, iterations);
+}
+
+static void bench_throughput(void)
+{
+    ddbg_breakpoint_t b;
+    check(dyndebug_add_breakpoint(&b, (void *)&watched, DDBG_BREAK_DATA_WRITE,
+        DDBG_BREAK_8BYTES, on_hit, NULL, true), "dyndebug_add_breakpoint");
+    hits = 0;
+    uint64_t start = now_ns();
+    for (int i = 0 ; i < THROUGHPUT_HITS ; i++)
+        watched = i;
+    uint64_t elapsed = now_ns() - start;
+    check(dyndebug_remove_breakpoint(&b), "dyndebug_remove_breakpoint");
+    report_value("trap_throughput", "hits/s", hits * 1000000000ULL / elapsed);
+}
+
+/* The report goes to stderr, silenced meanwhile */
+static void bench_crash(uint64_t *samples, int iterations)
+{
+    dyndebug_install_crash_handler(on_crash);
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    for (int i = 0 ; i < iterations ; i++)
+    {
+        uint64_t start = now_ns();
+        crash_read();
+        samples[i] = now_ns() - start;
+    }
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    close(null);
+    report("crash_report", samples, iterations);
+}
+
+int main(int argc, const char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    uint64_t *samples[4];
+    /* Large enough for the startup samples as well */
+    int count = iterations > STARTUP_SAMPLES ? iterations : STARTUP_SAMPLES;
+    for (int i = 0 ; i < 4 ; i++)
+        samples[i] = calloc(count, sizeof(uint64_t));
+
+    printf("{\"iterations\": %d, \"benchmarks\": [", iterations);
+    bench_startup(samples[0]);
+    bench_control(samples, iterations);
+    bench_trap(samples[0], iterations);
+    bench_throughput();
+    /* Full reports are slow, a tenth of the iterations is plenty */
+    bench_crash(samples[0], iterations / 10 ? iterations / 10 : 1);
+    printf("\n]}\n");
+
+    for (int i = 0 ; i < 4 ; i++)
+        free(samples[i]);
+    return 0;
+}
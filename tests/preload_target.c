@@ -0,0 +1,28 @@
+/* Run by the unit tests under LD_PRELOAD=libdyndbg_preload.so, knows nothing
+of dyndbg */
+#include <stdio.h>
+
+#define PRELOAD_CALLS           10
+
+volatile int preload_counter;
+
+__attribute__((noinline)) int preload_probed(int i)
+{
+    return i + 1;
+}
+
+__attribute__((noinline)) int preload_probed_too(int i)
+{
+    return i * 2;
+}
+
+int main(void)
+{
+    int total = 0;
+    for (int i = 0 ; i < PRELOAD_CALLS ; i++)
+    {
+        total += preload_probed(i) + preload_probed_too(i);
+        preload_counter = i;
+    }
+    return total == 145 ? 0 : 1;
+}
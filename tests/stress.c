@@ -0,0 +1,272 @@
+#include <dyndbg/dyndbg_us.h>
+
+#include <stdio.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define MAX_THREADS             64
+#define MAX_WATCHES             4
+#define MAX_SAMPLES             4096    /* trap latencies kept per thread */
+#define LOCK_PERIOD             64      /* iterations between lock handoffs */
+#define PERIOD_STEPS            3       /* hit periods swept, tenfold apart */
+
+typedef struct
+{
+    volatile uint64_t       value;
+    uint8_t                 pad[56];    /* one watch per cache line */
+} padded_t;
+
+typedef struct
+{
+    pthread_t               thread;
+    uint64_t                ops;
+    uint64_t                expected;   /* watched writes */
+    uint64_t                delivered;
+    uint64_t                misattributed;
+    uint64_t                private_data[8];
+    uint64_t                samples[MAX_SAMPLES];
+    int                     sample_count;
+    volatile uint64_t       *last_write;
+    uint64_t                trap_start;
+} worker_t;
+
+typedef struct
+{
+    int                     threads;
+    int                     watches;
+    int                     churn;      /* control threads toggling watches */
+    int                     hit_period; /* iterations between watched writes */
+    int                     duration_ms;
+} stress_config_t;
+
+static padded_t hot[MAX_WATCHES];
+static padded_t cold[MAX_WATCHES];      /* written as often, never watched */
+static uint64_t shared_counter;
+static uint64_t locked_counter;
+static pthread_mutex_t handoff = PTHREAD_MUTEX_INITIALIZER;
+static ddbg_breakpoint_t watches[MAX_WATCHES];
+static worker_t workers[MAX_THREADS];
+static pthread_barrier_t start_barrier;
+static volatile bool stopping;
+static stress_config_t config;
+static __thread worker_t *self;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs in the writing thread, the hit must be the write it just did */
+static void on_hit(ddbg_breakpoint_t *b)
+{
+    worker_t *worker = self;
+    if (!worker)
+        return;
+    worker->delivered++;
+    if (b->address != (void *)worker->last_write)
+        worker->misattributed++;
+    if (worker->sample_count < MAX_SAMPLES)
+        worker->samples[worker->sample_count++] = now_ns() - worker->trap_start;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    self = worker;
+    pthread_barrier_wait(&start_barrier);
+    uint64_t i = 0;
+    while (!stopping)
+    {
+        /* Per thread data, shared counter and now and then a lock handoff */
+        worker->private_data[i & 7]++;
+        __atomic_fetch_add(&shared_counter, 1, __ATOMIC_RELAXED);
+        if (!(i % LOCK_PERIOD))
+        {
+            pthread_mutex_lock(&handoff);
+            locked_counter++;
+            pthread_mutex_unlock(&handoff);
+        }
+        if (!(i % config.hit_period))
+        {
+            int w = (i / config.hit_period) % MAX_WATCHES;
+            cold[w].value++;
+            if (w < config.watches)
+            {
+                worker->expected++;
+                worker->last_write = &hot[w].value;
+                worker->trap_start = now_ns();
+            }
+            hot[w].value++;
+        }
+        i++;
+    }
+    worker->ops = i;
+    return NULL;
+}
+
+static void *churn_main(void *arg)
+{
+    unsigned int seed = (uintptr_t)arg;
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 500000};
+    while (!stopping)
+    {
+        ddbg_breakpoint_t *b = &watches[rand_r(&seed) % config.watches];
+        dyndebug_disable_breakpoint(b);
+        nanosleep(&pause, NULL);
+        dyndebug_enable_breakpoint(b);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/* Returns the operations per second, the hit accounting is printed */
+static double run(const stress_config_t *run_config, double baseline)
+{
+    config = *run_config;
+    memset(workers, 0, sizeof(workers));
+    stopping = false;
+    pthread_barrier_init(&start_barrier, NULL, config.threads + 1);
+    for (int t = 0 ; t < config.threads ; t++)
+        pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+
+    /* Debug registers are mirrored to the existing threads only */
+    for (int w = 0 ; w < config.watches ; w++)
+        if (dyndebug_add_breakpoint(&watches[w], (void *)&hot[w].value,
+                DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES, on_hit, NULL, true) !=
+                DDBG_SUCCESS)
+        {
+            fprintf(stderr, "Cannot arm watch %d\n", w);
+            exit(2);
+        }
+    pthread_t churners[MAX_THREADS];
+    pthread_barrier_wait(&start_barrier);
+    uint64_t start = now_ns();
+    for (int c = 0 ; c < config.churn ; c++)
+        pthread_create(&churners[c], NULL, churn_main, (void *)(uintptr_t)c);
+
+    struct timespec duration = {.tv_sec = config.duration_ms / 1000,
+        .tv_nsec = (config.duration_ms % 1000) * 1000000L};
+    nanosleep(&duration, NULL);
+    stopping = true;
+    for (int t = 0 ; t < config.threads ; t++)
+        pthread_join(workers[t].thread, NULL);
+    uint64_t elapsed = now_ns() - start;
+    for (int c = 0 ; c < config.churn ; c++)
+        pthread_join(churners[c], NULL);
+    pthread_barrier_destroy(&start_barrier);
+    for (int w = 0 ; w < config.watches ; w++)
+        dyndebug_remove_breakpoint(&watches[w]);
+
+    uint64_t ops = 0, expected = 0, delivered = 0, misattributed = 0;
+    static uint64_t samples[MAX_THREADS * MAX_SAMPLES];
+    int sample_count = 0;
+    for (int t = 0 ; t < config.threads ; t++)
+    {
+        ops += workers[t].ops;
+        expected += workers[t].expected;
+        delivered += workers[t].delivered;
+        misattributed += workers[t].misattributed;
+        memcpy(&samples[sample_count], workers[t].samples,
+            workers[t].sample_count * sizeof(uint64_t));
+        sample_count += workers[t].sample_count;
+    }
+    qsort(samples, sample_count, sizeof(uint64_t), compare_u64);
+
+    double rate = ops * 1e9 / elapsed;
+    /* Churned watches miss the writes done while disarmed */
+    int64_t lost = config.churn ? 0 : (int64_t)(expected - delivered);
+    printf("%7d %7d %6d %5d %12.0f %8.2f %9lu %9lu %9lu %9lu %6ld %6lu\n",
+        config.threads, config.watches, config.hit_period, config.churn, rate,
+        baseline > 0 ? baseline / rate : 1.0, delivered,
+        sample_count ? samples[sample_count / 2] : 0,
+        sample_count ? samples[sample_count * 99 / 100] : 0,
+        sample_count ? samples[sample_count - 1] : 0, lost, misattributed);
+    if (lost || misattributed)
+    {
+        fprintf(stderr, "%ld hits lost, %lu misattributed\n", lost,
+            misattributed);
+        exit(3);
+    }
+    return rate;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-w max_watches] "
+        "[-p min_hit_period] [-c churn_threads] [-d duration_ms]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    stress_config_t base = {.threads = 4, .watches = MAX_WATCHES, .churn = 1,
+        .hit_period = 100, .duration_ms = 200};
+    int option;
+    while ((option = getopt(argc, argv, "t:w:p:c:d:")) != -1)
+    {
+        switch (option)
+        {
+            case 't': base.threads = atoi(optarg); break;
+            case 'w': base.watches = atoi(optarg); break;
+            case 'p': base.hit_period = atoi(optarg); break;
+            case 'c': base.churn = atoi(optarg); break;
+            case 'd': base.duration_ms = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (base.threads < 1 || base.threads > MAX_THREADS || base.watches < 0 ||
+            base.watches > MAX_WATCHES || base.hit_period < 1 ||
+            base.hit_period > INT32_MAX / 100 ||
+            base.churn < 0 || base.churn > MAX_THREADS || base.duration_ms < 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (dyndebug_start_monitor() != DDBG_SUCCESS)
+    {
+        fprintf(stderr, "Cannot start the monitor\n");
+        return 2;
+    }
+
+    /* Slowdown against the same thread count with nothing armed, latencies
+    from the watched write to the callback in ns. The hit/miss mix goes from
+    the shortest period on, each step ten times fewer hits */
+    printf("threads watches period churn        ops/s slowdown      hits       p50"
+        "       p99       max   lost misatt\n");
+    for (int threads = 1 ; threads <= base.threads ; threads++)
+    {
+        stress_config_t run_config = base;
+        run_config.threads = threads;
+        run_config.churn = 0;
+        run_config.watches = 0;
+        double baseline = run(&run_config, 0);
+        for (int step = 0 ; step < PERIOD_STEPS ; step++)
+        {
+            run_config.churn = 0;
+            for (int watches = 1 ; watches <= base.watches ; watches++)
+            {
+                run_config.watches = watches;
+                run(&run_config, baseline);
+            }
+            if (base.churn && base.watches)
+            {
+                run_config.churn = base.churn;
+                run(&run_config, baseline);
+            }
+            run_config.hit_period *= 10;
+        }
+    }
+    return 0;
+}
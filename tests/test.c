@@ -1,38 +1,58 @@
 #include <dyndbg/dyndbg_us.h>
+#include <dyndbg/dyndbg_ctl.h>
+#include <dyndbg/dyndbg_stats.h>
 
 #include <stdio.h>
 
 #define __USE_GNU
 #include <ucontext.h>
 
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <elf.h>
 
 volatile uint64_t idx;
 volatile int b0_count = 0;
 volatile int b1_count = 0;
 volatile int b2_count = 0;
+volatile uint64_t hot[2];
+volatile struct { uint32_t a, b; } __attribute__((aligned(8))) pairs[3];
+int packed_hits[6];
+volatile uint32_t state;
+uint64_t state_changes[2];
 
 #define test_assert(under_test, expect)                                         \
     {                                                                           \
-        int res = under_test;                                                   \
-        if (res != expect) {                                                    \
-            fprintf(stderr, "" # under_test " returned %d instead of %d!!,"     \
-            " test failed\n", res, expect);                                     \
+        long res = (under_test), expected = (long)(expect);                     \
+        if (res != expected) {                                                  \
+            fprintf(stderr, "%s returned %ld instead of %ld!!, test failed\n",  \
+                #under_test, res, expected);                                    \
             assert(false);                                                      \
         }                                                                       \
     }
 
 #define test_assert2(under_test, expect1, expect2)                              \
     {                                                                           \
-        int res = under_test;                                                   \
-        if (res != expect1 && res != expect2) {                                 \
-            fprintf(stderr, "" # under_test " returned %d instead of %d or %d!!"\
-             " test failed\n", res, expect1, expect2);                          \
+        long res = (under_test);                                                \
+        long expected1 = (long)(expect1), expected2 = (long)(expect2);          \
+        if (res != expected1 && res != expected2) {                             \
+            fprintf(stderr, "%s returned %ld instead of %ld or %ld!!,"          \
+                " test failed\n", #under_test, res, expected1, expected2);      \
             assert(false);                                                      \
         }                                                                       \
     }
@@ -54,17 +74,194 @@ void on_b2_triggerred()
     b2_count++;
 }
 
+void on_packed_hit(ddbg_breakpoint_t *b)
+{
+    (*(int *)b->callback_priv_arg)++;
+}
+
+void on_self_removed(ddbg_breakpoint_t *b)
+{
+    (*(int *)b->callback_priv_arg)++;
+    dyndebug_remove_breakpoint(b);
+}
+
+void on_state_changed(ddbg_breakpoint_t *b)
+{
+    state_changes[0] = b->old_value;
+    state_changes[1] = b->shadow;
+    (*(int *)b->callback_priv_arg)++;
+}
+
+/* Held until released to fill the queue */
+volatile bool async_hold;
+pid_t async_tids[2];
+
+void on_async_hit(ddbg_breakpoint_t *b)
+{
+    const ddbg_hit_t *hit = dyndebug_get_hit();
+    async_tids[0] = hit->tid;
+    async_tids[1] = gettid();
+    test_assert(hit->breakpoint == b, true);
+    test_assert(dyndebug_get_trap_ucontext() == NULL, true);
+    while (async_hold)
+        sched_yield();
+    (*(int *)b->callback_priv_arg)++;
+}
+
+/* Refused, its own queued hits would outlive it */
+void on_async_remove(ddbg_breakpoint_t *b)
+{
+    *(ddbg_result_t *)b->callback_priv_arg = dyndebug_remove_breakpoint(b);
+}
+
 int func(void)
 {
     return 0;
 }
 
+static __attribute__((noinline)) int symbol_one(void)
+{
+    return 1;
+}
+
+static __attribute__((noinline)) int symbol_two(void)
+{
+    return 2;
+}
+
+static __attribute__((noinline)) long scaled(long x, double scale)
+{
+    return x * scale;
+}
+
+int probe_exits;
+void on_probe_exit(ddbg_breakpoint_t *b __attribute__((unused)))
+{
+    probe_exits++;
+}
+
+/* Still running when its probe is removed, by another thread or by itself */
+static __attribute__((noinline)) int lingering(ddbg_breakpoint_t *b)
+{
+    if (b)
+        return dyndebug_remove_breakpoint(b);
+    usleep(50000);
+    return 0;
+}
+
+static void *lingering_main(void *arg __attribute__((unused)))
+{
+    lingering(NULL);
+    return NULL;
+}
+
+static __attribute__((noinline)) long double halved(long x)
+{
+    return x / 2.0L;
+}
+
+/* Loops back to its second instruction, within the bytes a probe replaces */
+int looping(void);
+__asm__(".text\n"
+        ".type looping, @function\n"
+        "looping:\n"
+        "    xor %eax, %eax\n"
+        "1:  add $1, %eax\n"
+        "    cmp $3, %eax\n"
+        "    jne 1b\n"
+        "    ret\n"
+        ".size looping, . - looping\n");
+
+/* Frees st0 and changes xmm0, as any callee seeing an empty x87 stack may */
+void on_clobbering_exit(ddbg_breakpoint_t *b __attribute__((unused)))
+{
+    __asm__ volatile("ffree %%st(0)\n\tpxor %%xmm0, %%xmm0" ::: "xmm0");
+    probe_exits++;
+}
+
+__attribute__((noinline)) int traced(int n)
+{
+    int sum = 0;
+    for (int i = 0 ; i < n ; i++)
+        sum += i;
+    return sum;
+}
+
+extern char probe_fault_start[], probe_fault_end[];
+
+__attribute__((noinline)) long probe_read(long *address)
+{
+    register long value __asm__("rax");
+    __asm__ volatile("probe_fault_start: movq (%1), %0\n"
+                     "probe_fault_end:\n" : "=a"(value) : "r"(address));
+    return value;
+}
+
+__attribute__((noinline)) long crash_read(void)
+{
+    register long *prax __asm__("rax") = (long*)5;
+    __asm__ volatile("movq (%0), %0\n" : "+r"(prax));
+    return (long)prax;
+}
+
+/* Stores through rax, which crash_callback points to idx */
+__attribute__((noinline)) void crash_write(long *address)
+{
+    register long *prax __asm__("rax") = address;
+    __asm__ volatile("movq $1, (%0)\n" : "+r"(prax) :: "memory");
+}
+
+void *parked(void *arg __attribute__((unused)))
+{
+    pause();
+    return NULL;
+}
+
+__attribute__((noinline)) void hot_write(int i)
+{
+    hot[i]++;
+}
+
+void *hot_writer(void *arg __attribute__((unused)))
+{
+    for (int i = 0 ; i < 200 ; i++)
+    {
+        hot_write(1);
+        usleep(500);
+    }
+    return NULL;
+}
+
+/* Two requests from a short lived thread, returns its tid */
+void *timeline_toggler(void *arg)
+{
+    ddbg_breakpoint_t *b = (ddbg_breakpoint_t *)arg;
+    dyndebug_disable_breakpoint(b);
+    dyndebug_enable_breakpoint(b);
+    return (void *)(intptr_t)syscall(SYS_gettid);
+}
+
+__attribute__((noinline)) void profile_busy(void)
+{
+    /* Mostly spin in this frame, libc has no frame pointer */
+    clock_t end = clock() + CLOCKS_PER_SEC / 5;
+    while (clock() < end)
+        for (int i = 0 ; i < 100000 ; i++)
+            idx++;
+}
+
+int crash_callbacks;
 void crash_callback(int signum, void *_ucontext)
 {
     ucontext_t *ucontext = _ucontext;
 
+    crash_callbacks++;
     if (signum == SIGFPE)
+    {
+        /* cltd may have sign extended a negative eax, avoid the overflow */
         ucontext->uc_mcontext.gregs[REG_RCX] = 1;
+        ucontext->uc_mcontext.gregs[REG_RDX] = 0;
+    }
     else if (signum == SIGILL)
         ucontext->uc_mcontext.gregs[REG_RIP] += 2;
     else
@@ -75,6 +272,29 @@ void crash_callback(int signum, void *_ucontext)
     }
 }
 
+/* A forked child with a monitor of its own and a parked thread crashes, its
+report goes to path. Returns its exit status */
+static int crash_child(uint32_t flags, long *address, const char *path)
+{
+    int status;
+    pid_t pid = fork();
+    if (!pid)
+    {
+        pthread_t thread;
+        int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+        if (fd < 0 || dup2(fd, STDERR_FILENO) < 0 ||
+                dyndebug_start_monitor() != DDBG_SUCCESS ||
+                dyndebug_set_crash_flags(flags) != DDBG_SUCCESS ||
+                pthread_create(&thread, NULL, parked, NULL))
+            _exit(1);
+        crash_write(address);
+        _exit(0);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
 int main(int argc, const char **argv)
 {
     char data[1024];
@@ -107,6 +327,72 @@ int main(int argc, const char **argv)
     /* SIGILL */
     __asm__("ud2\n");
 
+    /* Fault fixups, resumed without report nor callback */
+    long probed = 0x1234;
+    test_assert(dyndebug_add_fault_fixup(probe_fault_start, probe_fault_end,
+            probe_fault_end, REG_RAX, -1), DDBG_SUCCESS);
+    test_assert(dyndebug_add_fault_fixup(probe_fault_start, probe_fault_end,
+            probe_fault_end, REG_RAX, -1), DDBG_BP_ALREADY_EXISTS);
+    test_assert(probe_read(&probed), 0x1234);
+    rc = crash_callbacks;
+    test_assert(probe_read((long *)8), -1);
+    test_assert(crash_callbacks, rc);
+    test_assert(dyndebug_remove_fault_fixup(probe_fault_start), DDBG_SUCCESS);
+    test_assert(dyndebug_remove_fault_fixup(probe_fault_start),
+            DDBG_INVALID_ARGUMENT);
+
+    /* Crash signatures, the second identical crash is only counted */
+    ddbg_crash_signature_t signatures[4];
+    test_assert(dyndebug_set_crash_flags(DDBG_CRASH_DEDUPLICATE), DDBG_SUCCESS);
+    test_assert(dyndebug_set_crash_summary_interval(0), DDBG_SUCCESS);
+    for (loops = 0 ; loops < 2 ; loops++)
+        crash_read();
+    test_assert(crash_callbacks, rc + 2);
+    test_assert(dyndebug_get_crash_signatures(signatures, 4), 1);
+    test_assert(signatures[0].count, 2);
+    test_assert(signatures[0].signum, SIGSEGV);
+    test_assert(dyndebug_set_crash_flags(DDBG_CRASH_DEFAULT), DDBG_SUCCESS);
+    loops = 0;
+
+    /* Every thread of the crashed process has its registers dumped */
+    char report[64], report_line[256];
+    int report_threads = 0, report_dumps = 0;
+    bool report_thread = false;
+    snprintf(report, sizeof(report), "/tmp/dyndbg_crash.%d", getpid());
+    test_assert(crash_child(DDBG_CRASH_ALL_THREADS, (long *)8, report), 0);
+    FILE *reported = fopen(report, "r");
+    test_assert(reported != NULL, true);
+    while (fgets(report_line, sizeof(report_line), reported))
+    {
+        report_dumps += report_thread && !strncmp(report_line, "RAX  0x", 7);
+        report_thread = !strncmp(report_line, "Thread ", 7);
+        report_threads += report_thread;
+    }
+    fclose(reported);
+    unlink(report);
+    test_assert(report_threads, 2);
+    test_assert(report_dumps, 2);
+
+    /* Memory capture, a window around the fault address */
+    long *readonly = mmap(NULL, 4096, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+    uint64_t window_start, window_end, faulted = (uint64_t)&readonly[3];
+    char window_labels[64];
+    bool fault_window = false;
+    test_assert(readonly != MAP_FAILED, true);
+    test_assert(crash_child(DDBG_CRASH_MEMORY_CAPTURE, &readonly[3], report), 0);
+    reported = fopen(report, "r");
+    test_assert(reported != NULL, true);
+    while (fgets(report_line, sizeof(report_line), reported))
+        if (sscanf(report_line, "[%63[^]]] 0x%lx-0x%lx", window_labels,
+                &window_start, &window_end) == 3 &&
+                strstr(window_labels, "fault"))
+            fault_window = window_start <= faulted && faulted < window_end;
+    fclose(reported);
+    unlink(report);
+    munmap(readonly, 4096);
+    test_assert(fault_window, true);
+
     test_assert(dyndebug_start_monitor(), DDBG_SUCCESS);
 
     ddbg_breakpoint_t _b0, *b0 = &_b0, _b1, *b1 = &_b1, _b2, *b2 = &_b2;
@@ -210,6 +496,683 @@ int main(int argc, const char **argv)
     rc = func();
     test_assert(b2_count, 1);
 
+    /* Slot packing, 6 watches in 3 debug registers, writes demultiplexed */
+    ddbg_breakpoint_t packed[6];
+    for (int i = 0 ; i < 6 ; i++)
+        test_assert(dyndebug_add_breakpoint(&packed[i], i % 2 ?
+                (void *)&pairs[i / 2].b : (void *)&pairs[i / 2].a,
+                DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+                &packed_hits[i], true), DDBG_SUCCESS);
+    pairs[0].b = 1;
+    pairs[2].a = 2;
+    pairs[2].a = 2;
+    test_assert(packed_hits[0] + packed_hits[2] + packed_hits[3] +
+            packed_hits[5], 0);
+    test_assert(packed_hits[1], 1);
+    test_assert(packed_hits[4], 2);
+    test_assert(dyndebug_disable_breakpoint(&packed[1]), DDBG_SUCCESS);
+    pairs[0].b = 3;
+    pairs[0].a = 4;
+    test_assert(packed_hits[1], 1);
+    test_assert(packed_hits[0], 1);
+    for (int i = 0 ; i < 6 ; i++)
+        test_assert(dyndebug_remove_breakpoint(&packed[i]), DDBG_SUCCESS);
+    pairs[1].a = 5;
+    test_assert(packed_hits[2], 0);
+
+    /* A watch hit alone then joined, a string store is told by the values */
+    test_assert(dyndebug_add_breakpoint(&packed[2], (void *)&pairs[1].a,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+            &packed_hits[2], true), DDBG_SUCCESS);
+    pairs[1].a = 6;
+    test_assert(dyndebug_add_breakpoint(&packed[3], (void *)&pairs[1].b,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+            &packed_hits[3], true), DDBG_SUCCESS);
+    void *destination = (void *)&pairs[1].b;
+    __asm__ volatile("stosl" : "+D"(destination) : "a"(7) : "memory");
+    test_assert(packed_hits[2], 1);
+    test_assert(packed_hits[3], 1);
+    /* Split over two slots since, the same value stored is seen */
+    pairs[1].a = 6;
+    test_assert(packed_hits[2], 2);
+    test_assert(packed_hits[3], 1);
+    test_assert(dyndebug_remove_breakpoint(&packed[2]), DDBG_SUCCESS);
+    test_assert(dyndebug_remove_breakpoint(&packed[3]), DDBG_SUCCESS);
+
+    /* Read watches are never packed, a read only calls its own */
+    for (int i = 0 ; i < 2 ; i++)
+        test_assert(dyndebug_add_breakpoint(&packed[i], i ?
+                (void *)&pairs[2].b : (void *)&pairs[2].a,
+                DDBG_BREAK_DATA_RDWR, DDBG_BREAK_4BYTES, on_packed_hit,
+                &packed_hits[i], true), DDBG_SUCCESS);
+    rc = pairs[2].a;
+    test_assert(packed_hits[0], 2);
+    test_assert(packed_hits[1], 1);
+    for (int i = 0 ; i < 2 ; i++)
+        test_assert(dyndebug_remove_breakpoint(&packed[i]), DDBG_SUCCESS);
+
+    /* A callback removing its own breakpoint from the trap handler */
+    int removed_hits = 0;
+    ddbg_breakpoint_t bremoved;
+    test_assert(dyndebug_add_breakpoint(&bremoved, (void *)&hot[0],
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES, on_self_removed,
+            &removed_hits, true), DDBG_SUCCESS);
+    hot[0] = 1;
+    hot[0] = 2;
+    test_assert(removed_hits, 1);
+    test_assert(dyndebug_find_breakpoint((void *)&hot[0], DDBG_BREAK_DATA_WRITE,
+            DDBG_BREAK_8BYTES, false) == NULL, true);
+    hot[0] = 0;
+
+    /* Value filtering, same value stores and out of range values are quiet */
+    int state_hits = 0;
+    ddbg_breakpoint_t bstate;
+    test_assert(dyndebug_add_breakpoint(&bstate, (void *)&state,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_state_changed,
+            &state_hits, true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(&bstate, DDBG_BP_ON_CHANGE),
+            DDBG_SUCCESS);
+    for (int i = 0 ; i < 8 ; i++)
+        state = 0;
+    test_assert(state_hits, 0);
+    state = 3;
+    state = 3;
+    test_assert(state_hits, 1);
+    test_assert(state_changes[0], 0);
+    test_assert(state_changes[1], 3);
+    test_assert(dyndebug_set_value_filter(&bstate, 0xff, 0x10, 0x20),
+            DDBG_SUCCESS);
+    state = 0x103;
+    state = 0x105;
+    test_assert(state_hits, 1);
+    state = 0x115;
+    test_assert(state_hits, 2);
+    test_assert(state_changes[0], 0x105);
+    test_assert(state_changes[1], 0x115);
+    test_assert(dyndebug_remove_breakpoint(&bstate), DDBG_SUCCESS);
+
+    /* Gated breakpoint, only reported in between enter and exit, disarmed
+when idle and rearmed by the next entry */
+    int gated_hits = 0;
+    ddbg_breakpoint_t bgated;
+    test_assert(dyndebug_add_breakpoint(&bgated, (void *)&state,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+            &gated_hits, true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(&bgated, DDBG_BP_GATED),
+            DDBG_SUCCESS);
+    state = 1;
+    dyndebug_gate_enter(&bgated);
+    state = 2;
+    dyndebug_gate_exit(&bgated);
+    state = 3;
+    test_assert(gated_hits, 1);
+    test_assert(dyndebug_set_gate_demotion(10), DDBG_SUCCESS);
+    usleep(100000);
+    test_assert(bgated.enabled, false);
+    dyndebug_gate_enter(&bgated);
+    test_assert(bgated.enabled, true);
+    usleep(50000);
+    state = 4;
+    dyndebug_gate_exit(&bgated);
+    test_assert(gated_hits, 2);
+    test_assert(dyndebug_set_gate_demotion(0), DDBG_SUCCESS);
+    test_assert(dyndebug_remove_breakpoint(&bgated), DDBG_SUCCESS);
+
+    /* Use after free, the quarantined block first word is watched */
+    ddbg_uaf_report_t uaf;
+    test_assert(dyndebug_start_uaf_detector(16, 1, 1, 10), DDBG_SUCCESS);
+    test_assert(dyndebug_start_uaf_detector(16, 1, 1, 10),
+            DDBG_INVALID_ARGUMENT);
+    volatile uint64_t *freed = malloc(64);
+    dyndebug_uaf_free((void *)freed);
+    usleep(50000);
+    test_assert(dyndebug_get_uaf_reports(&uaf, 1), 0);
+    rc = freed[0];
+    test_assert(dyndebug_get_uaf_reports(&uaf, 1), 1);
+    test_assert(uaf.address == (void *)freed, true);
+    test_assert(uaf.access_pcs[0] != NULL && uaf.free_pcs[0] != NULL, true);
+    test_assert(dyndebug_stop_uaf_detector(), DDBG_SUCCESS);
+    test_assert(dyndebug_stop_uaf_detector(), DDBG_INVALID_ARGUMENT);
+
+    /* Breakpoints by name, static functions are indexed too */
+    int symbol_hits = 0;
+    ddbg_breakpoint_t bsymbols[4];
+    const char *symbol_patterns[] = {"symbol_o*", "symbol_two", "no_such_symbol"};
+    test_assert(dyndebug_resolve_symbol("symbol_two") == (void *)symbol_two,
+            true);
+    test_assert(dyndebug_add_symbol_breakpoints(symbol_patterns, 3, bsymbols, 4,
+            on_packed_hit, &symbol_hits), 2);
+    rc = symbol_one() + symbol_two();
+    test_assert(symbol_hits, 2);
+    for (int i = 0 ; i < 2 ; i++)
+        test_assert(dyndebug_remove_breakpoint(&bsymbols[i]), DDBG_SUCCESS);
+
+    /* Probe, the prologue jumps to a trampoline, arguments and return value
+go through untouched */
+    int probe_hits = 0;
+    long probe_sum = 0;
+    ddbg_breakpoint_t bprobe;
+    test_assert(dyndebug_add_breakpoint(&bprobe, (void *)scaled,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_packed_hit, &probe_hits,
+            false), DDBG_SUCCESS);
+    test_assert(dyndebug_set_probe_exit(&bprobe, on_probe_exit), DDBG_SUCCESS);
+    for (int i = 0 ; i < 1000 ; i++)
+        probe_sum += scaled(i, 2.0);
+    test_assert(probe_sum, 999000);
+    test_assert(probe_hits, 1000);
+    test_assert(probe_exits, 1000);
+    test_assert(dyndebug_disable_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(scaled(3, 2.0), 6);
+    test_assert(probe_hits, 1000);
+    test_assert(dyndebug_enable_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(scaled(3, 2.0), 6);
+    test_assert(probe_hits, 1001);
+    test_assert(dyndebug_remove_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(scaled(3, 2.0), 6);
+    test_assert(probe_exits, 1001);
+
+    /* Removal waits for the calls of the other threads, not for its own */
+    pthread_t lingerer;
+    test_assert(dyndebug_add_breakpoint(&bprobe, (void *)lingering,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_packed_hit, &probe_hits,
+            false), DDBG_SUCCESS);
+    test_assert(dyndebug_set_probe_exit(&bprobe, on_probe_exit), DDBG_SUCCESS);
+    pthread_create(&lingerer, NULL, lingering_main, NULL);
+    while (__atomic_load_n(&probe_hits, __ATOMIC_ACQUIRE) == 1001)
+        usleep(1000);
+    test_assert(dyndebug_remove_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(probe_exits, 1002);
+    pthread_join(lingerer, NULL);
+    test_assert(dyndebug_add_breakpoint(&bprobe, (void *)lingering,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_packed_hit, &probe_hits,
+            false), DDBG_SUCCESS);
+    test_assert(dyndebug_set_probe_exit(&bprobe, on_probe_exit), DDBG_SUCCESS);
+    test_assert(lingering(&bprobe), DDBG_SUCCESS);
+    test_assert(probe_hits, 1003);
+    test_assert(probe_exits, 1002);
+
+    /* The x87 return value of a long double function */
+    test_assert(dyndebug_add_breakpoint(&bprobe, (void *)halved,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_packed_hit, &probe_hits,
+            false), DDBG_SUCCESS);
+    test_assert(dyndebug_set_probe_exit(&bprobe, on_clobbering_exit),
+            DDBG_SUCCESS);
+    test_assert(halved(7) == 3.5L, true);
+    test_assert(probe_exits, 1003);
+    test_assert(dyndebug_remove_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&bprobe, (void *)looping,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_packed_hit, &probe_hits,
+            false), DDBG_INVALID_ARGUMENT);
+    test_assert(dyndebug_remove_breakpoint(&bprobe), DDBG_SUCCESS);
+    test_assert(looping(), 3);
+
+    /* Control socket, a batch of adds, the hits are read back by listing */
+    static volatile uint32_t ctl_value;
+    ddbg_ctl_message_t ctl;
+    struct sockaddr_un ctl_address = {.sun_family = AF_UNIX};
+    int ctl_length = snprintf(&ctl_address.sun_path[1],
+            sizeof(ctl_address.sun_path) - 1, "dyndbg.test.%d", getpid());
+    test_assert(dyndebug_start_control(&ctl_address.sun_path[1]), DDBG_SUCCESS);
+    int ctl_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    test_assert(connect(ctl_fd, (struct sockaddr *)&ctl_address,
+            offsetof(struct sockaddr_un, sun_path) + 1 + ctl_length), 0);
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.op = DDBG_CTL_ADD;
+    ctl.count = 3;
+    strcpy(ctl.items[0].symbol, "symbol_two");
+    ctl.items[1].address = (uint64_t)&ctl_value;
+    ctl.items[1].type = DDBG_BREAK_DATA_WRITE;
+    ctl.items[1].size = DDBG_BREAK_4BYTES;
+    strcpy(ctl.items[2].symbol, "no_such_symbol");
+    send(ctl_fd, &ctl, DDBG_CTL_MESSAGE_SIZE(ctl.count), 0);
+    test_assert(recv(ctl_fd, &ctl, sizeof(ctl), 0), DDBG_CTL_MESSAGE_SIZE(3));
+    test_assert(ctl.items[0].result, DDBG_SUCCESS);
+    test_assert(ctl.items[0].address == (uint64_t)symbol_two, true);
+    test_assert(ctl.items[1].result, DDBG_SUCCESS);
+    test_assert(ctl.items[2].result, DDBG_INVALID_ARGUMENT);
+    rc = symbol_two();
+    ctl_value = 1;
+    ctl_value = 2;
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.op = DDBG_CTL_LIST;
+    send(ctl_fd, &ctl, DDBG_CTL_MESSAGE_SIZE(0), 0);
+    recv(ctl_fd, &ctl, sizeof(ctl), 0);
+    test_assert(ctl.total, ctl.count);
+    int ctl_owned = 0;
+    for (uint32_t i = 0 ; i < ctl.count ; i++)
+    {
+        if (!ctl.items[i].owned)
+            continue;
+        ctl_owned++;
+        test_assert(ctl.items[i].hits,
+                (ctl.items[i].address == (uint64_t)&ctl_value ? 2 : 1));
+    }
+    test_assert(ctl_owned, 2);
+    ctl.op = DDBG_CTL_REMOVE;
+    ctl.count = 1;
+    memset(&ctl.items[0], 0, sizeof(ddbg_ctl_item_t));
+    strcpy(ctl.items[0].symbol, "symbol_two");
+    send(ctl_fd, &ctl, DDBG_CTL_MESSAGE_SIZE(1), 0);
+    recv(ctl_fd, &ctl, sizeof(ctl), 0);
+    test_assert(ctl.items[0].result, DDBG_SUCCESS);
+    test_assert(ctl.items[0].hits, 1);
+    close(ctl_fd);
+    /* Clients of another user are refused, becoming one takes root */
+    if (!geteuid())
+    {
+        pid_t other = fork();
+        if (!other)
+        {
+            ctl_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+            ctl.op = DDBG_CTL_LIST;
+            _exit(setuid(65534) || connect(ctl_fd,
+                (struct sockaddr *)&ctl_address,
+                offsetof(struct sockaddr_un, sun_path) + 1 + ctl_length) ||
+                (send(ctl_fd, &ctl, DDBG_CTL_MESSAGE_SIZE(0), MSG_NOSIGNAL) >= 0 &&
+                recv(ctl_fd, &ctl, sizeof(ctl), 0) > 0));
+        }
+        int other_status;
+        test_assert(waitpid(other, &other_status, 0), other);
+        test_assert(WIFEXITED(other_status) && !WEXITSTATUS(other_status), true);
+    }
+    test_assert(dyndebug_stop_control(), DDBG_SUCCESS);
+    test_assert(dyndebug_find_breakpoint((void *)&ctl_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, false) == NULL, true);
+
+    /* Statistics page, read from the file as another process would */
+    static volatile uint32_t stats_value;
+    int stats_hits = 0, stats_found = 0;
+    char stats_path[64];
+    ddbg_breakpoint_t bstats;
+    ddbg_stats_breakpoint_t stats[DDBG_STATS_BREAKPOINTS];
+    test_assert(dyndebug_start_stats(), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&bstats, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit, &stats_hits,
+            true), DDBG_SUCCESS);
+    for (int i = 0 ; i < 3 ; i++)
+        stats_value = i;
+    snprintf(stats_path, sizeof(stats_path), "%s%d", DDBG_STATS_PREFIX, getpid());
+    int stats_fd = open(stats_path, O_RDONLY);
+    const ddbg_stats_page_t *stats_page = mmap(NULL, sizeof(ddbg_stats_page_t),
+            PROT_READ, MAP_SHARED, stats_fd, 0);
+    close(stats_fd);
+    test_assert(stats_page != MAP_FAILED, true);
+    test_assert(stats_page->magic == DDBG_STATS_MAGIC, true);
+    int stats_count = ddbg_stats_read(stats_page, stats, 16);
+    for (int i = 0 ; i < stats_count ; i++)
+    {
+        if (stats[i].address != (uint64_t)&stats_value)
+            continue;
+        stats_found++;
+        test_assert(stats[i].hits, 3);
+        test_assert(stats[i].state, DDBG_STATS_ENABLED);
+        test_assert(stats[i].last_hit_ns != 0, true);
+    }
+    test_assert(stats_found, 1);
+    test_assert(stats_page->slots[0] + stats_page->slots[1] +
+            stats_page->slots[2] + stats_page->slots[3] > 0, true);
+    test_assert(dyndebug_remove_breakpoint(&bstats), DDBG_SUCCESS);
+    stats_count = ddbg_stats_read(stats_page, stats, 16);
+    for (int i = 0 ; i < stats_count ; i++)
+        test_assert(stats[i].address != (uint64_t)&stats_value, true);
+    munmap((void *)stats_page, sizeof(ddbg_stats_page_t));
+    test_assert(dyndebug_stop_stats(), DDBG_SUCCESS);
+    test_assert(access(stats_path, F_OK), -1);
+    /* Private to the user and never written through a planted link */
+    test_assert(symlink("/dev/null", stats_path), 0);
+    test_assert(dyndebug_start_stats(), DDBG_SUCCESS);
+    struct stat stats_stat;
+    test_assert(lstat(stats_path, &stats_stat), 0);
+    test_assert(S_ISREG(stats_stat.st_mode), true);
+    test_assert(stats_stat.st_mode & 0777, 0600);
+    test_assert(dyndebug_stop_stats(), DDBG_SUCCESS);
+
+    /* Monitor latencies, every request goes through each phase */
+    ddbg_monitor_stats_t monitor_stats;
+    ddbg_breakpoint_t btimed;
+    test_assert(dyndebug_set_monitor_stats(true), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&btimed, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit, &stats_hits,
+            true), DDBG_SUCCESS);
+    test_assert(dyndebug_remove_breakpoint(&btimed), DDBG_SUCCESS);
+    test_assert(dyndebug_set_monitor_stats(false), DDBG_SUCCESS);
+    test_assert(dyndebug_get_stats(&monitor_stats), DDBG_SUCCESS);
+    test_assert(monitor_stats.requests, 2);
+    test_assert(monitor_stats.stops, 2);
+    test_assert(monitor_stats.ptraces >= 8, true);
+    for (int phase = 0 ; phase < DDBG_PHASES ; phase++)
+    {
+        uint64_t bucketed = 0;
+        for (int i = 0 ; i < DDBG_LATENCY_BUCKETS ; i++)
+            bucketed += monitor_stats.phases[phase].buckets[i];
+        test_assert(bucketed, 2);
+    }
+    test_assert(monitor_stats.phases[DDBG_PHASE_REQUEST].total_ns >
+            monitor_stats.phases[DDBG_PHASE_ATTACH].total_ns, true);
+    test_assert(dyndebug_latency_bucket_ns(DDBG_LATENCY_SUB),
+            1 << DDBG_LATENCY_SHIFT);
+
+    /* Timeline, a hit shows up as a trap, its request and its callback, the
+    requests of the two threads show up on their own tracks, the second one
+    reusing the drained buffer of the first */
+    char timeline_path[64], timeline_line[512], timeline_tid[2][32];
+    int timeline_traps = 0, timeline_callbacks = 0, timeline_enables = 0;
+    int timeline_stops = 0, timeline_names[2] = {0, 0};
+    int timeline_toggles[2] = {0, 0};
+    pthread_t toggler;
+    void *toggler_tid;
+    snprintf(timeline_path, sizeof(timeline_path), "/tmp/dyndbg_timeline.%d.json",
+            getpid());
+    test_assert(dyndebug_start_timeline(timeline_path), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&btimed, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit, &stats_hits,
+            true), DDBG_SUCCESS);
+    stats_value = 7;
+    for (int t = 0 ; t < 2 ; t++)
+    {
+        pthread_create(&toggler, NULL, timeline_toggler, &btimed);
+        pthread_join(toggler, &toggler_tid);
+        snprintf(timeline_tid[t], sizeof(timeline_tid[t]), "\"tid\": %d,",
+                (int)(intptr_t)toggler_tid);
+        usleep(200000);
+    }
+    test_assert(dyndebug_remove_breakpoint(&btimed), DDBG_SUCCESS);
+    test_assert(dyndebug_stop_timeline(), DDBG_SUCCESS);
+    FILE *timeline = fopen(timeline_path, "r");
+    test_assert(timeline != NULL, true);
+    while (fgets(timeline_line, sizeof(timeline_line), timeline))
+    {
+        timeline_traps += strstr(timeline_line, "\"name\": \"trap\"") != NULL;
+        timeline_callbacks += strstr(timeline_line,
+                "\"name\": \"callback\"") != NULL;
+        timeline_enables += strstr(timeline_line, "\"name\": \"enable\"") != NULL;
+        timeline_stops += strstr(timeline_line, "\"name\": \"stopped\"") != NULL;
+        for (int t = 0 ; t < 2 ; t++)
+        {
+            if (!strstr(timeline_line, timeline_tid[t]))
+                continue;
+            timeline_names[t] += strstr(timeline_line, "thread_name") != NULL;
+            timeline_toggles[t] += strstr(timeline_line,
+                    "\"name\": \"disable\"") != NULL;
+            timeline_toggles[t] += strstr(timeline_line,
+                    "\"name\": \"enable\"") != NULL;
+        }
+    }
+    fclose(timeline);
+    unlink(timeline_path);
+    test_assert(timeline_traps, 1);
+    test_assert(timeline_callbacks, 1);
+    test_assert(timeline_enables, 3);
+    /* Each request stops the process, the add, the hit, 4 toggles, remove */
+    test_assert(timeline_stops, 7);
+    test_assert(timeline_names[0], 1);
+    test_assert(timeline_names[1], 1);
+    test_assert(timeline_toggles[0], 2);
+    test_assert(timeline_toggles[1], 2);
+
+    /* Asynchronous callbacks, run by a worker, the hits beyond the queue depth
+    are dropped while the worker is held */
+    ddbg_breakpoint_t basync;
+    ddbg_dispatch_stats_t dispatch_stats;
+    int async_hits = 0;
+    cpu_set_t async_cpus, async_former;
+    test_assert(dyndebug_start_dispatcher(2, 4, 8, 0), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&basync, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_async_hit, &async_hits,
+            true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(&basync, DDBG_BP_ASYNC),
+            DDBG_SUCCESS);
+    for (int i = 0 ; i < 3 ; i++)
+        stats_value = i;
+    test_assert(dyndebug_flush_dispatcher(), DDBG_SUCCESS);
+    test_assert(async_hits, 3);
+    test_assert(async_tids[0], gettid());
+    test_assert(async_tids[1] != gettid(), true);
+    /* One CPU, one queue */
+    pthread_getaffinity_np(pthread_self(), sizeof(async_former), &async_former);
+    CPU_ZERO(&async_cpus);
+    CPU_SET(sched_getcpu(), &async_cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(async_cpus), &async_cpus);
+    async_hold = true;
+    for (int i = 0 ; i < 10 ; i++)
+        stats_value = i;
+    async_hold = false;
+    pthread_setaffinity_np(pthread_self(), sizeof(async_former), &async_former);
+    test_assert(dyndebug_remove_breakpoint(&basync), DDBG_SUCCESS);
+    test_assert(dyndebug_stop_dispatcher(), DDBG_SUCCESS);
+    test_assert(dyndebug_get_dispatch_stats(&dispatch_stats), DDBG_SUCCESS);
+    test_assert(dispatch_stats.queued + dispatch_stats.dropped, 13);
+    test_assert(dispatch_stats.dispatched, dispatch_stats.queued);
+    test_assert(dispatch_stats.dropped >= 5, true);
+    test_assert(async_hits, dispatch_stats.dispatched);
+    test_assert(dispatch_stats.max_depth <= 4, true);
+    /* A worker cannot remove an asynchronous breakpoint, not even its own */
+    ddbg_result_t async_removed = DDBG_SUCCESS;
+    test_assert(dyndebug_start_dispatcher(1, 4, 8, 0), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(&basync, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_async_remove,
+            &async_removed, true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(&basync, DDBG_BP_ASYNC),
+            DDBG_SUCCESS);
+    stats_value = 1;
+    test_assert(dyndebug_flush_dispatcher(), DDBG_SUCCESS);
+    test_assert(async_removed, DDBG_INVALID_ARGUMENT);
+    test_assert(dyndebug_remove_breakpoint(&basync), DDBG_SUCCESS);
+    test_assert(dyndebug_stop_dispatcher(), DDBG_SUCCESS);
+
+    /* Forked child, its own session, the parent one is left alone */
+    ddbg_breakpoint_t bparent, bchild;
+    int parent_hits = 0, child_status;
+    test_assert(dyndebug_add_breakpoint(&bparent, (void *)&stats_value,
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+            &parent_hits, true), DDBG_SUCCESS);
+    pid_t child = fork();
+    if (!child)
+    {
+        /* Not armed here, the debug registers are not inherited */
+        int child_hits = 0;
+        stats_value = 1;
+        if (bparent.enabled || parent_hits)
+            _exit(1);
+        if (dyndebug_add_breakpoint(&bchild, (void *)&ctl_value,
+                DDBG_BREAK_DATA_WRITE, DDBG_BREAK_4BYTES, on_packed_hit,
+                &child_hits, true) != DDBG_SUCCESS)
+            _exit(2);
+        ctl_value = 1;
+        ctl_value = 2;
+        if (dyndebug_remove_breakpoint(&bchild) != DDBG_SUCCESS ||
+                child_hits != 2)
+            _exit(3);
+        _exit(0);
+    }
+    test_assert(waitpid(child, &child_status, 0), child);
+    test_assert(WIFEXITED(child_status), true);
+    test_assert(WEXITSTATUS(child_status), 0);
+    stats_value = 2;
+    test_assert(parent_hits, 1);
+    test_assert(dyndebug_remove_breakpoint(&bparent), DDBG_SUCCESS);
+
+    /* Crash core of a forked child, an x86_64 ELF core with its notes */
+    char crash_core[64];
+    Elf64_Ehdr core_ehdr;
+    Elf64_Phdr core_phdr;
+    int core_notes = 0;
+    pid_t crashed = fork();
+    if (!crashed)
+    {
+        if (dyndebug_set_core_policy(DDBG_CORE_DEFAULT, "unit_test.core") !=
+                DDBG_SUCCESS ||
+                dyndebug_set_crash_flags(DDBG_CRASH_CORE_FILE) != DDBG_SUCCESS)
+            _exit(1);
+        crash_read();
+        _exit(0);
+    }
+    test_assert(waitpid(crashed, &child_status, 0), crashed);
+    test_assert(WIFEXITED(child_status) && !WEXITSTATUS(child_status), true);
+    snprintf(crash_core, sizeof(crash_core), "unit_test.core.%d", crashed);
+    int core_fd = open(crash_core, O_RDONLY);
+    test_assert(core_fd >= 0, true);
+    test_assert(pread(core_fd, &core_ehdr, sizeof(core_ehdr), 0),
+            (ssize_t)sizeof(core_ehdr));
+    test_assert(memcmp(core_ehdr.e_ident, ELFMAG, SELFMAG), 0);
+    test_assert(core_ehdr.e_type == ET_CORE &&
+            core_ehdr.e_machine == EM_X86_64, true);
+    for (int phdr = 0 ; phdr < core_ehdr.e_phnum ; phdr++)
+    {
+        test_assert(pread(core_fd, &core_phdr, sizeof(core_phdr),
+                core_ehdr.e_phoff + phdr * sizeof(core_phdr)),
+                (ssize_t)sizeof(core_phdr));
+        core_notes += core_phdr.p_type == PT_NOTE && core_phdr.p_filesz > 0;
+    }
+    test_assert(core_notes, 1);
+    close(core_fd);
+    unlink(crash_core);
+    for (rc = 0 ; dyndebug_add_core_region(&data[rc], 1) == DDBG_SUCCESS ; rc++)
+        ;
+    test_assert(dyndebug_add_core_region(&data[rc], 1), DDBG_ALL_HWBP_BUSY);
+    while (rc--)
+        test_assert(dyndebug_remove_core_region(&data[rc]), DDBG_SUCCESS);
+
+    /* Trace window, the loop shows up as repeated runs */
+    ddbg_breakpoint_t _b3, *b3 = &_b3;
+    ddbg_trace_run_t runs[64];
+    test_assert(dyndebug_set_trace_window(64, REG_RAX, DDBG_FIXUP_NO_REGISTER),
+            DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(b3, traced, DDBG_BREAK_INSTRUCTION,
+            DDBG_BREAK_1BYTE, on_b2_triggerred, NULL, true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(b3, DDBG_BP_TRACE), DDBG_SUCCESS);
+    test_assert(dyndebug_get_trace(runs, 64), 0);
+    test_assert(traced(100), 4950);
+    test_assert(b2_count, 2);
+    rc = dyndebug_get_trace(runs, 64);
+    test_assert(rc > 2, true);
+    test_assert(runs[0].rip == (uint64_t)traced, true);
+    for (loops = 0, idx = 0 ; idx < (uint64_t)rc ; idx++)
+        loops += runs[idx].steps;
+    test_assert(loops, 64);
+    test_assert(dyndebug_get_trace(runs, 64), 0);
+    test_assert(dyndebug_remove_breakpoint(b3), DDBG_SUCCESS);
+
+    /* Snapshots, a stopped copy per hit up to the limit */
+    ddbg_snapshot_t snapshots[4];
+    char core[64], proc_state[256], cwd[256];
+    test_assert(dyndebug_set_snapshot_limits(1, 0), DDBG_SUCCESS);
+    test_assert(dyndebug_add_breakpoint(b3, traced, DDBG_BREAK_INSTRUCTION,
+            DDBG_BREAK_1BYTE, on_b2_triggerred, NULL, true), DDBG_SUCCESS);
+    test_assert(dyndebug_set_breakpoint_flags(b3, DDBG_BP_SNAPSHOT), DDBG_SUCCESS);
+    /* Its core goes to its working directory, not the monitor one */
+    assert(getcwd(cwd, sizeof(cwd)));
+    test_assert(chdir("/tmp"), 0);
+    test_assert(traced(10), 45);
+    test_assert(traced(10), 45);
+    test_assert(chdir(cwd), 0);
+    test_assert(dyndebug_remove_breakpoint(b3), DDBG_SUCCESS);
+    test_assert(dyndebug_account_snapshots(snapshots, 4), 1);
+    test_assert(snapshots[0].address == (void *)traced, true);
+    snprintf(core, sizeof(core), "/proc/%d/stat", snapshots[0].pid);
+    FILE *stat_file = fopen(core, "r");
+    assert(stat_file && fgets(proc_state, sizeof(proc_state), stat_file));
+    fclose(stat_file);
+    test_assert(strstr(proc_state, ") T ") != NULL, true);
+    test_assert(dyndebug_dump_snapshot(snapshots[0].pid), DDBG_SUCCESS);
+    snprintf(core, sizeof(core), "/tmp/dyndbg.core.%d", snapshots[0].pid);
+    test_assert(access(core, R_OK), 0);
+    unlink(core);
+    test_assert(dyndebug_release_snapshot(snapshots[0].pid), DDBG_SUCCESS);
+    test_assert(dyndebug_release_snapshot(snapshots[0].pid),
+            DDBG_INVALID_ARGUMENT);
+    test_assert(dyndebug_account_snapshots(snapshots, 4), 0);
+
+    /* Write profiler, two addresses written by two threads share one slot */
+    ddbg_write_site_t sites[8];
+    pthread_t writer;
+    uint64_t hot_hits[2] = {0, 0};
+    test_assert(dyndebug_add_profiled_watch((void *)&hot[0],
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES), DDBG_SUCCESS);
+    test_assert(dyndebug_add_profiled_watch((void *)&hot[1],
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES), DDBG_SUCCESS);
+    test_assert(dyndebug_add_profiled_watch((void *)&hot[1],
+            DDBG_BREAK_DATA_WRITE, DDBG_BREAK_8BYTES), DDBG_BP_ALREADY_EXISTS);
+    test_assert(dyndebug_start_write_profiler(1, 10), DDBG_SUCCESS);
+    pthread_create(&writer, NULL, hot_writer, NULL);
+    for (int i = 0 ; i < 200 ; i++)
+    {
+        hot_write(0);
+        usleep(500);
+    }
+    pthread_join(writer, NULL);
+    test_assert(dyndebug_stop_write_profiler("/dev/null"), DDBG_SUCCESS);
+    rc = dyndebug_get_write_sites(sites, 8);
+    for (int i = 0 ; i < rc ; i++)
+        hot_hits[(volatile uint64_t *)sites[i].address - hot] += sites[i].count;
+    test_assert(hot_hits[0] > 0 && hot_hits[0] < 200, true);
+    test_assert(hot_hits[1] > 0 && hot_hits[1] < 200, true);
+
+    /* Sampling profiler, the busy loop shows up in the folded stacks and the
+    SIGPROF action of the application is back after */
+    char line[4096];
+    bool found = false;
+    struct sigaction profile_action = {0};
+    profile_action.sa_handler = SIG_IGN;
+    sigaction(SIGPROF, &profile_action, NULL);
+    test_assert(dyndebug_start_profiler(1000, "unit_test.folded"), DDBG_SUCCESS);
+    test_assert(dyndebug_start_profiler(1000, NULL), DDBG_INVALID_ARGUMENT);
+    test_assert(dyndebug_profile_thread(), DDBG_BP_ALREADY_EXISTS);
+    profile_busy();
+    test_assert(dyndebug_stop_profiler(), DDBG_SUCCESS);
+    test_assert(dyndebug_stop_profiler(), DDBG_INVALID_ARGUMENT);
+    sigaction(SIGPROF, NULL, &profile_action);
+    test_assert(profile_action.sa_handler == SIG_IGN, true);
+    FILE *folded = fopen("unit_test.folded", "r");
+    assert(folded);
+    while (!found && fgets(line, sizeof(line), folded))
+        found = strstr(line, "main;profile_busy") != NULL;
+    fclose(folded);
+    unlink("unit_test.folded");
+    test_assert(found, true);
+
+    /* LD_PRELOAD, the probes and the watch of the configuration are armed at
+    startup, the report at exit counts their hits */
+    char preload_dir[256], preload_library[320], preload_target[320];
+    char preload_report[64], preload_config[256], preload_line[256];
+    int preload_status, preload_counts = 0;
+    ssize_t preload_length = readlink("/proc/self/exe", preload_dir,
+            sizeof(preload_dir) - 1);
+    test_assert(preload_length > 0, true);
+    preload_dir[preload_length] = '\0';
+    *strrchr(preload_dir, '/') = '\0';
+    snprintf(preload_library, sizeof(preload_library),
+            "%s/libdyndbg_preload.so", preload_dir);
+    snprintf(preload_target, sizeof(preload_target), "%s/preload_target",
+            preload_dir);
+    snprintf(preload_report, sizeof(preload_report), "/tmp/dyndbg_preload.%d",
+            getpid());
+    snprintf(preload_config, sizeof(preload_config), "preload_probed:p;"
+            "preload_probed_too:p;preload_counter:w:4;report %s",
+            preload_report);
+    pid_t preloaded = fork();
+    if (!preloaded)
+    {
+        setenv("LD_PRELOAD", preload_library, 1);
+        setenv("DYNDBG_BREAKPOINTS", preload_config, 1);
+        unsetenv("DYNDBG_CONFIG");
+        execl(preload_target, preload_target, (char *)NULL);
+        _exit(127);
+    }
+    test_assert(waitpid(preloaded, &preload_status, 0), preloaded);
+    test_assert(WIFEXITED(preload_status) && !WEXITSTATUS(preload_status),
+            true);
+    FILE *preload = fopen(preload_report, "r");
+    test_assert(preload != NULL, true);
+    while (fgets(preload_line, sizeof(preload_line), preload))
+        preload_counts += !strcmp(preload_line,
+                "dyndbg: preload_probed count 10 hits\n") ||
+            !strcmp(preload_line, "dyndbg: preload_probed_too count 10 hits\n") ||
+            !strcmp(preload_line, "dyndbg: preload_counter count 10 hits\n");
+    fclose(preload);
+    unlink(preload_report);
+    test_assert(preload_counts, 3);
+
     printf("All tests succeeded!!\nThat's all folks!\n");
     return 0;
 }
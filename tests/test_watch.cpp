@@ -0,0 +1,93 @@
+#include <dyndbg/dyndbg.hpp>
+
+#include <cassert>
+#include <cstdio>
+
+struct pair_t
+{
+    uint64_t                first;
+    uint64_t                second;
+};
+
+struct __attribute__((packed)) odd_t
+{
+    uint8_t                 tag;
+    uint16_t                value;
+};
+
+static_assert(dyndbg::watch<uint32_t>::slots == 1, "one 4 bytes slot");
+static_assert(dyndbg::watch<pair_t>::length == 8, "8 bytes slots");
+static_assert(dyndbg::watch<pair_t>::slots == 2, "two 8 bytes slots");
+static_assert(dyndbg::watch<odd_t>::length == 1, "packed, byte slots");
+static_assert(dyndbg::watch<odd_t>::slots == 3, "three byte slots");
+
+static volatile int hits = 0;
+static volatile uint32_t counter;
+static pair_t pair;
+
+static void on_hit(ddbg_breakpoint_t *)
+{
+    hits++;
+}
+
+__attribute__((noinline)) static int called(void)
+{
+    return 1;
+}
+
+#define test_assert(under_test, expect)                                         \
+    {                                                                           \
+        long res = (under_test);                                                \
+        if (res != (long)(expect)) {                                            \
+            fprintf(stderr, "%s returned %ld instead of %ld!!, test failed\n",  \
+                #under_test, res, (long)(expect));                              \
+            assert(false);                                                      \
+        }                                                                       \
+    }
+
+int main()
+{
+    test_assert(dyndebug_start_monitor(), DDBG_SUCCESS);
+
+    {
+        dyndbg::watch<volatile uint32_t> watch(counter, on_hit);
+        test_assert(watch.result(), DDBG_SUCCESS);
+        counter = 1;
+        counter = 2;
+        test_assert(hits, 2);
+    }
+    counter = 3;
+    test_assert(hits, 2);
+
+    {
+        dyndbg::watch<pair_t, DDBG_BREAK_DATA_RDWR> watch(pair, on_hit);
+        test_assert(watch.result(), DDBG_SUCCESS);
+        pair.second = 5;
+        test_assert(hits, 3);
+        dyndbg::watch<pair_t> other(pair, on_hit);
+        test_assert(other.result(), DDBG_SUCCESS);
+        /* Out of debug registers or duplicated, the whole object or nothing */
+        dyndbg::watch<volatile uint32_t> busy(counter, on_hit);
+        dyndbg::watch<pair_t> again(pair, on_hit);
+        test_assert(busy.result(), DDBG_ALL_HWBP_BUSY);
+        test_assert(again.result(), DDBG_INVALID_ARGUMENT);
+        /* Both watches match, each of their slots is reported */
+        pair.first = 6;
+        test_assert(hits, 5);
+    }
+    pair.first = 7;
+    test_assert(hits, 5);
+
+    {
+        dyndbg::scoped_breakpoint breakpoint((void *)called,
+            DDBG_BREAK_INSTRUCTION, DDBG_BREAK_1BYTE, on_hit);
+        test_assert(bool(breakpoint), true);
+        called();
+        test_assert(hits, 6);
+    }
+    called();
+    test_assert(hits, 6);
+
+    printf("All tests succeeded!!\nThat's all folks!\n");
+    return 0;
+}
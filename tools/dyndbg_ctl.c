@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <dyndbg/dyndbg_us.h>
+#include <dyndbg/dyndbg_ctl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+static const char *types[] = {"x", "w", "io", "rw"};
+static const int sizes[] = {1, 2, 8, 4};
+
+static void usage(const char *program)
+{
+    fprintf(stderr, "usage: %s <pid|name> list\n"
+        "       %s <pid|name> add|remove <address|symbol>[:x|w|rw[:1|2|4|8]]...\n",
+        program, program);
+}
+
+static int connect_control(const char *target)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    char *end;
+    strtol(target, &end, 10);
+    int length = *end ?
+        snprintf(&address.sun_path[1], sizeof(address.sun_path) - 1, "%s", target) :
+        snprintf(&address.sun_path[1], sizeof(address.sun_path) - 1, "%s%s",
+            DDBG_CTL_PREFIX, target);
+    if (length >= (int)sizeof(address.sun_path) - 1)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address,
+            offsetof(struct sockaddr_un, sun_path) + 1 + length))
+    {
+        fprintf(stderr, "Cannot connect to %s -- %s\n", &address.sun_path[1],
+            strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int exchange(int fd, ddbg_ctl_message_t *message)
+{
+    if (send(fd, message, DDBG_CTL_MESSAGE_SIZE(message->count), 0) < 0 ||
+            recv(fd, message, sizeof(ddbg_ctl_message_t), 0) <
+            (ssize_t)DDBG_CTL_MESSAGE_SIZE(0))
+    {
+        fprintf(stderr, "Control request failed -- %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* <address|symbol>[:type[:size]], executed by default, 8 bytes for data */
+static void parse_item(char *arg, ddbg_ctl_item_t *item)
+{
+    memset(item, 0, sizeof(ddbg_ctl_item_t));
+    char *type = strchr(arg, ':');
+    char *size = NULL;
+    if (type)
+    {
+        *type++ = '\0';
+        size = strchr(type, ':');
+        if (size)
+            *size++ = '\0';
+    }
+
+    char *end;
+    item->address = strtoull(arg, &end, 0);
+    if (*end || !*arg)
+    {
+        item->address = 0;
+        snprintf(item->symbol, DDBG_CTL_SYMBOL_LENGTH, "%s", arg);
+    }
+
+    item->type = DDBG_BREAK_INSTRUCTION;
+    for (int t = 0 ; type && t < 4 ; t++)
+        if (!strcmp(type, types[t]))
+            item->type = t;
+    item->size = item->type == DDBG_BREAK_INSTRUCTION ?
+        DDBG_BREAK_1BYTE : DDBG_BREAK_8BYTES;
+    for (int s = 0 ; size && s < 4 ; s++)
+        if (atoi(size) == sizes[s])
+            item->size = s;
+}
+
+static void print_item(const ddbg_ctl_item_t *item)
+{
+    printf("0x%016lx %-2s %d %-8s %s hits %lu %s\n", item->address,
+        types[item->type & 3], sizes[item->size & 3],
+        item->result == DDBG_SUCCESS ? (item->enabled ? "armed" : "disarmed") :
+        "failed", item->owned ? "ctl" : "app", item->hits, item->symbol);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    ddbg_ctl_message_t message;
+    memset(&message, 0, DDBG_CTL_MESSAGE_SIZE(0));
+    if (!strcmp(argv[2], "list"))
+        message.op = DDBG_CTL_LIST;
+    else if (!strcmp(argv[2], "add"))
+        message.op = DDBG_CTL_ADD;
+    else if (!strcmp(argv[2], "remove"))
+        message.op = DDBG_CTL_REMOVE;
+    if (!message.op || (message.op != DDBG_CTL_LIST && argc < 4) ||
+            argc - 3 > DDBG_CTL_MAX_ITEMS)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = connect_control(argv[1]);
+    if (fd < 0)
+        return 1;
+
+    int rc = 0;
+    if (message.op == DDBG_CTL_LIST)
+    {
+        /* One page of DDBG_CTL_MAX_ITEMS per request */
+        do
+        {
+            message.op = DDBG_CTL_LIST;
+            message.count = 0;
+            if (exchange(fd, &message))
+            {
+                rc = 1;
+                break;
+            }
+            for (uint32_t i = 0 ; i < message.count ; i++)
+                print_item(&message.items[i]);
+            message.offset += message.count;
+        } while (message.count && message.offset < message.total);
+    }
+    else
+    {
+        for (int i = 3 ; i < argc ; i++)
+            parse_item(argv[i], &message.items[message.count++]);
+        rc = exchange(fd, &message) ? 1 : 0;
+        for (uint32_t i = 0 ; !rc && i < message.count ; i++)
+        {
+            print_item(&message.items[i]);
+            if (message.items[i].result != DDBG_SUCCESS)
+                rc = 2;
+        }
+    }
+    close(fd);
+    return rc;
+}